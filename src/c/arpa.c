@@ -54,7 +54,7 @@ struct arpa *arpa_open(const char *path)
     unigram_section->n_ngrams = a->n_ngrams[0];
     a->sections[0] = unigram_section;
 
-    for (int i = 1; i < a->order; i++)
+    for (int i = 1; i <= a->order; i++)
         a->sections[i] = NULL;
 
     return a;
@@ -127,27 +127,36 @@ static int process_header_line(char *line, uint64_t i, void *arg)
     return 0;
 }
 
-static void
-get_section_begin(const struct arpa *a, unsigned short n, fpos_t **begin)
+/**
+ * Find the position of the title of the \p n -gram section, searching from
+ * the closest section before it that was already found.
+ * @return 0 on success, 1 if the section was not found.
+ */
+static int
+get_section_begin(const struct arpa *a, unsigned short n, fpos_t *begin)
 {
-    struct arpa_section *s = a->sections[n - 2];
-    if (s == NULL)
-        get_section_begin(a, n - 1, begin);
-    else
-        *begin = s->i;
+    const struct arpa_section *s = a->sections[n - 2];
+    if (s != NULL)
+        *begin = *s->begin;
+    else if (get_section_begin(a, n - 1, begin) != 0)
+        return 1;
     FILE *f = fopen(a->path, "r");
-    fsetpos(f, *begin);
+    fsetpos(f, begin);
 
     char sec_title[16];
     snprintf(sec_title, 16, "\\%d-grams:\n", n);
     char *line = NULL;
     size_t len = 0;
-    while (getline(&line, &len, f) != -1) {
+    int found = 0;
+    while (!found && getline(&line, &len, f) != -1) {
         if (line[0] == '\\' && strcmp(line, sec_title) == 0)
-            return;
-        fgetpos(f, *begin);
+            found = 1;
+        else
+            fgetpos(f, begin);
     }
-    *begin = NULL;
+    free(line);
+    fclose(f);
+    return !found;
 }
 
 struct arpa_section *arpa_get_section(const struct arpa *a, unsigned short n)
@@ -161,13 +170,14 @@ struct arpa_section *arpa_get_section(const struct arpa *a, unsigned short n)
     s->i = malloc(sizeof(fpos_t));
     s->f = fopen(a->path, "r");
     s->n_ngrams = a->n_ngrams[n - 1];
-    get_section_begin(a, n, &s->begin);
-    if (s->begin == NULL) {
+    if (get_section_begin(a, n, s->begin) != 0) {
         log_error("%d-gram section begin not found", n);
         exit(EXIT_FAILURE);
     }
     *s->i = *s->begin;
     fsetpos(s->f, s->begin);
+    // kept, so that the sections after it are searched from it
+    a->sections[n - 1] = s;
     return s;
 }
 
@@ -200,20 +210,27 @@ parse_section_line(const char *line, unsigned short n, struct arpa_ngram *ngram)
         strcpy(ngram->words[i], word);
     }
 
-    if (sscanf(line, "%f%n", &ngram->backoff, &nchar_matched) == EOF)
-        return -4;
+    // a missing backoff, as in the highest order n-grams, means a backoff of 0
+    if (sscanf(line, "%f", &ngram->backoff) != 1)
+        ngram->backoff = 0;
 
     return 0;
 }
 
-static int
-(*arpa_for_each_section_ngram_action)(struct arpa_ngram *ngram, void *arg);
+/**
+ * An action without the index of the n-gram, along with its argument.
+ */
+struct ngram_action {
+    int (*f)(struct arpa_ngram *ngram, void *arg);
+    void *arg;
+};
 
 static int
 arpa_for_each_section_ngram_action_ignoring_i(struct arpa_ngram *ngram,
                                               uint64_t i, void *arg)
 {
-    return arpa_for_each_section_ngram_action(ngram, arg);
+    const struct ngram_action *action = arg;
+    return action->f(ngram, action->arg);
 }
 
 uint64_t arpa_for_each_section_ngram(const struct arpa_section *s,
@@ -221,10 +238,10 @@ uint64_t arpa_for_each_section_ngram(const struct arpa_section *s,
                                               void *arg),
                                      void *arg)
 {
-    arpa_for_each_section_ngram_action = f;
+    struct ngram_action action = { f, arg };
     return arpa_for_each_section_ngrami(s,
                                         arpa_for_each_section_ngram_action_ignoring_i,
-                                        arg);
+                                        &action);
 }
 
 uint64_t arpa_for_each_section_ngrami(const struct arpa_section *s,
@@ -266,21 +283,28 @@ uint64_t arpa_for_each_section_ngrami(const struct arpa_section *s,
     return i;
 }
 
-static int (*arpa_for_each_section_line_action)(char *line, void *arg);
+/**
+ * An action without the index of the line, along with its argument.
+ */
+struct line_action {
+    int (*f)(char *line, void *arg);
+    void *arg;
+};
 
 static int
 arpa_for_each_section_line_ignoring_i(char *line, uint64_t i, void *arg)
 {
-    return arpa_for_each_section_line_action(line, arg);
+    const struct line_action *action = arg;
+    return action->f(line, action->arg);
 }
 
 uint64_t arpa_for_each_section_line(const struct arpa_section *s,
                                     int (*f)(char *line, void *arg),
                                     void *arg)
 {
-    arpa_for_each_section_line_action = f;
+    struct line_action action = { f, arg };
     return arpa_for_each_section_linei(s, arpa_for_each_section_line_ignoring_i,
-                                       arg);
+                                       &action);
 }
 
 uint64_t arpa_for_each_section_linei(const struct arpa_section *s,
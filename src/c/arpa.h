@@ -53,6 +53,14 @@ void arpa_close(struct arpa *a);
  */
 struct arpa_section *arpa_get_section(const struct arpa *a, unsigned short n);
 
+/**
+ * Call \p f with \p arg for each line of section \p s, until it returns
+ * non-zero.
+ * @note The sections of an ARPA file share its position in the file, so an
+ * arpa must only be read by one thread at a time. Different arpas can be
+ * read at once.
+ * @return the number of lines read.
+ */
 uint64_t arpa_for_each_section_line(const struct arpa_section *s,
                                     int (*f)(char *line, void *arg),
                                     void *arg);
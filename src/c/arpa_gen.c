@@ -0,0 +1,359 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "arpa_gen.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <c/util/log.h>
+
+#define SENTENCE_START 0
+#define SENTENCE_END 1
+#define TEXT_MAX_LENGTH 16
+/// the probability of the children of an n-gram, the rest being backed off
+#define DISCOUNT 0.9
+#define SENTENCE_START_PROBABILITY (-99)
+
+struct arpa_gen {
+    unsigned short order;
+    uint32_t vocab_size;
+    uint64_t seed;
+    uint64_t *n_ngrams;
+    double *fanout_scales;  /// children per parent weight of each order
+    double *weights;        /// Zipf weights of the words, by rank
+    double *cdf;            /// cumulative weights of the words as children
+    char (*texts)[TEXT_MAX_LENGTH];
+    uint64_t *drawn;        /// bitmap of the words drawn as children
+    // the children, and their probabilities, of the n-gram of each order
+    // being walked
+    uint32_t **children;
+    float **probabilities;
+};
+
+/**
+ * A walk through the n-grams of the tree, in the order of the ARPA file, down
+ * to the n-grams of order \p n, which are passed to \p f.
+ */
+struct walk {
+    struct arpa_gen *g;
+    unsigned short n;
+    uint64_t *indexes;      /// index of the next n-gram of each order
+    uint32_t *path;         /// words of the n-gram being walked
+    void (*f)(struct walk *w, float probability, float backoff);
+    void *arg;
+};
+
+static uint64_t mix(uint64_t x);
+
+static double next_uniform(uint64_t *state);
+
+static double get_parent_weight(const struct arpa_gen *g, uint32_t word);
+
+static uint32_t draw_word(const struct arpa_gen *g, uint64_t *state);
+
+static int cmp_word_ids(const void *a, const void *b);
+
+static uint32_t
+draw_children(struct arpa_gen *g, unsigned short n, uint32_t fanout,
+              uint64_t *state);
+
+static void walk(struct arpa_gen *g, unsigned short n,
+                 void (*f)(struct walk *w, float probability, float backoff),
+                 void *arg);
+
+static void walk_ngram(struct walk *w, unsigned short n, float probability);
+
+static void add_parent_weight(struct walk *w, float probability,
+                              float backoff);
+
+static void do_nothing(struct walk *w, float probability, float backoff);
+
+static void write_ngram(struct walk *w, float probability, float backoff);
+
+struct arpa_gen *
+arpa_gen_new(unsigned short order, const uint64_t *n_ngrams,
+             double zipf_exponent, uint64_t seed)
+{
+    if (order < 1 || n_ngrams[0] < 4 || n_ngrams[0] > UINT32_MAX) {
+        log_error("Invalid ARPA generator parameters");
+        return NULL;
+    }
+    struct arpa_gen *g = calloc(1, sizeof(struct arpa_gen));
+    if (g == NULL)
+        return NULL;
+    const uint32_t v = n_ngrams[0];
+    g->order = order;
+    g->vocab_size = v;
+    g->seed = seed;
+    g->n_ngrams = calloc(order, sizeof(uint64_t));
+    g->fanout_scales = calloc(order, sizeof(double));
+    g->weights = malloc(v * sizeof(double));
+    g->cdf = malloc(v * sizeof(double));
+    g->texts = malloc(v * sizeof(*g->texts));
+    g->drawn = calloc((v + 63) / 64, sizeof(uint64_t));
+    g->children = calloc(order, sizeof(uint32_t *));
+    g->probabilities = calloc(order, sizeof(float *));
+    if (g->n_ngrams == NULL || g->fanout_scales == NULL ||
+        g->weights == NULL || g->cdf == NULL || g->texts == NULL ||
+        g->drawn == NULL || g->children == NULL || g->probabilities == NULL) {
+        arpa_gen_delete(g);
+        return NULL;
+    }
+
+    for (uint32_t w = 0; w < v; w++) {
+        g->weights[w] = pow(w + 1.0, -zipf_exponent);
+        // "<s>" is never a child
+        g->cdf[w] = (w == SENTENCE_START) ? 0 : g->cdf[w - 1] + g->weights[w];
+        snprintf(g->texts[w], TEXT_MAX_LENGTH, "w%" PRIu32, w);
+    }
+    snprintf(g->texts[SENTENCE_START], TEXT_MAX_LENGTH, "<s>");
+    snprintf(g->texts[SENTENCE_END], TEXT_MAX_LENGTH, "</s>");
+    snprintf(g->texts[v - 1], TEXT_MAX_LENGTH, "<unk>");
+
+    // the scale of each order is such that its n-grams have as many children
+    // as requested, before rounding
+    for (unsigned short n = 1; n < order; n++) {
+        double weights_sum = 0;
+        walk(g, n, add_parent_weight, &weights_sum);
+        g->fanout_scales[n - 1] = (weights_sum > 0) ?
+                                  n_ngrams[n] / weights_sum : 0;
+        // "<s>" has the largest weight, 1
+        double max_fanout = floor(g->fanout_scales[n - 1]) + 1;
+        if (max_fanout > v - 1)
+            max_fanout = v - 1;
+        g->children[n - 1] = malloc(((size_t) max_fanout + 1) *
+                                    sizeof(uint32_t));
+        g->probabilities[n - 1] = malloc(((size_t) max_fanout + 1) *
+                                         sizeof(float));
+        if (g->children[n - 1] == NULL || g->probabilities[n - 1] == NULL) {
+            arpa_gen_delete(g);
+            return NULL;
+        }
+    }
+    g->n_ngrams[0] = v;
+    walk(g, order, do_nothing, NULL);
+    return g;
+}
+
+void arpa_gen_delete(struct arpa_gen *g)
+{
+    if (g->children != NULL) {
+        for (unsigned short n = 1; n < g->order; n++)
+            free(g->children[n - 1]);
+    }
+    if (g->probabilities != NULL) {
+        for (unsigned short n = 1; n < g->order; n++)
+            free(g->probabilities[n - 1]);
+    }
+    free(g->children);
+    free(g->probabilities);
+    free(g->drawn);
+    free(g->texts);
+    free(g->cdf);
+    free(g->weights);
+    free(g->fanout_scales);
+    free(g->n_ngrams);
+    free(g);
+}
+
+uint64_t arpa_gen_get_n_ngrams(const struct arpa_gen *g, unsigned short n)
+{
+    return g->n_ngrams[n - 1];
+}
+
+int arpa_gen_fwrite(struct arpa_gen *g, FILE *f)
+{
+    fprintf(f, "\\data\\\n");
+    for (unsigned short n = 1; n <= g->order; n++)
+        fprintf(f, "ngram %d=%" PRIu64 "\n", n, g->n_ngrams[n - 1]);
+    for (unsigned short n = 1; n <= g->order; n++) {
+        log_info("Writing %d-grams", n);
+        fprintf(f, "\n\\%d-grams:\n", n);
+        walk(g, n, write_ngram, f);
+    }
+    fprintf(f, "\n\\end\\\n");
+    return ferror(f) ? 1 : 0;
+}
+
+uint64_t arpa_gen_parse_count(const char *text, char **end)
+{
+    uint64_t count = strtoull(text, end, 10);
+    if (*end == text)
+        return 0;
+    switch (**end) {
+        case 'K':
+            count *= 1000, (*end)++;
+            break;
+        case 'M':
+            count *= 1000000, (*end)++;
+            break;
+        case 'B':
+            count *= 1000000000, (*end)++;
+            break;
+    }
+    return count;
+}
+
+/**
+ * The finalizer of SplitMix64.
+ */
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+/**
+ * @return a number in [0, 1) of the SplitMix64 sequence of \p state.
+ */
+static double next_uniform(uint64_t *state)
+{
+    *state += UINT64_C(0x9e3779b97f4a7c15);
+    return (double) (mix(*state) >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Nothing follows "</s>", and the other words have as many children as their
+ * frequency.
+ */
+static double get_parent_weight(const struct arpa_gen *g, uint32_t word)
+{
+    return (word == SENTENCE_END) ? 0 : g->weights[word];
+}
+
+/**
+ * Draw a word, but "<s>", by its frequency.
+ */
+static uint32_t draw_word(const struct arpa_gen *g, uint64_t *state)
+{
+    const double x = next_uniform(state) * g->cdf[g->vocab_size - 1];
+    uint32_t l = 0, r = g->vocab_size - 1;
+    while (l < r) {
+        const uint32_t m = l + (r - l) / 2;
+        if (g->cdf[m] > x)
+            r = m;
+        else
+            l = m + 1;
+    }
+    return l;
+}
+
+static int cmp_word_ids(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Draw \p fanout different words as the children of the \p n -gram being
+ * walked, and set their probabilities, proportional to their frequencies.
+ * @return the number of children, \p fanout.
+ */
+static uint32_t
+draw_children(struct arpa_gen *g, unsigned short n, uint32_t fanout,
+              uint64_t *state)
+{
+    uint32_t *children = g->children[n - 1];
+    uint32_t m = 0;
+    for (uint64_t tries = 2 * (uint64_t) fanout + 16; m < fanout && tries > 0;
+         tries--) {
+        const uint32_t w = draw_word(g, state);
+        if ((g->drawn[w / 64] & (UINT64_C(1) << (w % 64))) == 0) {
+            g->drawn[w / 64] |= UINT64_C(1) << (w % 64);
+            children[m++] = w;
+        }
+    }
+    // the rarest words are seldom drawn, so a fan-out close to the size of the
+    // vocabulary is completed with the most frequent words left
+    for (uint32_t w = SENTENCE_START + 1; m < fanout; w++) {
+        if ((g->drawn[w / 64] & (UINT64_C(1) << (w % 64))) == 0) {
+            g->drawn[w / 64] |= UINT64_C(1) << (w % 64);
+            children[m++] = w;
+        }
+    }
+    qsort(children, m, sizeof(uint32_t), cmp_word_ids);
+
+    double weights_sum = 0;
+    for (uint32_t i = 0; i < m; i++) {
+        g->drawn[children[i] / 64] = 0;
+        weights_sum += g->weights[children[i]];
+    }
+    for (uint32_t i = 0; i < m; i++)
+        g->probabilities[n - 1][i] = (float) log10(
+                DISCOUNT * g->weights[children[i]] / weights_sum);
+    return m;
+}
+
+static void walk(struct arpa_gen *g, unsigned short n,
+                 void (*f)(struct walk *w, float probability, float backoff),
+                 void *arg)
+{
+    uint64_t indexes[g->order];
+    uint32_t path[g->order];
+    for (unsigned short i = 0; i < g->order; i++)
+        indexes[i] = 0;
+    struct walk w = {
+            .g = g, .n = n, .indexes = indexes, .path = path, .f = f,
+            .arg = arg
+    };
+    for (uint32_t word = 0; word < g->vocab_size; word++) {
+        path[0] = word;
+        walk_ngram(&w, 1, (word == SENTENCE_START) ?
+                          SENTENCE_START_PROBABILITY :
+                          (float) log10(g->weights[word] /
+                                        g->cdf[g->vocab_size - 1]));
+    }
+    for (unsigned short i = 0; i < n; i++)
+        g->n_ngrams[i] = indexes[i];
+}
+
+/**
+ * Walk the \p n -gram of \p w->path. The backoff and the children of an
+ * n-gram are drawn from a state seeded by its order and index, so they are
+ * the same in every walk.
+ */
+static void walk_ngram(struct walk *w, unsigned short n, float probability)
+{
+    struct arpa_gen *g = w->g;
+    uint64_t state = mix(g->seed ^ mix((uint64_t) n << 48 ^
+                                       w->indexes[n - 1]++));
+    const float backoff = (float) log10(0.1 + 0.8 * next_uniform(&state));
+    if (n == w->n) {
+        w->f(w, probability, (n < g->order) ? backoff : 0);
+        return;
+    }
+    const double expected = g->fanout_scales[n - 1] *
+                            get_parent_weight(g, w->path[n - 1]);
+    double fanout = floor(expected + next_uniform(&state));
+    if (fanout > g->vocab_size - 1)
+        fanout = g->vocab_size - 1;
+    const uint32_t n_children = draw_children(g, n, (uint32_t) fanout, &state);
+    for (uint32_t i = 0; i < n_children; i++) {
+        w->path[n] = g->children[n - 1][i];
+        walk_ngram(w, n + 1, g->probabilities[n - 1][i]);
+    }
+}
+
+static void add_parent_weight(struct walk *w, float probability,
+                              float backoff)
+{
+    *(double *) w->arg += get_parent_weight(w->g, w->path[w->n - 1]);
+}
+
+static void do_nothing(struct walk *w, float probability, float backoff)
+{
+}
+
+static void write_ngram(struct walk *w, float probability, float backoff)
+{
+    FILE *f = w->arg;
+    fprintf(f, "%.7g", probability);
+    for (unsigned short i = 0; i < w->n; i++) {
+        fputc('\t', f);
+        fputs(w->g->texts[w->path[i]], f);
+    }
+    if (w->n < w->g->order)
+        fprintf(f, "\t%.7g", backoff);
+    fputc('\n', f);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Generator of synthetic ARPA files, to benchmark the tries of models
+ * larger than the test data. The word frequencies follow Zipf's law: the word
+ * of rank r, starting at 0, is as frequent as 1 / (r + 1)^s, s being the Zipf
+ * exponent. The n-grams are the paths of a tree whose nodes have as many
+ * children as the frequency of their last word, so the fan-outs are as skewed
+ * as the words, and the children are drawn from the same distribution. Every
+ * n-gram context is thus an (n-1)-gram of the file.
+ * The tree is generated from a seed, node by node, so it is walked again for
+ * each section instead of being kept in memory, and files of billions of
+ * n-grams take as little memory as small ones.
+ * @code
+ * const uint64_t n_ngrams[] = { 10000, 100000, 400000 };
+ * struct arpa_gen *g = arpa_gen_new(3, n_ngrams, 1.0, 42);
+ * arpa_gen_fwrite(g, f);
+ * arpa_gen_delete(g);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_ARPA_GEN_H
+#define NGRAM_LM_ARPA_GEN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct arpa_gen;
+
+/**
+ * Create a generator of \p order -gram models, and find the number of
+ * n-grams of each order.
+ * @param order
+ * @param n_ngrams the number of n-grams of each order, from the unigrams,
+ * which are the vocabulary. The number of n-grams of the higher orders is only
+ * approximated, see arpa_gen_get_n_ngrams().
+ * @param zipf_exponent the skew of the word frequencies, e.g. 1.
+ * @param seed
+ * @return the generator, or NULL if there are less than 4 unigrams, more than
+ * UINT32_MAX, or it could not be allocated. Use arpa_gen_delete() to free it.
+ */
+struct arpa_gen *
+arpa_gen_new(unsigned short order, const uint64_t *n_ngrams,
+             double zipf_exponent, uint64_t seed);
+
+void arpa_gen_delete(struct arpa_gen *g);
+
+/**
+ * @return the number of \p n -grams generated by \p g, which is close to the
+ * one requested, but not the same, since the number of children of each
+ * n-gram is rounded and at most the size of the vocabulary.
+ */
+uint64_t arpa_gen_get_n_ngrams(const struct arpa_gen *g, unsigned short n);
+
+/**
+ * Write the ARPA file of \p g to \p f.
+ * @return 0 on success, 1 if \p f could not be written.
+ */
+int arpa_gen_fwrite(struct arpa_gen *g, FILE *f);
+
+/**
+ * Parse a count of n-grams, with an optional K, M or B (10^9) suffix, e.g.
+ * "100M", as strtoull() does.
+ * @param text
+ * @param end pass out pointer for the character after the count, or \p text
+ * if there is none.
+ * @return the count.
+ */
+uint64_t arpa_gen_parse_count(const char *text, char **end);
+
+#endif //NGRAM_LM_ARPA_GEN_H
@@ -0,0 +1,124 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/arpa.h"
+#include "c/arpa_gen.h"
+#include "c/trie.h"
+#include "c/util/log.h"
+}
+
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <string>
+
+/**
+ * Write the ARPA file of \p g to a temporary file.
+ * @return its path.
+ */
+static std::string write_arpa(struct arpa_gen *g)
+{
+    char path[] = "/tmp/ngram_lm_arpa_gen_XXXXXX";
+    const int fd = mkstemp(path);
+    EXPECT_NE(fd, -1);
+    FILE *f = fdopen(fd, "w");
+    EXPECT_EQ(arpa_gen_fwrite(g, f), 0);
+    fclose(f);
+    return path;
+}
+
+TEST(ArpaGen, GeneratesAboutTheRequestedCounts)
+{
+    const uint64_t n_ngrams[] = { 1000, 20000, 50000 };
+    struct arpa_gen *g = arpa_gen_new(3, n_ngrams, 1.0, 42);
+    ASSERT_TRUE(g != nullptr);
+    EXPECT_EQ(arpa_gen_get_n_ngrams(g, 1), 1000);
+    for (int n = 2; n <= 3; n++) {
+        EXPECT_GT(arpa_gen_get_n_ngrams(g, n), n_ngrams[n - 1] * 0.9);
+        EXPECT_LT(arpa_gen_get_n_ngrams(g, n), n_ngrams[n - 1] * 1.1);
+    }
+    arpa_gen_delete(g);
+}
+
+TEST(ArpaGen, GeneratesTheSameFileFromTheSameSeed)
+{
+    const uint64_t n_ngrams[] = { 100, 1000, 2000 };
+    struct arpa_gen *g = arpa_gen_new(3, n_ngrams, 1.1, 7);
+    ASSERT_TRUE(g != nullptr);
+    const std::string first = write_arpa(g), second = write_arpa(g);
+    arpa_gen_delete(g);
+    const std::string cmp = "cmp -s " + first + " " + second;
+    EXPECT_EQ(std::system(cmp.c_str()), 0);
+    std::remove(first.c_str());
+    std::remove(second.c_str());
+}
+
+struct fanouts {
+    int frequent;
+    int rare;
+};
+
+static int count_fanouts(struct arpa_ngram *ngram, void *arg)
+{
+    auto *f = static_cast<struct fanouts *>(arg);
+    f->frequent += std::string(ngram->words[0]) == "w2";
+    f->rare += std::string(ngram->words[0]) == "w400";
+    return 0;
+}
+
+struct query {
+    const struct trie *t;
+    int found;
+};
+
+static int query_ngram(struct arpa_ngram *ngram, void *arg)
+{
+    auto *q = static_cast<struct query *>(arg);
+    struct gram grams[4];
+    q->found += trie_query_ngram_grams(
+            q->t, const_cast<const char **>(ngram->words), 4, grams) == 4;
+    return 0;
+}
+
+TEST(ArpaGen, TrieCanBeBuiltFromTheGeneratedFile)
+{
+    log_set_quiet(true);
+    const uint64_t n_ngrams[] = { 500, 5000, 10000, 10000 };
+    struct arpa_gen *g = arpa_gen_new(4, n_ngrams, 1.0, 42);
+    ASSERT_TRUE(g != nullptr);
+    const std::string path = write_arpa(g);
+    struct arpa *a = arpa_open(path.c_str());
+    struct trie *t = trie_new_from_arpa(4, a);
+    for (int n = 1; n <= 4; n++)
+        EXPECT_EQ(t->n_ngrams[n - 1], arpa_gen_get_n_ngrams(g, n));
+
+    // the frequent words have more children than the rare ones
+    struct fanouts fanouts = { 0, 0 };
+    arpa_for_each_section_ngram(arpa_get_section(a, 2), count_fanouts,
+                                &fanouts);
+    EXPECT_GT(fanouts.frequent, 10 * fanouts.rare);
+
+    struct query query = { t, 0 };
+    EXPECT_EQ(arpa_for_each_section_ngram(arpa_get_section(a, 4), query_ngram,
+                                          &query), t->n_ngrams[3]);
+    EXPECT_EQ(query.found, t->n_ngrams[3]);
+
+    trie_delete(t);
+    arpa_close(a);
+    arpa_gen_delete(g);
+    std::remove(path.c_str());
+    log_set_quiet(false);
+}
+
+TEST(ArpaGen, ParsesCounts)
+{
+    char *end;
+    const char *text = "100M,2K";
+    EXPECT_EQ(arpa_gen_parse_count(text, &end), 100000000);
+    EXPECT_EQ(*end, ',');
+    EXPECT_EQ(arpa_gen_parse_count(end + 1, &end), 2000);
+    EXPECT_EQ(*end, '\0');
+    EXPECT_EQ(arpa_gen_parse_count("1B", &end), 1000000000);
+    text = "x";
+    arpa_gen_parse_count(text, &end);
+    EXPECT_EQ(end, text);
+}
@@ -5,6 +5,8 @@ extern "C" {
 }
 
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 TEST(Arpa, New)
 {
@@ -72,4 +74,99 @@ TEST(Arpa, ForEachSectionNgram)
     ASSERT_STREQ(words[80].c_str(), "vida");
     ASSERT_STREQ(words[208].c_str(), "europeia");
     ASSERT_STREQ(words[209].c_str(), "");
-}
\ No newline at end of file
+}
+
+int count_ngrams(struct arpa_ngram *ngram, void *arg)
+{
+    (*static_cast<uint64_t *>(arg))++;
+    return 0;
+}
+
+int count_words(struct arpa_ngram *ngram, void *arg)
+{
+    *static_cast<uint64_t *>(arg) += ngram->n;
+    return 0;
+}
+
+int count_lines(char *line, void *arg)
+{
+    (*static_cast<uint64_t *>(arg))++;
+    return 0;
+}
+
+int count_chars(char *line, void *arg)
+{
+    *static_cast<uint64_t *>(arg) += strlen(line);
+    return 0;
+}
+
+TEST(Arpa, ConcurrentForEachSection)
+{
+    // the threads iterate with different actions at once, which goes wrong
+    // if the actions of the threads are mixed up
+    const int n_threads = 8;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([i]() {
+            struct arpa *a = arpa_open("data/tmp.arpa");
+            const unsigned short n = i % 3 + 1;
+            const struct arpa_section *s = arpa_get_section(a, n);
+            uint64_t count = 0;
+            if (i % 2 == 0) {
+                arpa_for_each_section_ngram(s, count_ngrams, &count);
+                EXPECT_EQ(count, a->n_ngrams[n - 1]);
+            } else {
+                arpa_for_each_section_ngram(s, count_words, &count);
+                EXPECT_EQ(count, n * a->n_ngrams[n - 1]);
+            }
+            uint64_t lines = 0, chars = 0;
+            arpa_for_each_section_line(s, count_lines, &lines);
+            arpa_for_each_section_line(s, count_chars, &chars);
+            EXPECT_GT(lines, a->n_ngrams[n - 1]);
+            EXPECT_GT(chars, 2 * lines);
+            arpa_close(a);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+}
+
+int first_word_of_ngram(struct arpa_ngram *ngram, uint64_t i, void *arg)
+{
+    if (i == 0)
+        *static_cast<std::string *>(arg) = ngram->words[ngram->n - 1];
+    return 0;
+}
+
+TEST(Arpa, GetsEverySectionOfHighOrderFiles)
+{
+    // a 5-gram file of the n-grams "a", "a b", "a b c"... each order once,
+    // with an extra unigram
+    const char *const path = "data/tmp5.arpa";
+    FILE *f = fopen(path, "w");
+    ASSERT_TRUE(f != nullptr);
+    fputs("\\data\\\nngram 1=2\nngram 2=1\nngram 3=1\nngram 4=1\n"
+          "ngram 5=1\n\n\\1-grams:\n-1\ta\t-0.1\n-1\tb\t-0.1\n\n"
+          "\\2-grams:\n-1\ta b\t-0.1\n\n\\3-grams:\n-1\ta b c\t-0.1\n\n"
+          "\\4-grams:\n-1\ta b c d\t-0.1\n\n\\5-grams:\n-1\ta b c d e\n\n"
+          "\\end\\\n", f);
+    fclose(f);
+    const char *last_words[] = { "a", "b", "c", "d", "e" };
+    // the sections are found whichever order they are got in
+    for (int reverse = 0; reverse < 2; reverse++) {
+        struct arpa *a = arpa_open(path);
+        ASSERT_EQ(a->order, 5);
+        for (int j = 0; j < 5; j++) {
+            const unsigned short n = reverse ? 5 - j : j + 1;
+            const struct arpa_section *s = arpa_get_section(a, n);
+            uint64_t count = 0;
+            arpa_for_each_section_ngram(s, count_ngrams, &count);
+            EXPECT_EQ(count, a->n_ngrams[n - 1]);
+            std::string first;
+            arpa_for_each_section_ngrami(s, first_word_of_ngram, &first);
+            EXPECT_EQ(first, last_words[n - 1]);
+        }
+        arpa_close(a);
+    }
+    std::remove(path);
+}
@@ -5,8 +5,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bit.h"
+#include "unpack.h"
 #include "util/log.h"
 
 static void quicksort(struct array *a, uint64_t l, uint64_t r,
@@ -21,7 +23,11 @@ static int8_t binary_search(struct array *a, uint64_t l, uint64_t r, void *key,
                             int (*cmp)(void *, void *, void *pVoid),
                             void *arg, uint64_t *index);
 
-static int (*compare_func_no_arg)(void *, void *);
+static inline void
+get_bits(const uint8_t *src, uint64_t offset, unsigned int nbits, void *dest);
+
+static inline void
+set_bits(uint8_t *dest, uint64_t offset, unsigned int nbits, const void *src);
 
 struct array *array_new(uint8_t elem_size, uint64_t length)
 {
@@ -39,22 +45,50 @@ void array_delete(struct array *a)
     free(a);
 }
 
+/**
+ * Copy \p nbits bits starting \p offset bits after \p src into the
+ * ceil(\p nbits / 8) bytes pointed by \p dest, 64 bits at a time. The bits of
+ * the last byte that follow the copied ones are cleared.
+ */
+static inline void
+get_bits(const uint8_t *src, uint64_t offset, unsigned int nbits, void *dest)
+{
+    uint8_t *d = dest;
+    for (; nbits > 64; nbits -= 64, offset += 64, d += sizeof(uint64_t))
+        store_le64(d, bits_get(src, offset, 64));
+    uint64_t x = bits_get(src, offset, nbits);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(d, &x, (nbits + 7) / 8);
+}
+
+/**
+ * Copy the first \p nbits bits of the ceil(\p nbits / 8) bytes pointed by \p
+ * src to \p dest, starting \p offset bits after it, 64 bits at a time.
+ */
+static inline void
+set_bits(uint8_t *dest, uint64_t offset, unsigned int nbits, const void *src)
+{
+    const uint8_t *s = src;
+    for (; nbits > 64; nbits -= 64, offset += 64, s += sizeof(uint64_t))
+        bits_set(dest, offset, 64, load_le64(s));
+    uint64_t x = 0;
+    memcpy(&x, s, (nbits + 7) / 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    bits_set(dest, offset, nbits, x);
+}
+
 void array_set(const struct array *a, uint64_t at, void *value)
 {
-    const uint64_t i = (at * a->elem_size) / 8;
-    const uint8_t offset = (at * a->elem_size) % 8;
-    uint8_t *dest = (uint8_t *) (a->elems + i);
-    mov(value, 0, dest, offset, a->elem_size);
+    set_bits(a->elems, at * a->elem_size, a->elem_size, value);
 }
 
 void array_get(const struct array *a, uint64_t at, void *dest)
 {
-    const uint64_t i = (at * a->elem_size) / 8;
-    const uint8_t offset = (at * a->elem_size) % 8;
-    uint8_t *src = (uint8_t *) ((uint8_t *) a->elems + i);
-    *((uint8_t *) dest +
-      a->elem_size / 8) = 0;  // clear last byte for convenience
-    mov(src, offset, dest, 0, a->elem_size);
+    get_bits(a->elems, at * a->elem_size, a->elem_size, dest);
 }
 
 void array_fill(struct array *a, void *value)
@@ -63,15 +97,20 @@ void array_fill(struct array *a, void *value)
         array_set(a, i, value);
 }
 
+/**
+ * Compare \p a and \p b with the comparator pointed by \p arg, so that the
+ * comparators without an argument can be passed down to the functions that
+ * take one, without keeping them in a global.
+ */
 static inline int compare_func_stub_arg(void *a, void *b, void *arg)
 {
-    return compare_func_no_arg(a, b);
+    int (**cmp)(void *, void *) = arg;
+    return (*cmp)(a, b);
 }
 
 void array_sort(struct array *a, int (*cmp)(void *a, void *b))
 {
-    compare_func_no_arg = cmp;
-    quicksort(a, 0, a->len - 1, compare_func_stub_arg, NULL);
+    quicksort(a, 0, a->len - 1, compare_func_stub_arg, &cmp);
 }
 
 void array_sort_r(struct array *a, int (*cmp)(void *a, void *b, void *arg),
@@ -142,8 +181,7 @@ int8_t array_bsearch_within(void *key, struct array *a,
                             uint64_t r,
                             uint64_t *index)
 {
-    compare_func_no_arg = cmp;
-    return binary_search(a, l, r - 1, key, compare_func_stub_arg, NULL, index);
+    return binary_search(a, l, r - 1, key, compare_func_stub_arg, &cmp, index);
 }
 
 int8_t array_bsearch_r_within(void *key, struct array *a,
@@ -175,14 +213,61 @@ static int8_t binary_search(struct array *a, uint64_t l, uint64_t r, void *key,
         return binary_search(a, mid + 1, r, key, cmp, arg, index);
 }
 
+uint64_t array_get_field(const struct array *a, uint64_t at,
+                         unsigned int offset, unsigned int nbits)
+{
+    return bits_get(a->elems, at * a->elem_size + offset, nbits);
+}
+
+void array_unpack_field(const struct array *a, uint64_t l, uint64_t r,
+                        unsigned int offset, unsigned int nbits, void *dest,
+                        unsigned int dest_size)
+{
+    unpack_field(a->elems, a->elem_size, l, r, offset, nbits, dest, dest_size);
+}
+
+int8_t array_isearch_within(uint64_t key, const struct array *a,
+                            unsigned int offset, unsigned int nbits,
+                            uint64_t l, uint64_t r, uint64_t *index)
+{
+    while (l < r) {
+        const uint64_t len = r - l;
+        const uint64_t low = array_get_field(a, l, offset, nbits);
+        const uint64_t high = array_get_field(a, r - 1, offset, nbits);
+        if (key < low || key > high)
+            return -1;
+        // interpolation step, followed by a binary step if it was not enough
+        // to halve [l, r)
+        uint64_t mid = (low == high) ? l : l + (uint64_t) (
+                (double) (key - low) / (double) (high - low) * (len - 1));
+        for (int step = 0; step < 2 && l < r; step++) {
+            if (step == 1) {
+                if (r - l <= len / 2)
+                    break;
+                mid = l + (r - l) / 2;
+            }
+            const uint64_t value = array_get_field(a, mid, offset, nbits);
+            if (value == key) {
+                *index = mid;
+                return 0;
+            }
+            if (value < key)
+                l = mid + 1;
+            else
+                r = mid;
+        }
+    }
+    return -1;
+}
+
 void elem_extract(const void *elem, void **dests, const unsigned int *sizes,
                   unsigned int n)
 {
     uint8_t *src = (uint8_t *) elem;
     uint8_t offset = 0;
     for (unsigned int i = 0; i < n; i++) {
-        *((uint8_t *) dests[i] +
-          sizes[i] / 8) = 0;  // clear last byte for convenience
+        if (sizes[i] % 8 != 0)  // clear last byte for convenience
+            *((uint8_t *) dests[i] + sizes[i] / 8) = 0;
         mov(src, offset, dests[i], 0, sizes[i]);
         src += (offset + sizes[i]) / 8;
         offset = (offset + sizes[i]) % 8;
@@ -192,9 +277,11 @@ void elem_extract(const void *elem, void **dests, const unsigned int *sizes,
 void array_get_extracted(const struct array *a, uint64_t at, void **dest,
                          const unsigned int *sizes, unsigned int n)
 {
-    uint8_t tmp[a->elem_size / 8 + 1];
-    array_get(a, at, tmp);
-    elem_extract(tmp, dest, sizes, n);
+    uint64_t offset = at * a->elem_size;
+    for (unsigned int i = 0; i < n; i++) {
+        get_bits(a->elems, offset, sizes[i], dest[i]);
+        offset += sizes[i];
+    }
 }
 
 void elems_compact(void **elems, void *dest, const unsigned int *sizes,
@@ -211,9 +298,11 @@ void elems_compact(void **elems, void *dest, const unsigned int *sizes,
 void array_set_compacted(const struct array *a, uint64_t at, void **elems,
                          const unsigned int *sizes, unsigned int n)
 {
-    uint8_t tmp[a->elem_size / 8 + 1];
-    elems_compact(elems, tmp, sizes, n);
-    array_set(a, at, tmp);
+    uint64_t offset = at * a->elem_size;
+    for (unsigned int i = 0; i < n; i++) {
+        set_bits(a->elems, offset, sizes[i], elems[i]);
+        offset += sizes[i];
+    }
 }
 
 void array_fwrite(const struct array *a, FILE *out)
@@ -243,6 +332,24 @@ size_t array_fread(struct array *a, FILE *in)
     return 1;
 }
 
+size_t array_map(struct array *a, FILE *in, const uint8_t *mapping)
+{
+    size_t read = fread(a, sizeof(struct array), 1, in);
+    if (read != 1) {
+        log_error("Exactly 1 struct array should have been read from file, but "
+                  "%d was", read);
+        return read;
+    }
+    const long offset = ftell(in);
+    const size_t n = a->elem_size * a->len / 8 + 1;
+    if (offset < 0 || fseek(in, n, SEEK_CUR) != 0) {
+        log_error("Could not skip the array elements of the file");
+        return 0;
+    }
+    a->elems = (uint8_t *) mapping + offset;
+    return 1;
+}
+
 struct array *array_slice(const struct array *a, uint64_t l, uint64_t r)
 {
     if (r <= l)
@@ -99,7 +99,8 @@ void array_set(const struct array *a, uint64_t at, void *value);
 /**
  * Copy sequentially `a->elem_size` bits starting from the
  * position/first_child_index of \p a defined by \p at into the address pointed
- * by \p value.
+ * by \p value. Exactly ceil(`a->elem_size` / 8) bytes are written, with the
+ * bits of the last byte that follow the element being cleared.
  * @param a
  * @param at
  * @param dest
@@ -127,6 +128,9 @@ void array_sort(struct array *a, int (*cmp)(void *a, void *b));
  * Same as array_sort() but an extra argument can be passed through \p arg.
  * The argument will be passed to the \p cmp function (useful to avoid
  * passing state through global variables).
+ * @note The sorts and searches keep no state besides their arguments, so
+ * that different arrays can be sorted, and the same array searched, from
+ * many threads at once.
  * @param a
  * @param cmp
  * @param arg
@@ -194,6 +198,56 @@ int8_t array_bsearch_r_within(void *key, struct array *a,
                               void *arg,
                               uint64_t l, uint64_t r, uint64_t *index);
 
+/**
+ * Get \p nbits bits, starting \p offset bits after the beginning of the
+ * \p at-th element of \p a, as an unsigned integer. Useful to read a single
+ * field of a compacted element without extracting the others.
+ * @param a
+ * @param at
+ * @param offset offset of the field within the element (in bits)
+ * @param nbits size of the field (in bits), at most 64
+ * @return the field value
+ */
+uint64_t array_get_field(const struct array *a, uint64_t at,
+                         unsigned int offset, unsigned int nbits);
+
+/**
+ * Unpack the unsigned integer field that starts \p offset bits after the
+ * beginning of each element of the slice [\p l, \p r) of \p a into the dense
+ * column \p dest. It is equivalent to calling array_get_field() for each
+ * element, but uses SIMD kernels when the CPU supports them (see unpack.h).
+ * @param a
+ * @param l
+ * @param r
+ * @param offset offset of the field within each element (in bits)
+ * @param nbits size of the field (in bits), at most 64
+ * @param dest array of \p r - \p l integers where to unpack the field into
+ * @param dest_size size in bytes of each integer of \p dest: 4 or 8
+ */
+void array_unpack_field(const struct array *a, uint64_t l, uint64_t r,
+                        unsigned int offset, unsigned int nbits, void *dest,
+                        unsigned int dest_size);
+
+/**
+ * Search for \p key within an unsigned integer field of the elements of
+ * \p a using interpolation search, falling back to binary search steps
+ * whenever an interpolation step does not halve the interval. The elements
+ * in [\p l, \p r) must be sorted in ascending order of that field, and
+ * the search does about \f$ \log \log n \f$ probes when the field values
+ * are uniformly distributed (such as word ids).
+ * @param key value to search for
+ * @param a array to be searched
+ * @param offset offset of the field within each element (in bits)
+ * @param nbits size of the field (in bits), at most 64
+ * @param l left bound (inclusive) of the interval to search within for
+ * @param r right bound (exclusive) of the interval to search within for
+ * @param index pass out pointer for returning the index
+ * @return 0 if found or -1 if not found
+ */
+int8_t array_isearch_within(uint64_t key, const struct array *a,
+                            unsigned int offset, unsigned int nbits,
+                            uint64_t l, uint64_t r, uint64_t *index);
+
 /**
  * Split the data pointed by \p elem into \p order memory spaces pointed by
  * the \p dests array. The number of bits of data that each memory space
@@ -265,6 +319,17 @@ void array_fwrite(const struct array *a, FILE *out);
  */
 size_t array_fread(struct array *a, FILE *in);
 
+/**
+ * Same as array_fread(), but the elements are not read: they are pointed to
+ * in \p mapping, the memory map of the whole file of \p in, which is left
+ * after them. The array must not be freed with array_delete(), nor changed.
+ * @param a
+ * @param in
+ * @param mapping
+ * @return 1 on success.
+ */
+size_t array_map(struct array *a, FILE *in, const uint8_t *mapping);
+
 /**
  * Create a new array, containing the slice [\p l,\p r) from \p a.
  * @warning The returned array should be freed by the caller. Use
@@ -2,9 +2,12 @@
 
 extern "C" {
 #include "c/array.h"
+#include "c/unpack.h"
 }
 
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 TEST(Array, NewArray)
 {
@@ -505,6 +508,50 @@ TEST(Array, Sort)
     EXPECT_EQ(value16, 1023);
 }
 
+int uint16_compare_desc(void *a, void *b)
+{
+    return uint16_compare(b, a);
+}
+
+TEST(Array, ConcurrentSortAndSearch)
+{
+    // the threads sort their arrays in opposite orders at once, which goes
+    // wrong if the comparators of the threads are mixed up
+    const int n_threads = 8;
+    const uint64_t length = 1000;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([i, length]() {
+            struct array *a = array_new(13, length);
+            for (uint64_t j = 0; j < length; j++) {
+                uint16_t value = (j * 7919 + i) % 8192;
+                array_set(a, j, &value);
+            }
+            const bool ascending = i % 2 == 0;
+            array_sort(a, ascending ? uint16_compare : uint16_compare_desc);
+            uint16_t prev, current;
+            for (uint64_t j = 1; j < length; j++) {
+                array_get(a, j - 1, &prev);
+                array_get(a, j, &current);
+                EXPECT_TRUE(ascending ? prev <= current : prev >= current);
+            }
+            if (ascending) {
+                for (uint64_t j = 0; j < length; j++) {
+                    uint64_t index;
+                    array_get(a, j, &current);
+                    EXPECT_EQ(array_bsearch(&current, a, uint16_compare,
+                                            &index), 0);
+                    array_get(a, index, &prev);
+                    EXPECT_EQ(prev, current);
+                }
+            }
+            array_delete(a);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+}
+
 TEST(Array, BinarySearch)
 {
     uint8_t elem_size = 3;
@@ -527,6 +574,55 @@ TEST(Array, BinarySearch)
     EXPECT_EQ(index, 8);
 }
 
+TEST(Array, GetField)
+{
+    const unsigned int sizes[] = { 32, 17, 9 };
+    struct array *a = array_new(32 + 17 + 9, 5);
+    for (uint32_t i = 0; i < 5; i++) {
+        float probability = -1.5f * i;
+        uint32_t id = 1000 * i + 7;
+        uint16_t index = 3 * i;
+        void *elems[] = { &probability, &id, &index };
+        array_set_compacted(a, i, elems, sizes, 3);
+    }
+    for (uint32_t i = 0; i < 5; i++) {
+        EXPECT_EQ(array_get_field(a, i, 32, 17), 1000 * i + 7);
+        EXPECT_EQ(array_get_field(a, i, 49, 9), 3 * i);
+    }
+    array_delete(a);
+}
+
+TEST(Array, InterpolationSearch)
+{
+    const uint64_t length = 1000;
+    const unsigned int sizes[] = { 3, 20 };
+    struct array *a = array_new(3 + 20, length);
+    uint32_t ids[length];
+    srand(42);
+    for (uint64_t i = 0; i < length; i++) {
+        ids[i] = ((i > 0) ? ids[i - 1] : 0) + 1 + rand() % 100 * (i % 7);
+        uint8_t other = i % 8;
+        void *elems[] = { &other, &ids[i] };
+        array_set_compacted(a, i, elems, sizes, 2);
+    }
+
+    uint64_t index;
+    for (uint64_t i = 0; i < length; i++) {
+        ASSERT_EQ(array_isearch_within(ids[i], a, 3, 20, 0, length, &index), 0);
+        EXPECT_EQ(index, i);
+        if (i > 0 && ids[i - 1] + 1 < ids[i]) {
+            EXPECT_EQ(array_isearch_within(ids[i] - 1, a, 3, 20, 0, length,
+                                           &index), -1);
+        }
+    }
+    EXPECT_EQ(array_isearch_within(ids[10], a, 3, 20, 11, length, &index), -1);
+    EXPECT_EQ(array_isearch_within(ids[10], a, 3, 20, 0, 10, &index), -1);
+    EXPECT_EQ(array_isearch_within(ids[10], a, 3, 20, 10, 10, &index), -1);
+    EXPECT_EQ(array_isearch_within(ids[length - 1] + 1, a, 3, 20, 0, length,
+                                   &index), -1);
+    array_delete(a);
+}
+
 TEST(Array, ElemExtract)
 {
     uint64_t src = 869032957162;
@@ -545,7 +641,7 @@ TEST(Array, ElemsCompact)
     struct tmp {
         uint16_t a;
         uint8_t b;
-        uint8_t c;
+        uint16_t c;
     };
 
     struct tmp tmp = { 1020, 123, 132 };
@@ -555,3 +651,40 @@ TEST(Array, ElemsCompact)
     elems_compact(elems, &dest, sizes, 3);
     EXPECT_EQ(dest, 17428476);
 }
+
+TEST(Array, UnpackField)
+{
+    const enum unpack_isa isas[] = { UNPACK_SCALAR, UNPACK_AVX2,
+                                     UNPACK_AVX512 };
+    const enum unpack_isa detected = unpack_get_isa();
+    const unsigned int sizes[] = { 32, 19, 25 };
+    const uint64_t length = 1003;
+    struct array *a = array_new(32 + 19 + 25, length);
+    for (uint64_t i = 0; i < length; i++) {
+        uint32_t probability = 0xdeadbeef ^ i;
+        uint32_t id = (i * 7919) % (1 << 19);
+        uint64_t index = i * 31337 % (1 << 25);
+        void *elems[] = { &probability, &id, &index };
+        array_set_compacted(a, i, elems, sizes, 3);
+    }
+
+    for (enum unpack_isa isa: isas) {
+        if (unpack_set_isa(isa) != 0)
+            continue;
+        for (uint64_t l: { 0, 1, 5, 100 }) {
+            const uint64_t r = length - l / 2;
+            uint32_t probabilities[length], ids[length];
+            uint64_t indexes[length];
+            array_unpack_field(a, l, r, 0, 32, probabilities, 4);
+            array_unpack_field(a, l, r, 32, 19, ids, 4);
+            array_unpack_field(a, l, r, 51, 25, indexes, 8);
+            for (uint64_t i = l; i < r; i++) {
+                ASSERT_EQ(probabilities[i - l], 0xdeadbeef ^ i) << isa;
+                ASSERT_EQ(ids[i - l], (i * 7919) % (1 << 19)) << isa;
+                ASSERT_EQ(indexes[i - l], i * 31337 % (1 << 25)) << isa;
+            }
+        }
+    }
+    unpack_set_isa(detected);
+    array_delete(a);
+}
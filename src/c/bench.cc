@@ -0,0 +1,397 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * Microbenchmarks of the bit-packed array and of the trie queries. The trie
+ * is built from the ARPA file of the NGRAM_LM_BENCH_ARPA environment
+ * variable, of the order of NGRAM_LM_BENCH_ORDER, or from the test data by
+ * default. The mixture of different vocabularies is of generated models.
+ * Run from the project root, e.g.:
+ *     ngram_lm_bench --benchmark_out=bench.json --benchmark_out_format=json
+ */
+
+extern "C" {
+#include "c/arpa.h"
+#include "c/arpa_gen.h"
+#include "c/array.h"
+#include "c/bit.h"
+#include "c/ngram.h"
+#include "c/trie.h"
+#include "c/util/log.h"
+}
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// the number of elements of the arrays searched, and of the queries made
+const uint64_t ARRAY_LEN = 1 << 20;
+const int N_QUERIES = 1 << 12;
+
+/**
+ * Random indexes of an array of \p len elements.
+ */
+static std::vector<uint64_t> random_indexes(uint64_t len)
+{
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> indexes(N_QUERIES);
+    for (auto &i : indexes)
+        i = rng() % len;
+    return indexes;
+}
+
+static void BM_mov(benchmark::State &state)
+{
+    const unsigned int nbits = state.range(0);
+    uint8_t src[16], dest[16];
+    std::memset(src, 0xa5, sizeof(src));
+    std::memset(dest, 0, sizeof(dest));
+    uint8_t offset = 0;
+    for (auto _ : state) {
+        mov(src, offset, dest, (offset + 3) % 8, nbits);
+        benchmark::DoNotOptimize(dest);
+        offset = (offset + 1) % 8;
+    }
+}
+BENCHMARK(BM_mov)->Arg(7)->Arg(25)->Arg(57)->Arg(64);
+
+static void BM_array_get(benchmark::State &state)
+{
+    const uint8_t elem_size = state.range(0);
+    struct array *a = array_new(elem_size, ARRAY_LEN);
+    uint8_t value[32];
+    std::memset(value, 0x5a, sizeof(value));
+    array_fill(a, value);
+    const std::vector<uint64_t> indexes = random_indexes(ARRAY_LEN);
+    size_t i = 0;
+    for (auto _ : state) {
+        array_get(a, indexes[i++ % N_QUERIES], value);
+        benchmark::DoNotOptimize(value);
+    }
+    array_delete(a);
+}
+BENCHMARK(BM_array_get)->Arg(7)->Arg(25)->Arg(57)->Arg(64)->Arg(121);
+
+static void BM_array_set(benchmark::State &state)
+{
+    const uint8_t elem_size = state.range(0);
+    struct array *a = array_new(elem_size, ARRAY_LEN);
+    uint8_t value[32];
+    std::memset(value, 0x5a, sizeof(value));
+    const std::vector<uint64_t> indexes = random_indexes(ARRAY_LEN);
+    size_t i = 0;
+    for (auto _ : state) {
+        array_set(a, indexes[i++ % N_QUERIES], value);
+        benchmark::ClobberMemory();
+    }
+    array_delete(a);
+}
+BENCHMARK(BM_array_set)->Arg(7)->Arg(25)->Arg(57)->Arg(64)->Arg(121);
+
+/**
+ * Compare the elements \p a and \p b, of as many bytes as the size_t
+ * pointed by \p arg, as unsigned integers.
+ */
+static int cmp_elems(void *a, void *b, void *arg)
+{
+    uint64_t x = 0, y = 0;
+    std::memcpy(&x, a, *(size_t *) arg);
+    std::memcpy(&y, b, *(size_t *) arg);
+    return (x > y) - (x < y);
+}
+
+/**
+ * An array of ARRAY_LEN 25-bit word ids, sorted within each range of
+ * \p fanout elements, as the children of the nodes of a trie level.
+ */
+static struct array *new_children_array(uint64_t fanout)
+{
+    struct array *a = array_new(25, ARRAY_LEN);
+    std::mt19937_64 rng(7);
+    for (uint64_t l = 0; l < ARRAY_LEN; l += fanout) {
+        std::vector<uint64_t> ids(std::min(fanout, ARRAY_LEN - l));
+        for (auto &id : ids)
+            id = rng() % (1 << 25);
+        std::sort(ids.begin(), ids.end());
+        for (uint64_t i = 0; i < ids.size(); i++)
+            array_set(a, l + i, &ids[i]);
+    }
+    return a;
+}
+
+static void BM_array_bsearch_r_within(benchmark::State &state)
+{
+    const uint64_t fanout = state.range(0);
+    struct array *a = new_children_array(fanout);
+    size_t elem_bytes = 4;
+    const std::vector<uint64_t> indexes = random_indexes(ARRAY_LEN);
+    size_t i = 0;
+    for (auto _ : state) {
+        const uint64_t at = indexes[i++ % N_QUERIES];
+        const uint64_t l = at / fanout * fanout;
+        const uint64_t r = std::min(l + fanout, ARRAY_LEN);
+        uint64_t key = array_get_field(a, at, 0, 25), index;
+        benchmark::DoNotOptimize(array_bsearch_r_within(
+                &key, a, cmp_elems, &elem_bytes, l, r, &index));
+    }
+    array_delete(a);
+}
+BENCHMARK(BM_array_bsearch_r_within)->RangeMultiplier(8)->Range(8, 1 << 15);
+
+static void BM_array_isearch_within(benchmark::State &state)
+{
+    const uint64_t fanout = state.range(0);
+    struct array *a = new_children_array(fanout);
+    const std::vector<uint64_t> indexes = random_indexes(ARRAY_LEN);
+    size_t i = 0;
+    for (auto _ : state) {
+        const uint64_t at = indexes[i++ % N_QUERIES];
+        const uint64_t l = at / fanout * fanout;
+        const uint64_t r = std::min(l + fanout, ARRAY_LEN);
+        uint64_t index;
+        benchmark::DoNotOptimize(array_isearch_within(
+                array_get_field(a, at, 0, 25), a, 0, 25, l, r, &index));
+    }
+    array_delete(a);
+}
+BENCHMARK(BM_array_isearch_within)->RangeMultiplier(8)->Range(8, 1 << 15);
+
+static void BM_array_sort_r(benchmark::State &state)
+{
+    const uint64_t len = state.range(0);
+    struct array *a = array_new(57, len);
+    std::mt19937_64 rng(3);
+    size_t elem_bytes = 8;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (uint64_t i = 0; i < len; i++) {
+            uint64_t value = rng();
+            array_set(a, i, &value);
+        }
+        state.ResumeTiming();
+        array_sort_r(a, cmp_elems, &elem_bytes);
+    }
+    state.SetItemsProcessed(state.iterations() * len);
+    array_delete(a);
+}
+BENCHMARK(BM_array_sort_r)->RangeMultiplier(16)->Range(1 << 10, 1 << 18)
+        ->Unit(benchmark::kMillisecond);
+
+/**
+ * The trie of the benchmarks, along with contexts that are in it.
+ */
+struct bench_trie {
+    struct trie *t;
+    std::vector<std::string> words;
+    // pairs of words: a random one followed by one of its predictions
+    std::vector<std::vector<const char *>> contexts;
+
+    bench_trie()
+    {
+        log_set_quiet(true);
+        const char *path = std::getenv("NGRAM_LM_BENCH_ARPA");
+        const char *order = std::getenv("NGRAM_LM_BENCH_ORDER");
+        t = trie_new_from_arpa_path((order != nullptr) ? std::atoi(order) : 3,
+                                    (path != nullptr) ? path :
+                                    "./data/tmp.arpa");
+        for (uint64_t i = 0; i < t->n_ngrams[0]; i++)
+            words.emplace_back(t->vocab_lookup[i].text);
+        std::mt19937_64 rng(11);
+        struct word *preds[4];
+        for (int i = 0; i < N_QUERIES; i++) {
+            const char *first = words[rng() % words.size()].c_str();
+            trie_get_k_nwp(t, &first, 1, 4, preds);
+            const struct word *second = preds[rng() % 4];
+            contexts.push_back({ first, (second != nullptr) ? second->text :
+                                        first });
+        }
+    }
+
+    ~bench_trie()
+    {
+        trie_delete(t);
+    }
+};
+
+static const bench_trie &get_bench_trie()
+{
+    static bench_trie bt;
+    return bt;
+}
+
+static void BM_vocab_lookup(benchmark::State &state)
+{
+    const bench_trie &bt = get_bench_trie();
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(trie_get_word_id_from_text(
+                bt.t, bt.words[i++ % bt.words.size()].c_str()));
+}
+BENCHMARK(BM_vocab_lookup);
+
+static void BM_trie_get_nwp(benchmark::State &state)
+{
+    const bench_trie &bt = get_bench_trie();
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bt.contexts[i++ % N_QUERIES];
+        benchmark::DoNotOptimize(trie_get_nwp(
+                bt.t, const_cast<const char **>(context.data()), 2));
+    }
+}
+BENCHMARK(BM_trie_get_nwp);
+
+static void BM_trie_get_k_nwp(benchmark::State &state)
+{
+    const bench_trie &bt = get_bench_trie();
+    const unsigned short k = state.range(0);
+    std::vector<struct word *> preds(k);
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bt.contexts[i++ % N_QUERIES];
+        trie_get_k_nwp(bt.t, const_cast<const char **>(context.data()), 2, k,
+                       preds.data());
+        benchmark::DoNotOptimize(preds.data());
+    }
+}
+BENCHMARK(BM_trie_get_k_nwp)->Arg(1)->Arg(10)->Arg(100);
+
+/**
+ * The tries of two generated models of 30000 and 20000 words, the first one
+ * being a general model and the second one a domain model, whose vocabulary
+ * lacks 10000 of its words, along with contexts of both.
+ */
+struct bench_mixture {
+    struct trie *tries[2];
+    struct trie_mixture *mix;
+    std::vector<std::string> words;
+    std::vector<std::vector<const char *>> contexts;
+
+    bench_mixture()
+    {
+        log_set_quiet(true);
+        const uint64_t n_words[] = { 30000, 20000 };
+        for (int i = 0; i < 2; i++) {
+            const uint64_t n_ngrams[] = { n_words[i], 10 * n_words[i],
+                                          20 * n_words[i] };
+            struct arpa_gen *g = arpa_gen_new(3, n_ngrams, 1.0, 42 + i);
+            char path[] = "/tmp/ngram_lm_bench_XXXXXX";
+            FILE *f = fdopen(mkstemp(path), "w");
+            arpa_gen_fwrite(g, f);
+            fclose(f);
+            arpa_gen_delete(g);
+            tries[i] = trie_new_from_arpa_path(3, path);
+            std::remove(path);
+        }
+        const float weights[] = { 0.5, 0.5 };
+        mix = trie_mixture_new(const_cast<const struct trie **>(tries),
+                               weights, 2);
+        std::mt19937_64 rng(11);
+        for (int i = 0; i < 2 * N_QUERIES; i++)
+            words.push_back("w" + std::to_string(rng() % n_words[i % 2] + 1));
+        for (int i = 0; i < N_QUERIES; i++)
+            contexts.push_back({ words[2 * i].c_str(),
+                                 words[2 * i + 1].c_str() });
+    }
+
+    ~bench_mixture()
+    {
+        trie_mixture_delete(mix);
+        trie_delete(tries[0]);
+        trie_delete(tries[1]);
+    }
+};
+
+static const bench_mixture &get_bench_mixture()
+{
+    static bench_mixture bm;
+    return bm;
+}
+
+static void BM_trie_mixture_get_k_nwp(benchmark::State &state)
+{
+    // a mixture of 3 models, each being the trie of the benchmarks, which is
+    // searched once, so this is what a mixture adds to a query of a trie
+    const bench_trie &bt = get_bench_trie();
+    const struct trie *tries[] = { bt.t, bt.t, bt.t };
+    const float weights[] = { 0.5, 0.3, 0.2 };
+    struct trie_mixture *mix = trie_mixture_new(tries, weights, 3);
+    const unsigned short k = state.range(0);
+    std::vector<struct prediction> predictions(k);
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bt.contexts[i++ % N_QUERIES];
+        benchmark::DoNotOptimize(trie_mixture_get_k_nwp(
+                mix, const_cast<const char **>(context.data()), 2, k,
+                predictions.data()));
+    }
+    trie_mixture_delete(mix);
+}
+BENCHMARK(BM_trie_mixture_get_k_nwp)->Arg(1)->Arg(10)->Arg(100);
+
+static void BM_trie_mixture_of_different_vocabularies(benchmark::State &state)
+{
+    const bench_mixture &bm = get_bench_mixture();
+    const unsigned short k = state.range(0);
+    std::vector<struct prediction> predictions(k);
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bm.contexts[i++ % N_QUERIES];
+        benchmark::DoNotOptimize(trie_mixture_get_k_nwp(
+                bm.mix, const_cast<const char **>(context.data()), 2, k,
+                predictions.data()));
+    }
+}
+BENCHMARK(BM_trie_mixture_of_different_vocabularies)
+        ->Arg(1)->Arg(10)->Arg(100);
+
+// the query of each trie of the mixture on its own, which is not enough to
+// find the top k of the mixture
+static void BM_trie_get_k_nwp_of_each_trie(benchmark::State &state)
+{
+    const bench_mixture &bm = get_bench_mixture();
+    const unsigned short k = state.range(0);
+    std::vector<struct prediction> predictions(k);
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bm.contexts[i++ % N_QUERIES];
+        for (const struct trie *t : bm.tries)
+            benchmark::DoNotOptimize(trie_get_k_nwp_predictions(
+                    t, const_cast<const char **>(context.data()), 2, k,
+                    predictions.data()));
+    }
+}
+BENCHMARK(BM_trie_get_k_nwp_of_each_trie)->Arg(1)->Arg(10)->Arg(100);
+
+static void BM_trie_query_ngram(benchmark::State &state)
+{
+    const bench_trie &bt = get_bench_trie();
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bt.contexts[i++ % N_QUERIES];
+        int n = 2;
+        struct ngram *ngram = trie_query_ngram(
+                bt.t, const_cast<const char **>(context.data()), &n);
+        benchmark::DoNotOptimize(ngram);
+        ngram_delete(ngram);
+    }
+}
+BENCHMARK(BM_trie_query_ngram);
+
+static void BM_trie_query_ngram_grams(benchmark::State &state)
+{
+    const bench_trie &bt = get_bench_trie();
+    struct gram grams[2];
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &context = bt.contexts[i++ % N_QUERIES];
+        benchmark::DoNotOptimize(trie_query_ngram_grams(
+                bt.t, const_cast<const char **>(context.data()), 2, grams));
+    }
+}
+BENCHMARK(BM_trie_query_ngram_grams);
+
+BENCHMARK_MAIN();
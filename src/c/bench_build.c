@@ -0,0 +1,230 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include <argp.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <c/util/log.h>
+#include "arpa_gen.h"
+#include "trie.h"
+
+#define MIN_VOCAB_SIZE 1000
+#define MAX_VOCAB_SIZE (1 << 21)
+/// the vocabulary is this fraction of the n-grams, within the limits above
+#define N_NGRAMS_PER_WORD 100
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program benchmarks the building of tries from "
+                    "synthetic ARPA files of SIZE n-grams, e.g. 1M, 100M or "
+                    "1B, each built by its own process to measure its peak "
+                    "memory.";
+
+static char args_doc[] = "SIZE...";
+
+static struct argp_option options[] = {
+        { "order", 'n', "ORDER", 0, "N-gram order (default 3)", 0 },
+        { "zipf", 's', "EXPONENT", 0, "Zipf exponent (default 1)", 0 },
+        { "dir", 'd', "DIR", 0,
+          "Directory of the generated ARPA files (default /tmp)", 0 },
+        { "keep", 'k', 0, 0, "Keep the generated ARPA files", 0 },
+        { 0 }
+};
+
+struct arguments {
+    int order;
+    double zipf_exponent;
+    char *dir;
+    int keep;
+    char **sizes;
+    int n_sizes;
+};
+
+struct build_stats {
+    double seconds;
+    long peak_rss_kib;
+};
+
+/**
+ * Skip the '=' of the short options given as -n=X.
+ */
+static const char *skip_equals(const char *arg)
+{
+    return (arg[0] == '=') ? arg + 1 : arg;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'n':
+            arguments->order = atoi(skip_equals(arg));
+            break;
+        case 's':
+            arguments->zipf_exponent = strtod(skip_equals(arg), NULL);
+            break;
+        case 'd':
+            arguments->dir = (char *) skip_equals(arg);
+            break;
+        case 'k':
+            arguments->keep = 1;
+            break;
+        case ARGP_KEY_ARGS:
+            arguments->sizes = &state->argv[state->next];
+            arguments->n_sizes = state->argc - state->next;
+            break;
+        case ARGP_KEY_NO_ARGS:
+            argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Split \p size n-grams into the vocabulary and the n-grams of the higher
+ * orders, the higher the order the more n-grams, as in real models.
+ */
+static void split_size(uint64_t size, int order, uint64_t *n_ngrams)
+{
+    uint64_t vocab_size = size / N_NGRAMS_PER_WORD;
+    if (vocab_size < MIN_VOCAB_SIZE)
+        vocab_size = MIN_VOCAB_SIZE;
+    if (vocab_size > MAX_VOCAB_SIZE)
+        vocab_size = MAX_VOCAB_SIZE;
+    n_ngrams[0] = vocab_size;
+    const uint64_t rest = (size > vocab_size) ? size - vocab_size : 0;
+    const uint64_t parts = (uint64_t) order * (order - 1) / 2;
+    for (int n = 2; n <= order; n++)
+        n_ngrams[n - 1] = rest / parts * (n - 1);
+}
+
+/**
+ * Generate the ARPA file \p path of about \p size n-grams.
+ * @return the number of n-grams generated, or 0 on failure.
+ */
+static uint64_t generate(const struct arguments *arguments, uint64_t size,
+                         const char *path)
+{
+    uint64_t n_ngrams[arguments->order];
+    split_size(size, arguments->order, n_ngrams);
+    struct arpa_gen *g = arpa_gen_new(arguments->order, n_ngrams,
+                                      arguments->zipf_exponent, 42);
+    if (g == NULL)
+        return 0;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        log_error("File '%s' could not be opened: %s.\n", path,
+                  strerror(errno));
+        arpa_gen_delete(g);
+        return 0;
+    }
+    const int error = arpa_gen_fwrite(g, f);
+    uint64_t total = 0;
+    for (int n = 1; n <= arguments->order; n++)
+        total += arpa_gen_get_n_ngrams(g, n);
+    arpa_gen_delete(g);
+    if (fclose(f) != 0 || error) {
+        log_error("File '%s' could not be written", path);
+        return 0;
+    }
+    return total;
+}
+
+/**
+ * Build the trie of the ARPA file \p path in a child process, so that its
+ * peak resident set size is the one of the build alone.
+ * @return 0 on success, 1 on failure.
+ */
+static int build(int order, const char *path, struct build_stats *stats)
+{
+    // or the child would write the output buffered so far again
+    fflush(stdout);
+    const double start = now();
+    const pid_t pid = fork();
+    if (pid < 0) {
+        log_error("Could not fork: %s", strerror(errno));
+        return 1;
+    }
+    if (pid == 0) {
+        log_set_quiet(true);
+        // and the progress of the build
+        freopen("/dev/null", "w", stdout);
+        trie_delete(trie_new_from_arpa_path(order, path));
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS) {
+        log_error("The trie of '%s' could not be built", path);
+        return 1;
+    }
+    stats->seconds = now() - start;
+    stats->peak_rss_kib = usage.ru_maxrss;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = {
+            .order = 3, .zipf_exponent = 1, .dir = "/tmp", .keep = 0
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.order < 2) {
+        log_error("The order must be at least 2");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("size\tn-grams\tgenerate s\tbuild s\tn-grams/s\tpeak RSS MiB\t"
+           "bytes/n-gram\n");
+    for (int i = 0; i < arguments.n_sizes; i++) {
+        char *end;
+        const uint64_t size = arpa_gen_parse_count(arguments.sizes[i], &end);
+        if (end == arguments.sizes[i] || *end != '\0') {
+            log_error("Invalid size '%s'", arguments.sizes[i]);
+            exit(EXIT_FAILURE);
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/ngram_lm_bench_%s_%d.arpa",
+                 arguments.dir, arguments.sizes[i], arguments.order);
+
+        const double start = now();
+        const uint64_t total = generate(&arguments, size, path);
+        const double generate_seconds = now() - start;
+        struct build_stats stats;
+        if (total == 0 || build(arguments.order, path, &stats) != 0)
+            exit(EXIT_FAILURE);
+        if (!arguments.keep)
+            remove(path);
+
+        printf("%s\t%" PRIu64 "\t%.1f\t%.1f\t%.0f\t%.1f\t%.1f\n",
+               arguments.sizes[i], total, generate_seconds, stats.seconds,
+               total / stats.seconds, stats.peak_rss_kib / 1024.0,
+               stats.peak_rss_kib * 1024.0 / total);
+        fflush(stdout);
+    }
+
+    exit(0);
+}
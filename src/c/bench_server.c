@@ -0,0 +1,408 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include <argp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <c/util/log.h>
+#include "metrics.h"
+#include "shm_client.h"
+
+#define READ_SIZE (64 * 1024)
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program benchmarks a server of ngram_lm_server, "
+                    "sending it the contexts of CONTEXTS_FILE, one per line, "
+                    "over and over, from CONNECTIONS connections at once, each "
+                    "with up to DEPTH requests in flight, and reports the "
+                    "throughput and latency quantiles of the requests. With "
+                    "--shm, the connections are shared memory clients.";
+
+static char args_doc[] = "CONTEXTS_FILE";
+
+static struct argp_option options[] = {
+        { "unix", 'u', "PATH", 0, "Path of the Unix socket of the server", 0 },
+        { "port", 'p', "PORT", 0, "Port of the TCP socket of the server", 0 },
+        { "host", 'H', "ADDRESS", 0,
+          "IPv4 address of the server (default 127.0.0.1)", 0 },
+        { "shm", 's', "NAME", 0,
+          "Name of the shared memory segment of the server", 0 },
+        { "connections", 'c', "CONNECTIONS", 0,
+          "Number of connections, each of its own thread (default 4)", 0 },
+        { "depth", 'd', "DEPTH", 0,
+          "Requests in flight per connection (default 16)", 0 },
+        { "requests", 'n', "N", 0, "Number of requests (default 100000)", 0 },
+        { "predictions", 'k', "K", 0,
+          "Number of predictions per request (default 3)", 0 },
+        { 0 }
+};
+
+struct arguments {
+    char *unix_path;
+    int port;
+    char *host;
+    char *shm_name;
+    int n_connections;
+    int depth;
+    uint64_t n_requests;
+    int k;
+    char *contexts;
+};
+
+/**
+ * The requests of the contexts, each a line, and the contexts themselves.
+ */
+struct requests {
+    char **lines;
+    size_t *lens;
+    char **contexts;
+    size_t n;
+};
+
+struct client {
+    const struct arguments *arguments;
+    const struct requests *requests;
+    struct metrics *latencies;
+    uint64_t n_requests;
+    uint64_t first_request;     /// the requests sent start from this one
+    uint64_t errors;            /// requests answered with an error
+    int failed;
+};
+
+/**
+ * Skip the '=' of the short options given as -n=X.
+ */
+static const char *skip_equals(const char *arg)
+{
+    return (arg[0] == '=') ? arg + 1 : arg;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'u':
+            arguments->unix_path = (char *) skip_equals(arg);
+            break;
+        case 'p':
+            arguments->port = atoi(skip_equals(arg));
+            break;
+        case 'H':
+            arguments->host = (char *) skip_equals(arg);
+            break;
+        case 's':
+            arguments->shm_name = (char *) skip_equals(arg);
+            break;
+        case 'c':
+            arguments->n_connections = atoi(skip_equals(arg));
+            break;
+        case 'd':
+            arguments->depth = atoi(skip_equals(arg));
+            break;
+        case 'n':
+            arguments->n_requests = strtoull(skip_equals(arg), NULL, 10);
+            break;
+        case 'k':
+            arguments->k = atoi(skip_equals(arg));
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 1)
+                argp_usage(state);
+            arguments->contexts = arg;
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1)
+                argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+/**
+ * Read the contexts of \p path into requests of \p k predictions.
+ * @return 0 on success, 1 if the file could not be read or has no contexts.
+ */
+static int read_requests(const char *path, int k, struct requests *requests)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        log_error("File '%s' could not be opened: %s", path, strerror(errno));
+        return 1;
+    }
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    *requests = (struct requests) { NULL, NULL, NULL, 0 };
+    while ((len = getline(&line, &line_cap, f)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (requests->n == cap) {
+            cap = (cap > 0) ? 2 * cap : 1024;
+            requests->lines = realloc(requests->lines, cap * sizeof(char *));
+            requests->lens = realloc(requests->lens, cap * sizeof(size_t));
+            requests->contexts = realloc(requests->contexts,
+                                         cap * sizeof(char *));
+        }
+        requests->contexts[requests->n] = strdup(line);
+        const size_t size = len + 16;
+        char *request = malloc(size);
+        requests->lens[requests->n] = snprintf(request, size, "%d %s\n", k,
+                                               line);
+        requests->lines[requests->n++] = request;
+    }
+    free(line);
+    fclose(f);
+    if (requests->n == 0) {
+        log_error("File '%s' has no contexts", path);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Connect to the server of \p arguments.
+ * @return the socket, or -1 if it could not connect.
+ */
+static int connect_server(const struct arguments *arguments)
+{
+    int fd;
+    if (arguments->unix_path != NULL) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        strncpy(address.sun_path, arguments->unix_path,
+                sizeof(address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *) &address,
+                                sizeof(address)) == 0)
+            return fd;
+    } else {
+        struct sockaddr_in address = { .sin_family = AF_INET,
+                                       .sin_port = htons(arguments->port) };
+        inet_pton(AF_INET, arguments->host, &address.sin_addr);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        const int on = 1;
+        if (fd != -1 && connect(fd, (struct sockaddr *) &address,
+                                sizeof(address)) == 0 &&
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == 0)
+            return fd;
+    }
+    log_error("Could not connect to the server: %s", strerror(errno));
+    if (fd != -1)
+        close(fd);
+    return -1;
+}
+
+/**
+ * Send the requests of a client, keeping up to depth of them in flight, and
+ * record the latency of each one, from the time it is sent to the time its
+ * response is read.
+ */
+static void *run_client(void *arg)
+{
+    struct client *c = arg;
+    const int depth = c->arguments->depth;
+    const int fd = connect_server(c->arguments);
+    uint64_t *send_times = malloc(depth * sizeof(uint64_t));
+    char *in = malloc(READ_SIZE);
+    char *out = NULL;
+    size_t out_cap = 0;
+    size_t in_len = 0;
+    uint64_t sent = 0, received = 0;
+    c->failed = fd == -1;
+    while (!c->failed && received < c->n_requests) {
+        size_t out_len = 0;
+        const uint64_t now = metrics_now();
+        for (; sent < c->n_requests && sent - received < (uint64_t) depth;
+               sent++) {
+            const size_t i = (c->first_request + sent) % c->requests->n;
+            const size_t len = c->requests->lens[i];
+            if (out_len + len > out_cap) {
+                out_cap = 2 * (out_len + len);
+                out = realloc(out, out_cap);
+            }
+            memcpy(&out[out_len], c->requests->lines[i], len);
+            out_len += len;
+            send_times[sent % depth] = now;
+        }
+        for (size_t written = 0; written < out_len;) {
+            const ssize_t n = send(fd, &out[written], out_len - written,
+                                   MSG_NOSIGNAL);
+            if (n < 0 && errno != EINTR) {
+                c->failed = 1;
+                break;
+            }
+            written += (n > 0) ? n : 0;
+        }
+
+        const ssize_t n = recv(fd, &in[in_len], READ_SIZE - in_len, 0);
+        if (n <= 0) {
+            if (n == 0 || errno != EINTR)
+                c->failed = 1;
+            continue;
+        }
+        in_len += n;
+        const uint64_t read_time = metrics_now();
+        char *line = in, *end;
+        while ((end = memchr(line, '\n', &in[in_len] - line)) != NULL) {
+            metrics_record(c->latencies, METRICS_K_NWP,
+                           read_time - send_times[received % depth]);
+            c->errors += strncmp(line, "ERR", 3) == 0;
+            received++;
+            line = end + 1;
+        }
+        in_len -= line - in;
+        memmove(in, line, in_len);
+        if (in_len == READ_SIZE) {
+            log_error("Response longer than %d bytes", READ_SIZE);
+            c->failed = 1;
+        }
+    }
+    if (c->failed)
+        log_error("Connection lost after %" PRIu64 " responses", received);
+    if (fd != -1)
+        close(fd);
+    free(send_times);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/**
+ * Same as run_client(), but through a shared memory client.
+ */
+static void *run_shm_client(void *arg)
+{
+    struct client *c = arg;
+    const int depth = c->arguments->depth;
+    struct shm_client *client = shm_client_open(c->arguments->shm_name);
+    uint64_t *send_times = malloc(depth * sizeof(uint64_t));
+    struct shm_response response;
+    uint64_t sent = 0, received = 0;
+    c->failed = client == NULL;
+    if (c->failed)
+        log_error("Could not attach to the shared memory of the server");
+    while (!c->failed && received < c->n_requests) {
+        for (; sent < c->n_requests && sent - received < (uint64_t) depth;
+               sent++) {
+            const size_t i = (c->first_request + sent) % c->requests->n;
+            send_times[sent % depth] = metrics_now();
+            const int status = shm_client_send(client,
+                                               c->requests->contexts[i],
+                                               c->arguments->k, sent);
+            if (status == 1)
+                break;
+            if (status != 0) {
+                c->failed = 1;
+                break;
+            }
+        }
+        // take all the responses that arrived, waiting for the first one
+        for (int block = 1; !c->failed && received < sent; block = 0) {
+            const int status = shm_client_receive(client, &response, block);
+            if (status == 1)
+                break;
+            if (status != 0) {
+                c->failed = 1;
+                break;
+            }
+            metrics_record(c->latencies, METRICS_K_NWP,
+                           metrics_now() - send_times[received % depth]);
+            c->errors += response.error != SHM_OK;
+            received++;
+        }
+    }
+    if (c->failed)
+        log_error("Client failed after %" PRIu64 " responses", received);
+    shm_client_close(client);
+    free(send_times);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = {
+            .port = -1, .host = "127.0.0.1", .n_connections = 4, .depth = 16,
+            .n_requests = 100000, .k = 3
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.unix_path == NULL && arguments.port < 0 &&
+        arguments.shm_name == NULL) {
+        log_error("Give the path of a Unix socket, the port of a TCP one or "
+                  "the name of a shared memory segment");
+        exit(EXIT_FAILURE);
+    }
+    if (arguments.n_connections < 1 || arguments.depth < 1) {
+        log_error("The connections and depth must be positive");
+        exit(EXIT_FAILURE);
+    }
+    struct requests requests;
+    if (read_requests(arguments.contexts, arguments.k, &requests) != 0)
+        exit(EXIT_FAILURE);
+
+    const int n_clients = arguments.n_connections;
+    struct metrics *latencies = metrics_new(n_clients);
+    struct client clients[n_clients];
+    pthread_t threads[n_clients];
+    const double start = metrics_now();
+    for (int i = 0; i < n_clients; i++) {
+        clients[i] = (struct client) {
+                &arguments, &requests, latencies,
+                arguments.n_requests * (i + 1) / n_clients -
+                arguments.n_requests * i / n_clients,
+                requests.n * i / n_clients, 0, 0
+        };
+        if (pthread_create(&threads[i], NULL, (arguments.shm_name != NULL) ?
+                                              run_shm_client : run_client,
+                           &clients[i]) != 0) {
+            log_error("Could not start the clients");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t errors = 0;
+    int failed = 0;
+    for (int i = 0; i < n_clients; i++) {
+        pthread_join(threads[i], NULL);
+        errors += clients[i].errors;
+        failed |= clients[i].failed;
+    }
+    const double seconds = (metrics_now() - start) * 1e-9;
+
+    struct metrics_snapshot snapshot;
+    metrics_snapshot(latencies, &snapshot);
+    const struct metrics_summary *s = &snapshot.histograms[METRICS_K_NWP];
+    printf("requests\tseconds\trequests/s\tp50 us\tp90 us\tp99 us\t"
+           "p99.9 us\tmax us\terrors\n");
+    printf("%" PRIu64 "\t%.2f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%" PRIu64
+           "\n", s->count, seconds, s->count / seconds, s->p50 * 1e-3,
+           s->p90 * 1e-3, s->p99 * 1e-3, s->p999 * 1e-3, s->max * 1e-3,
+           errors);
+
+    metrics_delete(latencies);
+    for (size_t i = 0; i < requests.n; i++) {
+        free(requests.lines[i]);
+        free(requests.contexts[i]);
+    }
+    free(requests.lines);
+    free(requests.lens);
+    free(requests.contexts);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
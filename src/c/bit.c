@@ -2,13 +2,23 @@
 
 #include "bit.h"
 
-static void set_byte(void *dest, uint8_t x, unsigned short offset)
+static inline uint8_t
+get_byte(const uint8_t *src, uint8_t offset, unsigned int nbits)
 {
-    *((uint8_t *) (dest)) = CONCAT(uint8_t, *((uint8_t *) (dest)), (x),
-                                   (offset));
-    *(((uint8_t *) (dest)) + 1) = COMBINE(uint8_t, ((x) >> (8 - (offset))),
-                                          *(((uint8_t *) (dest)) + 1),
-                                          (offset));
+    uint8_t x = src[0] >> offset;
+    if (offset + nbits > 8)
+        x |= src[1] << (8 - offset);
+    return x;
+}
+
+static inline void
+set_byte(uint8_t *dest, uint8_t x, uint8_t offset, unsigned int nbits)
+{
+    const uint16_t mask = ((1U << nbits) - 1) << offset;
+    const uint16_t bits = ((uint16_t) x << offset) & mask;
+    dest[0] = (dest[0] & ~mask) | bits;
+    if (offset + nbits > 8)
+        dest[1] = (dest[1] & ~(mask >> 8)) | (bits >> 8);
 }
 
 void
@@ -26,22 +36,13 @@ mov_from(const void *src, uint8_t src_offset, void *dest, unsigned int nbits)
 void mov(const void *src, uint8_t src_offset, void *dest, uint8_t dest_offset,
          unsigned int nbits)
 {
-    unsigned int i = src_offset / 8;
-    while (i--)
-        src = (uint8_t *) src + 1;
-    i = dest_offset / 8;
-    while (i--)
-        dest = (uint8_t *) dest + 1;
+    const uint8_t *s = (const uint8_t *) src + src_offset / 8;
+    uint8_t *d = (uint8_t *) dest + dest_offset / 8;
     src_offset %= 8;
     dest_offset %= 8;
 
-    i = nbits / 8;
-    while (i--) {
-        set_byte(dest, BYTE_FROM(src, src_offset), dest_offset);
-        src = (uint8_t *) src + 1;
-        dest = (uint8_t *) dest + 1;
-    }
-    set_byte(dest, COMBINE(uint8_t, BYTE_FROM(src, src_offset),
-                           BYTE_FROM(dest, dest_offset), nbits % 8),
-             dest_offset);
+    for (; nbits >= 8; nbits -= 8, s++, d++)
+        set_byte(d, get_byte(s, src_offset, 8), dest_offset, 8);
+    if (nbits > 0)
+        set_byte(d, get_byte(s, src_offset, nbits), dest_offset, nbits);
 }
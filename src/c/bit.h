@@ -7,6 +7,7 @@
 #define NGRAM_LM_BIT_H
 
 #include <stdint.h>
+#include <string.h>
 
 #define LEFT_ONES(type, x) (~(~0U << (x)))
 #define RIGHT_ONES(type, x) (~0U << (sizeof(type) * 8 - (x)))
@@ -36,7 +37,9 @@ end) & (place)) )
 (uint8_t, ((x) >> (8-(offset))), *(((uint8_t *)(dest))+1), (offset));} )
 
 /**
- *
+ * Copies \p nbits starting at \p src + \p src_offset to \p dest + \p
+ * dest_offset, one byte at a time. Only the bytes holding the copied bits
+ * are read or written.
  * @warning no bit is cleared. Make sure that dest is initialized as desired
  * (with 0's probably).
  * @param src
@@ -72,4 +75,78 @@ mov_to(const void *src, unsigned int nbits, void *dest, uint8_t dest_offset);
 void
 mov_from(const void *src, uint8_t src_offset, void *dest, unsigned int nbits);
 
+/**
+ * Load the 8 bytes starting at \p src as a little-endian 64-bit word.
+ * @param src
+ * @return
+ */
+static inline uint64_t load_le64(const void *src)
+{
+    uint64_t x;
+    memcpy(&x, src, sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+/**
+ * Store \p x at \p dest as a little-endian 64-bit word.
+ * @param dest
+ * @param x
+ */
+static inline void store_le64(void *dest, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(dest, &x, sizeof(uint64_t));
+}
+
+/**
+ * Get \p nbits (at most 64) bits starting \p offset bits after \p src, with
+ * one unaligned 64-bit load, plus a one byte load when the bits span 9 bytes.
+ * @warning The 8 bytes starting at the byte where the bits begin are read,
+ * so the memory pointed by \p src must be padded accordingly (as the elements
+ * of an array are).
+ * @param src
+ * @param offset number of bits of offset
+ * @param nbits
+ * @return the bits, as an unsigned integer.
+ */
+static inline uint64_t
+bits_get(const void *src, uint64_t offset, unsigned int nbits)
+{
+    const uint8_t *p = (const uint8_t *) src + offset / 8;
+    const unsigned int shift = offset % 8;
+    uint64_t x = load_le64(p) >> shift;
+    if (shift + nbits > 64)
+        x |= (uint64_t) p[8] << (64 - shift);
+    return (nbits < 64) ? x & ((UINT64_C(1) << nbits) - 1) : x;
+}
+
+/**
+ * Set \p nbits (at most 64) bits starting \p offset bits after \p dest with
+ * the first \p nbits bits of \p value. The other bits are left as is.
+ * @warning The same padding considerations of bits_get() apply.
+ * @param dest
+ * @param offset number of bits of offset
+ * @param nbits
+ * @param value
+ */
+static inline void
+bits_set(void *dest, uint64_t offset, unsigned int nbits, uint64_t value)
+{
+    uint8_t *p = (uint8_t *) dest + offset / 8;
+    const unsigned int shift = offset % 8;
+    const uint64_t mask = (nbits < 64) ? (UINT64_C(1) << nbits) - 1 :
+                          UINT64_MAX;
+    value &= mask;
+    store_le64(p, (load_le64(p) & ~(mask << shift)) | (value << shift));
+    if (shift + nbits > 64) {
+        const uint8_t high_mask = (1U << (shift + nbits - 64)) - 1;
+        p[8] = (p[8] & ~high_mask) | (uint8_t) (value >> (64 - shift));
+    }
+}
+
 #endif //NGRAM_LM_BIT_H
@@ -0,0 +1,64 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "eytzinger.h"
+
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE 64
+#define KEYS_PER_CACHE_LINE (CACHE_LINE_SIZE / sizeof(word_id_type))
+
+static uint32_t fill(struct eytzinger *e, const word_id_type *sorted,
+                     uint32_t i, uint64_t k);
+
+struct eytzinger *eytzinger_new(const word_id_type *sorted, uint32_t n)
+{
+    struct eytzinger *e = malloc(sizeof(struct eytzinger));
+    e->len = n;
+    // keys[0] is never visited. With the array aligned to a cache line, the
+    // 16 descendants of the k-th key that are 4 levels below it share the
+    // cache line starting at keys[16k].
+    size_t size = (n + 1) * sizeof(word_id_type);
+    size += CACHE_LINE_SIZE - size % CACHE_LINE_SIZE;
+    e->keys = aligned_alloc(CACHE_LINE_SIZE, size);
+    e->ranks = malloc((n + 1) * sizeof(uint32_t));
+    e->keys[0] = 0;
+    e->ranks[0] = 0;
+    fill(e, sorted, 0, 1);
+    return e;
+}
+
+void eytzinger_delete(struct eytzinger *e)
+{
+    free(e->keys);
+    free(e->ranks);
+    free(e);
+}
+
+static uint32_t fill(struct eytzinger *e, const word_id_type *sorted,
+                     uint32_t i, uint64_t k)
+{
+    if (k <= e->len) {
+        i = fill(e, sorted, i, 2 * k);
+        e->keys[k] = sorted[i];
+        e->ranks[k] = i++;
+        i = fill(e, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+int8_t eytzinger_search(const struct eytzinger *e, word_id_type key,
+                        uint32_t *rank)
+{
+    uint64_t k = 1;
+    while (k <= e->len) {
+        __builtin_prefetch(e->keys + k * KEYS_PER_CACHE_LINE);
+        k = 2 * k + (e->keys[k] < key);
+    }
+    // k went right every time since the lower bound was last visited. Undo
+    // those moves, plus the final move to the left.
+    k >>= __builtin_ffsll((long long) ~k);
+    if (k == 0 || e->keys[k] != key)
+        return -1;
+    *rank = e->ranks[k];
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Sorted set of word ids stored in Eytzinger (BFS) order. A sorted
+ * array of \f$n\f$ keys is laid out as an implicit binary tree where the
+ * children of the \f$k\f$-th key are at positions \f$2k\f$ and \f$2k + 1\f$.
+ * The first levels of the tree share a few cache lines and the search loop is
+ * branchless, so the memory accesses of the next levels can be prefetched
+ * before they are needed. This is useful for large sibling ranges of the
+ * trie (e.g. the children of "<s>"), where a binary search over the
+ * bit-packed array is one cache miss per probe.
+ * @code
+ * word_id_type sorted[] = { 2, 3, 5, 7, 11 };
+ * struct eytzinger *e = eytzinger_new(sorted, 5);
+ * uint32_t rank;
+ * if (eytzinger_search(e, 7, &rank) == 0)
+ *     assert(rank == 3);
+ * eytzinger_delete(e);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_EYTZINGER_H
+#define NGRAM_LM_EYTZINGER_H
+
+#include <stdint.h>
+
+#include "word.h"
+
+struct eytzinger {
+    uint32_t len;
+    word_id_type *keys;     /// 1-indexed keys in Eytzinger order
+    uint32_t *ranks;        /// position of keys[k] in the sorted order
+};
+
+/**
+ * Create an Eytzinger layout of the \p n keys of \p sorted.
+ * @warning \p sorted must be sorted in ascending order. The returned layout
+ * must be freed by the caller. Use eytzinger_delete().
+ * @param sorted
+ * @param n
+ * @return
+ */
+struct eytzinger *eytzinger_new(const word_id_type *sorted, uint32_t n);
+
+/**
+ * Free \p e.
+ * @param e
+ */
+void eytzinger_delete(struct eytzinger *e);
+
+/**
+ * Search for \p key.
+ * @param e
+ * @param key
+ * @param rank pass out pointer for returning the position of \p key in the
+ * sorted order
+ * @return 0 if found or -1 if not found
+ */
+int8_t eytzinger_search(const struct eytzinger *e, word_id_type key,
+                        uint32_t *rank);
+
+#endif //NGRAM_LM_EYTZINGER_H
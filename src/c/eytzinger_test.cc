@@ -0,0 +1,41 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/eytzinger.h"
+}
+
+#include <gtest/gtest.h>
+
+TEST(Eytzinger, New)
+{
+    word_id_type sorted[] = { 2, 3, 5, 7, 11, 13 };
+    struct eytzinger *e = eytzinger_new(sorted, 6);
+    EXPECT_EQ(e->len, 6);
+    EXPECT_EQ(e->keys[1], 7);
+    EXPECT_EQ(e->keys[2], 3);
+    EXPECT_EQ(e->keys[3], 13);
+    EXPECT_EQ(e->keys[4], 2);
+    EXPECT_EQ(e->keys[5], 5);
+    EXPECT_EQ(e->keys[6], 11);
+    EXPECT_EQ(e->ranks[1], 3);
+    EXPECT_EQ(e->ranks[4], 0);
+    eytzinger_delete(e);
+}
+
+TEST(Eytzinger, Search)
+{
+    for (uint32_t n = 1; n < 300; n++) {
+        word_id_type sorted[n];
+        for (uint32_t i = 0; i < n; i++)
+            sorted[i] = 3 * i + 1;
+        struct eytzinger *e = eytzinger_new(sorted, n);
+        uint32_t rank;
+        for (uint32_t i = 0; i < n; i++) {
+            ASSERT_EQ(eytzinger_search(e, sorted[i], &rank), 0);
+            EXPECT_EQ(rank, i);
+            EXPECT_EQ(eytzinger_search(e, sorted[i] + 1, &rank), -1);
+        }
+        EXPECT_EQ(eytzinger_search(e, 0, &rank), -1);
+        eytzinger_delete(e);
+    }
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include <argp.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <c/util/log.h>
+#include "arpa_gen.h"
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program generates a synthetic ARPA file, of Zipf "
+                    "distributed words, to benchmark the tries.";
+
+static char args_doc[] = "OUT_FILE";
+
+static struct argp_option options[] = {
+        { "order", 'n', "ORDER", 0, "N-gram order (default 3)", 0 },
+        { "counts", 'c', "COUNTS", 0,
+          "Comma separated number of n-grams of each order, from the size of "
+          "the vocabulary, with an optional K, M or B suffix (default "
+          "10K,100K,400K)", 0 },
+        { "zipf", 's', "EXPONENT", 0, "Zipf exponent (default 1)", 0 },
+        { "seed", 'r', "SEED", 0, "Random seed (default 42)", 0 },
+        { 0 }
+};
+
+struct arguments {
+    int order;
+    char *counts;
+    double zipf_exponent;
+    uint64_t seed;
+    char *out;
+};
+
+/**
+ * Skip the '=' of the short options given as -n=X.
+ */
+static const char *skip_equals(const char *arg)
+{
+    return (arg[0] == '=') ? arg + 1 : arg;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'n':
+            arguments->order = atoi(skip_equals(arg));
+            break;
+        case 'c':
+            arguments->counts = (char *) skip_equals(arg);
+            break;
+        case 's':
+            arguments->zipf_exponent = strtod(skip_equals(arg), NULL);
+            break;
+        case 'r':
+            arguments->seed = strtoull(skip_equals(arg), NULL, 10);
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 1)
+                argp_usage(state);
+            arguments->out = arg;
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1)
+                argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+/**
+ * Parse the \p order comma separated counts of \p text into \p n_ngrams.
+ * @return 0 on success, 1 if there are too few counts or they are invalid.
+ */
+static int parse_counts(const char *text, int order, uint64_t *n_ngrams)
+{
+    for (int n = 0; n < order; n++) {
+        char *end;
+        n_ngrams[n] = arpa_gen_parse_count(text, &end);
+        if (end == text)
+            return 1;
+        if (*end != ((n < order - 1) ? ',' : '\0'))
+            return 1;
+        text = end + 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = {
+            .order = 3, .counts = "10K,100K,400K", .zipf_exponent = 1,
+            .seed = 42
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.order < 1) {
+        log_error("The order must be positive");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t n_ngrams[arguments.order];
+    if (parse_counts(arguments.counts, arguments.order, n_ngrams) != 0) {
+        log_error("Expected %d comma separated counts, got '%s'",
+                  arguments.order, arguments.counts);
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Generating the %d-gram model...", arguments.order);
+    struct arpa_gen *g = arpa_gen_new(arguments.order, n_ngrams,
+                                      arguments.zipf_exponent, arguments.seed);
+    if (g == NULL)
+        exit(EXIT_FAILURE);
+    for (int n = 1; n <= arguments.order; n++)
+        log_info("%d-grams: %" PRIu64, n, arpa_gen_get_n_ngrams(g, n));
+
+    FILE *f = fopen(arguments.out, "w");
+    if (f == NULL) {
+        log_error("File '%s' could not be opened: %s.\n", arguments.out,
+                  strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    const int error = arpa_gen_fwrite(g, f);
+    if (fclose(f) != 0 || error) {
+        log_error("File '%s' could not be written", arguments.out);
+        exit(EXIT_FAILURE);
+    }
+    arpa_gen_delete(g);
+    log_info("ARPA file successfully generated");
+
+    exit(0);
+}
@@ -0,0 +1,294 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "hot_cache.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE_SIZE 64
+#define WAYS 4
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+#define SKETCH_SAMPLE_FACTOR 10
+
+/**
+ * An entry, followed by its k predictions. A writer makes the version odd
+ * while it writes, so that a reader that sees the same even version before
+ * and after reading the entry knows that it read a consistent one.
+ */
+struct entry {
+    atomic_uint version;
+    atomic_ushort len;
+    atomic_uint_least64_t key;      /// 0 when empty
+    atomic_uint_least64_t predictions[];
+};
+
+struct hot_cache {
+    unsigned short k;
+    size_t entry_size;
+    uint64_t n_sets;
+    unsigned char *entries;
+    atomic_uchar *sketch;           /// SKETCH_DEPTH rows of sketch_width
+    uint64_t sketch_width;          /// power of 2
+    uint64_t sample_size;           /// increments between halvings
+    atomic_uint_least64_t increments;
+    atomic_uint_least64_t lookups;
+    atomic_uint_least64_t hits;
+    atomic_uint_least64_t admissions;
+    atomic_uint_least64_t rejections;
+};
+
+static uint64_t mix(uint64_t key);
+
+static struct entry *get_entry(const struct hot_cache *c, uint64_t i);
+
+static struct entry *find_victim(struct hot_cache *c, uint64_t key);
+
+static unsigned int estimate(const struct hot_cache *c, uint64_t key);
+
+static void increment(struct hot_cache *c, uint64_t key);
+
+static void halve(struct hot_cache *c);
+
+struct hot_cache *hot_cache_new(size_t budget, unsigned short k)
+{
+    const size_t entry_size = sizeof(struct entry) +
+                              k * sizeof(atomic_uint_least64_t);
+    // the sketch has at most 2 counters per entry in each row
+    const uint64_t n_sets = budget / (WAYS * (entry_size + 2 * SKETCH_DEPTH));
+    if (n_sets == 0 || k == 0)
+        return NULL;
+    struct hot_cache *c = malloc(sizeof(struct hot_cache));
+    c->k = k;
+    c->entry_size = entry_size;
+    c->n_sets = n_sets;
+    size_t size = n_sets * WAYS * entry_size;
+    size += CACHE_LINE_SIZE - size % CACHE_LINE_SIZE;
+    c->entries = aligned_alloc(CACHE_LINE_SIZE, size);
+    for (uint64_t i = 0; i < n_sets * WAYS; i++) {
+        struct entry *e = get_entry(c, i);
+        atomic_init(&e->version, 0);
+        atomic_init(&e->len, 0);
+        atomic_init(&e->key, 0);
+    }
+    c->sketch_width = 1;
+    while (2 * c->sketch_width <= 2 * n_sets * WAYS)
+        c->sketch_width *= 2;
+    c->sketch = malloc(SKETCH_DEPTH * c->sketch_width);
+    for (uint64_t i = 0; i < SKETCH_DEPTH * c->sketch_width; i++)
+        atomic_init(&c->sketch[i], 0);
+    c->sample_size = SKETCH_SAMPLE_FACTOR * n_sets * WAYS;
+    atomic_init(&c->increments, 0);
+    atomic_init(&c->lookups, 0);
+    atomic_init(&c->hits, 0);
+    atomic_init(&c->admissions, 0);
+    atomic_init(&c->rejections, 0);
+    return c;
+}
+
+void hot_cache_delete(struct hot_cache *c)
+{
+    free(c->entries);
+    free(c->sketch);
+    free(c);
+}
+
+unsigned short hot_cache_k(const struct hot_cache *c)
+{
+    return c->k;
+}
+
+int8_t hot_cache_get(struct hot_cache *c, uint64_t key, unsigned short k,
+                     struct prediction *predictions, unsigned short *len)
+{
+    atomic_fetch_add_explicit(&c->lookups, 1, memory_order_relaxed);
+    increment(c, key);
+    const uint64_t set = (mix(key) >> 32) * c->n_sets >> 32;
+    for (uint64_t i = set * WAYS; i < (set + 1) * WAYS; i++) {
+        struct entry *e = get_entry(c, i);
+        const unsigned int version = atomic_load_explicit(&e->version,
+                                                          memory_order_acquire);
+        if (version & 1 ||
+            atomic_load_explicit(&e->key, memory_order_relaxed) != key)
+            continue;
+        const unsigned short found = atomic_load_explicit(
+                &e->len, memory_order_relaxed);
+        for (unsigned short j = 0; j < k; j++) {
+            const uint64_t p = atomic_load_explicit(&e->predictions[j],
+                                                    memory_order_relaxed);
+            const uint32_t probability_bits = p;
+            predictions[j].word_id = p >> 32;
+            memcpy(&predictions[j].probability, &probability_bits,
+                   sizeof(float));
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->version, memory_order_relaxed) != version)
+            return -1;
+        *len = (found < k) ? found : k;
+        atomic_fetch_add_explicit(&c->hits, 1, memory_order_relaxed);
+        return 0;
+    }
+    return -1;
+}
+
+int hot_cache_admits(struct hot_cache *c, uint64_t key)
+{
+    const struct entry *victim = find_victim(c, key);
+    const uint64_t victim_key = atomic_load_explicit(&victim->key,
+                                                     memory_order_relaxed);
+    if (victim_key == 0 || estimate(c, key) > estimate(c, victim_key))
+        return 1;
+    atomic_fetch_add_explicit(&c->rejections, 1, memory_order_relaxed);
+    return 0;
+}
+
+void hot_cache_put(struct hot_cache *c, uint64_t key,
+                   const struct prediction *predictions, unsigned short len)
+{
+    struct entry *victim = find_victim(c, key);
+    const uint64_t victim_key = atomic_load_explicit(&victim->key,
+                                                     memory_order_relaxed);
+    if (victim_key == key ||
+        (victim_key != 0 && estimate(c, key) <= estimate(c, victim_key)))
+        return;
+    unsigned int version = atomic_load_explicit(&victim->version,
+                                                memory_order_relaxed);
+    if (version & 1 ||
+        !atomic_compare_exchange_strong_explicit(&victim->version, &version,
+                                                 version + 1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+        return;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&victim->key, key, memory_order_relaxed);
+    atomic_store_explicit(&victim->len, len, memory_order_relaxed);
+    for (unsigned short j = 0; j < c->k; j++) {
+        uint32_t probability_bits;
+        memcpy(&probability_bits, &predictions[j].probability, sizeof(float));
+        atomic_store_explicit(&victim->predictions[j],
+                              (uint64_t) predictions[j].word_id << 32 |
+                              probability_bits, memory_order_relaxed);
+    }
+    atomic_store_explicit(&victim->version, version + 2, memory_order_release);
+    atomic_fetch_add_explicit(&c->admissions, 1, memory_order_relaxed);
+}
+
+void hot_cache_get_stats(const struct hot_cache *c,
+                         struct hot_cache_stats *stats)
+{
+    stats->lookups = atomic_load_explicit(&c->lookups, memory_order_relaxed);
+    stats->hits = atomic_load_explicit(&c->hits, memory_order_relaxed);
+    stats->admissions = atomic_load_explicit(&c->admissions,
+                                             memory_order_relaxed);
+    stats->rejections = atomic_load_explicit(&c->rejections,
+                                             memory_order_relaxed);
+    stats->capacity = c->n_sets * WAYS;
+    stats->size = sizeof(struct hot_cache) + c->n_sets * WAYS * c->entry_size +
+                  SKETCH_DEPTH * c->sketch_width;
+}
+
+/**
+ * Murmur3 64-bit finalizer.
+ */
+static uint64_t mix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct entry *get_entry(const struct hot_cache *c, uint64_t i)
+{
+    return (struct entry *) (c->entries + i * c->entry_size);
+}
+
+/**
+ * @return the entry of the set of \p key with \p key, or else an empty one,
+ * or else the least frequent one.
+ */
+static struct entry *find_victim(struct hot_cache *c, uint64_t key)
+{
+    const uint64_t set = (mix(key) >> 32) * c->n_sets >> 32;
+    struct entry *victim = NULL;
+    unsigned int victim_count = SKETCH_MAX_COUNT + 1;
+    for (uint64_t i = set * WAYS; i < (set + 1) * WAYS; i++) {
+        struct entry *e = get_entry(c, i);
+        const uint64_t e_key = atomic_load_explicit(&e->key,
+                                                    memory_order_relaxed);
+        if (e_key == key || e_key == 0)
+            return e;
+        const unsigned int count = estimate(c, e_key);
+        if (count < victim_count) {
+            victim = e;
+            victim_count = count;
+        }
+    }
+    return victim;
+}
+
+/**
+ * The counters of \p key are at (h1 + i * h2) mod width of each row i.
+ */
+static unsigned int estimate(const struct hot_cache *c, uint64_t key)
+{
+    const uint64_t h = mix(key);
+    const uint64_t h1 = h, h2 = (h >> 32) | 1;
+    unsigned int count = SKETCH_MAX_COUNT;
+    for (uint64_t i = 0; i < SKETCH_DEPTH; i++) {
+        const atomic_uchar *counter =
+                &c->sketch[i * c->sketch_width +
+                           ((h1 + i * h2) & (c->sketch_width - 1))];
+        const unsigned int v = atomic_load_explicit(counter,
+                                                    memory_order_relaxed);
+        if (v < count)
+            count = v;
+    }
+    return count;
+}
+
+/**
+ * Increment the counters of \p key that are not saturated, so that the
+ * contexts that are looked up the most only read their counters. Concurrent
+ * increments of the same counter may be lost, which only makes the estimates
+ * a little lower.
+ */
+static void increment(struct hot_cache *c, uint64_t key)
+{
+    const uint64_t h = mix(key);
+    const uint64_t h1 = h, h2 = (h >> 32) | 1;
+    int incremented = 0;
+    for (uint64_t i = 0; i < SKETCH_DEPTH; i++) {
+        atomic_uchar *counter =
+                &c->sketch[i * c->sketch_width +
+                           ((h1 + i * h2) & (c->sketch_width - 1))];
+        unsigned char v = atomic_load_explicit(counter, memory_order_relaxed);
+        if (v < SKETCH_MAX_COUNT) {
+            atomic_compare_exchange_strong_explicit(counter, &v, v + 1,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed);
+            incremented = 1;
+        }
+    }
+    if (incremented &&
+        atomic_fetch_add_explicit(&c->increments, 1, memory_order_relaxed) + 1
+        == c->sample_size)
+        halve(c);
+}
+
+/**
+ * Halve every counter, so that the frequencies follow the recent lookups.
+ */
+static void halve(struct hot_cache *c)
+{
+    for (uint64_t i = 0; i < SKETCH_DEPTH * c->sketch_width; i++) {
+        const unsigned char v = atomic_load_explicit(&c->sketch[i],
+                                                     memory_order_relaxed);
+        atomic_store_explicit(&c->sketch[i], v / 2, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&c->increments, c->sample_size,
+                              memory_order_relaxed);
+}
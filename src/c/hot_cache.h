@@ -0,0 +1,93 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Fixed-size cache of the top-k next word predictions of the most
+ * frequent contexts. The frequency of every context looked up is estimated by
+ * a count-min sketch, whose counters are halved periodically so that old
+ * popularity fades away, and a context only takes the place of a cached one
+ * if it is looked up more often (TinyLFU admission). The entries are grouped
+ * in sets of a few ways, and each entry is guarded by a sequence lock, so
+ * that any number of threads can look up and fill the cache without locks.
+ * @code
+ * struct hot_cache *c = hot_cache_new(1 << 20, 10);
+ * unsigned short len;
+ * if (hot_cache_get(c, key, k, predictions, &len) != 0 &&
+ *     hot_cache_admits(c, key)) {
+ *     // compute the top 10 predictions of the context of key
+ *     hot_cache_put(c, key, top_10, len);
+ * }
+ * hot_cache_delete(c);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_HOT_CACHE_H
+#define NGRAM_LM_HOT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "word.h"
+
+struct hot_cache;
+
+struct hot_cache_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t admissions;        /// entries written
+    uint64_t rejections;        /// contexts less frequent than the victim
+    uint64_t capacity;          /// number of entries
+    size_t size;                /// bytes used
+};
+
+/**
+ * Create a cache of the top \p k predictions of as many contexts as fit in
+ * \p budget bytes, the frequency sketch included.
+ * @return the cache, or NULL if \p budget is too small for a set of entries.
+ * Use hot_cache_delete() to free it.
+ */
+struct hot_cache *hot_cache_new(size_t budget, unsigned short k);
+
+void hot_cache_delete(struct hot_cache *c);
+
+/**
+ * @return the number of predictions of each entry of \p c.
+ */
+unsigned short hot_cache_k(const struct hot_cache *c);
+
+/**
+ * Look up the context \p key, counting the lookup in its frequency.
+ * @param c
+ * @param key non-zero context key.
+ * @param k at most hot_cache_k().
+ * @param predictions array of \p k predictions, written on a hit.
+ * @param len pass out pointer for the number of predictions found, at most
+ * \p k, written on a hit.
+ * @return 0 on a hit or -1 on a miss.
+ */
+int8_t hot_cache_get(struct hot_cache *c, uint64_t key, unsigned short k,
+                     struct prediction *predictions, unsigned short *len);
+
+/**
+ * @return whether the context \p key is more frequent than the entry it would
+ * replace, so that its predictions are worth computing for hot_cache_put().
+ */
+int hot_cache_admits(struct hot_cache *c, uint64_t key);
+
+/**
+ * Cache the predictions of the context \p key, if it is still more frequent
+ * than the entry it would replace and no other thread is writing that entry.
+ * @param c
+ * @param key non-zero context key.
+ * @param predictions array of hot_cache_k() predictions.
+ * @param len number of predictions found.
+ */
+void hot_cache_put(struct hot_cache *c, uint64_t key,
+                   const struct prediction *predictions, unsigned short len);
+
+/**
+ * Get the statistics of \p c, gathered since its creation.
+ */
+void hot_cache_get_stats(const struct hot_cache *c,
+                         struct hot_cache_stats *stats);
+
+#endif //NGRAM_LM_HOT_CACHE_H
@@ -0,0 +1,136 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/hot_cache.h"
+}
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+// budget of a cache of a single set of 4 entries of the top 2 predictions
+const size_t ONE_SET_BUDGET = 4 * (16 + 2 * 8 + 2 * 4);
+
+static void fill(uint64_t key, struct prediction *predictions, int k)
+{
+    for (int j = 0; j < k; j++) {
+        predictions[j].word_id = key * 10 + j;
+        predictions[j].probability = -(float) j;
+    }
+}
+
+TEST(HotCache, New)
+{
+    EXPECT_EQ(hot_cache_new(ONE_SET_BUDGET - 1, 2), nullptr);
+    EXPECT_EQ(hot_cache_new(1 << 20, 0), nullptr);
+    struct hot_cache *c = hot_cache_new(ONE_SET_BUDGET, 2);
+    ASSERT_NE(c, nullptr);
+    EXPECT_EQ(hot_cache_k(c), 2);
+    struct hot_cache_stats stats;
+    hot_cache_get_stats(c, &stats);
+    EXPECT_EQ(stats.capacity, 4);
+    EXPECT_EQ(stats.lookups, 0);
+    hot_cache_delete(c);
+
+    c = hot_cache_new(1 << 20, 10);
+    hot_cache_get_stats(c, &stats);
+    EXPECT_LE(stats.size, (1 << 20) + sizeof(void *) * 8 + 64);
+    EXPECT_GT(stats.capacity, 4000);
+    hot_cache_delete(c);
+}
+
+TEST(HotCache, GetPut)
+{
+    struct hot_cache *c = hot_cache_new(1 << 16, 4);
+    struct prediction predictions[4], got[4];
+    unsigned short len;
+    EXPECT_EQ(hot_cache_get(c, 7, 4, got, &len), -1);
+    EXPECT_TRUE(hot_cache_admits(c, 7));
+    fill(7, predictions, 4);
+    hot_cache_put(c, 7, predictions, 3);
+
+    EXPECT_EQ(hot_cache_get(c, 7, 4, got, &len), 0);
+    EXPECT_EQ(len, 3);
+    for (int j = 0; j < 4; j++) {
+        EXPECT_EQ(got[j].word_id, predictions[j].word_id);
+        EXPECT_EQ(got[j].probability, predictions[j].probability);
+    }
+    EXPECT_EQ(hot_cache_get(c, 7, 2, got, &len), 0);
+    EXPECT_EQ(len, 2);
+    EXPECT_EQ(hot_cache_get(c, 8, 2, got, &len), -1);
+
+    struct hot_cache_stats stats;
+    hot_cache_get_stats(c, &stats);
+    EXPECT_EQ(stats.lookups, 4);
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.admissions, 1);
+    hot_cache_delete(c);
+}
+
+TEST(HotCache, Admission)
+{
+    struct hot_cache *c = hot_cache_new(ONE_SET_BUDGET, 2);
+    struct prediction predictions[2], got[2];
+    unsigned short len;
+    for (uint64_t key = 1; key <= 4; key++) {
+        hot_cache_get(c, key, 2, got, &len);
+        fill(key, predictions, 2);
+        hot_cache_put(c, key, predictions, 2);
+    }
+    // as frequent as the cached contexts
+    EXPECT_EQ(hot_cache_get(c, 5, 2, got, &len), -1);
+    EXPECT_FALSE(hot_cache_admits(c, 5));
+    fill(5, predictions, 2);
+    hot_cache_put(c, 5, predictions, 2);
+    EXPECT_EQ(hot_cache_get(c, 5, 2, got, &len), -1);
+
+    // more frequent than the cached contexts
+    EXPECT_TRUE(hot_cache_admits(c, 5));
+    hot_cache_put(c, 5, predictions, 2);
+    EXPECT_EQ(hot_cache_get(c, 5, 2, got, &len), 0);
+    EXPECT_EQ(got[1].word_id, 51);
+    int cached = 0;
+    for (uint64_t key = 1; key <= 4; key++)
+        cached += hot_cache_get(c, key, 2, got, &len) == 0;
+    EXPECT_EQ(cached, 3);
+
+    struct hot_cache_stats stats;
+    hot_cache_get_stats(c, &stats);
+    EXPECT_EQ(stats.admissions, 5);
+    EXPECT_EQ(stats.rejections, 1);
+    hot_cache_delete(c);
+}
+
+TEST(HotCache, ConcurrentReadersAndWriters)
+{
+    const int k = 8;
+    struct hot_cache *c = hot_cache_new(16 * 1024, k);
+    std::vector<std::thread> threads;
+    std::vector<int> inconsistent(8, 0);
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([c, i, &inconsistent]() {
+            struct prediction predictions[k], got[k];
+            unsigned short len;
+            for (uint64_t n = 0; n < 20000; n++) {
+                const uint64_t key = 1 + (n * 7919 + i) % 300;
+                if (hot_cache_get(c, key, k, got, &len) == 0) {
+                    for (int j = 0; j < k; j++)
+                        inconsistent[i] += got[j].word_id != key * 10 + j;
+                    inconsistent[i] += len != k;
+                } else if (hot_cache_admits(c, key)) {
+                    fill(key, predictions, k);
+                    hot_cache_put(c, key, predictions, k);
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (int i = 0; i < 8; i++)
+        EXPECT_EQ(inconsistent[i], 0);
+    struct hot_cache_stats stats;
+    hot_cache_get_stats(c, &stats);
+    EXPECT_EQ(stats.lookups, 8 * 20000);
+    EXPECT_GT(stats.hits, 0);
+    hot_cache_delete(c);
+}
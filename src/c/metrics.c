@@ -0,0 +1,282 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CACHE_LINE_SIZE 64
+#define MAX_VALUE_BITS 40   /// larger values are recorded as 2^40 - 1
+#define N_BUCKETS ((MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1) * \
+                   METRICS_SUB_BUCKETS)
+
+struct histogram {
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t buckets[N_BUCKETS];
+};
+
+/**
+ * Aligned to a cache line, so that the shards do not share any.
+ */
+struct shard {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t
+            counters[METRICS_N_COUNTERS];
+    struct histogram histograms[METRICS_N_HISTOGRAMS];
+};
+
+struct metrics {
+    unsigned int n_shards;      /// power of 2
+    struct shard *shards;
+};
+
+static const char *const COUNTER_NAMES[METRICS_N_COUNTERS] = {
+        "words", "oov_words", "contexts", "matched_context_words",
+        "ranked_contexts", "backoff_levels", "tokens", "oov_tokens",
+        "matched_orders", "token_backoffs"
+};
+
+static const char *const COUNTER_HELPS[METRICS_N_COUNTERS] = {
+        "Context words looked up in the vocabulary.",
+        "Context words not in the vocabulary.",
+        "Contexts whose predictions were looked up.",
+        "Sum of the lengths of the longest context suffixes in the trie.",
+        "Contexts whose predictions were ranked instead of cached.",
+        "Shorter contexts ranked for the ranked contexts.",
+        "Tokens scored.",
+        "Tokens scored that are not in the vocabulary.",
+        "Sum of the lengths of the n-grams that scored the tokens.",
+        "Backoffs added to the scores of the tokens."
+};
+
+static const char *const HISTOGRAM_LABELS[METRICS_N_HISTOGRAMS] = {
+        "api=\"k_nwp\"", "api=\"k_nwp_prefix\"", "api=\"k_nwp_batch\"",
+        "api=\"state_k_nwp\"", "api=\"score\"", "api=\"score_batch\"",
+        "api=\"query_ngram\"", "use=\"searched\"", "use=\"scanned\""
+};
+
+/// the number of the next thread that records metrics, starting at 1
+static atomic_uint next_thread_number = 1;
+static _Thread_local unsigned int thread_number;
+
+static struct shard *get_shard(const struct metrics *m);
+
+static unsigned int get_bucket(uint64_t value);
+
+static uint64_t get_bucket_upper_bound(unsigned int bucket);
+
+static void summarize(const struct metrics *m, enum metrics_histogram h,
+                      struct metrics_summary *summary);
+
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...);
+
+static void append_summary(char *buf, size_t size, size_t *len,
+                           const char *name, const char *labels,
+                           const struct metrics_summary *s, double unit);
+
+struct metrics *metrics_new(unsigned int n_shards)
+{
+    unsigned int shard_bits = 0;
+    while ((1u << shard_bits) < n_shards)
+        shard_bits++;
+    n_shards = 1u << shard_bits;
+
+    struct metrics *m = malloc(sizeof(struct metrics));
+    if (m == NULL)
+        return NULL;
+    m->n_shards = n_shards;
+    m->shards = aligned_alloc(CACHE_LINE_SIZE, n_shards * sizeof(struct shard));
+    if (m->shards == NULL) {
+        free(m);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < n_shards; i++) {
+        struct shard *s = &m->shards[i];
+        for (int c = 0; c < METRICS_N_COUNTERS; c++)
+            atomic_init(&s->counters[c], 0);
+        for (int h = 0; h < METRICS_N_HISTOGRAMS; h++) {
+            atomic_init(&s->histograms[h].sum, 0);
+            for (int b = 0; b < N_BUCKETS; b++)
+                atomic_init(&s->histograms[h].buckets[b], 0);
+        }
+    }
+    return m;
+}
+
+void metrics_delete(struct metrics *m)
+{
+    free(m->shards);
+    free(m);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_count(struct metrics *m, enum metrics_counter c, uint64_t n)
+{
+    atomic_fetch_add_explicit(&get_shard(m)->counters[c], n,
+                              memory_order_relaxed);
+}
+
+void metrics_record(struct metrics *m, enum metrics_histogram h,
+                    uint64_t value)
+{
+    struct histogram *histogram = &get_shard(m)->histograms[h];
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[get_bucket(value)], 1,
+                              memory_order_relaxed);
+}
+
+void metrics_record_latency(struct metrics *m, enum metrics_histogram h,
+                            uint64_t start)
+{
+    metrics_record(m, h, metrics_now() - start);
+}
+
+void metrics_snapshot(const struct metrics *m,
+                      struct metrics_snapshot *snapshot)
+{
+    for (int c = 0; c < METRICS_N_COUNTERS; c++) {
+        snapshot->counters[c] = 0;
+        for (unsigned int i = 0; i < m->n_shards; i++)
+            snapshot->counters[c] += atomic_load_explicit(
+                    &m->shards[i].counters[c], memory_order_relaxed);
+    }
+    for (int h = 0; h < METRICS_N_HISTOGRAMS; h++)
+        summarize(m, h, &snapshot->histograms[h]);
+}
+
+size_t metrics_format_prometheus(const struct metrics_snapshot *snapshot,
+                                 char *buf, size_t size)
+{
+    size_t len = 0;
+    if (size > 0)
+        buf[0] = '\0';
+    for (int c = 0; c < METRICS_N_COUNTERS; c++) {
+        append(buf, size, &len, "# HELP ngram_lm_%s_total %s\n"
+                                "# TYPE ngram_lm_%s_total counter\n"
+                                "ngram_lm_%s_total %" PRIu64 "\n",
+               COUNTER_NAMES[c], COUNTER_HELPS[c], COUNTER_NAMES[c],
+               COUNTER_NAMES[c], snapshot->counters[c]);
+    }
+    append(buf, size, &len,
+           "# HELP ngram_lm_query_latency_seconds Latency of the queries.\n"
+           "# TYPE ngram_lm_query_latency_seconds summary\n");
+    for (int h = 0; h < METRICS_N_LATENCIES; h++)
+        append_summary(buf, size, &len, "ngram_lm_query_latency_seconds",
+                       HISTOGRAM_LABELS[h], &snapshot->histograms[h], 1e-9);
+    append(buf, size, &len,
+           "# HELP ngram_lm_children_range_size Children in the ranges "
+           "searched for a child or scanned for predictions.\n"
+           "# TYPE ngram_lm_children_range_size summary\n");
+    for (int h = METRICS_N_LATENCIES; h < METRICS_N_HISTOGRAMS; h++)
+        append_summary(buf, size, &len, "ngram_lm_children_range_size",
+                       HISTOGRAM_LABELS[h], &snapshot->histograms[h], 1);
+    return len;
+}
+
+static struct shard *get_shard(const struct metrics *m)
+{
+    if (thread_number == 0)
+        thread_number = atomic_fetch_add_explicit(&next_thread_number, 1,
+                                                  memory_order_relaxed);
+    return &m->shards[(thread_number - 1) & (m->n_shards - 1)];
+}
+
+/**
+ * The values below 2 * METRICS_SUB_BUCKETS have a bucket each. The larger
+ * ones are split by their most significant bit, and then by the
+ * METRICS_SUB_BUCKET_BITS bits after it.
+ */
+static unsigned int get_bucket(uint64_t value)
+{
+    if (value < 2 * METRICS_SUB_BUCKETS)
+        return value;
+    if (value >= (UINT64_C(1) << MAX_VALUE_BITS))
+        value = (UINT64_C(1) << MAX_VALUE_BITS) - 1;
+    const unsigned int shift = 63 - __builtin_clzll(value) -
+                               METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (value >> shift) -
+           METRICS_SUB_BUCKETS;
+}
+
+static uint64_t get_bucket_upper_bound(unsigned int bucket)
+{
+    if (bucket < 2 * METRICS_SUB_BUCKETS)
+        return bucket;
+    const unsigned int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    const uint64_t lower = (uint64_t) (METRICS_SUB_BUCKETS +
+                                       bucket % METRICS_SUB_BUCKETS) << shift;
+    return lower + (UINT64_C(1) << shift) - 1;
+}
+
+static void summarize(const struct metrics *m, enum metrics_histogram h,
+                      struct metrics_summary *summary)
+{
+    uint64_t buckets[N_BUCKETS] = { 0 };
+    summary->count = 0;
+    summary->sum = 0;
+    for (unsigned int i = 0; i < m->n_shards; i++) {
+        const struct histogram *histogram = &m->shards[i].histograms[h];
+        summary->sum += atomic_load_explicit(&histogram->sum,
+                                             memory_order_relaxed);
+        for (int b = 0; b < N_BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&histogram->buckets[b],
+                                               memory_order_relaxed);
+        }
+    }
+    for (int b = 0; b < N_BUCKETS; b++)
+        summary->count += buckets[b];
+
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *values[] = { &summary->p50, &summary->p90, &summary->p99,
+                           &summary->p999 };
+    uint64_t seen = 0;
+    int q = 0, last = 0;
+    for (int b = 0; b < N_BUCKETS; b++) {
+        if (buckets[b] == 0)
+            continue;
+        seen += buckets[b];
+        last = b;
+        for (; q < 4 && (double) seen >= quantiles[q] * summary->count; q++)
+            *values[q] = get_bucket_upper_bound(b);
+    }
+    for (; q < 4; q++)
+        *values[q] = 0;
+    summary->max = (summary->count > 0) ? get_bucket_upper_bound(last) : 0;
+}
+
+/**
+ * Append the text of \p fmt to the \p len bytes of \p buf, truncated to its
+ * \p size, and add its whole length to \p len.
+ */
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf((*len < size) ? &buf[*len] : NULL,
+                            (*len < size) ? size - *len : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *len += n;
+}
+
+static void append_summary(char *buf, size_t size, size_t *len,
+                           const char *name, const char *labels,
+                           const struct metrics_summary *s, double unit)
+{
+    const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    const uint64_t values[] = { s->p50, s->p90, s->p99, s->p999 };
+    for (int q = 0; q < 4; q++)
+        append(buf, size, len, "%s{%s,quantile=\"%s\"} %.9g\n", name, labels,
+               quantiles[q], values[q] * unit);
+    append(buf, size, len, "%s_sum{%s} %.9g\n%s_count{%s} %" PRIu64 "\n",
+           name, labels, s->sum * unit, name, labels, s->count);
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Counters and histograms of the queries of a trie. The values are
+ * spread over shards, each aligned to its own cache lines, and every thread
+ * records in the shard of its thread number, so that the threads recording
+ * at once do not share cache lines as long as there are as many shards as
+ * threads. The shards are only added up when a snapshot is taken.
+ * The histograms are log-linear, as HDR histograms: each power of 2 is split
+ * in METRICS_SUB_BUCKETS buckets, so that a value is known within 1/8 of it.
+ * @code
+ * struct metrics *m = metrics_new(16);
+ * const uint64_t start = metrics_now();
+ * // query
+ * metrics_record_latency(m, METRICS_K_NWP, start);
+ * metrics_count(m, METRICS_WORDS, 2);
+ * struct metrics_snapshot s;
+ * metrics_snapshot(m, &s);
+ * metrics_delete(m);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_METRICS_H
+#define NGRAM_LM_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct metrics;
+
+enum metrics_counter {
+    METRICS_WORDS,              /// context words looked up in the vocabulary
+    METRICS_OOV_WORDS,          /// the ones not in the vocabulary
+    METRICS_CONTEXTS,           /// contexts whose predictions were looked up
+    METRICS_MATCHED_CONTEXT_WORDS,  /// sum of their suffix lengths in the trie
+    METRICS_RANKED_CONTEXTS,    /// contexts whose predictions were ranked
+    METRICS_BACKOFF_LEVELS,     /// shorter contexts ranked for them
+    METRICS_TOKENS,             /// tokens scored
+    METRICS_OOV_TOKENS,         /// the ones not in the vocabulary
+    METRICS_MATCHED_ORDERS,     /// sum of the n-gram lengths that scored them
+    METRICS_TOKEN_BACKOFFS,     /// backoffs added to their scores
+    METRICS_N_COUNTERS
+};
+
+enum metrics_histogram {
+    // latencies in nanoseconds
+    METRICS_K_NWP,              /// trie_get_k_nwp_predictions() and wrappers
+    METRICS_K_NWP_PREFIX,
+    METRICS_K_NWP_BATCH,
+    METRICS_STATE_K_NWP,
+    METRICS_SCORE,              /// trie_score_tokens(), trie_score_sentence()
+    METRICS_SCORE_BATCH,        /// trie_score_sentences() and trie_perplexity()
+    METRICS_QUERY_NGRAM,
+    // sizes of the children ranges
+    METRICS_SEARCHED_RANGES,    /// searched for a child
+    METRICS_SCANNED_RANGES,     /// scanned for the top-k predictions
+    METRICS_N_HISTOGRAMS
+};
+
+#define METRICS_N_LATENCIES (METRICS_QUERY_NGRAM + 1)
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+struct metrics_summary {
+    uint64_t count;
+    uint64_t sum;
+    // the quantiles and maximum are the upper bounds of their buckets
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+struct metrics_snapshot {
+    uint64_t counters[METRICS_N_COUNTERS];
+    struct metrics_summary histograms[METRICS_N_HISTOGRAMS];
+};
+
+/**
+ * Create metrics of \p n_shards shards.
+ * @param n_shards rounded up to a power of 2.
+ * @return the metrics, or NULL if they could not be allocated. Use
+ * metrics_delete() to free them.
+ */
+struct metrics *metrics_new(unsigned int n_shards);
+
+void metrics_delete(struct metrics *m);
+
+/**
+ * @return the time of a monotonic clock, in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Add \p n to the counter \p c.
+ */
+void metrics_count(struct metrics *m, enum metrics_counter c, uint64_t n);
+
+/**
+ * Record \p value in the histogram \p h.
+ */
+void metrics_record(struct metrics *m, enum metrics_histogram h,
+                    uint64_t value);
+
+/**
+ * Record in the latency histogram \p h the time elapsed since \p start, as
+ * given by metrics_now().
+ */
+void metrics_record_latency(struct metrics *m, enum metrics_histogram h,
+                            uint64_t start);
+
+/**
+ * Add up the shards of \p m. The values recorded while the snapshot is taken
+ * may or may not be part of it.
+ * @param m
+ * @param snapshot pass out pointer for the totals.
+ */
+void metrics_snapshot(const struct metrics *m,
+                      struct metrics_snapshot *snapshot);
+
+/**
+ * Write \p snapshot to \p buf in the Prometheus text exposition format, as
+ * snprintf() does: at most \p size bytes are written, '\0' included.
+ * @return the length of the whole text, which was truncated if it is at
+ * least \p size.
+ */
+size_t metrics_format_prometheus(const struct metrics_snapshot *snapshot,
+                                 char *buf, size_t size);
+
+#endif //NGRAM_LM_METRICS_H
@@ -0,0 +1,142 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/metrics.h"
+}
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(Metrics, Counters)
+{
+    struct metrics *m = metrics_new(4);
+    ASSERT_NE(m, nullptr);
+    struct metrics_snapshot s;
+    metrics_snapshot(m, &s);
+    for (uint64_t counter : s.counters)
+        EXPECT_EQ(counter, 0);
+
+    metrics_count(m, METRICS_WORDS, 3);
+    metrics_count(m, METRICS_WORDS, 2);
+    metrics_count(m, METRICS_OOV_WORDS, 1);
+    metrics_snapshot(m, &s);
+    EXPECT_EQ(s.counters[METRICS_WORDS], 5);
+    EXPECT_EQ(s.counters[METRICS_OOV_WORDS], 1);
+    EXPECT_EQ(s.counters[METRICS_TOKENS], 0);
+    metrics_delete(m);
+}
+
+TEST(Metrics, Histograms)
+{
+    struct metrics *m = metrics_new(1);
+    struct metrics_snapshot s;
+    metrics_snapshot(m, &s);
+    EXPECT_EQ(s.histograms[METRICS_K_NWP].count, 0);
+    EXPECT_EQ(s.histograms[METRICS_K_NWP].max, 0);
+
+    // the values up to 15 are exact
+    for (uint64_t v = 1; v <= 10; v++)
+        metrics_record(m, METRICS_SEARCHED_RANGES, v);
+    metrics_snapshot(m, &s);
+    const struct metrics_summary *r = &s.histograms[METRICS_SEARCHED_RANGES];
+    EXPECT_EQ(r->count, 10);
+    EXPECT_EQ(r->sum, 55);
+    EXPECT_EQ(r->p50, 5);
+    EXPECT_EQ(r->p90, 9);
+    EXPECT_EQ(r->p99, 10);
+    EXPECT_EQ(r->max, 10);
+
+    // the larger ones are known within 1/8 of them
+    for (int i = 0; i < 990; i++)
+        metrics_record(m, METRICS_K_NWP, 1000);
+    for (int i = 0; i < 10; i++)
+        metrics_record(m, METRICS_K_NWP, 1000000);
+    metrics_snapshot(m, &s);
+    const struct metrics_summary *l = &s.histograms[METRICS_K_NWP];
+    EXPECT_EQ(l->count, 1000);
+    EXPECT_EQ(l->sum, 990 * 1000 + 10 * 1000000);
+    EXPECT_GE(l->p50, 1000);
+    EXPECT_LT(l->p50, 1000 + 1000 / 8);
+    EXPECT_EQ(l->p99, l->p50);
+    EXPECT_GE(l->p999, 1000000);
+    EXPECT_LT(l->p999, 1000000 + 1000000 / 8);
+    EXPECT_EQ(l->max, l->p999);
+
+    // the values too large for the histogram are recorded as its largest
+    metrics_record(m, METRICS_SCORE, UINT64_MAX / 2);
+    metrics_snapshot(m, &s);
+    EXPECT_EQ(s.histograms[METRICS_SCORE].count, 1);
+    EXPECT_EQ(s.histograms[METRICS_SCORE].max, (UINT64_C(1) << 40) - 1);
+    metrics_delete(m);
+}
+
+TEST(Metrics, Latency)
+{
+    struct metrics *m = metrics_new(1);
+    const uint64_t start = metrics_now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    metrics_record_latency(m, METRICS_QUERY_NGRAM, start);
+    struct metrics_snapshot s;
+    metrics_snapshot(m, &s);
+    EXPECT_EQ(s.histograms[METRICS_QUERY_NGRAM].count, 1);
+    EXPECT_GE(s.histograms[METRICS_QUERY_NGRAM].sum, 2000000);
+    metrics_delete(m);
+}
+
+TEST(Metrics, ConcurrentRecords)
+{
+    // fewer shards than threads, so that some threads share a shard
+    struct metrics *m = metrics_new(4);
+    const int n_threads = 16, n_records = 10000;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([m]() {
+            for (int j = 0; j < n_records; j++) {
+                metrics_count(m, METRICS_TOKENS, 1);
+                metrics_record(m, METRICS_SCANNED_RANGES, j % 100);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    struct metrics_snapshot s;
+    metrics_snapshot(m, &s);
+    EXPECT_EQ(s.counters[METRICS_TOKENS], n_threads * n_records);
+    EXPECT_EQ(s.histograms[METRICS_SCANNED_RANGES].count,
+              n_threads * n_records);
+    EXPECT_EQ(s.histograms[METRICS_SCANNED_RANGES].sum,
+              n_threads * (n_records / 100) * 4950);
+    metrics_delete(m);
+}
+
+TEST(Metrics, FormatPrometheus)
+{
+    struct metrics *m = metrics_new(1);
+    metrics_count(m, METRICS_OOV_WORDS, 7);
+    metrics_record(m, METRICS_K_NWP_BATCH, 1500);
+    struct metrics_snapshot s;
+    metrics_snapshot(m, &s);
+
+    const size_t len = metrics_format_prometheus(&s, nullptr, 0);
+    std::vector<char> buf(len + 1);
+    EXPECT_EQ(metrics_format_prometheus(&s, buf.data(), buf.size()), len);
+    const std::string text(buf.data());
+    EXPECT_EQ(text.size(), len);
+    EXPECT_NE(text.find("# TYPE ngram_lm_oov_words_total counter\n"
+                        "ngram_lm_oov_words_total 7\n"), std::string::npos);
+    EXPECT_NE(text.find("ngram_lm_query_latency_seconds_count"
+                        "{api=\"k_nwp_batch\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("ngram_lm_query_latency_seconds_sum"
+                        "{api=\"k_nwp_batch\"} 1.5e-06\n"), std::string::npos);
+    EXPECT_NE(text.find("ngram_lm_children_range_size{use=\"scanned\","
+                        "quantile=\"0.99\"} 0\n"), std::string::npos);
+
+    // a short buffer gets the start of the text
+    char short_buf[16];
+    EXPECT_EQ(metrics_format_prometheus(&s, short_buf, sizeof(short_buf)), len);
+    EXPECT_EQ(std::string(short_buf), text.substr(0, sizeof(short_buf) - 1));
+    metrics_delete(m);
+}
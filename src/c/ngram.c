@@ -59,8 +59,8 @@ struct ngram *ngram_new_empty_unigram()
 
 void ngram_delete(struct ngram *n)
 {
-    if (n->context != NULL) {
-        ngram_delete(n->context);
+    for (struct ngram *context; n != NULL; n = context) {
+        context = n->context;
         free(n);
     }
 }
@@ -88,7 +88,7 @@ ngram_new_unigram(const struct word *word, float probability, float backoff);
 struct ngram *ngram_new_empty_unigram();
 
 /**
- * Free \p ngram.
+ * Free \p ngram, along with its context.
  * @param n
  */
 void ngram_delete(struct ngram *ngram);
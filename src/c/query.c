@@ -0,0 +1,600 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <c/util/log.h>
+#include "metrics.h"
+#include "trie.h"
+
+/// bytes of input read at once, and split among the threads as a whole
+#define CHUNK_SIZE (1 << 20)
+#define MAX_K 1000
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program queries a trie for each line of the INPUT "
+                    "files, or of the standard input if there are none or an "
+                    "INPUT is '-', writing a line of results per line, in the "
+                    "same order. The lines are queried by several threads, in "
+                    "batches, and the throughput and latency quantiles of the "
+                    "batches are written to the standard error at the end.\v"
+                    "Modes:\n"
+                    "  nwp    the most probable next word of the context\n"
+                    "  topk   the K most probable next words of the context\n"
+                    "  score  the log10 probability of the sentence, between "
+                    "<s> and </s>\n"
+                    "  ppl    the perplexity of the sentence, and of all of "
+                    "them at the end";
+
+static char args_doc[] = "TRIE_FILE [INPUT...]";
+
+static struct argp_option options[] = {
+        { "mode", 'm', "MODE", 0, "nwp, topk, score or ppl (default nwp)", 0 },
+        { "predictions", 'k', "K", 0,
+          "Number of predictions of the topk mode (default 3)", 0 },
+        { "threads", 't', "N", 0,
+          "Number of query threads (default as many as the online CPUs)", 0 },
+        { "batch", 'b', "N", 0, "Lines queried at once (default 64)", 0 },
+        { "read", 'r', 0, 0,
+          "Read the trie into memory instead of mapping it", 0 },
+        { 0 }
+};
+
+enum mode {
+    MODE_NWP,
+    MODE_TOPK,
+    MODE_SCORE,
+    MODE_PPL
+};
+
+struct arguments {
+    enum mode mode;
+    int k;
+    int n_threads;
+    int batch_size;
+    int read;
+    char *trie;
+    char **inputs;
+    int n_inputs;
+};
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+enum chunk_state {
+    CHUNK_FREE,
+    CHUNK_READ,                 /// to be queried
+    CHUNK_DONE                  /// to be written
+};
+
+/**
+ * Lines of the input, each ending in '\n', and their results.
+ */
+struct chunk {
+    struct buffer in;
+    struct buffer out;
+    enum chunk_state state;
+    uint64_t n_lines;
+    double log_prob;            /// sum of the scores of the sentences
+    uint64_t n_tokens;          /// of the sentences, "</s>" included
+};
+
+/**
+ * The chunks go around a ring, read in order by the main thread, queried
+ * by any of the query threads, and written in order by the writer thread.
+ */
+struct pipeline {
+    const struct arguments *arguments;
+    const struct trie *t;
+    struct metrics *latencies;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct chunk *chunks;
+    unsigned int n_chunks;
+    uint64_t n_read;
+    uint64_t n_taken;
+    uint64_t n_written;
+    int eof;
+    int failed;                 /// the output could not be written
+    // totals of the written chunks
+    uint64_t n_lines;
+    uint64_t n_bytes;
+    double log_prob;
+    uint64_t n_tokens;
+};
+
+/**
+ * Memory of a query thread, reused for each batch.
+ */
+struct batch {
+    const char **words;
+    size_t words_cap;
+    size_t *offsets;            /// of the words of each line in words
+    const char ***sentences;
+    int *lens;
+    unsigned int *ulens;
+    struct prediction *predictions;
+    float *totals;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+static int read_inputs(struct pipeline *p);
+
+static int read_chunk(struct pipeline *p, struct buffer *in,
+                      struct buffer *carry, int *fd, int *input);
+
+static void *run_queries(void *arg);
+
+static void query_chunk(struct pipeline *p, struct chunk *c,
+                        struct batch *b);
+
+static void query_batch(struct pipeline *p, struct chunk *c, struct batch *b,
+                        unsigned int m);
+
+static void *write_outputs(void *arg);
+
+static void *reallocate(void *ptr, size_t size);
+
+static void reserve(struct buffer *b, size_t len);
+
+static void append(struct buffer *b, const char *data, size_t len);
+
+static void print_summary(const struct pipeline *p, double seconds);
+
+/**
+ * Skip the '=' of the short options given as -n=X.
+ */
+static const char *skip_equals(const char *arg)
+{
+    return (arg[0] == '=') ? arg + 1 : arg;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    static const char *modes[] = { "nwp", "topk", "score", "ppl" };
+
+    switch (key) {
+        case 'm':
+            arg = (char *) skip_equals(arg);
+            for (arguments->mode = MODE_NWP;
+                 arguments->mode <= MODE_PPL &&
+                 strcmp(arg, modes[arguments->mode]) != 0;
+                 arguments->mode++);
+            if (arguments->mode > MODE_PPL)
+                argp_error(state, "Unknown mode '%s'", arg);
+            break;
+        case 'k':
+            arguments->k = atoi(skip_equals(arg));
+            break;
+        case 't':
+            arguments->n_threads = atoi(skip_equals(arg));
+            break;
+        case 'b':
+            arguments->batch_size = atoi(skip_equals(arg));
+            break;
+        case 'r':
+            arguments->read = 1;
+            break;
+        case ARGP_KEY_ARG:
+            // the inputs are taken by ARGP_KEY_ARGS
+            if (state->arg_num > 0)
+                return ARGP_ERR_UNKNOWN;
+            arguments->trie = arg;
+            break;
+        case ARGP_KEY_ARGS:
+            arguments->inputs = &state->argv[state->next];
+            arguments->n_inputs = state->argc - state->next;
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1)
+                argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = {
+            .mode = MODE_NWP, .k = 3, .n_threads = -1, .batch_size = 64
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if (arguments.k < 1 || arguments.k > MAX_K) {
+        log_error("The number of predictions must be in [1, %d]", MAX_K);
+        exit(EXIT_FAILURE);
+    }
+    if (arguments.batch_size < 1) {
+        log_error("The batch size must be positive");
+        exit(EXIT_FAILURE);
+    }
+    if (arguments.n_threads < 1) {
+        const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arguments.n_threads = (n_cpus > 1) ? n_cpus : 1;
+    }
+    if (arguments.mode == MODE_NWP)
+        arguments.k = 1;
+
+    struct trie *t;
+    if ((arguments.read ? trie_load(arguments.trie, &t) :
+         trie_map(arguments.trie, &t)) != 0) {
+        log_error("Trie '%s' could not be loaded", arguments.trie);
+        exit(EXIT_FAILURE);
+    }
+
+    const unsigned int n_threads = arguments.n_threads;
+    struct pipeline p = {
+            .arguments = &arguments, .t = t,
+            .latencies = metrics_new(n_threads),
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .changed = PTHREAD_COND_INITIALIZER,
+            // enough for every thread to have one, while others are read and
+            // written
+            .n_chunks = 2 * n_threads + 2
+    };
+    p.chunks = calloc(p.n_chunks, sizeof(struct chunk));
+    pthread_t threads[n_threads + 1];
+    const uint64_t start = metrics_now();
+    int error = p.latencies == NULL || p.chunks == NULL;
+    unsigned int n_started = 0;
+    for (; !error && n_started <= n_threads; n_started++)
+        error = pthread_create(&threads[n_started], NULL,
+                               (n_started == 0) ? write_outputs : run_queries,
+                               &p) != 0;
+    if (!error)
+        error = read_inputs(&p);
+    // the threads stop once they are done with the chunks read
+    pthread_mutex_lock(&p.lock);
+    p.eof = 1;
+    pthread_cond_broadcast(&p.changed);
+    pthread_mutex_unlock(&p.lock);
+    for (unsigned int i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+    error |= p.failed;
+    if (!error)
+        print_summary(&p, (metrics_now() - start) * 1e-9);
+
+    for (unsigned int i = 0; p.chunks != NULL && i < p.n_chunks; i++) {
+        free(p.chunks[i].in.data);
+        free(p.chunks[i].out.data);
+    }
+    free(p.chunks);
+    if (p.latencies != NULL)
+        metrics_delete(p.latencies);
+    trie_delete(t);
+    exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Read the inputs of \p p into chunks, and hand them to the query threads.
+ * @return 0 on success, 1 if an input could not be read.
+ */
+static int read_inputs(struct pipeline *p)
+{
+    struct buffer carry = { NULL, 0, 0 };
+    int fd = -1, input = -1;
+    int status = 0;
+    while (status == 0) {
+        struct chunk *c = &p->chunks[p->n_read % p->n_chunks];
+        pthread_mutex_lock(&p->lock);
+        while (c->state != CHUNK_FREE && !p->failed)
+            pthread_cond_wait(&p->changed, &p->lock);
+        const int failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (failed)
+            break;
+        // the chunk is the reader's until it is handed over
+        status = read_chunk(p, &c->in, &carry, &fd, &input);
+        if (status == 1 || c->in.len == 0)
+            break;
+        pthread_mutex_lock(&p->lock);
+        c->state = CHUNK_READ;
+        p->n_read++;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(carry.data);
+    if (fd != -1 && fd != STDIN_FILENO)
+        close(fd);
+    return status == 1;
+}
+
+/**
+ * Fill \p in with whole lines of the inputs of \p p, starting with the ones
+ * of \p carry, left by the previous chunk, and keep the partial last line in
+ * \p carry. The last line of an input ends the line even without a '\n'.
+ * @param p
+ * @param in
+ * @param carry
+ * @param fd the input being read, or -1 to open the next one.
+ * @param input the index of the input being read.
+ * @return 0 on success, -1 at the end of the inputs, 1 if an input could not
+ * be opened or read.
+ */
+static int read_chunk(struct pipeline *p, struct buffer *in,
+                      struct buffer *carry, int *fd, int *input)
+{
+    const struct arguments *arguments = p->arguments;
+    const int n_inputs = (arguments->n_inputs > 0) ? arguments->n_inputs : 1;
+    in->len = 0;
+    append(in, carry->data, carry->len);
+    carry->len = 0;
+    while (1) {
+        const char *end;
+        if (in->len >= CHUNK_SIZE &&
+            (end = memrchr(in->data, '\n', in->len)) != NULL) {
+            const size_t len = end + 1 - in->data;
+            append(carry, end + 1, in->len - len);
+            in->len = len;
+            return 0;
+        }
+        if (*fd == -1) {
+            if (*input + 1 == n_inputs)
+                return -1;
+            (*input)++;
+            const char *path = (arguments->n_inputs > 0) ?
+                               arguments->inputs[*input] : "-";
+            *fd = (strcmp(path, "-") == 0) ? STDIN_FILENO :
+                  open(path, O_RDONLY);
+            if (*fd == -1) {
+                log_error("File '%s' could not be opened: %s", path,
+                          strerror(errno));
+                return 1;
+            }
+        }
+        reserve(in, in->len + CHUNK_SIZE);
+        const ssize_t n = read(*fd, &in->data[in->len], CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Input could not be read: %s", strerror(errno));
+            return 1;
+        }
+        in->len += n;
+        if (n == 0) {
+            if (*fd != STDIN_FILENO)
+                close(*fd);
+            *fd = -1;
+            if (in->len > 0 && in->data[in->len - 1] != '\n')
+                append(in, "\n", 1);
+        }
+    }
+}
+
+static void *run_queries(void *arg)
+{
+    struct pipeline *p = arg;
+    const size_t batch_size = p->arguments->batch_size;
+    struct batch b = {
+            .offsets = reallocate(NULL, (batch_size + 1) * sizeof(size_t)),
+            .sentences = reallocate(NULL, batch_size * sizeof(const char **)),
+            .lens = reallocate(NULL, batch_size * sizeof(int)),
+            .ulens = reallocate(NULL, batch_size * sizeof(unsigned int)),
+            .predictions = reallocate(NULL, batch_size * p->arguments->k *
+                                            sizeof(struct prediction)),
+            .totals = reallocate(NULL, batch_size * sizeof(float))
+    };
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (p->n_taken == p->n_read && !p->eof)
+            pthread_cond_wait(&p->changed, &p->lock);
+        if (p->n_taken == p->n_read) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        struct chunk *c = &p->chunks[p->n_taken++ % p->n_chunks];
+        pthread_mutex_unlock(&p->lock);
+
+        query_chunk(p, c, &b);
+        pthread_mutex_lock(&p->lock);
+        c->state = CHUNK_DONE;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(b.words);
+    free(b.offsets);
+    free(b.sentences);
+    free(b.lens);
+    free(b.ulens);
+    free(b.predictions);
+    free(b.totals);
+    return NULL;
+}
+
+/**
+ * Query the lines of \p c, a batch at a time, splitting their words in place.
+ */
+static void query_chunk(struct pipeline *p, struct chunk *c, struct batch *b)
+{
+    const unsigned int batch_size = p->arguments->batch_size;
+    c->out.len = 0;
+    c->n_lines = 0;
+    c->log_prob = 0;
+    c->n_tokens = 0;
+    char *line = c->in.data;
+    char *const end = c->in.data + c->in.len;
+    unsigned int m = 0;
+    size_t n_words = 0;
+    b->offsets[0] = 0;
+    while (line < end) {
+        char *next = (char *) memchr(line, '\n', end - line) + 1;
+        next[-1] = '\0';
+        char *save;
+        for (char *word = strtok_r(line, " \t\r", &save); word != NULL;
+             word = strtok_r(NULL, " \t\r", &save)) {
+            if (n_words == b->words_cap) {
+                b->words_cap = (b->words_cap > 0) ? 2 * b->words_cap : 1024;
+                b->words = reallocate(b->words,
+                                      b->words_cap * sizeof(char *));
+            }
+            b->words[n_words++] = word;
+        }
+        b->offsets[++m] = n_words;
+        line = next;
+        if (m == batch_size || line == end) {
+            query_batch(p, c, b, m);
+            m = 0;
+            n_words = 0;
+        }
+    }
+}
+
+/**
+ * Query the \p m lines of \p b, and append their results to the output of
+ * \p c.
+ */
+static void query_batch(struct pipeline *p, struct chunk *c, struct batch *b,
+                        unsigned int m)
+{
+    const struct arguments *arguments = p->arguments;
+    const int k = arguments->k;
+    for (unsigned int i = 0; i < m; i++) {
+        b->sentences[i] = &b->words[b->offsets[i]];
+        b->lens[i] = b->ulens[i] = b->offsets[i + 1] - b->offsets[i];
+    }
+    const uint64_t start = metrics_now();
+    char number[32];
+    if (arguments->mode == MODE_NWP || arguments->mode == MODE_TOPK) {
+        trie_get_k_nwp_batch(p->t, b->sentences, b->lens, m, k,
+                             b->predictions);
+        metrics_record_latency(p->latencies, METRICS_K_NWP_BATCH, start);
+        for (unsigned int i = 0; i < m; i++) {
+            const struct prediction *predictions = &b->predictions[i * k];
+            for (int j = 0; j < k &&
+                            predictions[j].word_id != (word_id_type) -1; j++) {
+                if (j > 0)
+                    append(&c->out, " ", 1);
+                const char *text = p->t->vocab_lookup[predictions[j].word_id]
+                        .text;
+                append(&c->out, text, strlen(text));
+            }
+            append(&c->out, "\n", 1);
+        }
+    } else {
+        trie_score_sentences(p->t, b->sentences, b->ulens, m, b->totals, NULL);
+        metrics_record_latency(p->latencies, METRICS_SCORE_BATCH, start);
+        for (unsigned int i = 0; i < m; i++) {
+            const double value = (arguments->mode == MODE_SCORE) ?
+                                 b->totals[i] :
+                                 pow(10, -b->totals[i] / (b->ulens[i] + 1));
+            append(&c->out, number, snprintf(number, sizeof(number),
+                                             "%.6f\n", value));
+            c->log_prob += b->totals[i];
+            c->n_tokens += b->ulens[i] + 1;
+        }
+    }
+    c->n_lines += m;
+}
+
+/**
+ * Write the outputs of the chunks in order, and free them for the reader.
+ */
+static void *write_outputs(void *arg)
+{
+    struct pipeline *p = arg;
+    while (1) {
+        struct chunk *c = &p->chunks[p->n_written % p->n_chunks];
+        pthread_mutex_lock(&p->lock);
+        while (c->state != CHUNK_DONE && !(p->eof && p->n_written == p->n_read))
+            pthread_cond_wait(&p->changed, &p->lock);
+        const int done = c->state != CHUNK_DONE;
+        pthread_mutex_unlock(&p->lock);
+        if (done)
+            break;
+
+        const int failed = fwrite(c->out.data, 1, c->out.len, stdout) !=
+                           c->out.len;
+        if (failed)
+            log_error("Output could not be written: %s", strerror(errno));
+        pthread_mutex_lock(&p->lock);
+        p->n_lines += c->n_lines;
+        p->n_bytes += c->in.len;
+        p->log_prob += c->log_prob;
+        p->n_tokens += c->n_tokens;
+        p->failed |= failed;
+        c->state = CHUNK_FREE;
+        p->n_written++;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        if (failed)
+            break;
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+/**
+ * Resize \p ptr, or allocate it if NULL, to \p size bytes, exiting if they
+ * could not be allocated.
+ * @return the resized memory.
+ */
+static void *reallocate(void *ptr, size_t size)
+{
+    void *resized = realloc(ptr, size);
+    if (resized == NULL) {
+        log_error("Could not allocate %zu bytes", size);
+        exit(EXIT_FAILURE);
+    }
+    return resized;
+}
+
+/**
+ * Make room for \p len bytes in \p b.
+ */
+static void reserve(struct buffer *b, size_t len)
+{
+    if (len <= b->cap)
+        return;
+    b->cap = (2 * b->cap > len) ? 2 * b->cap : len;
+    b->data = reallocate(b->data, b->cap);
+}
+
+static void append(struct buffer *b, const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+    reserve(b, b->len + len);
+    memcpy(&b->data[b->len], data, len);
+    b->len += len;
+}
+
+static void print_summary(const struct pipeline *p, double seconds)
+{
+    struct metrics_snapshot snapshot;
+    metrics_snapshot(p->latencies, &snapshot);
+    const struct metrics_summary *s = &snapshot.histograms[
+            (p->arguments->mode <= MODE_TOPK) ? METRICS_K_NWP_BATCH :
+            METRICS_SCORE_BATCH];
+    fprintf(stderr, "lines\tMB\tseconds\tlines/s\tMB/s\tbatches\tp50 us\t"
+                    "p90 us\tp99 us\tp99.9 us\tmax us\n");
+    fprintf(stderr, "%" PRIu64 "\t%.1f\t%.2f\t%.0f\t%.1f\t%" PRIu64
+                    "\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", p->n_lines,
+            p->n_bytes * 1e-6, seconds, p->n_lines / seconds,
+            p->n_bytes * 1e-6 / seconds, s->count, s->p50 * 1e-3,
+            s->p90 * 1e-3, s->p99 * 1e-3, s->p999 * 1e-3, s->max * 1e-3);
+    if (p->arguments->mode == MODE_PPL)
+        fprintf(stderr, "perplexity\t%.4f\n",
+                pow(10, -p->log_prob / (p->n_tokens > 0 ? p->n_tokens : 1)));
+}
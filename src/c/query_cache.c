@@ -0,0 +1,240 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "query_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/murmur3.h"
+
+#define CACHE_LINE_SIZE 64
+#define MIN_BUCKETS 16
+#define BYTES_PER_BUCKET 128
+
+struct entry {
+    struct entry *chain;        /// next entry of the bucket
+    struct entry *prev;         /// clock ring
+    struct entry *next;
+    uint64_t hash;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint8_t referenced;
+    unsigned char data[];       /// key followed by the value
+};
+
+/**
+ * Aligned to a cache line, so that the shards do not share any.
+ */
+struct shard {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    struct entry **buckets;
+    uint64_t n_buckets;         /// power of 2
+    struct entry *hand;         /// next entry to be examined by the clock
+    struct query_cache_stats stats;
+};
+
+struct query_cache {
+    unsigned int n_shards;
+    unsigned int shard_bits;
+    struct shard *shards;
+};
+
+static uint64_t hash_key(const void *key, size_t key_size);
+
+static struct shard *get_shard(const struct query_cache *c, uint64_t hash);
+
+static struct entry **
+find_entry(struct shard *s, uint64_t hash, const void *key, size_t key_size);
+
+static void remove_entry(struct shard *s, struct entry **link);
+
+static void evict(struct shard *s, size_t size);
+
+struct query_cache *query_cache_new(size_t budget, unsigned int n_shards)
+{
+    unsigned int shard_bits = 0;
+    while ((1u << shard_bits) < n_shards)
+        shard_bits++;
+    n_shards = 1u << shard_bits;
+    const size_t shard_budget = budget / n_shards;
+    uint64_t n_buckets = MIN_BUCKETS;
+    while (2 * n_buckets * BYTES_PER_BUCKET <= shard_budget)
+        n_buckets *= 2;
+    const size_t buckets_size = n_buckets * sizeof(struct entry *);
+    if (shard_budget <= sizeof(struct shard) + buckets_size)
+        return NULL;
+
+    struct query_cache *c = malloc(sizeof(struct query_cache));
+    c->n_shards = n_shards;
+    c->shard_bits = shard_bits;
+    c->shards = aligned_alloc(CACHE_LINE_SIZE,
+                              n_shards * sizeof(struct shard));
+    for (unsigned int i = 0; i < n_shards; i++) {
+        struct shard *s = &c->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->buckets = calloc(n_buckets, sizeof(struct entry *));
+        s->n_buckets = n_buckets;
+        s->hand = NULL;
+        memset(&s->stats, 0, sizeof(struct query_cache_stats));
+        s->stats.budget = shard_budget - sizeof(struct shard) - buckets_size;
+    }
+    return c;
+}
+
+void query_cache_delete(struct query_cache *c)
+{
+    for (unsigned int i = 0; i < c->n_shards; i++) {
+        struct shard *s = &c->shards[i];
+        while (s->hand != NULL)
+            remove_entry(s, find_entry(s, s->hand->hash, s->hand->data,
+                                       s->hand->key_size));
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(c->shards);
+    free(c);
+}
+
+unsigned int query_cache_n_shards(const struct query_cache *c)
+{
+    return c->n_shards;
+}
+
+int8_t query_cache_get(struct query_cache *c, const void *key, size_t key_size,
+                       void *value, size_t *value_size)
+{
+    const uint64_t hash = hash_key(key, key_size);
+    struct shard *s = get_shard(c, hash);
+    int8_t found = -1;
+    pthread_mutex_lock(&s->lock);
+    s->stats.lookups++;
+    struct entry *e = *find_entry(s, hash, key, key_size);
+    if (e != NULL && e->value_size <= *value_size) {
+        memcpy(value, e->data + e->key_size, e->value_size);
+        *value_size = e->value_size;
+        e->referenced = 1;
+        s->stats.hits++;
+        found = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+void query_cache_put(struct query_cache *c, const void *key, size_t key_size,
+                     const void *value, size_t value_size)
+{
+    const uint64_t hash = hash_key(key, key_size);
+    struct shard *s = get_shard(c, hash);
+    const size_t size = sizeof(struct entry) + key_size + value_size;
+    if (size > s->stats.budget)
+        return;
+    struct entry *e = malloc(size);
+    e->hash = hash;
+    e->key_size = key_size;
+    e->value_size = value_size;
+    e->referenced = 0;
+    memcpy(e->data, key, key_size);
+    memcpy(e->data + key_size, value, value_size);
+
+    pthread_mutex_lock(&s->lock);
+    struct entry **link = find_entry(s, hash, key, key_size);
+    if (*link != NULL)
+        remove_entry(s, link);
+    evict(s, size);
+    struct entry **bucket = &s->buckets[hash & (s->n_buckets - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+    // behind the hand, so that it is the last one to be examined
+    if (s->hand == NULL) {
+        e->prev = e->next = e;
+        s->hand = e;
+    } else {
+        e->next = s->hand;
+        e->prev = s->hand->prev;
+        e->prev->next = e;
+        s->hand->prev = e;
+    }
+    s->stats.entries++;
+    s->stats.size += size;
+    s->stats.insertions++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void query_cache_get_stats(struct query_cache *c,
+                           struct query_cache_stats *stats)
+{
+    for (unsigned int i = 0; i < c->n_shards; i++) {
+        struct shard *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        stats[i] = s->stats;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static uint64_t hash_key(const void *key, size_t key_size)
+{
+    uint64_t hash[2];
+    murmurhash3(key, (int) key_size, hash);
+    return hash[0];
+}
+
+/**
+ * The shard is given by the highest bits of the hash, and the bucket within
+ * the shard by the lowest ones.
+ */
+static struct shard *get_shard(const struct query_cache *c, uint64_t hash)
+{
+    return &c->shards[c->shard_bits == 0 ? 0 : hash >> (64 - c->shard_bits)];
+}
+
+/**
+ * @return the link to the entry of \p key in its bucket, which points to
+ * NULL if there is none.
+ */
+static struct entry **
+find_entry(struct shard *s, uint64_t hash, const void *key, size_t key_size)
+{
+    struct entry **link = &s->buckets[hash & (s->n_buckets - 1)];
+    while (*link != NULL && ((*link)->hash != hash ||
+                             (*link)->key_size != key_size ||
+                             memcmp((*link)->data, key, key_size) != 0))
+        link = &(*link)->chain;
+    return link;
+}
+
+static void remove_entry(struct shard *s, struct entry **link)
+{
+    struct entry *e = *link;
+    *link = e->chain;
+    if (e->next == e) {
+        s->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (s->hand == e)
+            s->hand = e->next;
+    }
+    s->stats.entries--;
+    s->stats.size -= sizeof(struct entry) + e->key_size + e->value_size;
+    free(e);
+}
+
+/**
+ * Evict entries until there are \p size bytes available. The hand clears
+ * the reference of the referenced entries it passes, and evicts the first
+ * one that is not referenced.
+ */
+static void evict(struct shard *s, size_t size)
+{
+    while (s->stats.size + size > s->stats.budget) {
+        struct entry *e = s->hand;
+        s->hand = e->next;
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        remove_entry(s, find_entry(s, e->hash, e->data, e->key_size));
+        s->stats.evictions++;
+    }
+}
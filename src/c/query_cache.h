@@ -0,0 +1,90 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Concurrent cache of query results, keyed by byte strings (e.g. the
+ * word ids of a query and its parameters). The keys are spread over shards
+ * by their hash, and each shard has its own lock, byte budget and CLOCK
+ * eviction, so that threads only contend when their keys fall in the same
+ * shard. A lookup marks its entry as referenced, and the clock hand of a
+ * full shard evicts the first entry that was not referenced since the hand
+ * last passed it.
+ * @code
+ * struct query_cache *c = query_cache_new(1 << 20, 64);
+ * size_t size = sizeof(value);
+ * if (query_cache_get(c, key, key_size, value, &size) != 0) {
+ *     // compute value
+ *     query_cache_put(c, key, key_size, value, sizeof(value));
+ * }
+ * query_cache_delete(c);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_QUERY_CACHE_H
+#define NGRAM_LM_QUERY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct query_cache;
+
+struct query_cache_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t insertions;
+    uint64_t evictions;
+    uint64_t entries;
+    size_t size;                /// bytes taken by the entries
+    size_t budget;              /// bytes available for the entries
+};
+
+/**
+ * Create a cache of at most \p budget bytes, split into \p n_shards shards.
+ * @param budget
+ * @param n_shards rounded up to a power of 2.
+ * @return the cache, or NULL if \p budget is too small for the shards. Use
+ * query_cache_delete() to free it.
+ */
+struct query_cache *query_cache_new(size_t budget, unsigned int n_shards);
+
+void query_cache_delete(struct query_cache *c);
+
+/**
+ * @return the number of shards of \p c.
+ */
+unsigned int query_cache_n_shards(const struct query_cache *c);
+
+/**
+ * Look up \p key and copy its value to \p value.
+ * @param c
+ * @param key
+ * @param key_size
+ * @param value
+ * @param value_size size of \p value, as parameter. Size of the value found,
+ * as return-value.
+ * @return 0 on a hit or -1 if \p key is not cached or its value does not fit
+ * \p value.
+ */
+int8_t query_cache_get(struct query_cache *c, const void *key, size_t key_size,
+                       void *value, size_t *value_size);
+
+/**
+ * Cache \p value for \p key, replacing any value it had, and evicting entries
+ * of its shard until it fits the shard budget.
+ * @param c
+ * @param key
+ * @param key_size
+ * @param value
+ * @param value_size
+ */
+void query_cache_put(struct query_cache *c, const void *key, size_t key_size,
+                     const void *value, size_t value_size);
+
+/**
+ * Get the statistics of each shard of \p c.
+ * @param c
+ * @param stats array of query_cache_n_shards() statistics.
+ */
+void query_cache_get_stats(struct query_cache *c,
+                           struct query_cache_stats *stats);
+
+#endif //NGRAM_LM_QUERY_CACHE_H
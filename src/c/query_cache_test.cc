@@ -0,0 +1,143 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/query_cache.h"
+}
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+static struct query_cache_stats get_stats(struct query_cache *c)
+{
+    std::vector<struct query_cache_stats> stats(query_cache_n_shards(c));
+    query_cache_get_stats(c, stats.data());
+    struct query_cache_stats total = {};
+    for (auto &s : stats) {
+        total.lookups += s.lookups;
+        total.hits += s.hits;
+        total.insertions += s.insertions;
+        total.evictions += s.evictions;
+        total.entries += s.entries;
+        total.size += s.size;
+        total.budget += s.budget;
+    }
+    return total;
+}
+
+TEST(QueryCache, New)
+{
+    EXPECT_EQ(query_cache_new(64, 1), nullptr);
+    struct query_cache *c = query_cache_new(1 << 20, 5);
+    ASSERT_NE(c, nullptr);
+    EXPECT_EQ(query_cache_n_shards(c), 8);
+    struct query_cache_stats stats = get_stats(c);
+    EXPECT_EQ(stats.entries, 0);
+    EXPECT_LT(stats.budget, 1 << 20);
+    EXPECT_GT(stats.budget, (1 << 20) * 0.9);
+    query_cache_delete(c);
+}
+
+TEST(QueryCache, GetPut)
+{
+    struct query_cache *c = query_cache_new(1 << 16, 4);
+    const uint32_t key[] = { 1, 2, 3 }, other_key[] = { 1, 2 };
+    float value[] = { -1.0f, -2.0f }, got[2];
+    size_t size = sizeof(got);
+    EXPECT_EQ(query_cache_get(c, key, sizeof(key), got, &size), -1);
+    query_cache_put(c, key, sizeof(key), value, sizeof(value));
+    EXPECT_EQ(query_cache_get(c, key, sizeof(key), got, &size), 0);
+    EXPECT_EQ(size, sizeof(value));
+    EXPECT_EQ(got[1], -2.0f);
+    EXPECT_EQ(query_cache_get(c, other_key, sizeof(other_key), got, &size),
+              -1);
+
+    // too large for the buffer
+    size = sizeof(float);
+    EXPECT_EQ(query_cache_get(c, key, sizeof(key), got, &size), -1);
+
+    // replaced
+    value[1] = -3.0f;
+    query_cache_put(c, key, sizeof(key), value, sizeof(float));
+    size = sizeof(got);
+    EXPECT_EQ(query_cache_get(c, key, sizeof(key), got, &size), 0);
+    EXPECT_EQ(size, sizeof(float));
+
+    struct query_cache_stats stats = get_stats(c);
+    EXPECT_EQ(stats.lookups, 5);
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.insertions, 2);
+    EXPECT_EQ(stats.entries, 1);
+    query_cache_delete(c);
+}
+
+TEST(QueryCache, ClockEviction)
+{
+    // size the values so that exactly 3 entries fit in the single shard
+    struct query_cache *c = query_cache_new(4096, 1);
+    uint32_t key = 0;
+    query_cache_put(c, &key, sizeof(key), &key, 0);
+    struct query_cache_stats stats = get_stats(c);
+    const size_t value_size = stats.budget / 3 - stats.size;
+    query_cache_delete(c);
+
+    c = query_cache_new(4096, 1);
+    std::vector<char> value(value_size), got(value_size);
+    for (key = 0; key < 3; key++)
+        query_cache_put(c, &key, sizeof(key), value.data(), value_size);
+    EXPECT_EQ(get_stats(c).evictions, 0);
+
+    key = 0;
+    size_t size = value_size;
+    EXPECT_EQ(query_cache_get(c, &key, sizeof(key), got.data(), &size), 0);
+    // 0 was referenced, so 1 is evicted
+    key = 3;
+    query_cache_put(c, &key, sizeof(key), value.data(), value_size);
+    stats = get_stats(c);
+    EXPECT_EQ(stats.evictions, 1);
+    EXPECT_EQ(stats.entries, 3);
+    EXPECT_LE(stats.size, stats.budget);
+    for (uint32_t k : { 0, 2, 3 }) {
+        size = value_size;
+        EXPECT_EQ(query_cache_get(c, &k, sizeof(k), got.data(), &size), 0);
+    }
+    key = 1;
+    EXPECT_EQ(query_cache_get(c, &key, sizeof(key), got.data(), &size), -1);
+    query_cache_delete(c);
+}
+
+TEST(QueryCache, ConcurrentReadersAndWriters)
+{
+    struct query_cache *c = query_cache_new(64 * 1024, 16);
+    const int n_threads = 16, n = 20000;
+    std::vector<std::thread> threads;
+    std::vector<int> inconsistent(n_threads, 0);
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([c, i, &inconsistent]() {
+            uint64_t value[4], got[4];
+            for (uint64_t j = 0; j < n; j++) {
+                const uint64_t key = (j * 7919 + i) % 2000;
+                size_t size = sizeof(got);
+                if (query_cache_get(c, &key, sizeof(key), got, &size) == 0) {
+                    inconsistent[i] += size != (key % 4 + 1) * sizeof(uint64_t);
+                    for (size_t v = 0; v < size / sizeof(uint64_t); v++)
+                        inconsistent[i] += got[v] != key + v;
+                } else {
+                    for (int v = 0; v < 4; v++)
+                        value[v] = key + v;
+                    query_cache_put(c, &key, sizeof(key), value,
+                                    (key % 4 + 1) * sizeof(uint64_t));
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (int i = 0; i < n_threads; i++)
+        EXPECT_EQ(inconsistent[i], 0);
+    struct query_cache_stats stats = get_stats(c);
+    EXPECT_EQ(stats.lookups, n_threads * n);
+    EXPECT_GT(stats.hits, 0);
+    EXPECT_LE(stats.size, stats.budget);
+    query_cache_delete(c);
+}
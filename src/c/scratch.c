@@ -0,0 +1,111 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "scratch.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ALIGNMENT alignof(max_align_t)
+#define MIN_BLOCK_SIZE 4096
+#define round_up(x) (((x) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/**
+ * A block, followed by its memory.
+ */
+struct scratch_block {
+    struct scratch_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define HEADER_SIZE round_up(sizeof(struct scratch_block))
+
+static _Thread_local struct scratch_block *first;
+static _Thread_local struct scratch_block *current;
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void create_key(void);
+
+static void free_blocks(void *block);
+
+static void set_first(struct scratch_block *block);
+
+struct scratch_mark scratch_mark(void)
+{
+    struct scratch_mark mark = { current, 0 };
+    if (current != NULL)
+        mark.used = current->used;
+    return mark;
+}
+
+void *scratch_alloc(size_t size)
+{
+    size = round_up(size);
+    if (current != NULL && current->size - current->used >= size) {
+        void *memory = (unsigned char *) current + HEADER_SIZE + current->used;
+        current->used += size;
+        return memory;
+    }
+    // the blocks after the current one are free, so the next one is replaced
+    // along with them when too small
+    struct scratch_block *next = (current != NULL) ? current->next : first;
+    if (next != NULL && next->size < size) {
+        free_blocks(next);
+        next = NULL;
+    }
+    if (next == NULL) {
+        size_t block_size = (current != NULL) ? 2 * current->size :
+                            MIN_BLOCK_SIZE;
+        if (block_size < size)
+            block_size = size;
+        next = malloc(HEADER_SIZE + block_size);
+        if (next == NULL)
+            return NULL;
+        next->next = NULL;
+        next->size = block_size;
+        if (current != NULL)
+            current->next = next;
+        else
+            set_first(next);
+    }
+    current = next;
+    current->used = size;
+    return (unsigned char *) current + HEADER_SIZE;
+}
+
+void scratch_release(struct scratch_mark mark)
+{
+    current = mark.block;
+    if (current != NULL)
+        current->used = mark.used;
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&key, free_blocks);
+}
+
+/**
+ * Free \p block and the ones after it.
+ */
+static void free_blocks(void *block)
+{
+    for (struct scratch_block *b = block, *next; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+}
+
+/**
+ * Make \p block the first block of the calling thread, to be freed when the
+ * thread exits.
+ */
+static void set_first(struct scratch_block *block)
+{
+    pthread_once(&key_once, create_key);
+    pthread_setspecific(key, block);
+    first = block;
+}
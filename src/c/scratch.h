@@ -0,0 +1,54 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Thread-local scratch memory for the buffers of the queries whose
+ * size is only known at run time. Each thread has its own chain of blocks,
+ * which are kept when the memory is released, so that once they have grown
+ * to the largest size the queries of a thread need, the queries no longer
+ * allocate from the heap. The memory is taken and given back in stack order:
+ * @code
+ * struct scratch_mark mark = scratch_mark();
+ * int *buffer = scratch_alloc(n * sizeof(int));
+ * // ... calls that can take and give back scratch memory too ...
+ * scratch_release(mark);
+ * @endcode
+ * The blocks of a thread are freed when it exits.
+ */
+
+#ifndef NGRAM_LM_SCRATCH_H
+#define NGRAM_LM_SCRATCH_H
+
+#include <stddef.h>
+
+struct scratch_block;
+
+/**
+ * The scratch memory taken by a thread at some point.
+ */
+struct scratch_mark {
+    struct scratch_block *block;
+    size_t used;
+};
+
+/**
+ * Get a mark of the scratch memory taken so far by the calling thread.
+ * @return
+ */
+struct scratch_mark scratch_mark(void);
+
+/**
+ * Take \p size bytes of the scratch memory of the calling thread, aligned as
+ * malloc() does. Taking memory only allocates from the heap when the blocks
+ * of the thread are not large enough.
+ * @param size
+ * @return the memory, valid until a mark taken before it is released.
+ */
+void *scratch_alloc(size_t size);
+
+/**
+ * Give back the scratch memory taken by the calling thread after \p mark.
+ * @param mark
+ */
+void scratch_release(struct scratch_mark mark);
+
+#endif //NGRAM_LM_SCRATCH_H
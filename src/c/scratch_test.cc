@@ -0,0 +1,76 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include "c/scratch.h"
+}
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+TEST(Scratch, AlignsAllocations)
+{
+    const struct scratch_mark mark = scratch_mark();
+    for (size_t size = 1; size < 100; size += 7) {
+        void *p = scratch_alloc(size);
+        ASSERT_TRUE(p != nullptr);
+        EXPECT_EQ((uintptr_t) p % alignof(max_align_t), 0);
+        memset(p, 0xff, size);
+    }
+    scratch_release(mark);
+}
+
+TEST(Scratch, ReusesReleasedMemory)
+{
+    const struct scratch_mark mark = scratch_mark();
+    auto *first = (char *) scratch_alloc(100);
+    const struct scratch_mark inner = scratch_mark();
+    auto *second = (char *) scratch_alloc(200);
+    EXPECT_GE(second, first + 100);
+    scratch_release(inner);
+    EXPECT_EQ(scratch_alloc(50), second);
+    scratch_release(mark);
+    EXPECT_EQ(scratch_alloc(100), first);
+    scratch_release(mark);
+}
+
+TEST(Scratch, GrowsAndKeepsOlderAllocations)
+{
+    const struct scratch_mark mark = scratch_mark();
+    auto *small = (unsigned char *) scratch_alloc(64);
+    memset(small, 1, 64);
+    // larger than the first blocks, so that new ones are chained
+    for (size_t size = 1 << 12; size <= 1 << 20; size <<= 2) {
+        auto *p = (unsigned char *) scratch_alloc(size);
+        ASSERT_TRUE(p != nullptr);
+        memset(p, 2, size);
+    }
+    for (int i = 0; i < 64; i++)
+        EXPECT_EQ(small[i], 1);
+    scratch_release(mark);
+
+    // the chained blocks are kept, replacing the ones too small to be reused
+    void *large = scratch_alloc(1 << 21);
+    ASSERT_TRUE(large != nullptr);
+    memset(large, 3, 1 << 21);
+    scratch_release(mark);
+    EXPECT_EQ(scratch_alloc(1 << 21), large);
+    scratch_release(mark);
+}
+
+TEST(Scratch, IsPerThread)
+{
+    const struct scratch_mark mark = scratch_mark();
+    void *p = scratch_alloc(128);
+    void *q = nullptr;
+    std::thread thread([&q] {
+        const struct scratch_mark m = scratch_mark();
+        q = scratch_alloc(128);
+        memset(q, 0, 128);
+        scratch_release(m);
+    });
+    thread.join();
+    EXPECT_NE(p, q);
+    scratch_release(mark);
+}
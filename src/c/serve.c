@@ -0,0 +1,222 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include <argp.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <c/util/log.h>
+#include "server.h"
+#include "shm_server.h"
+#include "trie.h"
+
+/// requests in flight per shared memory client
+#define SHM_RING_SIZE 64
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program serves the next word predictions of a trie "
+                    "over TCP and Unix sockets. Each request is a line of the "
+                    "number of predictions and the words of the context, e.g. "
+                    "'3 this is', answered by a line of 'OK' and the "
+                    "predicted words, or of 'ERR' and the reason it failed. "
+                    "It also serves the clients on the same host through "
+                    "shared memory, without a system call per request (see "
+                    "shm_client.h).";
+
+static char args_doc[] = "TRIE_FILE";
+
+static struct argp_option options[] = {
+        { "unix", 'u', "PATH", 0, "Path of the Unix socket", 0 },
+        { "port", 'p', "PORT", 0, "Port of the TCP socket", 0 },
+        { "host", 'H', "ADDRESS", 0,
+          "IPv4 address of the TCP socket (default 127.0.0.1)", 0 },
+        { "workers", 'w', "N", 0,
+          "Worker threads besides the one of the sockets (default as many as "
+          "the other online CPUs)", 0 },
+        { "max-k", 'k', "K", 0,
+          "Maximum number of predictions per request (default 100)", 0 },
+        { "shm", 's', "NAME", 0,
+          "Name of the shared memory segment, e.g. /ngram_lm", 0 },
+        { "shm-threads", 't', "N", 0,
+          "Threads serving the shared memory (default 1)", 0 },
+        { "shm-clients", 'c', "N", 0,
+          "Shared memory clients at once (default 64)", 0 },
+        { 0 }
+};
+
+struct arguments {
+    char *unix_path;
+    int port;
+    char *host;
+    int n_workers;
+    int max_k;
+    char *shm_name;
+    int shm_threads;
+    int shm_clients;
+    char *trie;
+};
+
+static struct server *server;
+static volatile sig_atomic_t stopped;
+
+/**
+ * Skip the '=' of the short options given as -n=X.
+ */
+static const char *skip_equals(const char *arg)
+{
+    return (arg[0] == '=') ? arg + 1 : arg;
+}
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'u':
+            arguments->unix_path = (char *) skip_equals(arg);
+            break;
+        case 'p':
+            arguments->port = atoi(skip_equals(arg));
+            break;
+        case 'H':
+            arguments->host = (char *) skip_equals(arg);
+            break;
+        case 'w':
+            arguments->n_workers = atoi(skip_equals(arg));
+            break;
+        case 'k':
+            arguments->max_k = atoi(skip_equals(arg));
+            break;
+        case 's':
+            arguments->shm_name = (char *) skip_equals(arg);
+            break;
+        case 't':
+            arguments->shm_threads = atoi(skip_equals(arg));
+            break;
+        case 'c':
+            arguments->shm_clients = atoi(skip_equals(arg));
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 1)
+                argp_usage(state);
+            arguments->trie = arg;
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 1)
+                argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+static void stop(int signal)
+{
+    stopped = 1;
+    if (server != NULL)
+        server_stop(server);
+}
+
+/**
+ * Wait for SIGINT or SIGTERM, when there are no sockets to serve.
+ */
+static void wait_for_stop(void)
+{
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, &old);
+    while (!stopped)
+        sigsuspend(&old);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = {
+            .port = -1, .host = "127.0.0.1", .n_workers = -1, .max_k = 100,
+            .shm_threads = 1, .shm_clients = 64
+    };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    const int serve_sockets = arguments.unix_path != NULL ||
+                              arguments.port >= 0;
+    if (!serve_sockets && arguments.shm_name == NULL) {
+        log_error("Give the path of a Unix socket, the port of a TCP one or "
+                  "the name of a shared memory segment");
+        exit(EXIT_FAILURE);
+    }
+    if (arguments.max_k < 1 || arguments.max_k > UINT16_MAX) {
+        log_error("The maximum number of predictions must be in [1, %d]",
+                  UINT16_MAX);
+        exit(EXIT_FAILURE);
+    }
+    if (arguments.n_workers < 0) {
+        const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arguments.n_workers = (n_cpus > 1) ? n_cpus - 1 : 0;
+    }
+
+    struct trie *t;
+    if (trie_load(arguments.trie, &t) != 0) {
+        log_error("Trie '%s' could not be loaded", arguments.trie);
+        exit(EXIT_FAILURE);
+    }
+    struct server_options server_options = {
+            .unix_path = arguments.unix_path, .tcp_host = arguments.host,
+            .tcp_port = arguments.port, .n_workers = arguments.n_workers,
+            .max_k = arguments.max_k
+    };
+    if (serve_sockets && (server = server_new(t, &server_options)) == NULL)
+        exit(EXIT_FAILURE);
+    struct shm_server *shm_server = NULL;
+    if (arguments.shm_name != NULL) {
+        struct shm_server_options shm_options = {
+                .n_slots = arguments.shm_clients, .ring_size = SHM_RING_SIZE,
+                .n_threads = arguments.shm_threads
+        };
+        shm_server = shm_server_new(t, arguments.shm_name, &shm_options);
+        if (shm_server == NULL)
+            exit(EXIT_FAILURE);
+        log_info("Serving at shared memory '%s'", arguments.shm_name);
+    }
+    struct sigaction action = { .sa_handler = stop };
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (arguments.unix_path != NULL)
+        log_info("Serving at '%s'", arguments.unix_path);
+    if (arguments.port >= 0)
+        log_info("Serving at %s:%d", arguments.host,
+                 server_get_tcp_port(server));
+    int error = 0;
+    if (serve_sockets) {
+        error = server_run(server);
+        struct server_stats stats;
+        server_get_stats(server, &stats);
+        log_info("%" PRIu64 " requests of %" PRIu64 " connections answered "
+                 "in %" PRIu64 " batches of up to %" PRIu64, stats.requests,
+                 stats.connections, stats.batches, stats.max_batch_size);
+        server_delete(server);
+    } else {
+        wait_for_stop();
+    }
+    if (shm_server != NULL) {
+        struct shm_server_stats stats;
+        shm_server_get_stats(shm_server, &stats);
+        log_info("%" PRIu64 " shared memory requests answered in %" PRIu64
+                 " batches", stats.requests, stats.batches);
+        shm_server_delete(shm_server);
+    }
+    trie_delete(t);
+
+    exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,797 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+// for accept4()
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util/log.h"
+
+#define MAX_EVENTS 256
+/// bytes read from a connection per wait, so that none starves the others
+#define READ_SIZE (64 * 1024)
+/// a longer line closes its connection
+#define MAX_LINE_SIZE (64 * 1024)
+/// the connections with more bytes to write are not read until they are sent
+#define MAX_PENDING_OUT (1 << 20)
+/// fewer contexts per worker are not worth waking it up
+#define MIN_SLICE_SIZE 64
+#define RESPONSE_OK "OK"
+#define RESPONSE_ERR "ERR"
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct connection {
+    int fd;
+    struct buffer in;
+    size_t parsed;              /// bytes of in of the requests of the batch
+    struct buffer out;
+    size_t sent;                /// bytes of out already sent
+    uint32_t events;            /// events waited for
+    int eof;                    /// the peer will not send more requests
+    int failed;                 /// the connection is to be closed
+    int in_batch;               /// in the connections of the batch
+    struct connection *prev;
+    struct connection *next;
+};
+
+/**
+ * A request of a batch, whose context is the `len` words of the batch from
+ * `first_word`. A request that failed has k 0 and its reason as error.
+ */
+struct request {
+    struct connection *c;
+    unsigned short k;
+    const char *error;
+    size_t first_word;
+    int len;
+};
+
+/**
+ * The requests read in one wait for the sockets, which are answered
+ * together. Its arrays only grow, to be reused by the next batches.
+ */
+struct batch {
+    struct request *requests;
+    size_t n_requests;
+    size_t requests_cap;
+    const char **words;
+    size_t n_words;
+    size_t words_cap;
+    struct connection **connections;  /// the ones read or written
+    size_t n_connections;
+    size_t connections_cap;
+    // the contexts of the requests that did not fail, and their predictions
+    const char ***contexts;
+    size_t contexts_cap;
+    int *lens;
+    size_t lens_cap;
+    struct prediction *predictions;
+    size_t predictions_cap;
+};
+
+/**
+ * Worker threads that look up a slice of the contexts of the batch each, the
+ * thread of the sockets taking the first one.
+ */
+struct worker_pool {
+    const struct trie *t;
+    pthread_t *threads;
+    unsigned int n_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;        /// incremented for each job
+    unsigned int running;       /// workers still looking up their slice
+    int stop;
+    // the job
+    const char ***contexts;
+    const int *lens;
+    unsigned int m;
+    unsigned short k;
+    struct prediction *predictions;
+    unsigned int n_slices;
+};
+
+struct worker {
+    struct worker_pool *pool;
+    unsigned int slice;
+};
+
+struct server {
+    const struct trie *t;
+    unsigned short max_k;
+    int epoll_fd;
+    int unix_fd;
+    int tcp_fd;
+    int stop_fd;
+    char *unix_path;
+    struct connection *connections;   /// list of the open connections
+    struct worker_pool pool;
+    struct worker *workers;
+    struct batch batch;
+    struct server_stats stats;
+};
+
+static int listen_unix(const char *path);
+
+static int listen_tcp(const char *host, int port);
+
+static int watch(struct server *s, int fd, void *ptr, uint32_t events);
+
+static int pool_start(struct worker_pool *pool, struct worker *workers,
+                      const struct trie *t, unsigned int n_threads);
+
+static void pool_stop(struct worker_pool *pool);
+
+static void *pool_work(void *arg);
+
+static void
+pool_run(struct worker_pool *pool, const char ***contexts, const int *lens,
+         unsigned int m, unsigned short k, struct prediction *predictions);
+
+static void run_slice(struct worker_pool *pool, unsigned int slice);
+
+static void accept_connections(struct server *s, int listen_fd);
+
+static void close_connection(struct server *s, struct connection *c);
+
+static void add_to_batch(struct server *s, struct connection *c);
+
+static void read_connection(struct server *s, struct connection *c);
+
+static void parse_requests(struct server *s, struct connection *c);
+
+static void answer_batch(struct server *s);
+
+static void write_response(const struct trie *t, const struct request *r,
+                           const struct prediction *predictions);
+
+static void flush_connection(struct connection *c);
+
+static void finish_batch(struct server *s);
+
+static int buffer_reserve(struct buffer *b, size_t size);
+
+static int buffer_append(struct buffer *b, const char *data, size_t size);
+
+static int grow(void **array, size_t *cap, size_t n, size_t elem_size);
+
+struct server *server_new(const struct trie *t,
+                          const struct server_options *options)
+{
+    struct server *s = calloc(1, sizeof(struct server));
+    if (s == NULL)
+        return NULL;
+    s->t = t;
+    s->max_k = options->max_k;
+    s->unix_fd = s->tcp_fd = s->stop_fd = -1;
+    s->workers = malloc(options->n_workers * sizeof(struct worker));
+    if (pool_start(&s->pool, s->workers, t, options->n_workers) != 0)
+        log_warn("The worker threads could not be started, the batches are "
+                 "looked up by the thread of the sockets");
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    s->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (options->unix_path != NULL) {
+        s->unix_fd = listen_unix(options->unix_path);
+        if (s->unix_fd != -1)
+            s->unix_path = strdup(options->unix_path);
+    }
+    if (options->tcp_port >= 0)
+        s->tcp_fd = listen_tcp(options->tcp_host, options->tcp_port);
+    if (s->epoll_fd == -1 || s->stop_fd == -1 ||
+        (options->unix_path != NULL && s->unix_fd == -1) ||
+        (options->tcp_port >= 0 && s->tcp_fd == -1) ||
+        (s->unix_fd == -1 && s->tcp_fd == -1) ||
+        watch(s, s->stop_fd, &s->stop_fd, EPOLLIN) != 0 ||
+        (s->unix_fd != -1 && watch(s, s->unix_fd, &s->unix_fd, EPOLLIN) != 0) ||
+        (s->tcp_fd != -1 && watch(s, s->tcp_fd, &s->tcp_fd, EPOLLIN) != 0)) {
+        log_error("The server could not be started");
+        server_delete(s);
+        return NULL;
+    }
+    return s;
+}
+
+void server_delete(struct server *s)
+{
+    if (s == NULL)
+        return;
+    while (s->connections != NULL)
+        close_connection(s, s->connections);
+    pool_stop(&s->pool);
+    free(s->workers);
+    if (s->unix_fd != -1) {
+        close(s->unix_fd);
+        unlink(s->unix_path);
+    }
+    free(s->unix_path);
+    if (s->tcp_fd != -1)
+        close(s->tcp_fd);
+    if (s->stop_fd != -1)
+        close(s->stop_fd);
+    if (s->epoll_fd != -1)
+        close(s->epoll_fd);
+    free(s->batch.requests);
+    free(s->batch.words);
+    free(s->batch.connections);
+    free(s->batch.contexts);
+    free(s->batch.lens);
+    free(s->batch.predictions);
+    free(s);
+}
+
+int server_get_tcp_port(const struct server *s)
+{
+    struct sockaddr_in address;
+    socklen_t len = sizeof(address);
+    if (s->tcp_fd == -1 ||
+        getsockname(s->tcp_fd, (struct sockaddr *) &address, &len) != 0)
+        return -1;
+    return ntohs(address.sin_port);
+}
+
+void server_stop(struct server *s)
+{
+    const uint64_t one = 1;
+    // it is only read once, so it cannot fail but for a full counter
+    ssize_t written = write(s->stop_fd, &one, sizeof(one));
+    (void) written;
+}
+
+void server_get_stats(const struct server *s, struct server_stats *stats)
+{
+    *stats = s->stats;
+}
+
+int server_run(struct server *s)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int stopped = 0;
+    while (!stopped) {
+        const int n = epoll_wait(s->epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("Could not wait for the sockets: %s", strerror(errno));
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &s->stop_fd) {
+                uint64_t n_stops;
+                // so that it can be run again
+                if (read(s->stop_fd, &n_stops, sizeof(n_stops)) > 0)
+                    stopped = 1;
+            } else if (ptr == &s->unix_fd || ptr == &s->tcp_fd) {
+                accept_connections(s, *(int *) ptr);
+            } else {
+                struct connection *c = ptr;
+                add_to_batch(s, c);
+                if (events[i].events & EPOLLOUT)
+                    flush_connection(c);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_connection(s, c);
+            }
+        }
+        answer_batch(s);
+        finish_batch(s);
+    }
+    while (s->connections != NULL)
+        close_connection(s, s->connections);
+    return 0;
+}
+
+/**
+ * Create a Unix socket listening at \p path, replacing any file there.
+ * @return the socket, or -1 if it could not be created.
+ */
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        log_error("Unix socket path '%s' too long", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (fd == -1) {
+        log_error("Could not create a Unix socket: %s", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        log_error("Could not listen at '%s': %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Create a TCP socket listening at \p host and \p port.
+ * @return the socket, or -1 if it could not be created.
+ */
+static int listen_tcp(const char *host, int port)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET,
+                                   .sin_port = htons(port),
+                                   .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (host != NULL && inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+        log_error("Invalid IPv4 address '%s'", host);
+        return -1;
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (fd == -1) {
+        log_error("Could not create a TCP socket: %s", strerror(errno));
+        return -1;
+    }
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        log_error("Could not listen at port %d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Wait for the \p events of \p fd, which are returned with \p ptr.
+ * @return 0 on success, 1 on failure.
+ */
+static int watch(struct server *s, int fd, void *ptr, uint32_t events)
+{
+    struct epoll_event event = { .events = events, .data.ptr = ptr };
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        log_error("Could not watch a socket: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Start the \p n_threads threads of \p pool, each with its entry of
+ * \p workers.
+ * @return 0 on success, 1 if they could not be started.
+ */
+static int pool_start(struct worker_pool *pool, struct worker *workers,
+                      const struct trie *t, unsigned int n_threads)
+{
+    pool->t = t;
+    pool->n_threads = 0;
+    pool->generation = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->threads = malloc(n_threads * sizeof(pthread_t));
+    if (n_threads > 0 && (pool->threads == NULL || workers == NULL))
+        return 1;
+    for (unsigned int i = 0; i < n_threads; i++) {
+        workers[i].pool = pool;
+        workers[i].slice = i + 1;
+        if (pthread_create(&pool->threads[i], NULL, pool_work,
+                           &workers[i]) != 0) {
+            pool_stop(pool);
+            return 1;
+        }
+        pool->n_threads++;
+    }
+    return 0;
+}
+
+/**
+ * Stop and join the threads of \p pool.
+ */
+static void pool_stop(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (unsigned int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pool->n_threads = 0;
+    free(pool->threads);
+    pool->threads = NULL;
+}
+
+static void *pool_work(void *arg)
+{
+    const struct worker *w = arg;
+    struct worker_pool *pool = w->pool;
+    uint64_t generation = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (pool->generation == generation && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->stop)
+            break;
+        generation = pool->generation;
+        if (w->slice >= pool->n_slices)
+            continue;
+        pthread_mutex_unlock(&pool->mutex);
+        run_slice(pool, w->slice);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/**
+ * Get the top \p k predictions of the \p m contexts of \p contexts, split
+ * among the threads of \p pool and the calling one.
+ */
+static void
+pool_run(struct worker_pool *pool, const char ***contexts, const int *lens,
+         unsigned int m, unsigned short k, struct prediction *predictions)
+{
+    unsigned int n_slices = pool->n_threads + 1;
+    if (n_slices > m / MIN_SLICE_SIZE)
+        n_slices = (m / MIN_SLICE_SIZE > 0) ? m / MIN_SLICE_SIZE : 1;
+    if (n_slices == 1) {
+        trie_get_k_nwp_batch(pool->t, contexts, lens, m, k, predictions);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->contexts = contexts;
+    pool->lens = lens;
+    pool->m = m;
+    pool->k = k;
+    pool->predictions = predictions;
+    pool->n_slices = n_slices;
+    pool->running = n_slices - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_slice(pool, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Look up the \p slice -th of the n_slices slices of the job of \p pool.
+ */
+static void run_slice(struct worker_pool *pool, unsigned int slice)
+{
+    const uint64_t l = (uint64_t) pool->m * slice / pool->n_slices;
+    const uint64_t r = (uint64_t) pool->m * (slice + 1) / pool->n_slices;
+    trie_get_k_nwp_batch(pool->t, &pool->contexts[l], &pool->lens[l], r - l,
+                         pool->k, &pool->predictions[l * pool->k]);
+}
+
+static void accept_connections(struct server *s, int listen_fd)
+{
+    while (1) {
+        const int fd = accept4(listen_fd, NULL, NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_warn("Could not accept a connection: %s",
+                         strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        if (listen_fd == s->tcp_fd) {
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        struct connection *c = calloc(1, sizeof(struct connection));
+        if (c == NULL || watch(s, fd, c, EPOLLIN) != 0) {
+            log_warn("Could not open a connection");
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->next = s->connections;
+        if (s->connections != NULL)
+            s->connections->prev = c;
+        s->connections = c;
+        s->stats.connections++;
+    }
+}
+
+static void close_connection(struct server *s, struct connection *c)
+{
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        s->connections = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+/**
+ * Add \p c to the connections of the batch, which are written and closed,
+ * if need be, once the batch is answered.
+ */
+static void add_to_batch(struct server *s, struct connection *c)
+{
+    struct batch *b = &s->batch;
+    if (c->in_batch)
+        return;
+    if (grow((void **) &b->connections, &b->connections_cap,
+             b->n_connections + 1, sizeof(struct connection *)) != 0) {
+        // it is not answered, so it cannot be kept open
+        log_error("Could not grow the batch");
+        exit(EXIT_FAILURE);
+    }
+    b->connections[b->n_connections++] = c;
+    c->in_batch = 1;
+}
+
+/**
+ * Read up to READ_SIZE bytes of \p c, and parse its requests into the batch.
+ */
+static void read_connection(struct server *s, struct connection *c)
+{
+    size_t n_read = 0;
+    while (!c->eof && !c->failed && n_read < READ_SIZE) {
+        if (buffer_reserve(&c->in, c->in.len + READ_SIZE) != 0) {
+            c->failed = 1;
+            break;
+        }
+        const ssize_t n = recv(c->fd, &c->in.data[c->in.len], READ_SIZE, 0);
+        if (n > 0) {
+            c->in.len += n;
+            n_read += n;
+        } else if (n == 0) {
+            c->eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            c->failed = 1;
+        }
+    }
+    parse_requests(s, c);
+}
+
+/**
+ * Add the requests of the complete lines of \p c to the batch, splitting
+ * their words in place.
+ */
+static void parse_requests(struct server *s, struct connection *c)
+{
+    struct batch *b = &s->batch;
+    char *line = &c->in.data[c->parsed];
+    char *end;
+    while ((end = memchr(line, '\n', &c->in.data[c->in.len] - line)) != NULL) {
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        *end = '\0';
+        if (grow((void **) &b->requests, &b->requests_cap, b->n_requests + 1,
+                 sizeof(struct request)) != 0) {
+            c->failed = 1;
+            return;
+        }
+        struct request *r = &b->requests[b->n_requests];
+        *r = (struct request) { c, 0, NULL, b->n_words, 0 };
+        char *save;
+        const char *token = strtok_r(line, " \t", &save);
+        char *k_end;
+        const long k = (token != NULL) ? strtol(token, &k_end, 10) : 0;
+        if (token == NULL || *k_end != '\0' || k <= 0 || k > s->max_k) {
+            r->error = "invalid number of predictions";
+        } else {
+            r->k = k;
+            while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+                if (grow((void **) &b->words, &b->words_cap, b->n_words + 1,
+                         sizeof(char *)) != 0) {
+                    c->failed = 1;
+                    return;
+                }
+                b->words[b->n_words++] = token;
+                r->len++;
+            }
+        }
+        b->n_requests++;
+        line = end + 1;
+    }
+    c->parsed = line - c->in.data;
+    if (c->in.len - c->parsed > MAX_LINE_SIZE) {
+        log_warn("Request longer than %d bytes, closing its connection",
+                 MAX_LINE_SIZE);
+        c->failed = 1;
+    }
+}
+
+/**
+ * Look up the predictions of the requests of the batch that did not fail, at
+ * once, and write the responses to their connections.
+ */
+static void answer_batch(struct server *s)
+{
+    struct batch *b = &s->batch;
+    if (b->n_requests == 0)
+        return;
+    if (grow((void **) &b->contexts, &b->contexts_cap, b->n_requests,
+             sizeof(char **)) != 0 ||
+        grow((void **) &b->lens, &b->lens_cap, b->n_requests,
+             sizeof(int)) != 0) {
+        log_error("Could not grow the batch");
+        exit(EXIT_FAILURE);
+    }
+    unsigned int m = 0;
+    unsigned short k = 0;
+    for (size_t i = 0; i < b->n_requests; i++) {
+        const struct request *r = &b->requests[i];
+        if (r->k == 0)
+            continue;
+        b->contexts[m] = &b->words[r->first_word];
+        b->lens[m++] = r->len;
+        if (r->k > k)
+            k = r->k;
+    }
+    if (grow((void **) &b->predictions, &b->predictions_cap, (size_t) m * k,
+             sizeof(struct prediction)) != 0) {
+        log_error("Could not grow the batch");
+        exit(EXIT_FAILURE);
+    }
+    if (m > 0)
+        pool_run(&s->pool, b->contexts, b->lens, m, k, b->predictions);
+
+    // the top k_i predictions of each request are the first ones of the top k
+    const struct prediction *predictions = b->predictions;
+    for (size_t i = 0; i < b->n_requests; i++) {
+        const struct request *r = &b->requests[i];
+        write_response(s->t, r, predictions);
+        if (r->k > 0)
+            predictions += k;
+    }
+    s->stats.requests += b->n_requests;
+    s->stats.batches++;
+    if (b->n_requests > s->stats.max_batch_size)
+        s->stats.max_batch_size = b->n_requests;
+    b->n_requests = 0;
+    b->n_words = 0;
+}
+
+static void write_response(const struct trie *t, const struct request *r,
+                           const struct prediction *predictions)
+{
+    struct buffer *out = &r->c->out;
+    int error;
+    if (r->k == 0) {
+        error = buffer_append(out, RESPONSE_ERR " ", strlen(RESPONSE_ERR) + 1) |
+                buffer_append(out, r->error, strlen(r->error));
+    } else {
+        error = buffer_append(out, RESPONSE_OK, strlen(RESPONSE_OK));
+        for (unsigned short j = 0; j < r->k; j++) {
+            if (predictions[j].word_id == (word_id_type) -1)
+                break;
+            const char *text = t->vocab_lookup[predictions[j].word_id].text;
+            error |= buffer_append(out, " ", 1) |
+                     buffer_append(out, text, strlen(text));
+        }
+    }
+    if ((error | buffer_append(out, "\n", 1)) != 0)
+        r->c->failed = 1;
+}
+
+/**
+ * Send what can be sent of the responses of \p c without blocking.
+ */
+static void flush_connection(struct connection *c)
+{
+    while (!c->failed && c->sent < c->out.len) {
+        const ssize_t n = send(c->fd, &c->out.data[c->sent],
+                               c->out.len - c->sent, MSG_NOSIGNAL);
+        if (n >= 0)
+            c->sent += n;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        else if (errno != EINTR)
+            c->failed = 1;
+    }
+    if (c->sent == c->out.len)
+        c->out.len = c->sent = 0;
+}
+
+/**
+ * Send the responses of the connections of the batch, drop their answered
+ * requests, and close the ones that failed or are done, or else wait for
+ * them to be readable, and writable if they have responses left.
+ */
+static void finish_batch(struct server *s)
+{
+    struct batch *b = &s->batch;
+    for (size_t i = 0; i < b->n_connections; i++) {
+        struct connection *c = b->connections[i];
+        c->in_batch = 0;
+        flush_connection(c);
+        c->in.len -= c->parsed;
+        memmove(c->in.data, &c->in.data[c->parsed], c->in.len);
+        c->parsed = 0;
+        if (c->failed || (c->eof && c->out.len == 0)) {
+            close_connection(s, c);
+            continue;
+        }
+        uint32_t events = 0;
+        if (!c->eof && c->out.len - c->sent <= MAX_PENDING_OUT)
+            events |= EPOLLIN;
+        if (c->out.len > 0)
+            events |= EPOLLOUT;
+        if (events != c->events) {
+            struct epoll_event event = { .events = events, .data.ptr = c };
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+            c->events = events;
+        }
+    }
+    b->n_connections = 0;
+}
+
+/**
+ * Make \p b hold at least \p size bytes.
+ * @return 0 on success, 1 if it could not be grown.
+ */
+static int buffer_reserve(struct buffer *b, size_t size)
+{
+    return grow((void **) &b->data, &b->cap, size, 1);
+}
+
+/**
+ * @return 0 on success, 1 if \p b could not be grown.
+ */
+static int buffer_append(struct buffer *b, const char *data, size_t size)
+{
+    if (buffer_reserve(b, b->len + size) != 0)
+        return 1;
+    memcpy(&b->data[b->len], data, size);
+    b->len += size;
+    return 0;
+}
+
+/**
+ * Make the \p array of \p cap elements of \p elem_size bytes hold at least
+ * \p n, doubling it.
+ * @return 0 on success, 1 if it could not be grown, in which case it is kept.
+ */
+static int grow(void **array, size_t *cap, size_t n, size_t elem_size)
+{
+    if (n <= *cap)
+        return 0;
+    size_t new_cap = (*cap > 0) ? *cap : 16;
+    while (new_cap < n)
+        new_cap *= 2;
+    void *new_array = realloc(*array, new_cap * elem_size);
+    if (new_array == NULL)
+        return 1;
+    *array = new_array;
+    *cap = new_cap;
+    return 0;
+}
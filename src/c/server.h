@@ -0,0 +1,93 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Server of the next word predictions of a trie, over TCP and Unix
+ * sockets. Each request is a line of the number of predictions wanted and the
+ * words of the context, separated by spaces, and is answered, in the order of
+ * the requests of its connection, by a line of "OK" and the predicted words,
+ * from the best to the worst, or of "ERR" and the reason it failed:
+ * @code
+ * > 3 é que
+ * < OK os levaram já
+ * > 0 é
+ * < ERR invalid number of predictions
+ * @endcode
+ * A single thread waits for the sockets with epoll, and the requests read in
+ * one wait, from every connection, are answered together as a micro-batch by
+ * trie_get_k_nwp_batch(), split among a pool of worker threads. While a batch
+ * is looked up, the requests that arrive wait in the sockets, so the busier
+ * the server, the larger its batches.
+ * @code
+ * struct server_options options = { .unix_path = "/tmp/ngram_lm.sock",
+ *                                   .tcp_port = -1, .n_workers = 3,
+ *                                   .max_k = 100 };
+ * struct server *s = server_new(t, &options);
+ * server_run(s);  // until server_stop(s) is called
+ * server_delete(s);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_SERVER_H
+#define NGRAM_LM_SERVER_H
+
+#include <stdint.h>
+
+#include "trie.h"
+
+struct server;
+
+struct server_options {
+    const char *unix_path;      /// path of the Unix socket, or NULL
+    const char *tcp_host;       /// address of the TCP socket, or NULL for any
+    int tcp_port;               /// its port, 0 for any free one, -1 for none
+    unsigned int n_workers;     /// threads besides the one of the sockets
+    unsigned short max_k;       /// maximum number of predictions requested
+};
+
+struct server_stats {
+    uint64_t connections;       /// connections accepted
+    uint64_t requests;          /// requests answered, the failed ones included
+    uint64_t batches;           /// batches they were answered in
+    uint64_t max_batch_size;
+};
+
+/**
+ * Create a server of the predictions of \p t, listening on the sockets of
+ * \p options.
+ * @param t the trie, which must outlive the server.
+ * @param options
+ * @return the server, or NULL if a socket could not be created or there is
+ * none. Use server_delete() to free it.
+ */
+struct server *server_new(const struct trie *t,
+                          const struct server_options *options);
+
+/**
+ * Close the sockets of \p s, removing its Unix socket, and free it.
+ */
+void server_delete(struct server *s);
+
+/**
+ * @return the port of the TCP socket of \p s, e.g. the one chosen for a
+ * port 0, or -1 if it has none.
+ */
+int server_get_tcp_port(const struct server *s);
+
+/**
+ * Serve the requests until server_stop() is called. The connections still
+ * open are then closed.
+ * @return 0 if it was stopped, 1 if the sockets could not be waited for.
+ */
+int server_run(struct server *s);
+
+/**
+ * Make server_run() return, from any thread or a signal handler.
+ */
+void server_stop(struct server *s);
+
+/**
+ * Get the stats of \p s, once server_run() has returned.
+ */
+void server_get_stats(const struct server *s, struct server_stats *stats);
+
+#endif //NGRAM_LM_SERVER_H
@@ -0,0 +1,153 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "c/server.h"
+#include "c/trie.h"
+#include "c/util/log.h"
+}
+
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *TEST_DATA = "./data/tmp.arpa";
+
+/**
+ * Send \p requests to the socket \p fd at once, close its writing side, and
+ * read the responses until the server closes the connection.
+ */
+static std::string exchange(int fd, const std::string &requests)
+{
+    for (size_t sent = 0; sent < requests.size();) {
+        const ssize_t n = send(fd, &requests[sent], requests.size() - sent,
+                               MSG_NOSIGNAL);
+        EXPECT_GT(n, 0);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+    std::string responses;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        responses.append(buf, n);
+    close(fd);
+    return responses;
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_EQ(connect(fd, (struct sockaddr *) &address, sizeof(address)), 0);
+    return fd;
+}
+
+static int connect_tcp(int port)
+{
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    EXPECT_EQ(connect(fd, (struct sockaddr *) &address, sizeof(address)), 0);
+    return fd;
+}
+
+/**
+ * @return the response to the request of context \p words, as computed by
+ * \p t.
+ */
+static std::string expected_response(const struct trie *t,
+                                     std::vector<const char *> words, int k)
+{
+    std::vector<struct prediction> predictions(k);
+    const unsigned short found = trie_get_k_nwp_predictions(
+            t, words.data(), words.size(), k, predictions.data());
+    std::string response = "OK";
+    for (unsigned short i = 0; i < found; i++)
+        response += std::string(" ") +
+                    t->vocab_lookup[predictions[i].word_id].text;
+    return response + "\n";
+}
+
+TEST(Server, AnswersPipelinedRequestsInOrder)
+{
+    log_set_quiet(true);
+    struct trie *t = trie_new_from_arpa_path(3, TEST_DATA);
+    const std::string path = "/tmp/ngram_lm_server_test_" +
+                             std::to_string(getpid()) + ".sock";
+    struct server_options options = {};
+    options.unix_path = path.c_str();
+    options.tcp_host = "127.0.0.1";
+    options.tcp_port = 0;
+    options.n_workers = 2;
+    options.max_k = 10;
+    struct server *s = server_new(t, &options);
+    ASSERT_TRUE(s != nullptr);
+    ASSERT_GT(server_get_tcp_port(s), 0);
+    std::thread loop([s] { EXPECT_EQ(server_run(s), 0); });
+
+    const std::vector<std::vector<const char *>> contexts = {
+            { "é", "que" }, { "PAra", "é" }, {}, { "anonexistingword" },
+            { "havia", "é", "que", "os" }
+    };
+    std::string requests, expected;
+    // enough of them for the batches to be split among the workers
+    for (int i = 0; i < 1000; i++) {
+        const auto &context = contexts[i % contexts.size()];
+        const int k = 1 + i % 5;
+        requests += std::to_string(k);
+        for (const char *word : context)
+            requests += std::string(" ") + word;
+        requests += (i % 2) ? "\r\n" : "\n";
+        expected += expected_response(t, context, k);
+    }
+    EXPECT_EQ(exchange(connect_unix(path.c_str()), requests), expected);
+    EXPECT_EQ(exchange(connect_tcp(server_get_tcp_port(s)), requests),
+              expected);
+
+    EXPECT_EQ(exchange(connect_unix(path.c_str()),
+                       "0 é\n11 é\nx é\n\n3  é\tque \n1 é"),
+              "ERR invalid number of predictions\n"
+              "ERR invalid number of predictions\n"
+              "ERR invalid number of predictions\n"
+              "ERR invalid number of predictions\n" +
+              expected_response(t, { "é", "que" }, 3));
+
+    server_stop(s);
+    loop.join();
+    struct server_stats stats;
+    server_get_stats(s, &stats);
+    EXPECT_EQ(stats.connections, 3);
+    EXPECT_EQ(stats.requests, 2005);
+    EXPECT_LT(stats.batches, stats.requests);
+    EXPECT_GT(stats.max_batch_size, 1);
+    server_delete(s);
+    EXPECT_NE(access(path.c_str(), F_OK), 0);
+    trie_delete(t);
+    log_set_quiet(false);
+}
+
+TEST(Server, FailsWithoutSockets)
+{
+    log_set_quiet(true);
+    struct trie *t = trie_new_from_arpa_path(3, TEST_DATA);
+    struct server_options options = {};
+    options.tcp_port = -1;
+    options.max_k = 10;
+    EXPECT_TRUE(server_new(t, &options) == nullptr);
+    options.unix_path = "/nonexistent/dir/ngram_lm.sock";
+    EXPECT_TRUE(server_new(t, &options) == nullptr);
+    trie_delete(t);
+    log_set_quiet(false);
+}
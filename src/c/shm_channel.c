@@ -0,0 +1,80 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+// for the open file description locks
+#define _GNU_SOURCE
+
+#include "shm_channel.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct shm_slot *shm_get_slot(struct shm_header *h, uint32_t i)
+{
+    return (struct shm_slot *) ((char *) h + h->slots_offset) + i;
+}
+
+struct shm_request *shm_get_requests(struct shm_header *h, uint32_t i)
+{
+    const uint64_t slot_size = h->ring_size * (sizeof(struct shm_request) +
+                                               sizeof(struct shm_response));
+    return (struct shm_request *) ((char *) h + h->entries_offset +
+                                   i * slot_size);
+}
+
+struct shm_response *shm_get_responses(struct shm_header *h, uint32_t i)
+{
+    return (struct shm_response *) (shm_get_requests(h, i) + h->ring_size);
+}
+
+const char *shm_get_word_text(const struct shm_header *h, word_id_type id)
+{
+    if (id >= h->n_words)
+        return NULL;
+    const uint64_t *offsets = (const uint64_t *) ((const char *) h +
+                                                  h->text_offsets_offset);
+    return (const char *) h + h->texts_offset + offsets[id];
+}
+
+int shm_lock_slot(int fd, uint32_t i)
+{
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                          .l_start = i, .l_len = 1 };
+    return fcntl(fd, F_OFD_SETLK, &lock);
+}
+
+void shm_unlock_slot(int fd, uint32_t i)
+{
+    struct flock lock = { .l_type = F_UNLCK, .l_whence = SEEK_SET,
+                          .l_start = i, .l_len = 1 };
+    fcntl(fd, F_OFD_SETLK, &lock);
+}
+
+int shm_is_slot_locked(int fd, uint32_t i)
+{
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                          .l_start = i, .l_len = 1 };
+    if (fcntl(fd, F_OFD_GETLK, &lock) == -1)
+        return -1;
+    return lock.l_type != F_UNLCK;
+}
+
+void shm_sleep(_Atomic uint32_t *word, uint32_t value, _Atomic uint32_t *sleeps,
+               uint64_t timeout_ns)
+{
+    const struct timespec timeout = { timeout_ns / 1000000000,
+                                      timeout_ns % 1000000000 };
+    atomic_store(sleeps, 1);
+    // a producer that changed word before seeing sleeps set did not wake it
+    if (atomic_load(word) == value)
+        syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+    atomic_store(sleeps, 0);
+}
+
+void shm_wake(_Atomic uint32_t *word, _Atomic uint32_t *sleeps)
+{
+    if (atomic_load(sleeps))
+        syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
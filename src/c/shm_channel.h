@@ -0,0 +1,183 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Layout of the shared memory through which the clients on the same
+ * host as a shm_server query it, without a system call per query. The
+ * segment starts with a header, followed by the vocabulary of the trie, so
+ * that the clients get the texts of the predicted words from their ids, and
+ * by the client slots. Each slot has a ring of requests, written by its
+ * client and read by the server, and a ring of responses, written by the
+ * server and read by the client, so every ring has a single producer and a
+ * single consumer, and its indexes are all the synchronization it needs.
+ * A consumer that runs out of entries spins for a while, and then sleeps on
+ * a futex, which the producer only wakes when the consumer says it sleeps.
+ * The server threads sleep on a doorbell each, rung by the clients of their
+ * slots. A client holds a lock on the byte of its slot in the segment file
+ * while it is attached, which the kernel releases if the client dies, so the
+ * server tells the slots of dead clients even from another PID namespace.
+ */
+
+#ifndef NGRAM_LM_SHM_CHANNEL_H
+#define NGRAM_LM_SHM_CHANNEL_H
+
+#include <stdint.h>
+
+#include "word.h"
+
+#define SHM_MAGIC 0x6e676c6d    /// "nglm"
+#define SHM_VERSION 2
+#define SHM_CACHE_LINE_SIZE 64
+#define SHM_MAX_THREADS 64
+/// bytes of the text of a request context
+#define SHM_MAX_CONTEXT_SIZE 500
+#define SHM_MAX_K 30
+
+enum shm_slot_state {
+    SHM_SLOT_FREE,
+    SHM_SLOT_CLAIMED,           /// by a client, which is resetting it
+    SHM_SLOT_ATTACHED,          /// served
+    SHM_SLOT_DETACHING          /// left by its client, for the server to free
+};
+
+enum shm_error {
+    SHM_OK,
+    SHM_INVALID_K,              /// k is 0 or more than SHM_MAX_K
+    SHM_INVALID_CONTEXT         /// longer than SHM_MAX_CONTEXT_SIZE
+};
+
+/**
+ * A request of the top k predictions of a context, given by the text of its
+ * words, separated by spaces.
+ */
+struct shm_request {
+    uint64_t tag;               /// returned with the response
+    uint16_t k;
+    uint16_t len;               /// of the context
+    char context[SHM_MAX_CONTEXT_SIZE];
+};
+
+struct shm_response {
+    uint64_t tag;
+    uint16_t n_predictions;
+    uint16_t error;             /// an shm_error
+    uint32_t padding;
+    struct prediction predictions[SHM_MAX_K];
+};
+
+// the layout of the segment uses C11 atomics, which C++ cannot include (before
+// C++23), and the C++ users of the clients only need the messages
+#ifndef __cplusplus
+#include <stdatomic.h>
+
+/**
+ * Indexes of a ring, which grow forever and wrap around its size, a power
+ * of 2.
+ */
+struct shm_ring {
+    // the consumer waits on head for the producer to move it
+    _Alignas(SHM_CACHE_LINE_SIZE) _Atomic uint32_t head;  /// entries written
+    _Atomic uint32_t consumer_sleeps;
+    _Alignas(SHM_CACHE_LINE_SIZE) _Atomic uint32_t tail;  /// entries read
+};
+
+struct shm_slot {
+    _Alignas(SHM_CACHE_LINE_SIZE) _Atomic uint32_t state;
+    struct shm_ring requests;
+    struct shm_ring responses;
+};
+
+struct shm_doorbell {
+    _Alignas(SHM_CACHE_LINE_SIZE) _Atomic uint32_t rings;
+    _Atomic uint32_t sleeps;
+};
+
+/**
+ * Header of the segment. The offsets are from its start, and the entries of
+ * the rings of slot i start at entries_offset + i * (ring_size *
+ * (sizeof(struct shm_request) + sizeof(struct shm_response))), the requests
+ * first.
+ */
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t ring_size;
+    uint32_t n_threads;         /// slot i is served by thread i % n_threads
+    _Atomic uint32_t stopped;
+    uint64_t n_words;
+    uint64_t text_offsets_offset;   /// n_words + 1 offsets of the texts
+    uint64_t texts_offset;          /// the texts, '\0' terminated
+    uint64_t slots_offset;
+    uint64_t entries_offset;
+    uint64_t size;              /// of the segment
+    struct shm_doorbell doorbells[SHM_MAX_THREADS];
+};
+
+/**
+ * @return the slot \p i of the segment of \p h.
+ */
+struct shm_slot *shm_get_slot(struct shm_header *h, uint32_t i);
+
+/**
+ * @return the ring_size entries of the requests of the slot \p i.
+ */
+struct shm_request *shm_get_requests(struct shm_header *h, uint32_t i);
+
+/**
+ * @return the ring_size entries of the responses of the slot \p i.
+ */
+struct shm_response *shm_get_responses(struct shm_header *h, uint32_t i);
+
+/**
+ * @return the text of the word \p id of the vocabulary of the segment of
+ * \p h, or NULL if there is no such word.
+ */
+const char *shm_get_word_text(const struct shm_header *h, word_id_type id);
+
+/**
+ * Lock the slot \p i of the segment file \p fd for the open file description
+ * of \p fd, without waiting for another one that holds its lock.
+ * @return 0 on success, -1 if it is locked by another open file description
+ * or could not be locked.
+ */
+int shm_lock_slot(int fd, uint32_t i);
+
+/**
+ * Unlock the slot \p i of the segment file \p fd, locked by shm_lock_slot().
+ */
+void shm_unlock_slot(int fd, uint32_t i);
+
+/**
+ * @return whether the slot \p i of the segment file \p fd is locked by an
+ * open file description other than the one of \p fd, or -1 if it could not
+ * be told.
+ */
+int shm_is_slot_locked(int fd, uint32_t i);
+
+/**
+ * Sleep while \p word is \p value, for at most \p timeout_ns nanoseconds,
+ * saying so in \p sleeps, so that the producer wakes it up with shm_wake().
+ * It may return earlier, so the caller checks \p word again.
+ */
+void shm_sleep(_Atomic uint32_t *word, uint32_t value, _Atomic uint32_t *sleeps,
+               uint64_t timeout_ns);
+
+/**
+ * Wake the consumer sleeping on \p word, if \p sleeps says it sleeps, once
+ * \p word has been changed.
+ */
+void shm_wake(_Atomic uint32_t *word, _Atomic uint32_t *sleeps);
+
+/**
+ * Tell the CPU that the thread spins, waiting for another one.
+ */
+static inline void shm_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif //__cplusplus
+
+#endif //NGRAM_LM_SHM_CHANNEL_H
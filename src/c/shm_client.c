@@ -0,0 +1,199 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "shm_client.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// polls of a response before sleeping, if there is a CPU to spin on
+#define SPINS 4096
+/// the sleeping clients wake up this often to see if the server stopped
+#define SLEEP_TIMEOUT_NS 100000000
+
+struct shm_client {
+    int fd;                     /// of the segment, holding the slot lock
+    struct shm_header *h;
+    struct shm_slot *slot;
+    struct shm_request *requests;
+    struct shm_response *responses;
+    struct shm_doorbell *doorbell;
+    uint32_t mask;
+    unsigned int spins;
+    uint32_t sent;              /// the head of the requests
+    uint32_t received;          /// the tail of the responses
+};
+
+static struct shm_header *map_segment(const char *name, int *fd);
+
+static int claim_slot(struct shm_client *c);
+
+struct shm_client *shm_client_open(const char *name)
+{
+    struct shm_client *c = calloc(1, sizeof(struct shm_client));
+    if (c == NULL)
+        return NULL;
+    // spinning on a single CPU only delays the server
+    c->spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SPINS : 0;
+    c->fd = -1;
+    c->h = map_segment(name, &c->fd);
+    if (c->h == NULL || claim_slot(c) != 0) {
+        shm_client_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+void shm_client_close(struct shm_client *c)
+{
+    if (c == NULL)
+        return;
+    if (c->slot != NULL)
+        atomic_store_explicit(&c->slot->state, SHM_SLOT_DETACHING,
+                              memory_order_release);
+    if (c->h != NULL)
+        munmap(c->h, c->h->size);
+    // releases the lock of the slot, once it is not attached
+    if (c->fd != -1)
+        close(c->fd);
+    free(c);
+}
+
+int shm_client_send(struct shm_client *c, const char *context, uint16_t k,
+                    uint64_t tag)
+{
+    const size_t len = strlen(context);
+    if (len > SHM_MAX_CONTEXT_SIZE || atomic_load(&c->h->stopped))
+        return -1;
+    // the server takes a request when there is room for its response
+    if (c->sent - c->received == c->h->ring_size)
+        return 1;
+    struct shm_request *r = &c->requests[c->sent & c->mask];
+    r->tag = tag;
+    r->k = k;
+    r->len = len;
+    memcpy(r->context, context, len);
+    atomic_store(&c->slot->requests.head, ++c->sent);
+    atomic_fetch_add(&c->doorbell->rings, 1);
+    shm_wake(&c->doorbell->rings, &c->doorbell->sleeps);
+    return 0;
+}
+
+int shm_client_receive(struct shm_client *c, struct shm_response *response,
+                       int block)
+{
+    if (c->sent == c->received)
+        return -1;
+    unsigned int spins = 0;
+    uint32_t head;
+    while ((head = atomic_load_explicit(&c->slot->responses.head,
+                                        memory_order_acquire)) == c->received) {
+        if (atomic_load_explicit(&c->h->stopped, memory_order_relaxed))
+            return -1;
+        if (!block)
+            return 1;
+        if (++spins < c->spins)
+            shm_cpu_relax();
+        else
+            shm_sleep(&c->slot->responses.head, head,
+                      &c->slot->responses.consumer_sleeps, SLEEP_TIMEOUT_NS);
+    }
+    const struct shm_response *r = &c->responses[c->received & c->mask];
+    memcpy(response, r, offsetof(struct shm_response, predictions) +
+                        r->n_predictions * sizeof(struct prediction));
+    atomic_store_explicit(&c->slot->responses.tail, ++c->received,
+                          memory_order_release);
+    return 0;
+}
+
+int shm_client_get_k_nwp(struct shm_client *c, const char *context, uint16_t k,
+                         struct prediction *predictions,
+                         unsigned short *n_predictions)
+{
+    struct shm_response response;
+    if (c->sent != c->received || shm_client_send(c, context, k, 0) != 0 ||
+        shm_client_receive(c, &response, 1) != 0 || response.error != SHM_OK)
+        return 1;
+    memcpy(predictions, response.predictions,
+           response.n_predictions * sizeof(struct prediction));
+    *n_predictions = response.n_predictions;
+    return 0;
+}
+
+const char *shm_client_get_word_text(const struct shm_client *c,
+                                     word_id_type id)
+{
+    return shm_get_word_text(c->h, id);
+}
+
+/**
+ * Map the segment \p name of a running server.
+ * @param name
+ * @param fd pass out pointer for the file descriptor of the segment, kept
+ * open to hold the lock of the slot of the client.
+ * @return its header, or NULL if there is no such segment, it is not of
+ * this version, or its server stopped.
+ */
+static struct shm_header *map_segment(const char *name, int *fd)
+{
+    *fd = shm_open(name, O_RDWR, 0);
+    if (*fd == -1)
+        return NULL;
+    struct stat st;
+    struct shm_header *h = MAP_FAILED;
+    if (fstat(*fd, &st) == 0 &&
+        (size_t) st.st_size >= sizeof(struct shm_header))
+        h = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (h == MAP_FAILED)
+        return NULL;
+    if (h->magic != SHM_MAGIC || h->version != SHM_VERSION ||
+        h->size != (uint64_t) st.st_size || atomic_load(&h->stopped)) {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+/**
+ * Lock a free slot of the server of \p c and take it, with empty rings. The
+ * slot stays locked while \p c holds it, so that the server frees it if the
+ * process of \p c dies, even before attaching to it.
+ * @return 0 on success, 1 if all the slots are taken or locked.
+ */
+static int claim_slot(struct shm_client *c)
+{
+    struct shm_header *h = c->h;
+    for (uint32_t i = 0; i < h->n_slots; i++) {
+        struct shm_slot *slot = shm_get_slot(h, i);
+        // the client that left a free slot may not have released it yet
+        if (atomic_load(&slot->state) != SHM_SLOT_FREE ||
+            shm_lock_slot(c->fd, i) != 0)
+            continue;
+        uint32_t state = SHM_SLOT_FREE;
+        if (!atomic_compare_exchange_strong(&slot->state, &state,
+                                            SHM_SLOT_CLAIMED)) {
+            shm_unlock_slot(c->fd, i);
+            continue;
+        }
+        // the server does not touch a slot until it is attached
+        atomic_store_explicit(&slot->requests.head, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->requests.tail, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->responses.head, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->responses.tail, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->responses.consumer_sleeps, 0,
+                              memory_order_relaxed);
+        atomic_store_explicit(&slot->state, SHM_SLOT_ATTACHED,
+                              memory_order_release);
+        c->slot = slot;
+        c->requests = shm_get_requests(h, i);
+        c->responses = shm_get_responses(h, i);
+        c->doorbell = &h->doorbells[i % h->n_threads];
+        c->mask = h->ring_size - 1;
+        return 0;
+    }
+    return 1;
+}
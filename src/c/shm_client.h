@@ -0,0 +1,85 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Client of a shm_server on the same host. A client takes a slot of
+ * the shared memory segment of the server, and can keep up to ring_size
+ * requests in flight in it, whose responses come back in order. A client is
+ * not thread safe: use one per thread.
+ * @code
+ * struct shm_client *c = shm_client_open("/ngram_lm");
+ * struct prediction predictions[3];
+ * unsigned short n;
+ * if (shm_client_get_k_nwp(c, "é que", 3, predictions, &n) == 0)
+ *     for (unsigned short i = 0; i < n; i++)
+ *         puts(shm_client_get_word_text(c, predictions[i].word_id));
+ * shm_client_close(c);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_SHM_CLIENT_H
+#define NGRAM_LM_SHM_CLIENT_H
+
+#include <stdint.h>
+
+#include "shm_channel.h"
+
+struct shm_client;
+
+/**
+ * Attach to the server of the shared memory segment \p name.
+ * @return the client, or NULL if there is no such server or all its slots
+ * are taken. Use shm_client_close() to free it.
+ */
+struct shm_client *shm_client_open(const char *name);
+
+/**
+ * Leave the slot of \p c, and free it. Responses in flight are discarded.
+ */
+void shm_client_close(struct shm_client *c);
+
+/**
+ * Send the request of the top \p k predictions of \p context, the words of
+ * which are separated by spaces, without waiting for its response.
+ * @param c
+ * @param context
+ * @param k
+ * @param tag returned with the response.
+ * @return 0 if it was sent, 1 if there are ring_size requests in flight
+ * already, and -1 if \p context is longer than SHM_MAX_CONTEXT_SIZE bytes or
+ * the server stopped.
+ */
+int shm_client_send(struct shm_client *c, const char *context, uint16_t k,
+                    uint64_t tag);
+
+/**
+ * Receive the response to the oldest request in flight of \p c.
+ * @param c
+ * @param response
+ * @param block whether to wait for it, if it has not arrived.
+ * @return 0 if it was received, 1 if it has not arrived and \p block is
+ * false, and -1 if there are no requests in flight or the server stopped.
+ */
+int shm_client_receive(struct shm_client *c, struct shm_response *response,
+                       int block);
+
+/**
+ * Get the top \p k predictions of \p context, waiting for them.
+ * @param c a client without requests in flight.
+ * @param context
+ * @param k
+ * @param predictions where the predictions are written.
+ * @param n_predictions where their number is written.
+ * @return 0 on success, 1 if the server failed or the request is invalid.
+ */
+int shm_client_get_k_nwp(struct shm_client *c, const char *context, uint16_t k,
+                         struct prediction *predictions,
+                         unsigned short *n_predictions);
+
+/**
+ * @return the text of the word \p id of the vocabulary of the server, or
+ * NULL if there is no such word.
+ */
+const char *shm_client_get_word_text(const struct shm_client *c,
+                                     word_id_type id);
+
+#endif //NGRAM_LM_SHM_CLIENT_H
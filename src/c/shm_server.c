@@ -0,0 +1,415 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "shm_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_channel.h"
+#include "util/log.h"
+
+#define MAX_BATCH_SIZE 64
+/// scans without requests before sleeping, if there is a CPU to spin on
+#define SPINS 4096
+/// the sleeping threads wake up this often to see if they are stopped
+#define SLEEP_TIMEOUT_NS 100000000
+#define MAX_CONTEXT_WORDS (SHM_MAX_CONTEXT_SIZE / 2 + 1)
+
+/**
+ * A request taken from a slot. The contexts of the valid ones are looked up
+ * in the order of the entries.
+ */
+struct batch_entry {
+    uint32_t slot;
+    uint64_t tag;
+    uint16_t k;
+    uint16_t error;
+};
+
+struct shm_worker {
+    struct shm_server *s;
+    unsigned int index;
+    unsigned int cursor;        /// the slot the next scan starts from
+    pthread_t thread;
+    struct batch_entry entries[MAX_BATCH_SIZE];
+    unsigned int n_entries;
+    // the contexts of the valid entries
+    char texts[MAX_BATCH_SIZE][SHM_MAX_CONTEXT_SIZE + 1];
+    const char *words[MAX_BATCH_SIZE * MAX_CONTEXT_WORDS];
+    const char **contexts[MAX_BATCH_SIZE];
+    int lens[MAX_BATCH_SIZE];
+    unsigned int m;
+    unsigned short k;           /// the largest k of the valid entries
+    struct prediction predictions[MAX_BATCH_SIZE * SHM_MAX_K];
+    atomic_uint_least64_t requests;
+    atomic_uint_least64_t batches;
+};
+
+struct shm_server {
+    const struct trie *t;
+    char *name;
+    int fd;                     /// of the segment, to see its slot locks
+    struct shm_header *h;
+    atomic_int stop;
+    unsigned int spins;
+    unsigned int n_workers;
+    struct shm_worker *workers;
+};
+
+static struct shm_header *
+create_segment(const struct trie *t, const char *name,
+               const struct shm_server_options *options, int *fd);
+
+static void *serve(void *arg);
+
+static unsigned int take_requests(struct shm_worker *w);
+
+static void take_request(struct shm_worker *w, uint32_t slot,
+                         const struct shm_request *r);
+
+static void answer_requests(struct shm_worker *w);
+
+static void free_dead_clients(struct shm_worker *w);
+
+static void stop_workers(struct shm_server *s, unsigned int n_workers);
+
+static uint64_t round_up(uint64_t size);
+
+struct shm_server *shm_server_new(const struct trie *t, const char *name,
+                                  const struct shm_server_options *options)
+{
+    const unsigned int ring_size = options->ring_size;
+    if (options->n_threads == 0 || options->n_threads > SHM_MAX_THREADS ||
+        options->n_slots == 0 || ring_size == 0 ||
+        (ring_size & (ring_size - 1)) != 0) {
+        log_error("Invalid shared memory server options");
+        return NULL;
+    }
+    struct shm_server *s = calloc(1, sizeof(struct shm_server));
+    if (s == NULL)
+        return NULL;
+    s->t = t;
+    // spinning on a single CPU only delays the thread it waits for
+    s->spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SPINS : 0;
+    s->name = strdup(name);
+    s->fd = -1;
+    s->h = create_segment(t, name, options, &s->fd);
+    s->workers = calloc(options->n_threads, sizeof(struct shm_worker));
+    if (s->name == NULL || s->h == NULL || s->workers == NULL) {
+        shm_server_delete(s);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < options->n_threads; i++) {
+        s->workers[i].s = s;
+        s->workers[i].index = i;
+        if (pthread_create(&s->workers[i].thread, NULL, serve,
+                           &s->workers[i]) != 0) {
+            log_error("Could not start the shared memory server threads");
+            shm_server_delete(s);
+            return NULL;
+        }
+        s->n_workers++;
+    }
+    return s;
+}
+
+void shm_server_delete(struct shm_server *s)
+{
+    if (s == NULL)
+        return;
+    if (s->h != NULL) {
+        stop_workers(s, s->n_workers);
+        munmap(s->h, s->h->size);
+        shm_unlink(s->name);
+    }
+    if (s->fd != -1)
+        close(s->fd);
+    free(s->workers);
+    free(s->name);
+    free(s);
+}
+
+void shm_server_get_stats(const struct shm_server *s,
+                          struct shm_server_stats *stats)
+{
+    *stats = (struct shm_server_stats) { 0, 0 };
+    for (unsigned int i = 0; i < s->n_workers; i++) {
+        stats->requests += atomic_load_explicit(&s->workers[i].requests,
+                                                memory_order_relaxed);
+        stats->batches += atomic_load_explicit(&s->workers[i].batches,
+                                               memory_order_relaxed);
+    }
+}
+
+/**
+ * Create the segment \p name, with the vocabulary of \p t and the slots of
+ * \p options.
+ * @param fd pass out pointer for the file descriptor of the segment, which
+ * is kept open to see the locks of the clients on their slots.
+ * @return its header, or NULL if it could not be created.
+ */
+static struct shm_header *
+create_segment(const struct trie *t, const char *name,
+               const struct shm_server_options *options, int *fd)
+{
+    const uint64_t n_words = t->n_ngrams[0];
+    uint64_t texts_size = 0;
+    for (uint64_t i = 0; i < n_words; i++)
+        texts_size += strlen(t->vocab_lookup[i].text) + 1;
+    struct shm_header layout = {
+            .magic = SHM_MAGIC, .version = SHM_VERSION,
+            .n_slots = options->n_slots, .ring_size = options->ring_size,
+            .n_threads = options->n_threads, .n_words = n_words
+    };
+    layout.text_offsets_offset = round_up(sizeof(struct shm_header));
+    layout.texts_offset = layout.text_offsets_offset +
+                          (n_words + 1) * sizeof(uint64_t);
+    layout.slots_offset = round_up(layout.texts_offset + texts_size);
+    layout.entries_offset = round_up(layout.slots_offset +
+                                     options->n_slots *
+                                     sizeof(struct shm_slot));
+    layout.size = layout.entries_offset +
+                  (uint64_t) options->n_slots * options->ring_size *
+                  (sizeof(struct shm_request) + sizeof(struct shm_response));
+
+    shm_unlink(name);
+    *fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (*fd == -1) {
+        log_error("Could not create the shared memory '%s': %s", name,
+                  strerror(errno));
+        return NULL;
+    }
+    struct shm_header *h = MAP_FAILED;
+    if (ftruncate(*fd, layout.size) == 0)
+        h = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd,
+                 0);
+    if (h == MAP_FAILED) {
+        log_error("Could not map the shared memory '%s': %s", name,
+                  strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+    // the segment is zeroed, so the slots are free and their rings empty
+    uint64_t *offsets = (uint64_t *) ((char *) h + layout.text_offsets_offset);
+    char *texts = (char *) h + layout.texts_offset;
+    offsets[0] = 0;
+    for (uint64_t i = 0; i < n_words; i++) {
+        const size_t len = strlen(t->vocab_lookup[i].text) + 1;
+        memcpy(&texts[offsets[i]], t->vocab_lookup[i].text, len);
+        offsets[i + 1] = offsets[i] + len;
+    }
+    memcpy(h, &layout, sizeof(struct shm_header));
+    return h;
+}
+
+static void *serve(void *arg)
+{
+    struct shm_worker *w = arg;
+    struct shm_server *s = w->s;
+    struct shm_doorbell *doorbell = &s->h->doorbells[w->index];
+    unsigned int idle = 0;
+    time_t last_check = 0;
+    while (!atomic_load_explicit(&s->stop, memory_order_relaxed)) {
+        // read before the scan, so that a request sent after it is not
+        // slept on
+        const uint32_t rings = atomic_load(&doorbell->rings);
+        if (take_requests(w) > 0) {
+            answer_requests(w);
+            idle = 0;
+            continue;
+        }
+        if (++idle < s->spins) {
+            shm_cpu_relax();
+            continue;
+        }
+        const time_t now = time(NULL);
+        if (now != last_check) {
+            free_dead_clients(w);
+            last_check = now;
+        }
+        shm_sleep(&doorbell->rings, rings, &doorbell->sleeps,
+                  SLEEP_TIMEOUT_NS);
+        idle = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Take up to MAX_BATCH_SIZE requests from the slots of \p w, as many from
+ * each slot as there is room for their responses, and free the slots left
+ * by their clients. The scan starts at a different slot each time, so that
+ * every slot gets its turn.
+ * @return the number of requests taken.
+ */
+static unsigned int take_requests(struct shm_worker *w)
+{
+    struct shm_header *h = w->s->h;
+    const uint32_t mask = h->ring_size - 1;
+    const unsigned int n_slots = (h->n_slots - w->index + h->n_threads - 1) /
+                                 h->n_threads;
+    w->n_entries = w->m = w->k = 0;
+    for (unsigned int j = 0; j < n_slots && w->n_entries < MAX_BATCH_SIZE;
+         j++) {
+        const uint32_t i = w->index + (w->cursor + j) % n_slots * h->n_threads;
+        struct shm_slot *slot = shm_get_slot(h, i);
+        const uint32_t state = atomic_load_explicit(&slot->state,
+                                                    memory_order_acquire);
+        if (state == SHM_SLOT_DETACHING) {
+            atomic_store_explicit(&slot->state, SHM_SLOT_FREE,
+                                  memory_order_release);
+            continue;
+        }
+        if (state != SHM_SLOT_ATTACHED)
+            continue;
+        uint32_t tail = atomic_load_explicit(&slot->requests.tail,
+                                             memory_order_relaxed);
+        const uint32_t head = atomic_load(&slot->requests.head);
+        const uint32_t room = h->ring_size - (
+                atomic_load_explicit(&slot->responses.head,
+                                     memory_order_relaxed) -
+                atomic_load_explicit(&slot->responses.tail,
+                                     memory_order_acquire));
+        const struct shm_request *requests = shm_get_requests(h, i);
+        for (uint32_t taken = 0;
+             tail != head && taken < room && w->n_entries < MAX_BATCH_SIZE;
+             tail++, taken++)
+            take_request(w, i, &requests[tail & mask]);
+        // the requests were copied, so the client can reuse their entries
+        atomic_store_explicit(&slot->requests.tail, tail,
+                              memory_order_release);
+    }
+    w->cursor = (n_slots > 0) ? (w->cursor + 1) % n_slots : 0;
+    return w->n_entries;
+}
+
+/**
+ * Add the request \p r of the slot \p slot to the batch of \p w, splitting
+ * the words of a copy of its context.
+ */
+static void take_request(struct shm_worker *w, uint32_t slot,
+                         const struct shm_request *r)
+{
+    struct batch_entry *e = &w->entries[w->n_entries++];
+    *e = (struct batch_entry) { slot, r->tag, r->k, SHM_OK };
+    const uint16_t len = r->len;
+    if (e->k == 0 || e->k > SHM_MAX_K) {
+        e->error = SHM_INVALID_K;
+        return;
+    }
+    if (len > SHM_MAX_CONTEXT_SIZE) {
+        e->error = SHM_INVALID_CONTEXT;
+        return;
+    }
+    char *text = w->texts[w->m];
+    memcpy(text, r->context, len);
+    text[len] = '\0';
+    const char **words = &w->words[w->m * MAX_CONTEXT_WORDS];
+    int n = 0;
+    char *save;
+    for (char *word = strtok_r(text, " \t\n", &save); word != NULL;
+         word = strtok_r(NULL, " \t\n", &save))
+        words[n++] = word;
+    w->contexts[w->m] = words;
+    w->lens[w->m++] = n;
+    if (e->k > w->k)
+        w->k = e->k;
+}
+
+/**
+ * Look up the predictions of the valid requests of the batch of \p w at
+ * once, and write the responses to their slots, waking up their clients.
+ */
+static void answer_requests(struct shm_worker *w)
+{
+    struct shm_header *h = w->s->h;
+    const uint32_t mask = h->ring_size - 1;
+    if (w->m > 0)
+        trie_get_k_nwp_batch(w->s->t, w->contexts, w->lens, w->m, w->k,
+                             w->predictions);
+    // counted before the clients can see the responses
+    atomic_fetch_add_explicit(&w->requests, w->n_entries,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->batches, 1, memory_order_relaxed);
+    // the top k_i predictions of each request are the first ones of the top k
+    const struct prediction *predictions = w->predictions;
+    for (unsigned int i = 0; i < w->n_entries; i++) {
+        const struct batch_entry *e = &w->entries[i];
+        struct shm_slot *slot = shm_get_slot(h, e->slot);
+        const uint32_t head = atomic_load_explicit(&slot->responses.head,
+                                                   memory_order_relaxed);
+        struct shm_response *r = &shm_get_responses(h, e->slot)[head & mask];
+        r->tag = e->tag;
+        r->error = e->error;
+        r->n_predictions = 0;
+        if (e->error == SHM_OK) {
+            while (r->n_predictions < e->k &&
+                   predictions[r->n_predictions].word_id != (word_id_type) -1) {
+                r->predictions[r->n_predictions] =
+                        predictions[r->n_predictions];
+                r->n_predictions++;
+            }
+            predictions += w->k;
+        }
+        atomic_store(&slot->responses.head, head + 1);
+        // the responses of a slot are written one after the other
+        if (i + 1 == w->n_entries || w->entries[i + 1].slot != e->slot)
+            shm_wake(&slot->responses.head, &slot->responses.consumer_sleeps);
+    }
+}
+
+/**
+ * Free the slots of \p w whose clients died without leaving them, which
+ * released the locks of the slots. A client locks its slot before claiming
+ * it, and only unlocks it after detaching from it, and only this thread
+ * frees the slots of \p w, so a claimed or attached slot that is not locked
+ * is one of a dead client.
+ */
+static void free_dead_clients(struct shm_worker *w)
+{
+    struct shm_header *h = w->s->h;
+    for (uint32_t i = w->index; i < h->n_slots; i += h->n_threads) {
+        struct shm_slot *slot = shm_get_slot(h, i);
+        uint32_t state = atomic_load(&slot->state);
+        if ((state == SHM_SLOT_CLAIMED || state == SHM_SLOT_ATTACHED) &&
+            shm_is_slot_locked(w->s->fd, i) == 0 &&
+            atomic_compare_exchange_strong(&slot->state, &state,
+                                           SHM_SLOT_FREE))
+            log_warn("Freed the shared memory slot %u of a dead client", i);
+    }
+}
+
+/**
+ * Stop the first \p n_workers threads of \p s, and wake up the clients
+ * waiting for them, which then fail.
+ */
+static void stop_workers(struct shm_server *s, unsigned int n_workers)
+{
+    struct shm_header *h = s->h;
+    atomic_store(&s->stop, 1);
+    atomic_store(&h->stopped, 1);
+    for (unsigned int i = 0; i < n_workers; i++) {
+        atomic_fetch_add(&h->doorbells[i].rings, 1);
+        shm_wake(&h->doorbells[i].rings, &h->doorbells[i].sleeps);
+    }
+    for (unsigned int i = 0; i < n_workers; i++)
+        pthread_join(s->workers[i].thread, NULL);
+    for (uint32_t i = 0; i < h->n_slots; i++) {
+        struct shm_slot *slot = shm_get_slot(h, i);
+        shm_wake(&slot->responses.head, &slot->responses.consumer_sleeps);
+    }
+}
+
+/**
+ * @return \p size rounded up to a multiple of the cache line size.
+ */
+static uint64_t round_up(uint64_t size)
+{
+    return (size + SHM_CACHE_LINE_SIZE - 1) / SHM_CACHE_LINE_SIZE *
+           SHM_CACHE_LINE_SIZE;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Server of the next word predictions of a trie to the clients on the
+ * same host, through a shared memory segment (see shm_channel.h), so that a
+ * query costs no system call while the server is busy. Each server thread
+ * serves its own share of the client slots: it takes the requests of all of
+ * them, looks them up as a batch with trie_get_k_nwp_batch(), and writes
+ * their responses, spinning while there are none before sleeping on its
+ * doorbell. The clients use shm_client.h.
+ * @code
+ * struct shm_server_options options = { .n_slots = 64, .ring_size = 64,
+ *                                       .n_threads = 2 };
+ * struct shm_server *s = shm_server_new(t, "/ngram_lm", &options);
+ * // serve until
+ * shm_server_delete(s);
+ * @endcode
+ */
+
+#ifndef NGRAM_LM_SHM_SERVER_H
+#define NGRAM_LM_SHM_SERVER_H
+
+#include <stdint.h>
+
+#include "trie.h"
+
+struct shm_server;
+
+struct shm_server_options {
+    unsigned int n_slots;       /// clients attached at once
+    unsigned int ring_size;     /// requests in flight per client, a power of 2
+    unsigned int n_threads;     /// at most SHM_MAX_THREADS
+};
+
+struct shm_server_stats {
+    uint64_t requests;
+    uint64_t batches;
+};
+
+/**
+ * Create the shared memory segment \p name, replacing any segment of that
+ * name, and start the threads that serve it the predictions of \p t.
+ * @param t the trie, which must outlive the server.
+ * @param name name of the segment, as in shm_open(), e.g. "/ngram_lm".
+ * @param options
+ * @return the server, or NULL if the segment could not be created or the
+ * threads started. Use shm_server_delete() to free it.
+ */
+struct shm_server *shm_server_new(const struct trie *t, const char *name,
+                                  const struct shm_server_options *options);
+
+/**
+ * Stop the threads of \p s, which makes its clients fail, remove its
+ * segment, and free it.
+ */
+void shm_server_delete(struct shm_server *s);
+
+/**
+ * Get the stats of \p s so far.
+ */
+void shm_server_get_stats(const struct shm_server *s,
+                          struct shm_server_stats *stats);
+
+#endif //NGRAM_LM_SHM_SERVER_H
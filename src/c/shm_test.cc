@@ -0,0 +1,202 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+extern "C" {
+#include <sys/wait.h>
+#include <unistd.h>
+#include "c/shm_client.h"
+#include "c/shm_server.h"
+#include "c/trie.h"
+#include "c/util/log.h"
+}
+
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *TEST_DATA = "./data/tmp.arpa";
+
+static std::string segment_name()
+{
+    return "/ngram_lm_shm_test_" + std::to_string(getpid());
+}
+
+/**
+ * @return a client of \p name, waiting up to a few seconds for a slot.
+ */
+static struct shm_client *open_client(const std::string &name)
+{
+    struct shm_client *c = nullptr;
+    for (int i = 0; i < 5000 && c == nullptr; i++) {
+        c = shm_client_open(name.c_str());
+        if (c == nullptr)
+            usleep(1000);
+    }
+    return c;
+}
+
+static std::vector<struct prediction>
+expected_predictions(const struct trie *t, const char *context, int k)
+{
+    std::vector<const char *> words;
+    std::string text = context;
+    char *save;
+    for (char *word = strtok_r(&text[0], " ", &save); word != nullptr;
+         word = strtok_r(nullptr, " ", &save))
+        words.push_back(word);
+    std::vector<struct prediction> predictions(k);
+    predictions.resize(trie_get_k_nwp_predictions(t, words.data(),
+                                                  words.size(), k,
+                                                  predictions.data()));
+    return predictions;
+}
+
+static void expect_response(const struct trie *t, const char *context, int k,
+                            const struct shm_response &response)
+{
+    const auto expected = expected_predictions(t, context, k);
+    ASSERT_EQ(response.error, SHM_OK);
+    ASSERT_EQ(response.n_predictions, expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_EQ(response.predictions[i].word_id, expected[i].word_id);
+        EXPECT_FLOAT_EQ(response.predictions[i].probability,
+                        expected[i].probability);
+    }
+}
+
+static const std::vector<const char *> CONTEXTS = {
+        "é que", "PAra é", "", "anonexistingword", "havia é que os"
+};
+
+TEST(Shm, AnswersPipelinedRequestsInOrder)
+{
+    log_set_quiet(true);
+    struct trie *t = trie_new_from_arpa_path(3, TEST_DATA);
+    const std::string name = segment_name();
+    struct shm_server_options options = { 8, 16, 2 };
+    struct shm_server *s = shm_server_new(t, name.c_str(), &options);
+    ASSERT_TRUE(s != nullptr);
+
+    // clients of both threads at once
+    std::vector<std::thread> clients;
+    for (int c = 0; c < 3; c++)
+        clients.emplace_back([t, &name] {
+            struct shm_client *client = shm_client_open(name.c_str());
+            ASSERT_TRUE(client != nullptr);
+            struct shm_response response;
+            uint64_t sent = 0, received = 0;
+            while (received < 1000) {
+                while (sent < 1000 &&
+                       shm_client_send(client, CONTEXTS[sent % CONTEXTS.size()],
+                                       1 + sent % 5, sent) == 0)
+                    sent++;
+                ASSERT_EQ(shm_client_receive(client, &response, 1), 0);
+                ASSERT_EQ(response.tag, received);
+                expect_response(t, CONTEXTS[received % CONTEXTS.size()],
+                                1 + received % 5, response);
+                received++;
+            }
+            EXPECT_EQ(shm_client_receive(client, &response, 0), -1);
+            shm_client_close(client);
+        });
+    for (auto &client : clients)
+        client.join();
+
+    struct shm_server_stats stats;
+    shm_server_get_stats(s, &stats);
+    EXPECT_EQ(stats.requests, 3000);
+    EXPECT_LE(stats.batches, stats.requests);
+    shm_server_delete(s);
+    trie_delete(t);
+    log_set_quiet(false);
+}
+
+TEST(Shm, RejectsInvalidRequests)
+{
+    log_set_quiet(true);
+    struct trie *t = trie_new_from_arpa_path(3, TEST_DATA);
+    const std::string name = segment_name();
+    struct shm_server_options options = { 1, 4, 1 };
+    struct shm_server *s = shm_server_new(t, name.c_str(), &options);
+    ASSERT_TRUE(s != nullptr);
+    struct shm_client *c = shm_client_open(name.c_str());
+    ASSERT_TRUE(c != nullptr);
+    // the only slot is taken
+    EXPECT_TRUE(shm_client_open(name.c_str()) == nullptr);
+
+    struct shm_response response;
+    EXPECT_EQ(shm_client_send(c, "é", 0, 1), 0);
+    EXPECT_EQ(shm_client_send(c, "é", SHM_MAX_K + 1, 2), 0);
+    EXPECT_EQ(shm_client_send(c, std::string(SHM_MAX_CONTEXT_SIZE + 1,
+                                             'a').c_str(), 1, 3), -1);
+    EXPECT_EQ(shm_client_send(c, "é que", 3, 4), 0);
+    ASSERT_EQ(shm_client_receive(c, &response, 1), 0);
+    EXPECT_EQ(response.tag, 1);
+    EXPECT_EQ(response.error, SHM_INVALID_K);
+    ASSERT_EQ(shm_client_receive(c, &response, 1), 0);
+    EXPECT_EQ(response.error, SHM_INVALID_K);
+    ASSERT_EQ(shm_client_receive(c, &response, 1), 0);
+    EXPECT_EQ(response.tag, 4);
+    expect_response(t, "é que", 3, response);
+
+    struct prediction predictions[SHM_MAX_K];
+    unsigned short n;
+    ASSERT_EQ(shm_client_get_k_nwp(c, "é que", SHM_MAX_K, predictions, &n), 0);
+    const auto expected = expected_predictions(t, "é que", SHM_MAX_K);
+    ASSERT_EQ(n, expected.size());
+    for (unsigned short i = 0; i < n; i++)
+        EXPECT_STREQ(shm_client_get_word_text(c, predictions[i].word_id),
+                     t->vocab_lookup[expected[i].word_id].text);
+    EXPECT_TRUE(shm_client_get_word_text(c, t->n_ngrams[0]) == nullptr);
+
+    // the slot of a closed client is free again
+    shm_client_close(c);
+    struct shm_client *other = open_client(name);
+    ASSERT_TRUE(other != nullptr);
+    EXPECT_EQ(shm_client_get_k_nwp(other, "é que", 1, predictions, &n), 0);
+
+    // the clients of a stopped server fail
+    shm_server_delete(s);
+    EXPECT_EQ(shm_client_send(other, "é que", 1, 5), -1);
+    shm_client_close(other);
+    EXPECT_TRUE(shm_client_open(name.c_str()) == nullptr);
+    trie_delete(t);
+    log_set_quiet(false);
+}
+
+TEST(Shm, FreesTheSlotsOfDeadClients)
+{
+    log_set_quiet(true);
+    struct trie *t = trie_new_from_arpa_path(3, TEST_DATA);
+    const std::string name = segment_name();
+    struct shm_server_options options = { 1, 4, 1 };
+    struct shm_server *s = shm_server_new(t, name.c_str(), &options);
+    ASSERT_TRUE(s != nullptr);
+
+    // an idle client keeps its slot while the server looks for dead ones
+    struct shm_client *c = shm_client_open(name.c_str());
+    ASSERT_TRUE(c != nullptr);
+    usleep(1500000);
+    EXPECT_TRUE(shm_client_open(name.c_str()) == nullptr);
+    struct prediction predictions[1];
+    unsigned short n;
+    EXPECT_EQ(shm_client_get_k_nwp(c, "é que", 1, predictions, &n), 0);
+    shm_client_close(c);
+
+    // a client that exits without leaving its slot
+    const pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+    if (pid == 0)
+        _exit(open_client(name) != nullptr ? 0 : 1);
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    c = open_client(name);
+    ASSERT_TRUE(c != nullptr);
+    EXPECT_EQ(shm_client_get_k_nwp(c, "é que", 1, predictions, &n), 0);
+    shm_client_close(c);
+
+    shm_server_delete(s);
+    trie_delete(t);
+    log_set_quiet(false);
+}
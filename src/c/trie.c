@@ -2,35 +2,263 @@
 
 #include "trie.h"
 
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "array.h"
+#include "bit.h"
 #include "c/util/murmur3.h"
 #include "ngram.h"
+#include "scratch.h"
 #include "util/log.h"
 #include "util/progress.h"
 #include "word.h"
 
 #define ceil_log2(x) ((uint8_t) ceil(log2(x)))
 #define WORD_MAX_LENGTH 256
+#define DECODE_CHUNK_SIZE 256
 #define KNOWN_PORTUGUESE_WORD_MAX_LENGTH 46
+// first words of a trie file, before the struct trie it dumps
+#define TRIE_FILE_MAGIC 0x746c676e  /// "nglt"
+// changed whenever the struct trie or the records of the file change
+#define TRIE_FILE_VERSION 10
+#define BATCH_GROUP_SIZE 32
+// the fewest contexts of a batch worth a thread of their own
+#define MIN_THREAD_BATCH_SIZE 64
+#define UNKNOWN_WORD_LOG10_PROBABILITY (-100.0f)
+#define DEFAULT_QUERY_CACHE_SHARDS 64
+// searching a word among the children of a context costs about as much as
+// decoding this many children
+#define PROBE_COST 16
+#define DEFAULT_METRICS_SHARDS 16
+// at most one unknown word is logged per interval, in nanoseconds
+#define UNKNOWN_WORD_LOG_INTERVAL 1000000000
+// new word id of the words removed by a delta
+#define REMOVED_WORD ((word_id_type) -1)
+// index of the old trie node of an n-gram added by a delta
+#define NO_NODE UINT64_MAX
+// log10 probabilities summed in a different order can differ by this much
+#define MIXTURE_ROUNDING_SLACK 1e-5f
+// log2(10), to raise 10 to a power with exp2(), which is faster than pow()
+#define LOG2_10 3.32192809488736234787
+
+/**
+ * First word of the query cache keys, followed by the query parameters and
+ * the word ids of the query.
+ */
+enum query_type {
+    QUERY_K_NWP,
+    QUERY_NGRAM
+};
+
+/// the time after which the next unknown word can be logged
+static atomic_uint_least64_t next_unknown_word_log;
+/// the unknown words found since the last one logged
+static atomic_uint_least64_t unknown_words_not_logged;
 
 /**
  * Used during trie creation.
  */
 struct array_tmp_record {
     float probability;
+    float backoff;
     word_id_type word_id;
     uint64_t context_id;
 };
 
+/**
+ * Search of a word hash in the vocabulary lookup, used by the batch queries.
+ */
+struct vocab_search {
+    word_hash_type hash;
+    const char *text;
+    word_id_type *id;       /// where to write the word id
+    uint64_t base;          /// start of the range left to be searched
+};
+
+enum path_walk_stage {
+    WALK_BOUNDS,                /// read the children range of the last node
+    WALK_ENDPOINTS,             /// read the endpoints of the range left
+    WALK_INTERPOLATION_PROBE,
+    WALK_BINARY_PROBE,
+    WALK_DONE
+};
+
+/**
+ * One of the lookups of trie_get_k_nwp_batch(). The trie path of its context
+ * is walked one probe at a time, so that the probes of all the lookups of a
+ * group can be interleaved.
+ */
+struct path_walk {
+    const word_id_type *ids;    /// known word ids of the context
+    unsigned short len;         /// length of the suffix being walked
+    unsigned short n;           /// number of nodes of the suffix reached
+    uint64_t index;             /// index of the last node reached
+    uint64_t l;                 /// children range left to be searched
+    uint64_t r;
+    uint64_t len_before_probe;  /// length of [l, r) before the probes
+    uint64_t mid;               /// next probe
+    enum path_walk_stage stage;
+};
+
+/**
+ * The context of a query, with the trie nodes of every suffix of the longest
+ * suffix of the context that is in the trie.
+ */
+struct lm_state {
+    unsigned short max_len;     /// order - 1 of the trie
+    unsigned short len;         /// length of the matched suffix
+    word_id_type *ids;          /// word ids of the matched suffix
+    uint64_t *nodes;            /// index of the (i + 1)-gram suffix at i
+};
+
+/**
+ * One of the suffixes of the context of a next word prediction.
+ */
+struct context_level {
+    uint64_t node;
+    uint64_t l;                 /// children range
+    uint64_t r;
+    float backoff;
+    float positive_backoffs;    /// sum of the positive backoffs up to here
+};
+
+/**
+ * The words in [l, r) of the lexicon.
+ */
+struct lexicon_range {
+    uint32_t l;
+    uint32_t r;
+};
+
+/**
+ * The contexts of a batch given to one of the threads of
+ * trie_get_k_nwp_batch_parallel().
+ */
+struct batch_slice {
+    const struct trie *t;
+    const char ***contexts;
+    const int *lens;
+    unsigned int m;
+    unsigned short k;
+    struct prediction *predictions;
+};
+
+/**
+ * The best predictions found so far, in a heap with the worst at the root.
+ */
+struct top_k {
+    struct prediction *heap;
+    unsigned short len;
+    unsigned short k;
+};
+
+/**
+ * Tries whose predictions are interpolated, see trie_mixture_new().
+ */
+struct trie_mixture {
+    unsigned short m;
+    const struct trie **tries;
+    double *weights;            /// add up to 1
+    uint64_t n_words;
+    struct word *vocab_lookup;  /// union of the vocabularies, sorted by hash
+    word_id_type *trie_ids;     /// id in the trie i of the word w at w * m + i
+    word_id_type **mixture_ids; /// mixture id of each word id of each trie
+    word_id_type sentence_start;    /// mixture id of "<s>", or -1
+    word_id_type unknown;           /// mixture id of "<unk>", or -1
+};
+
+/**
+ * The context of one of the tries of a mixture in the search of the top
+ * predictions of the mixture, and the top predictions of the trie given it,
+ * which are scored in the mixture from the best one on.
+ */
+struct mixture_source {
+    const struct trie *t;
+    const struct context_level *levels;
+    float *backoffs;            /// sum of the backoffs of the levels after each
+    unsigned short n;           /// length of the context
+    double unknown;             /// probability, not log10, of words it lacks
+    struct prediction *ranked;  /// the top depth predictions, found of them
+    unsigned short depth;
+    unsigned short found;
+    unsigned short next;        /// the first of ranked not scored yet
+    double left;                /// highest probability of the words not scored
+};
+
+/**
+ * Open addressing set of the word ids scored by a search, in scratch memory.
+ */
+struct word_id_set {
+    word_id_type *ids;
+    uint64_t mask;
+    uint64_t len;
+};
+
+/**
+ * Change of an n-gram in a delta file, see trie_apply_delta().
+ */
+struct delta_entry {
+    unsigned short n;
+    int remove;                 /// whether it is removed, or added or changed
+    float probability;
+    float backoff;
+    uint64_t line;              /// of the delta file, the last change wins
+    char **words;
+    word_id_type *ids;          /// in the vocabulary of the updated trie
+};
+
+/**
+ * The changes of the n-grams of one order, sorted by their word ids.
+ */
+struct delta_section {
+    struct delta_entry *entries;
+    uint64_t len;
+    uint64_t capacity;
+};
+
+/**
+ * A depth first merge of the n-grams of a trie with the changes of a delta,
+ * in the order of the n-gram arrays of the updated trie.
+ */
+struct delta_merge {
+    const struct trie *old;
+    struct trie *new;
+    const word_id_type *id_map;     /// new id of each old word id
+    struct delta_section *sections;
+    uint64_t *cursors;          /// next change of each order
+    uint64_t *counts;           /// n-grams of each order merged so far
+    word_id_type *path;         /// word ids of the n-gram being merged
+    int write;                  /// whether to write the records or count them
+    int failed;
+};
+
 static struct trie *trie_new(unsigned short order);
 
+static void count_word(const struct trie *t, const char *word_text,
+                       word_id_type id);
+
+static inline uint64_t start_latency(const struct trie *t);
+
+static inline void record_latency(const struct trie *t,
+                                  enum metrics_histogram h, uint64_t start);
+
+static inline void
+count_metric(const struct trie *t, enum metrics_counter c, uint64_t n);
+
+static inline void
+record_metric(const struct trie *t, enum metrics_histogram h, uint64_t value);
+
 static void
 read_n_ngrams(int order, const struct arpa *arpa, uint64_t *n_ngrams);
 
@@ -39,6 +267,8 @@ static void create_vocab_lookup(uint64_t n_unigrams, const struct arpa *arpa,
 
 static int cmp_words(const void *a, const void *b);
 
+static size_t read_trie(struct trie **trie, FILE *f, const uint8_t *mapping);
+
 static void populate_ngrams(int order, const struct arpa *arpa, struct trie *t);
 
 static void populate_unigrams(const struct arpa *arpa, struct trie *t);
@@ -51,13 +281,17 @@ parse_ngram_definition(const char *line, int n, const struct trie *trie,
 
 static inline int is_unknown_wid(const struct trie *t, word_id_type id);
 
+static word_id_type find_word_id(const struct trie *t, const char *word_text);
+
 static void set_array_record(const struct trie *t, int n, uint64_t at,
                              struct array_record *ngram);
 
-static struct array_record
+static inline struct array_record
 get_array_record(const struct trie *t, int n, uint64_t at);
 
-static int cmp_array_records(void *a, void *b, void *arg);
+static void get_array_records_columns(const struct trie *t, int n, uint64_t l,
+                                      uint64_t r, float *probabilities,
+                                      word_id_type *word_ids);
 
 static uint64_t
 get_context_id(const struct trie *t, const word_id_type *context_words_ids,
@@ -75,10 +309,16 @@ static void reduce_last_order_array(struct trie *t);
 
 static unsigned long get_array_record_size(const struct trie *t, int n);
 
+static void set_record_layouts(struct trie *t);
+
+static unsigned int get_first_child_index_size(const struct trie *t, int n);
+
 static unsigned long get_array_tmp_record_size(const struct trie *t, int n);
 
-static void
-get_array_record_field_sizes(const struct trie *t, int n, unsigned int *dest);
+static unsigned int
+get_array_tmp_record_fields(const unsigned int *field_sizes,
+                            struct array_tmp_record *tmp_record, void **dest,
+                            unsigned int *sizes);
 
 static void get_array_tmp_record_field_sizes(const struct trie *t, int n,
                                              unsigned int *dest);
@@ -86,12 +326,187 @@ static void get_array_tmp_record_field_sizes(const struct trie *t, int n,
 static const struct word *
 trie_get_word_from_text(const struct trie *t, const char *word_text);
 
+static void large_ranges_delete(struct large_ranges *lr, unsigned short order);
+
+static void rank_unigrams(struct trie *t);
+
+static int cmp_predictions(const void *a, const void *b);
+
+static unsigned short
+get_suffix_nodes(const struct trie *t, const word_id_type *ids,
+                 unsigned short n, uint64_t *nodes);
+
+static unsigned short
+get_k_nwp_within(const struct trie *t, const uint64_t *nodes, unsigned short n,
+                 unsigned short k, struct prediction *predictions);
+
+static size_t get_state_size(const struct trie *t);
+
+static struct lm_state *init_state(const struct trie *t, void *memory);
+
+static unsigned short
+rank_predictions(const struct trie *t, const uint64_t *nodes, unsigned short n,
+                 unsigned short k, struct prediction *predictions);
+
+static void
+set_context_levels(const struct trie *t, const uint64_t *nodes,
+                   unsigned short n, struct context_level *levels);
+
+static unsigned short
+rank_levels(const struct trie *t, const struct context_level *levels,
+            unsigned short n, const struct lexicon_range *filter,
+            unsigned short k, struct prediction *predictions);
+
+static unsigned short finish_top_k(struct top_k *top);
+
+static unsigned short
+get_context_word_ids(const struct trie *t, const char **words, int n,
+                     word_id_type *ids);
+
+static unsigned short
+trim_context_ids(const struct trie *t, word_id_type *ids, unsigned short len);
+
+static unsigned short
+get_k_nwp_ids(const struct trie *t, word_id_type *key, unsigned short len,
+              unsigned short k, struct prediction *predictions);
+
+static void sort_lexicon(struct trie *t);
+
+static void set_lexicon_ranks(struct trie *t);
+
+static int cmp_word_texts(const void *a, const void *b);
+
+static void get_prefix_range(const struct trie *t, const char *prefix,
+                             struct lexicon_range *range);
+
+static unsigned short
+probe_words(const struct trie *t, const struct context_level *levels,
+            unsigned short n, const word_id_type *word_ids, uint64_t len,
+            unsigned short k, struct prediction *predictions);
+
+static inline void
+prefetch_records(const struct trie *t, int n, uint64_t l, uint64_t r);
+
+static void vocab_search_batch(const struct trie *t, struct vocab_search *s,
+                               unsigned int len);
+
+static void path_walk_start(const struct trie *t, struct path_walk *w);
+
+static void path_walk_backoff(const struct trie *t, struct path_walk *w);
+
+static void path_walk_step(const struct trie *t, struct path_walk *w);
+
+static void prefetch_state_score(const struct trie *t,
+                                 const struct lm_state *state,
+                                 word_id_type word_id);
+
+static void prefetch_state_children(const struct trie *t,
+                                    const struct lm_state *state);
+
+static inline int8_t
+find_child(const struct trie *t, int n, uint64_t parent_index, uint64_t left,
+           uint64_t right, word_id_type word_id, uint64_t *index);
+
+static void trie_get_nwp_f(struct array_record *ar, uint64_t ar_index,
+                           unsigned short trie_level, void *arg);
+
+static void *get_k_nwp_batch_slice(void *arg);
+
+static int read_delta(const struct trie *t, const char *path,
+                      struct delta_section *sections);
+
+static int parse_delta_line(char *line, unsigned short n, int remove,
+                            uint64_t line_number, struct delta_section *s);
+
+static void delta_sections_delete(struct delta_section *sections,
+                                  unsigned short order);
+
+static void dedup_delta_section(struct delta_section *s);
+
+static int cmp_delta_words(const void *a, const void *b);
+
+static int cmp_delta_ids(const void *a, const void *b);
+
+static int cmp_word_ids(const word_id_type *a, const word_id_type *b, int n);
+
+static word_id_type *merge_vocabulary(const struct trie *old,
+                                      struct delta_section *unigrams,
+                                      struct trie *new);
+
+static void merge_lexicon(const struct trie *old, const word_id_type *id_map,
+                          struct trie *new);
+
+static int resolve_delta_ids(const struct trie *t, const char *path,
+                             struct delta_section *s);
+
+static int merge_ngrams(struct delta_merge *m);
+
+static void merge_children(struct delta_merge *m, int n, uint64_t old_parent);
+
+static void
+merge_ngram(struct delta_merge *m, int n, word_id_type id, float probability,
+            float backoff, uint64_t old_index);
+
+static void skip_missing_contexts(struct delta_merge *m, int n, int all);
+
+static word_id_type
+mixture_find_word_id(const struct trie_mixture *mix, const char *word_text);
+
+static inline word_id_type
+mixture_trie_id(const struct trie_mixture *mix, word_id_type id,
+                unsigned short i);
+
+static void walk_mixture_context(const struct trie_mixture *mix,
+                                 struct lm_state **states, unsigned int stride,
+                                 const word_id_type *ids, unsigned int len);
+
+static void set_mixture_source(const struct trie_mixture *mix,
+                               unsigned short i, const struct lm_state *state,
+                               struct mixture_source *s);
+
+static float source_probability(const struct mixture_source *s,
+                                word_id_type id);
+
+static unsigned short
+rank_mixture(const struct trie_mixture *mix, struct mixture_source *sources,
+             unsigned short k, struct prediction *predictions);
+
+static int is_next_source(const struct trie_mixture *mix,
+                          const struct mixture_source *sources,
+                          unsigned short i, unsigned short j);
+
+static void rank_source(struct mixture_source *s, unsigned short depth);
+
+static void set_source_left(struct mixture_source *s);
+
+static void score_mixture_word(const struct trie_mixture *mix,
+                               const struct mixture_source *sources,
+                               word_id_type id, unsigned short known_i,
+                               double known, struct word_id_set *scored,
+                               struct top_k *top);
+
+static inline double to_probability(float log10_probability);
+
+static void word_id_set_init(struct word_id_set *s, uint64_t capacity);
+
+static int word_id_set_add(struct word_id_set *s, word_id_type id);
+
 static struct trie *trie_new(unsigned short order)
 {
     struct trie *t = malloc(sizeof(struct trie));
     t->order = order;
-    t->n_ngrams = malloc(order * sizeof(int));
+    t->n_ngrams = malloc(order * sizeof(uint64_t));
     t->arrays = malloc(order * sizeof(struct array *));
+    t->large_ranges = NULL;
+    t->layouts = NULL;
+    t->unigram_ranking = NULL;
+    t->lexicon = NULL;
+    t->lexicon_ranks = NULL;
+    t->hot_cache = NULL;
+    t->query_cache = NULL;
+    t->metrics = NULL;
+    t->mapping = NULL;
+    t->mapping_size = 0;
     return t;
 }
 
@@ -99,8 +514,11 @@ struct trie *trie_new_from_arpa(unsigned short order, const struct arpa *arpa)
 {
     struct trie *t = trie_new(order);
     read_n_ngrams(order, arpa, t->n_ngrams);
+    set_record_layouts(t);
     create_vocab_lookup(t->n_ngrams[0], arpa, t);
     populate_ngrams(order, arpa, t);
+    rank_unigrams(t);
+    sort_lexicon(t);
     return t;
 }
 
@@ -115,17 +533,36 @@ trie_new_from_arpa_path(unsigned short order, const char *arpa_path)
 
 void trie_delete(struct trie *t)
 {
+    if (t->large_ranges != NULL)
+        large_ranges_delete(t->large_ranges, t->order);
     for (int i = 0; i < t->order; i++) {
-        array_delete(t->arrays[i]);
+        if (t->mapping != NULL)
+            free(t->arrays[i]);
+        else
+            array_delete(t->arrays[i]);
     }
     free(t->arrays);
+    if (t->mapping != NULL)
+        munmap(t->mapping, t->mapping_size);
     free(t->vocab_lookup);
     free(t->n_ngrams);
+    free(t->layouts);
+    free(t->unigram_ranking);
+    free(t->lexicon);
+    free(t->lexicon_ranks);
+    if (t->hot_cache != NULL)
+        hot_cache_delete(t->hot_cache);
+    if (t->query_cache != NULL)
+        query_cache_delete(t->query_cache);
+    if (t->metrics != NULL)
+        metrics_delete(t->metrics);
     free(t);
 }
 
 void trie_fwrite(const struct trie *t, FILE *f)
 {
+    const uint32_t header[] = { TRIE_FILE_MAGIC, TRIE_FILE_VERSION };
+    fwrite(header, sizeof(uint32_t), 2, f);
     fwrite(t, sizeof(struct trie), 1, f);
     fwrite(t->n_ngrams, sizeof(uint64_t), t->order, f);
     fwrite(t->vocab_lookup, sizeof(struct word), t->n_ngrams[0], f);
@@ -138,22 +575,51 @@ void trie_fwrite(const struct trie *t, FILE *f)
     for (int i = 0; i < t->order; i++) {
         array_fwrite(t->arrays[i], f);
     }
+    fwrite(t->lexicon, sizeof(word_id_type), t->n_ngrams[0], f);
 }
 
 size_t trie_fread(struct trie **trie, FILE *f)
 {
+    return read_trie(trie, f, NULL);
+}
+
+/**
+ * Read the trie of \p f, as trie_fread() does, but with the elements of its
+ * arrays pointed to in \p mapping, the memory map of the file of \p f, if
+ * it is not NULL.
+ */
+static size_t read_trie(struct trie **trie, FILE *f, const uint8_t *mapping)
+{
+    uint32_t header[2];
+    if (fread(header, sizeof(uint32_t), 2, f) != 2 ||
+        header[0] != TRIE_FILE_MAGIC || header[1] != TRIE_FILE_VERSION) {
+        log_error("The file is not a trie file of version %d. Trie files "
+                  "saved by other versions must be rebuilt",
+                  TRIE_FILE_VERSION);
+        return 0;
+    }
     struct trie *t = malloc(sizeof(struct trie));
     size_t read = fread(t, sizeof(struct trie), 1, f);
     if (read != 1) {
         log_error("Could not read struct trie from file");
         return read;
     }
+    t->mapping = NULL;
+    t->mapping_size = 0;
+    t->large_ranges = NULL;
+    t->unigram_ranking = NULL;
+    t->lexicon = NULL;
+    t->lexicon_ranks = NULL;
+    t->hot_cache = NULL;
+    t->query_cache = NULL;
+    t->metrics = NULL;
     t->n_ngrams = malloc(t->order * sizeof(uint64_t));
     read = fread(t->n_ngrams, sizeof(uint64_t), t->order, f);
     if (read != t->order) {
         log_error("Could not read trie->n_ngrams from file");
         return read;
     }
+    set_record_layouts(t);
     t->vocab_lookup = malloc(t->n_ngrams[0] * sizeof(struct word));
     read = fread(t->vocab_lookup, sizeof(struct word), t->n_ngrams[0], f);
     if (read != t->n_ngrams[0]) {
@@ -178,13 +644,29 @@ size_t trie_fread(struct trie **trie, FILE *f)
     }
     t->arrays = malloc(t->order * sizeof(struct array *));
     for (int i = 0; i < t->order; i++) {
-        t->arrays[i] = malloc(t->n_ngrams[i] * get_array_record_size(t, i + 1));
-        read = array_fread(t->arrays[i], f);
+        t->arrays[i] = malloc(sizeof(struct array));
+        read = (mapping != NULL) ? array_map(t->arrays[i], f, mapping) :
+               array_fread(t->arrays[i], f);
         if (read != 1) {
             log_error("Could not read trie->arrays[%d] from file", i);
             return read;
         }
+        if (t->arrays[i]->elem_size != get_array_record_size(t, i + 1)) {
+            log_error("trie->arrays[%d] records have %d bits instead of %lu. "
+                      "The file was saved with an older record layout and "
+                      "must be rebuilt", i, t->arrays[i]->elem_size,
+                      get_array_record_size(t, i + 1));
+            return 0;
+        }
+    }
+    t->lexicon = malloc(t->n_ngrams[0] * sizeof(word_id_type));
+    read = fread(t->lexicon, sizeof(word_id_type), t->n_ngrams[0], f);
+    if (read != t->n_ngrams[0]) {
+        log_error("Could not read trie->lexicon from file");
+        return read;
     }
+    set_lexicon_ranks(t);
+    rank_unigrams(t);
     *trie = t;
     return 1;
 }
@@ -208,119 +690,672 @@ int trie_load(const char *path, struct trie **t)
         log_warn("'%s' file could not be opened: %s", path, strerror(errno));
         return 1;
     }
-    trie_fread(t, f);
+    size_t read = trie_fread(t, f);
     fclose(f);
-    return 0;
-}
-
-static void
-read_n_ngrams(const int order, const struct arpa *arpa, uint64_t *n_ngrams)
-{
-    for (int i = 0; i < order; i++)
-        n_ngrams[i] = arpa->n_ngrams[i];
+    return read != 1;
 }
 
-static int
-create_vocab_lookup_action_f(struct arpa_ngram *ngram, uint64_t i, void *arg)
+int trie_map(const char *path, struct trie **t)
 {
-    struct trie *t = arg;
-    const char *word = ngram->words[0];
-    if (strlen(word) > KNOWN_PORTUGUESE_WORD_MAX_LENGTH) {
-        log_warn(
-                "A text with %lu characters was found at the %lu-th line of the 1-grams section",
-                strlen(word), i + 1);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        log_warn("'%s' file could not be opened: %s", path, strerror(errno));
+        return 1;
     }
-    uint64_t out[2];
-    murmurhash3(word, strlen(word), out);
-    word_hash_type hash = out[0]; // qhashmurmur3_32(word, strlen(word));
-    t->vocab_lookup[i].hash = hash;
-    t->vocab_lookup[i].text = malloc((strlen(word) + 1) * sizeof(char));
-    strcpy(t->vocab_lookup[i].text, word);
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        log_warn("'%s' file could not be read: %s", path, strerror(errno));
+        fclose(f);
+        return 1;
+    }
+    // the reads of the last bits of an array go up to 8 bytes after them, so
+    // the file is mapped over zeroed pages that are a page longer
+    const size_t size = st.st_size + sysconf(_SC_PAGESIZE);
+    uint8_t *mapping = mmap(NULL, size, PROT_READ,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED ||
+        mmap(mapping, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+             fileno(f), 0) == MAP_FAILED) {
+        log_warn("'%s' file could not be mapped: %s", path, strerror(errno));
+        if (mapping != MAP_FAILED)
+            munmap(mapping, size);
+        fclose(f);
+        return 1;
+    }
+    size_t read = read_trie(t, f, mapping);
+    fclose(f);
+    if (read != 1) {
+        munmap(mapping, size);
+        return 1;
+    }
+    (*t)->mapping = mapping;
+    (*t)->mapping_size = size;
     return 0;
 }
 
-static void
-create_vocab_lookup(const uint64_t n_unigrams, const struct arpa *arpa,
-                    struct trie *t)
+struct trie *trie_apply_delta(const struct trie *t, const char *delta_path)
 {
-    t->vocab_lookup = malloc(n_unigrams * sizeof(struct word));
-    struct arpa_section *unigrams_section = arpa_get_section(arpa, 1);
-    arpa_for_each_section_ngrami(unigrams_section, create_vocab_lookup_action_f,
-                                 t);
-    qsort(t->vocab_lookup, n_unigrams, sizeof(struct word), cmp_words);
+    struct delta_section *sections = calloc(t->order,
+                                            sizeof(struct delta_section));
+    if (read_delta(t, delta_path, sections) != 0) {
+        delta_sections_delete(sections, t->order);
+        return NULL;
+    }
+    struct trie *new = trie_new(t->order);
+    word_id_type *id_map = merge_vocabulary(t, &sections[0], new);
+    int failed = 0;
+    for (int n = 1; n <= t->order && !failed; n++)
+        failed = resolve_delta_ids(new, delta_path, &sections[n - 1]);
+    struct delta_merge m = {
+            .old = t,
+            .new = new,
+            .id_map = id_map,
+            .sections = sections,
+            .cursors = malloc(t->order * sizeof(uint64_t)),
+            .counts = malloc(t->order * sizeof(uint64_t)),
+            .path = malloc(t->order * sizeof(word_id_type))
+    };
+    // the first pass counts the n-grams, which the record layouts depend on
+    if (!failed)
+        failed = merge_ngrams(&m);
+    if (!failed) {
+        for (int n = 2; n <= t->order; n++)
+            new->n_ngrams[n - 1] = m.counts[n - 1];
+        set_record_layouts(new);
+        for (int n = 1; n <= t->order; n++)
+            new->arrays[n - 1] = array_new(get_array_record_size(new, n),
+                                           new->n_ngrams[n - 1] +
+                                           (n < t->order));
+        m.write = 1;
+        failed = merge_ngrams(&m);
+    }
+    free(m.cursors);
+    free(m.counts);
+    free(m.path);
+    delta_sections_delete(sections, t->order);
+    if (failed) {
+        for (uint64_t i = 0; i < new->n_ngrams[0]; i++)
+            free(new->vocab_lookup[i].text);
+        free(new->vocab_lookup);
+        if (new->layouts != NULL)
+            for (int n = 1; n <= t->order; n++)
+                array_delete(new->arrays[n - 1]);
+        free(new->layouts);
+        free(new->arrays);
+        free(new->n_ngrams);
+        free(new);
+        free(id_map);
+        return NULL;
+    }
+    merge_lexicon(t, id_map, new);
+    free(id_map);
+    rank_unigrams(new);
+    return new;
 }
 
-static int cmp_words(const void *a, const void *b)
+/**
+ * Read the changes of the delta file \p path of \p t into the \p sections
+ * of each order, sorted by their words and without repeated n-grams.
+ * @return 0 on success, 1 if the file could not be read or is not valid.
+ */
+static int read_delta(const struct trie *t, const char *path,
+                      struct delta_section *sections)
 {
-    struct word *a_entry = (struct word *) a, *b_entry = (struct word *) b;
-    if (a_entry->hash < b_entry->hash) return -1;
-    else if (a_entry->hash > b_entry->hash) return 1;
-    else return 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        log_warn("'%s' file could not be opened: %s", path, strerror(errno));
+        return 1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    uint64_t line_number = 0;
+    int n = 0, remove = 0, failed = 0;
+    while (!failed && (len = getline(&line, &capacity, f)) != -1) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (line[0] == '\\') {
+            n = 0;
+            // the \data\ counts, if any, are of no use to a delta
+            if (strcmp(line, "\\data\\") == 0 || strcmp(line, "\\end\\") == 0)
+                continue;
+            if (sscanf(line, "\\%d-grams:", &n) == 1)
+                remove = 0;
+            else if (sscanf(line, "\\removed-%d-grams:", &n) == 1)
+                remove = 1;
+            if (n < 1 || n > t->order) {
+                log_error("'%s' line %" PRIu64 ": '%s' is not a section of a "
+                          "delta of a %d-gram trie", path, line_number, line,
+                          t->order);
+                failed = 1;
+            }
+            continue;
+        }
+        if (n == 0)
+            continue;
+        failed = parse_delta_line(line, n, remove, line_number,
+                                  &sections[n - 1]);
+        if (failed)
+            log_error("'%s' line %" PRIu64 " is not a valid %s%d-gram", path,
+                      line_number, remove ? "removed " : "", n);
+    }
+    free(line);
+    fclose(f);
+    for (int i = 0; i < t->order && !failed; i++)
+        dedup_delta_section(&sections[i]);
+    return failed;
 }
 
-static int populate_ngrams_action_f(char *line, uint64_t i, void *arg)
+/**
+ * Add the change of the \p n-gram of \p line to \p s: its probability, words
+ * and optional backoff if it is added or changed, or its words if it is
+ * removed.
+ * @return 0 on success, 1 if \p line is not valid.
+ */
+static int parse_delta_line(char *line, unsigned short n, int remove,
+                            uint64_t line_number, struct delta_section *s)
 {
-    if (line[0] == '\n')
+    struct delta_entry e = { .n = n, .remove = remove, .line = line_number };
+    char *save, *end;
+    char *token = strtok_r(line, " \t", &save);
+    if (!remove) {
+        if (token == NULL)
+            return 1;
+        e.probability = strtof(token, &end);
+        if (*end != '\0')
+            return 1;
+        token = strtok_r(NULL, " \t", &save);
+    }
+    e.words = malloc(n * sizeof(char *));
+    unsigned short i = 0;
+    for (; i < n && token != NULL; i++) {
+        e.words[i] = strdup(token);
+        token = strtok_r(NULL, " \t", &save);
+    }
+    int failed = i < n;
+    if (!failed && token != NULL) {
+        e.backoff = strtof(token, &end);
+        failed = remove || *end != '\0' || strtok_r(NULL, " \t", &save);
+    }
+    if (failed) {
+        while (i > 0)
+            free(e.words[--i]);
+        free(e.words);
         return 1;
-    void **args = arg;
-    int n = *(int *) args[0];
-    struct trie *t = (struct trie *) args[1];
-    struct array_tmp_record tmp;
-    tmp.context_id = 0;
-    tmp.probability = 0;
-    tmp.word_id = 0;
-    parse_ngram_definition(line, n, t, &tmp);
-    set_array_tmp_record(t, n, i, &tmp);
-    progress_bar("Reading ARPA", i, t->n_ngrams[n - 1]);
+    }
+    if (s->len == s->capacity) {
+        s->capacity = (s->capacity == 0) ? 64 : 2 * s->capacity;
+        s->entries = realloc(s->entries,
+                             s->capacity * sizeof(struct delta_entry));
+    }
+    s->entries[s->len++] = e;
     return 0;
 }
 
-static void populate_ngrams(int order, const struct arpa *arpa, struct trie *t)
+static void delta_sections_delete(struct delta_section *sections,
+                                  unsigned short order)
 {
-    populate_unigrams(arpa, t);
-    for (int n = 2; n <= order; n++) {
-        log_info("Populating %d-grams", n);
-
-        t->arrays[n - 1] = array_new(get_array_tmp_record_size(t, n),
-                                     t->n_ngrams[n - 1] + 1);
-        log_info("Array allocated");
-
-        char section_tile[24];
-        snprintf(section_tile, 24, "\\%d-grams:\n", n);
-        void *args[] = { &n, t };
-        struct arpa_section *arpa_section = arpa_get_section(arpa, n);
-        uint64_t i = arpa_for_each_section_linei(arpa_section,
-                                                 populate_ngrams_action_f,
-                                                 args);
-        struct array_tmp_record dummy = { 0, t->n_ngrams[0],
-                                          t->n_ngrams[n - 2] };
-        set_array_tmp_record(t, n, i, &dummy);
-
-        log_info("Sorting... This might take a while...");
-        unsigned int tmp_sizes[3];
-        get_array_tmp_record_field_sizes(t, n, tmp_sizes);
-        array_sort_r(t->arrays[n - 1], cmp_array_tmp_records,
-                     (void *) tmp_sizes);
-
-        fill_in_array_record_indexes(t, n - 1);
+    for (int n = 1; n <= order; n++) {
+        struct delta_section *s = &sections[n - 1];
+        for (uint64_t i = 0; i < s->len; i++) {
+            for (int j = 0; j < n; j++)
+                free(s->entries[i].words[j]);
+            free(s->entries[i].words);
+            free(s->entries[i].ids);
+        }
+        free(s->entries);
     }
-    reduce_last_order_array(t);
+    free(sections);
 }
 
-static int
-populate_unigrams_action_f(struct arpa_ngram *ngram, uint64_t i, void *arg)
+/**
+ * Sort the changes of \p s by their words, and keep only the last change of
+ * each n-gram.
+ */
+static void dedup_delta_section(struct delta_section *s)
+{
+    qsort(s->entries, s->len, sizeof(struct delta_entry), cmp_delta_words);
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < s->len; i++) {
+        struct delta_entry *e = &s->entries[i];
+        if (i + 1 < s->len) {
+            const struct delta_entry *next = &s->entries[i + 1];
+            int same = 1;
+            for (int j = 0; j < e->n && same; j++)
+                same = strcmp(e->words[j], next->words[j]) == 0;
+            if (same) {
+                for (int j = 0; j < e->n; j++)
+                    free(e->words[j]);
+                free(e->words);
+                continue;
+            }
+        }
+        s->entries[len++] = *e;
+    }
+    s->len = len;
+}
+
+static int cmp_delta_words(const void *a, const void *b)
+{
+    const struct delta_entry *a_entry = a, *b_entry = b;
+    for (int i = 0; i < a_entry->n; i++) {
+        const int cmp = strcmp(a_entry->words[i], b_entry->words[i]);
+        if (cmp != 0)
+            return cmp;
+    }
+    return (a_entry->line > b_entry->line) - (a_entry->line < b_entry->line);
+}
+
+static int cmp_delta_ids(const void *a, const void *b)
+{
+    const struct delta_entry *a_entry = a, *b_entry = b;
+    return cmp_word_ids(a_entry->ids, b_entry->ids, a_entry->n);
+}
+
+/**
+ * Compare the n-grams of word ids \p a and \p b, of length \p n, in the order
+ * of the trie.
+ */
+static int cmp_word_ids(const word_id_type *a, const word_id_type *b, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return (a[i] > b[i]) ? 1 : -1;
+    return 0;
+}
+
+/**
+ * Set the vocabulary of \p new to the words of \p old but the ones removed
+ * by the \p unigrams changes, plus the ones they add. The words of \p old
+ * are already sorted by hash, so only the added ones are sorted, and then
+ * merged with them.
+ * @return the new word id of each word id of \p old, or REMOVED_WORD.
+ */
+static word_id_type *merge_vocabulary(const struct trie *old,
+                                      struct delta_section *unigrams,
+                                      struct trie *new)
+{
+    const uint64_t n_old = old->n_ngrams[0];
+    word_id_type *id_map = calloc(n_old, sizeof(word_id_type));
+    struct word *added = malloc(unigrams->len * sizeof(struct word));
+    uint64_t n_added = 0, n_removed = 0;
+    for (uint64_t i = 0; i < unigrams->len; i++) {
+        const struct delta_entry *e = &unigrams->entries[i];
+        const word_id_type id = find_word_id(old, e->words[0]);
+        if (!is_unknown_wid(old, id)) {
+            if (e->remove && id_map[id] != REMOVED_WORD) {
+                id_map[id] = REMOVED_WORD;
+                n_removed++;
+            }
+        } else if (e->remove) {
+            log_warn("'%s' removed word is not in the vocabulary",
+                     e->words[0]);
+        } else {
+            uint64_t out[2];
+            murmurhash3(e->words[0], strlen(e->words[0]), out);
+            added[n_added].hash = out[0];
+            added[n_added++].text = e->words[0];
+        }
+    }
+    qsort(added, n_added, sizeof(struct word), cmp_words);
+
+    new->n_ngrams[0] = n_old - n_removed + n_added;
+    new->vocab_lookup = malloc(new->n_ngrams[0] * sizeof(struct word));
+    uint64_t i = 0, j = 0, len = 0;
+    while (i < n_old || j < n_added) {
+        if (i < n_old && id_map[i] == REMOVED_WORD) {
+            i++;
+            continue;
+        }
+        struct word *w = &new->vocab_lookup[len];
+        if (j == n_added ||
+            (i < n_old && cmp_words(&old->vocab_lookup[i], &added[j]) <= 0)) {
+            w->hash = old->vocab_lookup[i].hash;
+            w->text = strdup(old->vocab_lookup[i].text);
+            id_map[i++] = len++;
+        } else {
+            w->hash = added[j].hash;
+            w->text = strdup(added[j++].text);
+            len++;
+        }
+    }
+    free(added);
+    return id_map;
+}
+
+/**
+ * Set the lexicon of \p new by merging the one of \p old, but for the removed
+ * words, with the added words, which are the ones of \p new that are not
+ * in \p id_map.
+ */
+static void merge_lexicon(const struct trie *old, const word_id_type *id_map,
+                          struct trie *new)
+{
+    const uint64_t n_old = old->n_ngrams[0], n_new = new->n_ngrams[0];
+    uint8_t *kept = calloc(n_new, sizeof(uint8_t));
+    for (uint64_t i = 0; i < n_old; i++)
+        if (id_map[i] != REMOVED_WORD)
+            kept[id_map[i]] = 1;
+    const struct word **added = malloc(n_new * sizeof(struct word *));
+    uint64_t n_added = 0;
+    for (uint64_t i = 0; i < n_new; i++)
+        if (!kept[i])
+            added[n_added++] = &new->vocab_lookup[i];
+    qsort(added, n_added, sizeof(struct word *), cmp_word_texts);
+
+    new->lexicon = malloc(n_new * sizeof(word_id_type));
+    uint64_t i = 0, j = 0, len = 0;
+    while (len < n_new) {
+        const word_id_type id = (i < n_old) ? id_map[old->lexicon[i]] :
+                                REMOVED_WORD;
+        if (i < n_old && id == REMOVED_WORD) {
+            i++;
+        } else if (j == n_added ||
+                   (i < n_old && strcmp(new->vocab_lookup[id].text,
+                                        added[j]->text) <= 0)) {
+            new->lexicon[len++] = id;
+            i++;
+        } else {
+            new->lexicon[len++] = added[j++] - new->vocab_lookup;
+        }
+    }
+    free(added);
+    free(kept);
+    set_lexicon_ranks(new);
+}
+
+/**
+ * Set the word ids of the changes of \p s in the vocabulary of \p t, and sort
+ * them by those. The removals of unigrams are dropped, as merge_vocabulary()
+ * applied them, and so are the removals of n-grams with words that are not
+ * in the vocabulary, which are not in the trie either.
+ * @return 0 on success, 1 if an added n-gram has a word that is not in the
+ * vocabulary.
+ */
+static int resolve_delta_ids(const struct trie *t, const char *path,
+                             struct delta_section *s)
+{
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < s->len; i++) {
+        struct delta_entry *e = &s->entries[i];
+        e->ids = malloc(e->n * sizeof(word_id_type));
+        int known = 1;
+        for (int j = 0; j < e->n && known; j++) {
+            e->ids[j] = find_word_id(t, e->words[j]);
+            known = !is_unknown_wid(t, e->ids[j]);
+            if (!known && !e->remove) {
+                log_error("'%s' line %" PRIu64 ": '%s' word is not in the "
+                          "vocabulary", path, e->line, e->words[j]);
+                // the entries left keep their words, to be freed
+                memmove(&s->entries[len], e,
+                        (s->len - i) * sizeof(struct delta_entry));
+                s->len = len + (s->len - i);
+                return 1;
+            }
+        }
+        if (!known || (e->remove && e->n == 1)) {
+            for (int j = 0; j < e->n; j++)
+                free(e->words[j]);
+            free(e->words);
+            free(e->ids);
+            continue;
+        }
+        s->entries[len++] = *e;
+    }
+    s->len = len;
+    qsort(s->entries, s->len, sizeof(struct delta_entry), cmp_delta_ids);
+    return 0;
+}
+
+/**
+ * Merge the n-grams of the trie of \p m with the changes of the delta, in one
+ * depth first walk of the new trie, whose records are written if m->write is
+ * true, and only counted otherwise.
+ * @return 0 on success, 1 if an added n-gram has a context that is not in
+ * the updated trie.
+ */
+static int merge_ngrams(struct delta_merge *m)
+{
+    const unsigned short order = m->new->order;
+    for (int n = 1; n <= order; n++) {
+        m->cursors[n - 1] = 0;
+        m->counts[n - 1] = 0;
+    }
+    merge_children(m, 1, 0);
+    for (int n = 2; n <= order; n++)
+        skip_missing_contexts(m, n, 1);
+    if (m->failed || !m->write)
+        return m->failed;
+    // the sentinel records end the children ranges of the last n-grams
+    for (int n = 1; n < order; n++) {
+        struct array_record sentinel = {
+                .word_id = m->new->n_ngrams[0],
+                .first_child_index = m->counts[n]
+        };
+        set_array_record(m->new, n, m->counts[n - 1], &sentinel);
+    }
+    return 0;
+}
+
+/**
+ * Merge the \p n-gram children of the (n-1)-gram m->path, the ones of the
+ * old trie at \p old_parent, if it is not NO_NODE, with the changes of the
+ * delta of its children.
+ */
+static void merge_children(struct delta_merge *m, int n, uint64_t old_parent)
+{
+    const struct trie *old = m->old;
+    uint64_t l = 0, r = 0;
+    if (n == 1) {
+        r = old->n_ngrams[0];
+    } else if (old_parent != NO_NODE) {
+        l = get_array_record(old, n - 1, old_parent).first_child_index;
+        r = get_array_record(old, n - 1, old_parent + 1).first_child_index;
+    }
+    skip_missing_contexts(m, n, 0);
+    const struct delta_section *s = &m->sections[n - 1];
+    uint64_t *cursor = &m->cursors[n - 1];
+    while (!m->failed) {
+        const struct delta_entry *e = NULL;
+        if (*cursor < s->len &&
+            cmp_word_ids(s->entries[*cursor].ids, m->path, n - 1) == 0)
+            e = &s->entries[*cursor];
+        struct array_record record = { 0 };
+        word_id_type old_id = REMOVED_WORD;
+        if (l < r) {
+            record = get_array_record(old, n, l);
+            old_id = m->id_map[record.word_id];
+            // the n-grams of a removed word go with it
+            if (old_id == REMOVED_WORD) {
+                l++;
+                continue;
+            }
+        } else if (e == NULL) {
+            break;
+        }
+        const word_id_type delta_id = (e != NULL) ? e->ids[n - 1] :
+                                      REMOVED_WORD;
+        if (old_id < delta_id) {
+            merge_ngram(m, n, old_id, record.probability, record.backoff, l);
+            l++;
+        } else if (delta_id < old_id) {
+            if (!e->remove)
+                merge_ngram(m, n, delta_id, e->probability, e->backoff,
+                            NO_NODE);
+            else if (!m->write)
+                log_warn("Removed %d-gram of line %" PRIu64 " is not in the "
+                         "trie", n, e->line);
+            (*cursor)++;
+        } else {
+            // a change keeps the children, and a removal drops them too
+            if (!e->remove)
+                merge_ngram(m, n, delta_id, e->probability, e->backoff, l);
+            l++;
+            (*cursor)++;
+        }
+    }
+}
+
+/**
+ * Append the \p n-gram m->path plus \p id, which is the n-gram \p old_index
+ * of the old trie, or a new one if it is NO_NODE, to the new trie, followed
+ * by its children.
+ */
+static void
+merge_ngram(struct delta_merge *m, int n, word_id_type id, float probability,
+            float backoff, uint64_t old_index)
+{
+    const unsigned short order = m->new->order;
+    const uint64_t index = m->counts[n - 1]++;
+    m->path[n - 1] = id;
+    if (m->write) {
+        struct array_record record = {
+                .probability = probability,
+                .backoff = (n < order) ? backoff : 0,
+                .word_id = id,
+                .first_child_index = (n < order) ? m->counts[n] : 0
+        };
+        set_array_record(m->new, n, index, &record);
+    }
+    if (n < order)
+        merge_children(m, n + 1, old_index);
+}
+
+/**
+ * Skip the changes of the \p n-grams whose context comes before m->path, or
+ * all the ones left if \p all is true, as their context is not in the new
+ * trie. Removing those is a no-op, but adding them fails the merge.
+ */
+static void skip_missing_contexts(struct delta_merge *m, int n, int all)
+{
+    const struct delta_section *s = &m->sections[n - 1];
+    uint64_t *cursor = &m->cursors[n - 1];
+    for (; *cursor < s->len && !m->failed; (*cursor)++) {
+        const struct delta_entry *e = &s->entries[*cursor];
+        if (!all && cmp_word_ids(e->ids, m->path, n - 1) >= 0)
+            break;
+        if (e->remove) {
+            if (!m->write)
+                log_warn("Removed %d-gram of line %" PRIu64 " is not in the "
+                         "trie", n, e->line);
+        } else {
+            log_error("Added %d-gram of line %" PRIu64 " has a context that "
+                      "is not in the trie", n, e->line);
+            m->failed = 1;
+        }
+    }
+}
+
+static void
+read_n_ngrams(const int order, const struct arpa *arpa, uint64_t *n_ngrams)
+{
+    for (int i = 0; i < order; i++)
+        n_ngrams[i] = arpa->n_ngrams[i];
+}
+
+static int
+create_vocab_lookup_action_f(struct arpa_ngram *ngram, uint64_t i, void *arg)
+{
+    struct trie *t = arg;
+    const char *word = ngram->words[0];
+    if (strlen(word) > KNOWN_PORTUGUESE_WORD_MAX_LENGTH) {
+        log_warn(
+                "A text with %lu characters was found at the %lu-th line of the 1-grams section",
+                strlen(word), i + 1);
+    }
+    uint64_t out[2];
+    murmurhash3(word, strlen(word), out);
+    word_hash_type hash = out[0]; // qhashmurmur3_32(word, strlen(word));
+    t->vocab_lookup[i].hash = hash;
+    t->vocab_lookup[i].text = malloc((strlen(word) + 1) * sizeof(char));
+    strcpy(t->vocab_lookup[i].text, word);
+    return 0;
+}
+
+static void
+create_vocab_lookup(const uint64_t n_unigrams, const struct arpa *arpa,
+                    struct trie *t)
+{
+    t->vocab_lookup = malloc(n_unigrams * sizeof(struct word));
+    struct arpa_section *unigrams_section = arpa_get_section(arpa, 1);
+    arpa_for_each_section_ngrami(unigrams_section, create_vocab_lookup_action_f,
+                                 t);
+    qsort(t->vocab_lookup, n_unigrams, sizeof(struct word), cmp_words);
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+    struct word *a_entry = (struct word *) a, *b_entry = (struct word *) b;
+    if (a_entry->hash < b_entry->hash) return -1;
+    else if (a_entry->hash > b_entry->hash) return 1;
+    else return 0;
+}
+
+static int populate_ngrams_action_f(char *line, uint64_t i, void *arg)
+{
+    if (line[0] == '\n')
+        return 1;
+    void **args = arg;
+    int n = *(int *) args[0];
+    struct trie *t = (struct trie *) args[1];
+    struct array_tmp_record tmp = { 0 };
+    parse_ngram_definition(line, n, t, &tmp);
+    set_array_tmp_record(t, n, i, &tmp);
+    progress_bar("Reading ARPA", i, t->n_ngrams[n - 1]);
+    return 0;
+}
+
+static void populate_ngrams(int order, const struct arpa *arpa, struct trie *t)
+{
+    populate_unigrams(arpa, t);
+    for (int n = 2; n <= order; n++) {
+        log_info("Populating %d-grams", n);
+
+        t->arrays[n - 1] = array_new(get_array_tmp_record_size(t, n),
+                                     t->n_ngrams[n - 1] + 1);
+        log_info("Array allocated");
+
+        char section_tile[24];
+        snprintf(section_tile, 24, "\\%d-grams:\n", n);
+        void *args[] = { &n, t };
+        struct arpa_section *arpa_section = arpa_get_section(arpa, n);
+        uint64_t i = arpa_for_each_section_linei(arpa_section,
+                                                 populate_ngrams_action_f,
+                                                 args);
+        struct array_tmp_record dummy = {
+                .word_id = t->n_ngrams[0],
+                .context_id = t->n_ngrams[n - 2]
+        };
+        set_array_tmp_record(t, n, i, &dummy);
+
+        log_info("Sorting... This might take a while...");
+        unsigned int tmp_sizes[4];
+        get_array_tmp_record_field_sizes(t, n, tmp_sizes);
+        array_sort_r(t->arrays[n - 1], cmp_array_tmp_records,
+                     (void *) tmp_sizes);
+
+        fill_in_array_record_indexes(t, n - 1);
+    }
+    reduce_last_order_array(t);
+}
+
+static int
+populate_unigrams_action_f(struct arpa_ngram *ngram, uint64_t i, void *arg)
 {
-    struct unigram {
-        float probability;
-        uint64_t index;
-    } unigram;
     char *word = ngram->words[0];
     struct trie *t = arg;
 
     word_id_type id = trie_get_word_id_from_text(t, word);
-    unigram.probability = ngram->probability;
-    unigram.index = 0;
-    array_set(t->arrays[0], id, &unigram);
+    struct array_record unigram = {
+            .probability = ngram->probability,
+            .backoff = ngram->backoff,
+            .word_id = id,
+            .first_child_index = 0
+    };
+    set_array_record(t, 1, id, &unigram);
     progress_bar("Reading ARPA", i, t->n_ngrams[0]);
     return 0;
 }
@@ -342,45 +1377,54 @@ static void reduce_last_order_array(struct trie *t)
                                   t->n_ngrams[n - 1]);
     for (unsigned int i = 0; i < t->n_ngrams[n - 1]; i++) {
         t->arrays[n - 1] = old;
-        struct array_tmp_record ngram = get_array_tmp_record(t, n, i);
+        struct array_tmp_record tmp_ngram = get_array_tmp_record(t, n, i);
+        struct array_record ngram = {
+                .probability = tmp_ngram.probability,
+                .word_id = tmp_ngram.word_id
+        };
         t->arrays[n - 1] = new;
-        set_array_record(t, n, i, (struct array_record *) &ngram);
+        set_array_record(t, n, i, &ngram);
         progress_bar("Reducing N-gram array", i, t->n_ngrams[n - 1]);
     }
     array_delete(old);
 }
 
+/**
+ * Set the first child index of each (n-1)-gram, where \p n is its order, to
+ * the index of the first n-gram of its context or of a later one, so that
+ * the (n-1)-grams without children, the first and last ones included, have
+ * empty children ranges.
+ */
 static void fill_in_array_record_indexes(const struct trie *t, int n)
 {
     n++;
-    struct array_record dummy = get_array_record(t, n - 1, t->n_ngrams[n - 2]);
-    dummy.first_child_index = t->n_ngrams[n - 1];
-    set_array_record(t, n - 1, t->n_ngrams[n - 2], &dummy);
-
-    uint64_t context_id = get_array_tmp_record(t, n, 0).context_id;
-    struct array_record parent_ngram = get_array_record(t, n - 1, context_id);
-    parent_ngram.first_child_index = 0;
-    set_array_record(t, n - 1, context_id, &parent_ngram);
-    for (unsigned int i = 0; i < t->n_ngrams[n - 1]; i++) {
-        while (context_id < get_array_tmp_record(t, n, i).context_id) {
-            context_id++;
-            parent_ngram = get_array_record(t, n - 1, context_id);
-            parent_ngram.first_child_index = i;
-            set_array_record(t, n - 1, context_id, &parent_ngram);
-        }
-        progress_bar("Filling in the indexes", i, t->n_ngrams[n - 1]);
+    uint64_t i = 0;
+    // up to the dummy (n-1)-gram, whose index is the number of n-grams
+    for (uint64_t context_id = 0; context_id <= t->n_ngrams[n - 2];
+         context_id++) {
+        while (i < t->n_ngrams[n - 1] &&
+               get_array_tmp_record(t, n, i).context_id < context_id)
+            i++;
+        struct array_record parent_ngram = get_array_record(t, n - 1,
+                                                            context_id);
+        parent_ngram.first_child_index = i;
+        set_array_record(t, n - 1, context_id, &parent_ngram);
+        if (context_id < t->n_ngrams[n - 2])
+            progress_bar("Filling in the indexes", context_id,
+                         t->n_ngrams[n - 2]);
     }
 }
 
 static int cmp_array_tmp_records(void *a, void *b, void *arg)
 {
-    struct array_tmp_record tmp;
-    const unsigned int *sizes = (const unsigned int *) arg;
-    void *dest[] = { &tmp.probability, &tmp.word_id, &tmp.context_id };
-    elem_extract(a, dest, sizes, 3);
+    struct array_tmp_record tmp = { 0 };
+    void *dest[4];
+    unsigned int sizes[4];
+    unsigned int n_fields = get_array_tmp_record_fields(arg, &tmp, dest, sizes);
+    elem_extract(a, dest, sizes, n_fields);
     uint64_t a_context_id = tmp.context_id;
     word_id_type a_id = tmp.word_id;
-    elem_extract(b, dest, sizes, 3);
+    elem_extract(b, dest, sizes, n_fields);
     uint64_t b_context_id = tmp.context_id;
     word_id_type b_id = tmp.word_id;
     if (a_context_id < b_context_id) return -1;
@@ -410,27 +1454,68 @@ parse_ngram_definition(const char *line, const int n, const struct trie *trie,
 
         ids[i] = trie_get_word_id_from_text(trie, word);
     }
+    // a missing backoff means a backoff of 0
+    if (n == trie->order ||
+        sscanf(line, "%f", &tmp_ngram->backoff) != 1)
+        tmp_ngram->backoff = 0;
     tmp_ngram->context_id = get_context_id(trie, ids, n - 1);
     tmp_ngram->word_id = ids[n - 1];
 }
 
 word_id_type
 trie_get_word_id_from_text(const struct trie *t, const char *word_text)
+{
+    word_id_type id = find_word_id(t, word_text);
+    count_word(t, word_text, id);
+    return id;
+}
+
+/**
+ * Count the word \p word_text of id \p id in the metrics of \p t, if it
+ * collects them. An unknown word is logged, unless another one was logged
+ * less than UNKNOWN_WORD_LOG_INTERVAL ago, so that a stream of them does not
+ * slow the queries down.
+ */
+static void count_word(const struct trie *t, const char *word_text,
+                       word_id_type id)
+{
+    count_metric(t, METRICS_WORDS, 1);
+    if (!is_unknown_wid(t, id))
+        return;
+    count_metric(t, METRICS_OOV_WORDS, 1);
+    const uint64_t now = metrics_now();
+    uint64_t next = atomic_load_explicit(&next_unknown_word_log,
+                                         memory_order_relaxed);
+    if (now < next || !atomic_compare_exchange_strong_explicit(
+            &next_unknown_word_log, &next, now + UNKNOWN_WORD_LOG_INTERVAL,
+            memory_order_relaxed, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&unknown_words_not_logged, 1,
+                                  memory_order_relaxed);
+        return;
+    }
+    const uint64_t not_logged = atomic_exchange_explicit(
+            &unknown_words_not_logged, 0, memory_order_relaxed);
+    log_warn("'%s' text is not listed in the vocabulary lookup (%" PRIu64
+             " other unknown words since the last warning)", word_text,
+             not_logged);
+}
+
+/**
+ * Same as trie_get_word_id_from_text(), but without warning about unknown
+ * words.
+ */
+static word_id_type find_word_id(const struct trie *t, const char *word_text)
 {
     uint64_t out[2];
     murmurhash3(word_text, strlen(word_text), out);
     word_hash_type hash = out[0]; // qhashmurmur3_32(word_text, strlen
     // (word_text));
     struct word key = { hash, (char *) word_text };
-    void *idx = bsearch(&key, t->vocab_lookup, t->n_ngrams[0],
-                        sizeof(struct word), cmp_words);
-    word_id_type id =
-            ((intptr_t) idx - (intptr_t) t->vocab_lookup) / sizeof(struct word);
-    if (is_unknown_wid(t, id)) {
-        log_warn("'%s' text is not listed in the vocabulary lookup", word_text);
+    const struct word *idx = bsearch(&key, t->vocab_lookup, t->n_ngrams[0],
+                                     sizeof(struct word), cmp_words);
+    if (idx == NULL)
         return -1;
-    }
-    return id;
+    return idx - t->vocab_lookup;
 }
 
 static inline int is_unknown_wid(const struct trie *t, word_id_type id)
@@ -438,7 +1523,7 @@ static inline int is_unknown_wid(const struct trie *t, word_id_type id)
     return id >= t->n_ngrams[0];
 }
 
-static void
+void
 trie_get_word_ids(const struct trie *t, const char **word_text, unsigned int n,
                   word_id_type *dest)
 {
@@ -449,58 +1534,87 @@ trie_get_word_ids(const struct trie *t, const char **word_text, unsigned int n,
 static void set_array_record(const struct trie *t, int n, uint64_t at,
                              struct array_record *ngram)
 {
-    uint8_t tmp[t->arrays[n - 1]->elem_size / 8 + 1];
-    unsigned int sizes[3];
-    get_array_record_field_sizes(t, n, sizes);
-    if (n == 1) {
-        void *elems[] = { &ngram->probability, &ngram->first_child_index };
-        elems_compact(elems, tmp, sizes, 2);
-    } else if (n < t->order) {
-        void *elems[] = { &ngram->probability, &ngram->word_id,
-                          &ngram->first_child_index };
-        elems_compact(elems, tmp, sizes, 3);
-    } else {
-        void *elems[] = { &ngram->probability, &ngram->word_id };
-        elems_compact(elems, tmp, sizes, 2);
+    const struct record_layout *layout = &t->layouts[n - 1];
+    const struct array *a = t->arrays[n - 1];
+    const uint64_t bit = at * a->elem_size;
+    uint32_t probability;
+    memcpy(&probability, &ngram->probability, sizeof(float));
+    bits_set(a->elems, bit + layout->probability_offset,
+             layout->probability_size, probability);
+    if (layout->backoff_size > 0) {
+        uint32_t backoff;
+        memcpy(&backoff, &ngram->backoff, sizeof(float));
+        bits_set(a->elems, bit + layout->backoff_offset, layout->backoff_size,
+                 backoff);
     }
-    array_set(t->arrays[n - 1], at, tmp);
+    if (layout->word_id_size > 0)
+        bits_set(a->elems, bit + layout->word_id_offset, layout->word_id_size,
+                 ngram->word_id);
+    if (layout->first_child_index_size > 0)
+        bits_set(a->elems, bit + layout->first_child_index_offset,
+                 layout->first_child_index_size, ngram->first_child_index);
 }
 
-static struct array_record
+static inline struct array_record
 get_array_record(const struct trie *t, int n, uint64_t at)
 {
-    struct array_record ngram = { 0, 0, 0 };
-    unsigned int sizes[3];
-    get_array_record_field_sizes(t, n, sizes);
-    if (n == 1) {
-        void *dest[] = { &ngram.probability, &ngram.first_child_index };
-        array_get_extracted(t->arrays[n - 1], at, dest, sizes, 2);
-        ngram.word_id = at;
-    } else if (n < t->order) {
-        void *dest[] = { &ngram.probability, &ngram.word_id,
-                         &ngram.first_child_index };
-        array_get_extracted(t->arrays[n - 1], at, dest, sizes, 3);
-    } else {
-        void *dest[] = { &ngram.probability, &ngram.word_id };
-        array_get_extracted(t->arrays[n - 1], at, dest, sizes, 2);
-    }
+    const struct record_layout *layout = &t->layouts[n - 1];
+    const struct array *a = t->arrays[n - 1];
+    const uint64_t bit = at * a->elem_size;
+    struct array_record ngram;
+    const uint32_t probability = bits_get(a->elems,
+                                          bit + layout->probability_offset,
+                                          layout->probability_size);
+    memcpy(&ngram.probability, &probability, sizeof(float));
+    const uint32_t backoff = (layout->backoff_size > 0) ?
+                             bits_get(a->elems, bit + layout->backoff_offset,
+                                      layout->backoff_size) : 0;
+    memcpy(&ngram.backoff, &backoff, sizeof(float));
+    ngram.word_id = (layout->word_id_size > 0) ?
+                    bits_get(a->elems, bit + layout->word_id_offset,
+                             layout->word_id_size) : at;
+    ngram.first_child_index = (layout->first_child_index_size > 0) ?
+                              bits_get(a->elems,
+                                       bit + layout->first_child_index_offset,
+                                       layout->first_child_index_size) : 0;
     return ngram;
 }
 
+/**
+ * Decode the probabilities and the word ids of the \p n-grams in [\p l, \p r)
+ * into the \p probabilities and \p word_ids columns.
+ * @warning [\p l, \p r) cannot have more than DECODE_CHUNK_SIZE records.
+ */
+static void get_array_records_columns(const struct trie *t, int n, uint64_t l,
+                                      uint64_t r, float *probabilities,
+                                      word_id_type *word_ids)
+{
+    const struct record_layout *layout = &t->layouts[n - 1];
+    const struct array *a = t->arrays[n - 1];
+    uint32_t probability_bits[DECODE_CHUNK_SIZE];
+    array_unpack_field(a, l, r, layout->probability_offset,
+                       layout->probability_size, probability_bits,
+                       sizeof(uint32_t));
+    memcpy(probabilities, probability_bits, (r - l) * sizeof(float));
+    if (layout->word_id_size == 0) {
+        for (uint64_t i = l; i < r; i++)
+            word_ids[i - l] = i;
+        return;
+    }
+    array_unpack_field(a, l, r, layout->word_id_offset, layout->word_id_size,
+                       word_ids, sizeof(word_id_type));
+}
+
 static struct array_tmp_record
 get_array_tmp_record(const struct trie *t, int n, uint64_t at)
 {
-    struct array_tmp_record ngram = { 0, 0, 0 };
-    unsigned int sizes[3];
-    get_array_tmp_record_field_sizes(t, n, sizes);
-    if (n == 1) {
-        void *dest[] = { &ngram.probability, &ngram.context_id };
-        array_get_extracted(t->arrays[n - 1], at, dest, sizes, 2);
-    } else {
-        void *dest[] = { &ngram.probability, &ngram.word_id,
-                         &ngram.context_id };
-        array_get_extracted(t->arrays[n - 1], at, dest, sizes, 3);
-    }
+    struct array_tmp_record ngram = { 0 };
+    unsigned int field_sizes[4], sizes[4];
+    void *dest[4];
+    get_array_tmp_record_field_sizes(t, n, field_sizes);
+    unsigned int n_fields = get_array_tmp_record_fields(field_sizes, &ngram,
+                                                        dest, sizes);
+    array_get_extracted(t->arrays[n - 1], at, dest, sizes, n_fields);
     return ngram;
 }
 
@@ -508,164 +1622,452 @@ static void set_array_tmp_record(const struct trie *t, int n, uint64_t at,
                                  struct array_tmp_record *tmp_record)
 {
     uint8_t tmp[t->arrays[n - 1]->elem_size / 8 + 1];
-    unsigned int sizes[3];
-    get_array_tmp_record_field_sizes(t, n, sizes);
-    if (n == 1) {
-        void *elems[] = { &tmp_record->probability, &tmp_record->context_id };
-        elems_compact(elems, tmp, sizes, 2);
-    } else {
-        void *elems[] = { &tmp_record->probability, &tmp_record->word_id,
-                          &tmp_record->context_id };
-        elems_compact(elems, tmp, sizes, 3);
-    }
+    unsigned int field_sizes[4], sizes[4];
+    void *elems[4];
+    get_array_tmp_record_field_sizes(t, n, field_sizes);
+    unsigned int n_fields = get_array_tmp_record_fields(field_sizes,
+                                                        tmp_record, elems,
+                                                        sizes);
+    elems_compact(elems, tmp, sizes, n_fields);
     array_set(t->arrays[n - 1], at, tmp);
 }
 
-static int cmp_array_records(void *a, void *b, void *arg)
+int trie_cache_hot_contexts(struct trie *t, size_t budget, unsigned short k)
 {
-    struct array_record tmp;
-    const unsigned int *sizes = (const unsigned int *) arg;
-    void *dest[] = { &tmp.probability, &tmp.word_id, &tmp.first_child_index };
-    elem_extract(a, dest, sizes, 3);
-    word_id_type a_id = tmp.word_id;
-    elem_extract(b, dest, sizes, 3);
-    word_id_type b_id = tmp.word_id;
-    if (a_id < b_id) return -1;
-    else if (a_id > b_id) return 1;
-    else return 0;
-}
+    if (t->hot_cache != NULL) {
+        hot_cache_delete(t->hot_cache);
+        t->hot_cache = NULL;
+    }
+    if (budget == 0)
+        return 0;
 
-static unsigned short
-map_trie_path(const struct trie *t, const word_id_type *word_ids,
-              unsigned short path_len,
-              void (*f)(struct array_record *ar, uint64_t ar_index,
-                        unsigned short trie_level, void *arg), void *arg)
-{
-    unsigned short n = 1;
-    uint64_t index = word_ids[0];
-    struct array_record ar = get_array_record(t, 1, index);
-    ar.word_id = index;
-    f(&ar, index, 1, arg);
-    for (; n < path_len; n++) {
-        struct array_record adjacent_ar = get_array_record(t, n, index + 1);
-        uint64_t left_index = ar.first_child_index;
-        uint64_t right_index = adjacent_ar.first_child_index;
-        unsigned int sizes[3];
-        get_array_record_field_sizes(t, n + 1, sizes);
-        struct array_record key = { 0, word_ids[n], 0 };
-        if (array_bsearch_r_within(&key, t->arrays[n], cmp_array_records,
-                                   (void *) sizes, left_index, right_index,
-                                   &index) != 0) {
-            break;
-        }
-        ar = get_array_record(t, n + 1, index);
-        f(&ar, index, n + 1, arg);
+    t->hot_cache = hot_cache_new(budget, k);
+    if (t->hot_cache == NULL) {
+        log_warn("A budget of %zu bytes is too small for a hot cache of the "
+                 "top %hu predictions", budget, k);
+        return 1;
     }
-    return n;
+    return 0;
 }
 
-static void get_context_id_f(struct array_record *ar, uint64_t ar_index,
-                             unsigned short trie_level, void *arg)
+int trie_get_hot_cache_stats(const struct trie *t,
+                             struct hot_cache_stats *stats)
 {
-    uint64_t *indexes = arg;
-    indexes[trie_level - 1] = ar_index;
+    if (t->hot_cache == NULL)
+        return 1;
+    hot_cache_get_stats(t->hot_cache, stats);
+    return 0;
 }
 
-static uint64_t
-get_context_id(const struct trie *t, const word_id_type *context_words_ids,
-               int context_len)
+int trie_cache_queries(struct trie *t, size_t budget, unsigned int n_shards)
 {
-    uint64_t indexes[context_len];
-    unsigned short n;
-    if ((n = map_trie_path(t, context_words_ids, context_len, get_context_id_f,
-                           indexes)) != context_len) {
-        log_error("Trie path could only reach %d nodes", n);
-        exit(EXIT_FAILURE);
+    if (t->query_cache != NULL) {
+        query_cache_delete(t->query_cache);
+        t->query_cache = NULL;
     }
-    return indexes[context_len - 1];
+    if (budget == 0)
+        return 0;
+
+    if (n_shards == 0)
+        n_shards = DEFAULT_QUERY_CACHE_SHARDS;
+    t->query_cache = query_cache_new(budget, n_shards);
+    if (t->query_cache == NULL) {
+        log_warn("A budget of %zu bytes is too small for a query cache of %u "
+                 "shards", budget, n_shards);
+        return 1;
+    }
+    return 0;
 }
 
-static void trie_query_ngram_f(struct array_record *ar, uint64_t ar_index,
+unsigned int
+trie_get_query_cache_stats(const struct trie *t,
+                           struct query_cache_stats *stats, unsigned int n)
+{
+    if (t->query_cache == NULL)
+        return 0;
+    const unsigned int n_shards = query_cache_n_shards(t->query_cache);
+    if (n >= n_shards) {
+        query_cache_get_stats(t->query_cache, stats);
+    } else {
+        struct query_cache_stats *all = malloc(n_shards * sizeof(*all));
+        query_cache_get_stats(t->query_cache, all);
+        memcpy(stats, all, n * sizeof(*all));
+        free(all);
+    }
+    return n_shards;
+}
+
+int trie_collect_metrics(struct trie *t, int enable, unsigned int n_shards)
+{
+    if (t->metrics != NULL) {
+        metrics_delete(t->metrics);
+        t->metrics = NULL;
+    }
+    if (!enable)
+        return 0;
+
+    if (n_shards == 0)
+        n_shards = DEFAULT_METRICS_SHARDS;
+    t->metrics = metrics_new(n_shards);
+    if (t->metrics == NULL) {
+        log_warn("The metrics of %u shards could not be allocated", n_shards);
+        return 1;
+    }
+    return 0;
+}
+
+int trie_metrics_snapshot(const struct trie *t,
+                          struct metrics_snapshot *snapshot)
+{
+    if (t->metrics == NULL)
+        return 1;
+    metrics_snapshot(t->metrics, snapshot);
+    return 0;
+}
+
+static inline uint64_t start_latency(const struct trie *t)
+{
+    return (t->metrics != NULL) ? metrics_now() : 0;
+}
+
+static inline void record_latency(const struct trie *t,
+                                  enum metrics_histogram h, uint64_t start)
+{
+    if (t->metrics != NULL)
+        metrics_record_latency(t->metrics, h, start);
+}
+
+static inline void
+count_metric(const struct trie *t, enum metrics_counter c, uint64_t n)
+{
+    if (t->metrics != NULL)
+        metrics_count(t->metrics, c, n);
+}
+
+static inline void
+record_metric(const struct trie *t, enum metrics_histogram h, uint64_t value)
+{
+    if (t->metrics != NULL)
+        metrics_record(t->metrics, h, value);
+}
+
+void trie_index_large_ranges(struct trie *t, uint64_t min_fanout)
+{
+    if (t->large_ranges != NULL) {
+        large_ranges_delete(t->large_ranges, t->order);
+        t->large_ranges = NULL;
+    }
+    if (min_fanout == 0)
+        return;
+
+    struct large_ranges *lr = malloc(sizeof(struct large_ranges));
+    lr->min_fanout = min_fanout;
+    lr->len = calloc(t->order, sizeof(uint64_t));
+    lr->parents = calloc(t->order, sizeof(uint64_t *));
+    lr->layouts = calloc(t->order, sizeof(struct eytzinger **));
+    for (int n = 1; n < t->order; n++) {
+        uint64_t max_len = t->n_ngrams[n] / min_fanout;
+        lr->parents[n - 1] = malloc(max_len * sizeof(uint64_t));
+        lr->layouts[n - 1] = malloc(max_len * sizeof(struct eytzinger *));
+        uint64_t right = get_array_record(t, n, 0).first_child_index;
+        for (uint64_t i = 0; i < t->n_ngrams[n - 1]; i++) {
+            uint64_t left = right;
+            right = get_array_record(t, n, i + 1).first_child_index;
+            if (right < left || right - left < min_fanout)
+                continue;
+            word_id_type *ids = malloc((right - left) * sizeof(word_id_type));
+            for (uint64_t j = left; j < right; j++)
+                ids[j - left] = get_array_record(t, n + 1, j).word_id;
+            uint64_t m = lr->len[n - 1]++;
+            lr->parents[n - 1][m] = i;
+            lr->layouts[n - 1][m] = eytzinger_new(ids, right - left);
+            free(ids);
+        }
+        log_debug("%lu %d-gram sibling ranges indexed", lr->len[n - 1], n + 1);
+    }
+    t->large_ranges = lr;
+}
+
+static void large_ranges_delete(struct large_ranges *lr, unsigned short order)
+{
+    for (int n = 1; n < order; n++) {
+        for (uint64_t i = 0; i < lr->len[n - 1]; i++)
+            eytzinger_delete(lr->layouts[n - 1][i]);
+        free(lr->parents[n - 1]);
+        free(lr->layouts[n - 1]);
+    }
+    free(lr->len);
+    free(lr->parents);
+    free(lr->layouts);
+    free(lr);
+}
+
+/**
+ * @return the Eytzinger layout of the children of the \p parent_index-th
+ * \p n-gram, or NULL if they are not indexed. The sorted parent indexes are
+ * searched inline, since bsearch() would call its comparison function at
+ * every step of every child search.
+ */
+static inline const struct eytzinger *
+get_large_range_layout(const struct trie *t, int n, uint64_t parent_index)
+{
+    const struct large_ranges *lr = t->large_ranges;
+    const uint64_t *parents = lr->parents[n - 1];
+    uint64_t l = 0, r = lr->len[n - 1];
+    while (l < r) {
+        const uint64_t m = l + (r - l) / 2;
+        if (parents[m] < parent_index)
+            l = m + 1;
+        else
+            r = m;
+    }
+    if (l == lr->len[n - 1] || parents[l] != parent_index)
+        return NULL;
+    return lr->layouts[n - 1][l];
+}
+
+/**
+ * Search the children of the \p parent_index-th \p n-gram, which are in
+ * [\p left, \p right) of the (n + 1)-grams array, for \p word_id.
+ */
+static inline int8_t
+find_child(const struct trie *t, int n, uint64_t parent_index, uint64_t left,
+           uint64_t right, word_id_type word_id, uint64_t *index)
+{
+    record_metric(t, METRICS_SEARCHED_RANGES, right - left);
+    if (t->large_ranges != NULL && right > left &&
+        right - left >= t->large_ranges->min_fanout) {
+        const struct eytzinger *e = get_large_range_layout(t, n, parent_index);
+        if (e != NULL) {
+            uint32_t rank;
+            if (eytzinger_search(e, word_id, &rank) != 0)
+                return -1;
+            *index = left + rank;
+            return 0;
+        }
+    }
+    const struct record_layout *layout = &t->layouts[n];
+    return array_isearch_within(word_id, t->arrays[n], layout->word_id_offset,
+                                layout->word_id_size, left, right, index);
+}
+
+/**
+ * Walk the trie path defined by \p word_ids, calling \p f for each node
+ * visited. It is always inlined, so that \p f, which is always known at
+ * compile time, gets inlined too.
+ * @return the number of nodes visited.
+ */
+static inline __attribute__((always_inline)) unsigned short
+map_trie_path(const struct trie *t, const word_id_type *word_ids,
+              unsigned short path_len,
+              void (*f)(struct array_record *ar, uint64_t ar_index,
+                        unsigned short trie_level, void *arg), void *arg)
+{
+    unsigned short n = 1;
+    uint64_t index = word_ids[0];
+    struct array_record ar = get_array_record(t, 1, index);
+    ar.word_id = index;
+    f(&ar, index, 1, arg);
+    for (; n < path_len; n++) {
+        struct array_record adjacent_ar = get_array_record(t, n, index + 1);
+        uint64_t left_index = ar.first_child_index;
+        uint64_t right_index = adjacent_ar.first_child_index;
+        if (find_child(t, n, index, left_index, right_index, word_ids[n],
+                       &index) != 0) {
+            break;
+        }
+        ar = get_array_record(t, n + 1, index);
+        f(&ar, index, n + 1, arg);
+    }
+    return n;
+}
+
+static void get_context_id_f(struct array_record *ar, uint64_t ar_index,
+                             unsigned short trie_level, void *arg)
+{
+    uint64_t *indexes = arg;
+    indexes[trie_level - 1] = ar_index;
+}
+
+static uint64_t
+get_context_id(const struct trie *t, const word_id_type *context_words_ids,
+               int context_len)
+{
+    uint64_t indexes[context_len];
+    unsigned short n;
+    if ((n = map_trie_path(t, context_words_ids, context_len, get_context_id_f,
+                           indexes)) != context_len) {
+        log_error("Trie path could only reach %d nodes", n);
+        exit(EXIT_FAILURE);
+    }
+    return indexes[context_len - 1];
+}
+
+static void trie_query_ngram_f(struct array_record *ar, uint64_t ar_index,
                                unsigned short trie_level, void *arg)
 {
-    void **args = arg;
-    struct trie *t = args[0];
-    struct ngram **ngrams = args[1];
-    struct ngram *ngram = ngrams[trie_level - 1];
-    ngram->probability = ar->probability;
-    ngram->backoff = -1.0f;
-    ngram->word = &t->vocab_lookup[ar->word_id];
+    struct gram *grams = arg;
+    grams[trie_level - 1].word_id = ar->word_id;
+    grams[trie_level - 1].probability = ar->probability;
+    grams[trie_level - 1].backoff = ar->backoff;
 }
 
 struct ngram *trie_query_ngram(const struct trie *t, char const **words, int *n)
 {
-    word_id_type ids[*n];
-    for (int i = 0; i < *n; i++) {
-        ids[i] = trie_get_word_id_from_text(t, words[i]);
-    }
-    struct ngram *ngrams[*n];
-    for (int i = 0; i < *n; i++) {
-        ngrams[i] = ngram_new_empty_unigram();
-        if (i > 0)
-            ngrams[i]->context = ngrams[i - 1];
+    const struct scratch_mark mark = scratch_mark();
+    struct gram *grams = scratch_alloc(*n * sizeof(struct gram));
+    *n = trie_query_ngram_grams(t, words, *n, grams);
+    struct ngram *ngram = NULL;
+    for (int i = 0; i < *n; i++)
+        ngram = ngram_new_with_context(&t->vocab_lookup[grams[i].word_id],
+                                       grams[i].probability, grams[i].backoff,
+                                       ngram);
+    scratch_release(mark);
+    return ngram;
+}
+
+int trie_query_ngram_grams(const struct trie *t, char const **words, int n,
+                           struct gram *grams)
+{
+    const uint64_t start_time = start_latency(t);
+    word_id_type key[n + 1];
+    word_id_type *ids = &key[1];
+    trie_get_word_ids(t, words, n, ids);
+    struct query_cache *cache = t->query_cache;
+    const size_t key_size = (n + 1) * sizeof(word_id_type);
+    if (cache != NULL) {
+        key[0] = QUERY_NGRAM;
+        size_t size = n * sizeof(struct gram);
+        if (query_cache_get(cache, key, key_size, grams, &size) == 0) {
+            record_latency(t, METRICS_QUERY_NGRAM, start_time);
+            return size / sizeof(struct gram);
+        }
     }
-    void *args[] = { (void *) t, (void *) ngrams };
-    int ids_start = 0;
-    while (map_trie_path(t, &ids[ids_start], *n, trie_query_ngram_f, args) <
-           *n) {
-        ids_start++;
-        args[1] = &ngrams[ids_start];
-        *n = *n - 1;
+    // the n-grams ending at the last word that contain an unknown word are
+    // not in the trie
+    int start = n;
+    while (start > 0 && !is_unknown_wid(t, ids[start - 1]))
+        start--;
+    if (start < n) {
+        while (map_trie_path(t, &ids[start], n - start, trie_query_ngram_f,
+                             grams) < n - start)
+            start++;
+        if (cache != NULL)
+            query_cache_put(cache, key, key_size, grams,
+                            (n - start) * sizeof(struct gram));
     }
+    record_latency(t, METRICS_QUERY_NGRAM, start_time);
+    return n - start;
+}
 
-    for (int i = 0; i < ids_start; i++)
-        ngram_delete(ngrams[i]);
-    ngrams[ids_start]->context = NULL;
-    return ngrams[ids_start + *n - 1];
+uint64_t trie_get_children(const struct trie *t, const word_id_type *context,
+                           int n, word_id_type *ids, float *probabilities)
+{
+    uint64_t l = 0, r = t->n_ngrams[0];
+    if (n > 0) {
+        uint64_t node;
+        for (int i = 0; i < n; i++)
+            if (is_unknown_wid(t, context[i]))
+                return 0;
+        // the n-grams of the highest order have no children
+        if (n >= t->order ||
+            map_trie_path(t, context, n, trie_get_nwp_f, &node) != n)
+            return 0;
+        l = get_array_record(t, n, node).first_child_index;
+        r = get_array_record(t, n, node + 1).first_child_index;
+    }
+    if (ids == NULL)
+        return r - l;
+    for (uint64_t cl = l; cl < r; cl += DECODE_CHUNK_SIZE) {
+        const uint64_t cr = (r - cl < DECODE_CHUNK_SIZE) ? r :
+                            cl + DECODE_CHUNK_SIZE;
+        get_array_records_columns(t, n + 1, cl, cr, &probabilities[cl - l],
+                                  &ids[cl - l]);
+    }
+    return r - l;
 }
 
 static unsigned long get_array_record_size(const struct trie *t, int n)
 {
-    if (n == 1)
-        return 8 * (sizeof(float)) + ceil_log2(t->n_ngrams[n] + 1);
-    if (n == t->order)
-        return 8 * sizeof(float) + ceil_log2(t->n_ngrams[0]);
-    return 8 * (sizeof(float)) + ceil_log2(t->n_ngrams[0]) +
-           ceil_log2(t->n_ngrams[n] + 1);
+    const struct record_layout *layout = &t->layouts[n - 1];
+    return layout->first_child_index_offset + layout->first_child_index_size;
 }
 
 static unsigned long get_array_tmp_record_size(const struct trie *t, int n)
 {
-    if (n == 1)
-        return 8 * (sizeof(float)) + ceil_log2(t->n_ngrams[n] + 1);
-    if (n == t->order)
-        return 8 * (sizeof(float)) + ceil_log2(t->n_ngrams[0]) +
-               ceil_log2(t->n_ngrams[n - 2] + 1);
-    return 8 * (sizeof(float)) + ceil_log2(t->n_ngrams[0]) +
-           ceil_log2(t->n_ngrams[n] + 1);
+    unsigned int sizes[4];
+    get_array_tmp_record_field_sizes(t, n, sizes);
+    return sizes[0] + sizes[1] + sizes[2] + sizes[3];
 }
 
-static void
-get_array_record_field_sizes(const struct trie *t, int n, unsigned int *dest)
+static void set_record_layouts(struct trie *t)
 {
-    dest[0] = 8 * sizeof(float);
-    dest[1] = (n == 1) ? ceil_log2(t->n_ngrams[n] + 1) :
-              ceil_log2(t->n_ngrams[0]);
-    if (n != 1 && n != t->order)
-        dest[2] = ceil_log2(t->n_ngrams[n] + 1);
-    else
-        dest[2] = 0;
+    t->layouts = malloc(t->order * sizeof(struct record_layout));
+    for (int n = 1; n <= t->order; n++) {
+        struct record_layout *layout = &t->layouts[n - 1];
+        layout->probability_offset = 0;
+        layout->probability_size = 8 * sizeof(float);
+        layout->backoff_offset = layout->probability_size;
+        layout->backoff_size = (n == t->order) ? 0 : 8 * sizeof(float);
+        layout->word_id_offset = layout->backoff_offset + layout->backoff_size;
+        layout->word_id_size = (n == 1) ? 0 : ceil_log2(t->n_ngrams[0]);
+        layout->first_child_index_offset = layout->word_id_offset +
+                                           layout->word_id_size;
+        layout->first_child_index_size = get_first_child_index_size(t, n);
+    }
+}
+
+/**
+ * The first child indexes of the \p n-grams, where n is not the order of
+ * \p t, take the place of their context ids while they are built, so they
+ * are as large as either.
+ */
+static unsigned int get_first_child_index_size(const struct trie *t, int n)
+{
+    if (n == t->order)
+        return 0;
+    uint64_t max = t->n_ngrams[n];
+    if (n > 1 && t->n_ngrams[n - 2] > max)
+        max = t->n_ngrams[n - 2];
+    return ceil_log2(max + 1);
 }
 
+/**
+ * Get the sizes of the probability, backoff, word id and context id fields of
+ * the temporary records of the \p n-grams, where n > 1. Their context id
+ * takes the place of the first child index of the final records.
+ */
 static void get_array_tmp_record_field_sizes(const struct trie *t, int n,
                                              unsigned int *dest)
 {
     dest[0] = 8 * sizeof(float);
-    dest[1] = (n == 1) ? ceil_log2(t->n_ngrams[n] + 1) : ceil_log2
-    (t->n_ngrams[0]);
-    if (n != 1)
-        dest[2] = (n == t->order) ? ceil_log2(t->n_ngrams[n - 2] + 1) :
-                  ceil_log2(t->n_ngrams[n] + 1);
+    dest[1] = (n == t->order) ? 0 : 8 * sizeof(float);
+    dest[2] = ceil_log2(t->n_ngrams[0]);
+    dest[3] = (n == t->order) ? ceil_log2(t->n_ngrams[n - 2] + 1) :
+              get_first_child_index_size(t, n);
+}
+
+/**
+ * Fill in \p dest with the fields of \p tmp_record that are stored, given
+ * the \p field_sizes of get_array_tmp_record_field_sizes(), and \p sizes
+ * with their sizes.
+ * @return the number of fields stored.
+ */
+static unsigned int
+get_array_tmp_record_fields(const unsigned int *field_sizes,
+                            struct array_tmp_record *tmp_record, void **dest,
+                            unsigned int *sizes)
+{
+    void *fields[] = { &tmp_record->probability, &tmp_record->backoff,
+                       &tmp_record->word_id, &tmp_record->context_id };
+    unsigned int n_fields = 0;
+    for (int i = 0; i < 4; i++) {
+        if (field_sizes[i] == 0)
+            continue;
+        dest[n_fields] = fields[i];
+        sizes[n_fields++] = field_sizes[i];
+    }
+    return n_fields;
 }
 
 char *
@@ -700,153 +2102,1680 @@ static void trie_get_nwp_f(struct array_record *ar, uint64_t ar_index,
 
 struct word *trie_get_nwp(const struct trie *t, const char **words, int n)
 {
-    // TODO use trie_get_k_nwp
-    int is_nwp_for_sentence_start = n == 0;
-    uint64_t index;
-    word_id_type ids[n];
-    int ids_start = 0;
+    struct word *nwp;
+    trie_get_k_nwp(t, words, n, 1, &nwp);
+    return nwp;
+}
 
-    if (!is_nwp_for_sentence_start) {
-        trie_get_word_ids(t, words, n, ids);
-        for (int i = 0; i < n; i++)
-            if (is_unknown_wid(t, ids[i]))
-                ids_start = i + 1;
-        n = n - ids_start;
-        is_nwp_for_sentence_start = n == 0;
+/**
+ * Whether prediction \p a ranks below prediction \p b. Ties are broken by the
+ * word id, so that the predictions do not depend on the order in which they
+ * are found.
+ */
+static inline int
+is_worse_prediction(const struct prediction *a, const struct prediction *b)
+{
+    return a->probability < b->probability ||
+           (a->probability == b->probability && a->word_id > b->word_id);
+}
+
+static int cmp_predictions(const void *a, const void *b)
+{
+    return is_worse_prediction(a, b) - is_worse_prediction(b, a);
+}
+
+static void sift_down(struct prediction *heap, unsigned int len,
+                      unsigned int i)
+{
+    const struct prediction p = heap[i];
+    for (unsigned int child; (child = 2 * i + 1) < len; i = child) {
+        if (child + 1 < len && is_worse_prediction(&heap[child + 1],
+                                                   &heap[child]))
+            child++;
+        if (!is_worse_prediction(&heap[child], &p))
+            break;
+        heap[i] = heap[child];
     }
+    heap[i] = p;
+}
 
-    if (!is_nwp_for_sentence_start)
-        while (map_trie_path(t, &ids[ids_start], n, trie_get_nwp_f, &index) <
-               n) {
-            ids_start++;
-            n--;
-        }
-    else {
-        index = trie_get_word_id_from_text(t, "<s>");
-        n = 1;
+static void sift_up(struct prediction *heap, unsigned int i)
+{
+    const struct prediction p = heap[i];
+    for (unsigned int parent; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (!is_worse_prediction(&p, &heap[parent]))
+            break;
+        heap[i] = heap[parent];
+    }
+    heap[i] = p;
+}
+
+/**
+ * Whether \p p would be one of the best predictions found so far.
+ */
+static inline int top_k_admits(const struct top_k *top,
+                               const struct prediction *p)
+{
+    return top->len < top->k || is_worse_prediction(&top->heap[0], p);
+}
+
+/**
+ * Add \p p to the best predictions, replacing the worst one if there are
+ * \p k of them already.
+ * @warning \p p must be admitted by top_k_admits().
+ */
+static void top_k_push(struct top_k *top, struct prediction p)
+{
+    if (top->len < top->k) {
+        top->heap[top->len] = p;
+        sift_up(top->heap, top->len++);
+    } else {
+        top->heap[0] = p;
+        sift_down(top->heap, top->len, 0);
     }
+}
 
-    struct array_record ar = get_array_record(t, n, index);
-    struct array_record adjacent_ar = get_array_record(t, n, index + 1);
-    uint64_t left = ar.first_child_index;
-    uint64_t right = adjacent_ar.first_child_index;
-    struct array_record nwp_record = get_array_record(t, n + 1, left);
-    for (uint64_t i = left + 1; i < right; i++) {
-        struct array_record tmp_nwp_record = get_array_record(t, n + 1, i);
-        if (tmp_nwp_record.probability > nwp_record.probability)
-            nwp_record = tmp_nwp_record;
+/**
+ * Sort the heap from the best to the worst prediction, by moving the worst
+ * one to the end.
+ */
+static void top_k_sort(struct top_k *top)
+{
+    for (unsigned int i = top->len; i > 1; i--) {
+        const struct prediction worst = top->heap[0];
+        top->heap[0] = top->heap[i - 1];
+        top->heap[i - 1] = worst;
+        sift_down(top->heap, i - 1, 0);
     }
-    return &t->vocab_lookup[nwp_record.word_id];
 }
 
-static int k_nwp_f(const void *a, const void *b)
+/**
+ * Whether the word \p word_id follows any of the contexts of \p levels longer
+ * than \p c, in which case its probability is given by the longest of them.
+ */
+static int
+follows_longer_context(const struct trie *t, const struct context_level *levels,
+                       unsigned short n, unsigned short c,
+                       word_id_type word_id)
 {
-    const struct array_record *ra = (struct array_record *) a;
-    const struct array_record *rb = (struct array_record *) b;
-    if (ra->probability > rb->probability)
-        return -1;
-    if (ra->probability < rb->probability)
-        return 1;
+    uint64_t index;
+    for (unsigned short j = c + 1; j <= n; j++)
+        if (find_child(t, j, levels[j].node, levels[j].l, levels[j].r, word_id,
+                       &index) == 0)
+            return 1;
     return 0;
 }
 
-static void get_children_slice(const struct trie *t, const char **words,
-                               unsigned short *n, uint64_t *l, uint64_t *r)
+/**
+ * Whether the word \p word_id is in \p filter, the words in a range of the
+ * lexicon. A NULL \p filter holds every word.
+ */
+static inline int
+is_in_filter(const struct trie *t, const struct lexicon_range *filter,
+             word_id_type word_id)
 {
-    int is_sentence_start = *n == 0;
-    uint64_t index;
-    word_id_type ids[*n];
-    int ids_start = 0;
+    return filter == NULL || (t->lexicon_ranks[word_id] >= filter->l &&
+                              t->lexicon_ranks[word_id] < filter->r);
+}
 
-    if (!is_sentence_start) {
-        trie_get_word_ids(t, words, *n, ids);
-        for (int i = 0; i < *n; i++)
-            if (is_unknown_wid(t, ids[i]))
-                ids_start = i + 1;
-        *n = *n - ids_start;
-        is_sentence_start = *n == 0;
+/**
+ * Offer to \p top the children of the \p c-length context of \p levels that
+ * are in \p filter, with their probabilities weighted by \p backoff, skipping
+ * the ones that follow a longer context. The children are streamed in
+ * DECODE_CHUNK_SIZE chunks.
+ */
+static void
+select_children(const struct trie *t, const struct context_level *levels,
+                unsigned short n, unsigned short c, float backoff,
+                const struct lexicon_range *filter, struct top_k *top)
+{
+    float probabilities[DECODE_CHUNK_SIZE];
+    word_id_type ids[DECODE_CHUNK_SIZE];
+    const uint64_t r = levels[c].r;
+    record_metric(t, METRICS_SCANNED_RANGES, r - levels[c].l);
+    for (uint64_t cl = levels[c].l; cl < r; cl += DECODE_CHUNK_SIZE) {
+        const uint64_t cr = (r - cl < DECODE_CHUNK_SIZE) ? r :
+                            cl + DECODE_CHUNK_SIZE;
+        get_array_records_columns(t, c + 1, cl, cr, probabilities, ids);
+        for (uint64_t i = 0; i < cr - cl; i++) {
+            const struct prediction p = { ids[i], probabilities[i] + backoff };
+            if (top_k_admits(top, &p) && is_in_filter(t, filter, p.word_id) &&
+                !follows_longer_context(t, levels, n, c, p.word_id))
+                top_k_push(top, p);
+        }
     }
+}
 
-    if (!is_sentence_start) {
-        while (map_trie_path(t, &ids[ids_start], *n, trie_get_nwp_f, &index) <
-               *n) {
-            ids_start++;
-            *n = *n - 1;
-        }
-    } else {
-        index = trie_get_word_id_from_text(t, "<s>");
-        *n = 1;
-    }
-
-    struct array_record ar = get_array_record(t, *n, index);
-    struct array_record adjacent_ar = get_array_record(t, *n, index + 1);
-    *l = ar.first_child_index;
-    *r = adjacent_ar.first_child_index;
-}
-
-void trie_get_k_nwp_aux(const struct trie *t, const char **words, int n,
-                        unsigned short k, struct array_record *parent_records,
-                        unsigned int pr_len)
-{
-    uint64_t left, right;
-    unsigned short tmp_n = (unsigned short) n;
-    get_children_slice(t, words, &tmp_n, &left, &right);
-    words = &words[n - tmp_n];
-    n = tmp_n;
-    if (n == 0) n = 1;
-
-    struct array_record records[right - left];
-    unsigned int j = 0, jp = 0;
-    struct array_record r;
-    struct array_record pr = parent_records[0];
-    for (uint64_t i = left; i < right; i++) {
-        r = get_array_record(t, n + 1, i);
-        while (pr.word_id < r.word_id && jp < pr_len)
-            pr = parent_records[jp++];
-        if (pr.word_id == r.word_id)
+/**
+ * Offer to \p top the unigrams that are in \p filter, with their
+ * probabilities weighted by \p backoff, skipping the ones that follow a
+ * context of \p levels. The unigrams are visited from the best to the worst,
+ * so that the first one not admitted ends the search.
+ */
+static void
+select_unigrams(const struct trie *t, const struct context_level *levels,
+                unsigned short n, float backoff,
+                const struct lexicon_range *filter, struct top_k *top)
+{
+    for (uint64_t i = 0; i < t->n_ranked_unigrams; i++) {
+        struct prediction p = t->unigram_ranking[i];
+        if (!is_in_filter(t, filter, p.word_id))
             continue;
-        records[j++] = get_array_record(t, n + 1, i);
+        p.probability += backoff;
+        if (!top_k_admits(top, &p))
+            return;
+        if (!follows_longer_context(t, levels, n, 0, p.word_id))
+            top_k_push(top, p);
     }
-    for (uint64_t i = 0; i < j && i < k; i++)
-        parent_records[pr_len + i] = records[i];
-    if (j < k) {
-        trie_get_k_nwp_aux(t, &words[1], n - 1, k - j, parent_records, pr_len
-                                                                       + j);
+}
+
+/**
+ * Rank the unigrams but "<s>", which is never predicted, from the best to
+ * the worst.
+ */
+static void rank_unigrams(struct trie *t)
+{
+    const word_id_type sentence_start = find_word_id(t, "<s>");
+    float probabilities[DECODE_CHUNK_SIZE];
+    word_id_type ids[DECODE_CHUNK_SIZE];
+    const uint64_t r = t->n_ngrams[0];
+    t->unigram_ranking = malloc(r * sizeof(struct prediction));
+    t->n_ranked_unigrams = 0;
+    for (uint64_t cl = 0; cl < r; cl += DECODE_CHUNK_SIZE) {
+        const uint64_t cr = (r - cl < DECODE_CHUNK_SIZE) ? r :
+                            cl + DECODE_CHUNK_SIZE;
+        get_array_records_columns(t, 1, cl, cr, probabilities, ids);
+        for (uint64_t i = 0; i < cr - cl; i++) {
+            if (ids[i] == sentence_start)
+                continue;
+            struct prediction *p =
+                    &t->unigram_ranking[t->n_ranked_unigrams++];
+            p->word_id = ids[i];
+            p->probability = probabilities[i];
+        }
     }
-    qsort(&parent_records[pr_len], (j < k) ? j : k,
-          sizeof(struct array_record), k_nwp_f);
+    qsort(t->unigram_ranking, t->n_ranked_unigrams, sizeof(struct prediction),
+          cmp_predictions);
+}
+
+/**
+ * Get the trie nodes of the suffixes of the n-gram \p ids, the one of the
+ * c-gram suffix at nodes[c - 1], up to the longest suffix that is in the trie
+ * along with all of its own suffixes.
+ * @return the length of that suffix.
+ */
+static unsigned short
+get_suffix_nodes(const struct trie *t, const word_id_type *ids,
+                 unsigned short n, uint64_t *nodes)
+{
+    unsigned short c = 0;
+    while (c < n && !is_unknown_wid(t, ids[n - c - 1]) &&
+           map_trie_path(t, &ids[n - c - 1], c + 1, trie_get_nwp_f,
+                         &nodes[c]) == c + 1)
+        c++;
+    return c;
 }
 
 void trie_get_k_nwp(const struct trie *t, const char **words, int n,
                     unsigned short k, struct word **predictions)
 {
-    uint64_t left, right;
-    unsigned short tmp_n = (unsigned short) n;
-    get_children_slice(t, words, &tmp_n, &left, &right);
-    words = &words[n - tmp_n];
-    n = tmp_n;
+    const struct scratch_mark mark = scratch_mark();
+    struct prediction *word_predictions =
+            scratch_alloc(k * sizeof(struct prediction));
+    unsigned short len = trie_get_k_nwp_predictions(t, words, n, k,
+                                                    word_predictions);
+    for (unsigned short i = 0; i < k; i++)
+        predictions[i] = (i < len) ?
+                         &t->vocab_lookup[word_predictions[i].word_id] : NULL;
+    scratch_release(mark);
+}
+
+unsigned short
+trie_get_k_nwp_predictions(const struct trie *t, const char **words, int n,
+                           unsigned short k, struct prediction *predictions)
+{
+    const uint64_t start_time = start_latency(t);
+    word_id_type key[t->order + 1];
+    const unsigned short len = get_context_word_ids(t, words, n, &key[2]);
+    const unsigned short found = get_k_nwp_ids(t, key, len, k, predictions);
+    record_latency(t, METRICS_K_NWP, start_time);
+    return found;
+}
+
+unsigned short
+trie_get_k_nwp_word_ids(const struct trie *t, const word_id_type *ids, int n,
+                        unsigned short k, struct prediction *predictions)
+{
+    const uint64_t start_time = start_latency(t);
+    // only the last order - 1 words of a context can be matched
+    const int start = (n > t->order - 1) ? n - (t->order - 1) : 0;
+    word_id_type key[t->order + 1];
+    if (n > start)
+        memcpy(&key[2], &ids[start], (n - start) * sizeof(word_id_type));
+    const unsigned short len = trim_context_ids(t, &key[2], n - start);
+    const unsigned short found = get_k_nwp_ids(t, key, len, k, predictions);
+    record_latency(t, METRICS_K_NWP, start_time);
+    return found;
+}
+
+/**
+ * Get the top \p k next word predictions given the \p len ids of a context
+ * that start at \p key + 2, as set by get_context_word_ids(), using the query
+ * cache of \p t if it has one.
+ * @param key array of \p len + 2 ids, whose first two are set to the query
+ * type and \p k, the key of the query in the cache.
+ * @return the number of predictions found.
+ */
+static unsigned short
+get_k_nwp_ids(const struct trie *t, word_id_type *key, unsigned short len,
+              unsigned short k, struct prediction *predictions)
+{
+    word_id_type *ids = &key[2];
+    uint64_t nodes[t->order];
+    struct query_cache *cache = t->query_cache;
+    const size_t key_size = (len + 2) * sizeof(word_id_type);
+    const size_t value_size = k * sizeof(struct prediction);
+    unsigned short found;
+    if (cache != NULL) {
+        ids[-2] = QUERY_K_NWP;
+        ids[-1] = k;
+        size_t size = value_size;
+        if (query_cache_get(cache, &ids[-2], key_size, predictions,
+                            &size) == 0) {
+            for (found = 0; found < k; found++)
+                if (predictions[found].word_id == (word_id_type) -1)
+                    break;
+            return found;
+        }
+    }
+    found = get_k_nwp_within(t, nodes, get_suffix_nodes(t, ids, len, nodes), k,
+                             predictions);
+    if (cache != NULL)
+        query_cache_put(cache, &ids[-2], key_size, predictions, value_size);
+    return found;
+}
+
+/**
+ * Get the ids of the words of the \p n-length context \p words that can
+ * change its predictions: the last order - 1 ones, after the last unknown one.
+ * @param ids array of at least order - 1 ids where to set them.
+ * @return the number of ids set.
+ */
+static unsigned short
+get_context_word_ids(const struct trie *t, const char **words, int n,
+                     word_id_type *ids)
+{
+    // only the last order - 1 words of a context can be matched
+    const int start = (n > t->order - 1) ? n - (t->order - 1) : 0;
+    const unsigned short len = (unsigned short) (n - start);
+    trie_get_word_ids(t, &words[start], len, ids);
+    return trim_context_ids(t, ids, len);
+}
+
+/**
+ * Drop the ids of the \p len-length context \p ids up to its last unknown
+ * one, if any, which cut it off from the words before.
+ * @return the number of ids left at the start of \p ids.
+ */
+static unsigned short
+trim_context_ids(const struct trie *t, word_id_type *ids, unsigned short len)
+{
+    for (unsigned short i = len; i > 0; i--) {
+        if (is_unknown_wid(t, ids[i - 1])) {
+            memmove(ids, &ids[i], (len - i) * sizeof(word_id_type));
+            return len - i;
+        }
+    }
+    return len;
+}
+
+unsigned short
+trie_get_k_nwp_prefix(const struct trie *t, const char **words, int n,
+                      const char *prefix, unsigned short k,
+                      struct prediction *predictions)
+{
+    if (prefix[0] == '\0')
+        return trie_get_k_nwp_predictions(t, words, n, k, predictions);
+    const uint64_t start_time = start_latency(t);
+    word_id_type ids[t->order];
+    uint64_t nodes[t->order];
+    const unsigned short len = get_context_word_ids(t, words, n, ids);
+    unsigned short c = get_suffix_nodes(t, ids, len, nodes);
+    const word_id_type sentence_start = find_word_id(t, "<s>");
+    if (c == 0 && !is_unknown_wid(t, sentence_start)) {
+        nodes[0] = sentence_start;
+        c = 1;
+    }
+    struct context_level levels[c + 1];
+    set_context_levels(t, nodes, c, levels);
+
+    struct lexicon_range range;
+    get_prefix_range(t, prefix, &range);
+    const uint64_t size = range.r - range.l;
+    // Either search each word of the prefix among the children of each
+    // context, or scan the children of the contexts, and the unigrams from the
+    // best to the worst until k of the prefix are found, for the ones in the
+    // range of the prefix.
+    uint64_t scan_cost = size + k * (t->n_ngrams[0] / (size + 1));
+    for (unsigned short i = 1; i <= c; i++)
+        scan_cost += levels[i].r - levels[i].l;
+    const unsigned short found = (size * c * PROBE_COST <= scan_cost) ?
+            probe_words(t, levels, c, &t->lexicon[range.l], size, k,
+                        predictions) :
+            rank_levels(t, levels, c, &range, k, predictions);
+    record_latency(t, METRICS_K_NWP_PREFIX, start_time);
+    return found;
+}
 
-    unsigned long r_len = ((right - left) < k ? k : right - left);
-    struct array_record nwp_records[r_len];
-    int j = 0;
-    for (uint64_t i = left; i < right; i++) {
-        nwp_records[j++] = get_array_record(t, n + 1, i);
+/**
+ * Get the top \p k next word predictions among the \p len words \p word_ids
+ * but "<s>", given the context of \p levels, by searching each of them among
+ * the children of the contexts, from the longest to the shortest.
+ * @return the number of predictions found.
+ */
+static unsigned short
+probe_words(const struct trie *t, const struct context_level *levels,
+            unsigned short n, const word_id_type *word_ids, uint64_t len,
+            unsigned short k, struct prediction *predictions)
+{
+    const word_id_type sentence_start = find_word_id(t, "<s>");
+    struct top_k top = { predictions, 0, k };
+    for (uint64_t i = 0; i < len; i++) {
+        const word_id_type id = word_ids[i];
+        if (id == sentence_start)
+            continue;
+        // the unigrams are indexed by their word id
+        uint64_t index = id;
+        float backoff = 0;
+        unsigned short c = n;
+        for (; c > 0; c--) {
+            if (find_child(t, c, levels[c].node, levels[c].l, levels[c].r, id,
+                           &index) == 0)
+                break;
+            backoff += levels[c].backoff;
+        }
+        const struct prediction p = {
+                id, get_array_record(t, c + 1, index).probability + backoff
+        };
+        if (top_k_admits(&top, &p))
+            top_k_push(&top, p);
     }
-    if (k > j)
-        trie_get_k_nwp_aux(t, &words[1], n - 1, k - j, nwp_records, j);
+    return finish_top_k(&top);
+}
+
+/**
+ * Sort the word ids of \p t in the lexicographic order of their text, so that
+ * the words starting with the same prefix are next to each other.
+ */
+static void sort_lexicon(struct trie *t)
+{
+    const uint64_t n = t->n_ngrams[0];
+    const struct word **words = malloc(n * sizeof(struct word *));
+    for (uint64_t i = 0; i < n; i++)
+        words[i] = &t->vocab_lookup[i];
+    qsort(words, n, sizeof(struct word *), cmp_word_texts);
+    t->lexicon = malloc(n * sizeof(word_id_type));
+    for (uint64_t i = 0; i < n; i++)
+        t->lexicon[i] = words[i] - t->vocab_lookup;
+    free(words);
+    set_lexicon_ranks(t);
+}
 
-    qsort(nwp_records, right - left, sizeof(struct array_record), k_nwp_f);
+/**
+ * Set the position of each word id in the lexicon of \p t.
+ */
+static void set_lexicon_ranks(struct trie *t)
+{
+    t->lexicon_ranks = malloc(t->n_ngrams[0] * sizeof(uint32_t));
+    for (uint64_t i = 0; i < t->n_ngrams[0]; i++)
+        t->lexicon_ranks[t->lexicon[i]] = i;
+}
 
-    for (int i = 0; i < k; i++)
-        predictions[i] = &t->vocab_lookup[nwp_records[i].word_id];
+static int cmp_word_texts(const void *a, const void *b)
+{
+    const struct word *const *a_word = a, *const *b_word = b;
+    return strcmp((*a_word)->text, (*b_word)->text);
 }
 
-float trie_ngram_probability(const struct trie *t, const char **words, int n)
+/**
+ * Get the \p range of the lexicon of the words starting with \p prefix.
+ */
+static void get_prefix_range(const struct trie *t, const char *prefix,
+                             struct lexicon_range *range)
 {
-    int tmp_n = n;
-    struct ngram *ngram = trie_query_ngram(t, words, &tmp_n);
-    if (tmp_n == n)
-        return ngram->probability;
-    else
-        return ngram->probability + 0;
+    const size_t len = strlen(prefix);
+    uint64_t lo = 0, hi = t->n_ngrams[0];
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (strcmp(t->vocab_lookup[t->lexicon[mid]].text, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    range->l = lo;
+    // the words from l on start with the prefix up to the first that does not
+    hi = t->n_ngrams[0];
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (strncmp(t->vocab_lookup[t->lexicon[mid]].text, prefix, len) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    range->r = lo;
+}
+
+/**
+ * Get the top \p k next word predictions given the context whose suffixes
+ * have the nodes \p nodes, the one of the c-gram suffix at nodes[c - 1].
+ * An empty context is taken as "<s>". The predictions of the hot contexts
+ * are taken from the hot cache, if any, which is filled with the ones that
+ * become hot. The predictions left are set to an unknown word with a -inf
+ * probability.
+ * @return the number of predictions found.
+ */
+static unsigned short
+get_k_nwp_within(const struct trie *t, const uint64_t *nodes, unsigned short n,
+                 unsigned short k, struct prediction *predictions)
+{
+    count_metric(t, METRICS_CONTEXTS, 1);
+    count_metric(t, METRICS_MATCHED_CONTEXT_WORDS, n);
+    uint64_t sentence_start;
+    if (n == 0 && !is_unknown_wid(t, find_word_id(t, "<s>"))) {
+        sentence_start = find_word_id(t, "<s>");
+        nodes = &sentence_start;
+        n = 1;
+    }
+    struct hot_cache *cache = t->hot_cache;
+    if (cache == NULL || n == 0 || k > hot_cache_k(cache))
+        return rank_predictions(t, nodes, n, k, predictions);
+
+    // the node of the longest suffix identifies the context
+    const uint64_t key = nodes[n - 1] * t->order + n;
+    unsigned short len;
+    if (hot_cache_get(cache, key, k, predictions, &len) == 0)
+        return len;
+    if (!hot_cache_admits(cache, key))
+        return rank_predictions(t, nodes, n, k, predictions);
+    const unsigned short cache_k = hot_cache_k(cache);
+    const struct scratch_mark mark = scratch_mark();
+    struct prediction *cached = scratch_alloc(cache_k *
+                                              sizeof(struct prediction));
+    len = rank_predictions(t, nodes, n, cache_k, cached);
+    hot_cache_put(cache, key, cached, len);
+    memcpy(predictions, cached, k * sizeof(struct prediction));
+    scratch_release(mark);
+    return (len < k) ? len : k;
+}
+
+/**
+ * Get the top \p k next word predictions given the context whose suffixes
+ * have the nodes \p nodes, as get_k_nwp_within() but without the hot cache.
+ * The probability of each word is the one of the longest context it
+ * follows, weighted by the backoffs of the longer contexts. The contexts are
+ * visited from the longest to the shortest, and the search stops as soon as
+ * no shorter context can beat the k-th best prediction, which needs the
+ * log10 probabilities to be at most 0.
+ * @return the number of predictions found.
+ */
+static unsigned short
+rank_predictions(const struct trie *t, const uint64_t *nodes, unsigned short n,
+                 unsigned short k, struct prediction *predictions)
+{
+    struct context_level levels[n + 1];
+    set_context_levels(t, nodes, n, levels);
+    return rank_levels(t, levels, n, NULL, k, predictions);
+}
+
+/**
+ * Set the \p n + 1 levels of the context whose suffixes have the nodes
+ * \p nodes, the one of the c-gram suffix at nodes[c - 1]. Level 0 is the
+ * empty context.
+ */
+static void
+set_context_levels(const struct trie *t, const uint64_t *nodes,
+                   unsigned short n, struct context_level *levels)
+{
+    levels[0].positive_backoffs = 0;
+    for (unsigned short c = 1; c <= n; c++) {
+        const struct array_record ar = get_array_record(t, c, nodes[c - 1]);
+        levels[c].node = nodes[c - 1];
+        levels[c].l = ar.first_child_index;
+        levels[c].r = get_array_record(t, c, nodes[c - 1] + 1)
+                .first_child_index;
+        levels[c].backoff = ar.backoff;
+        levels[c].positive_backoffs = levels[c - 1].positive_backoffs +
+                                      fmaxf(ar.backoff, 0);
+    }
+}
+
+/**
+ * Get the top \p k next word predictions in \p filter given the context of
+ * \p levels, as rank_predictions().
+ * @return the number of predictions found.
+ */
+static unsigned short
+rank_levels(const struct trie *t, const struct context_level *levels,
+            unsigned short n, const struct lexicon_range *filter,
+            unsigned short k, struct prediction *predictions)
+{
+    struct top_k top = { predictions, 0, k };
+    float backoff = 0;
+    int c;
+    for (c = n; c >= 0; c--) {
+        // the shorter contexts have their backoffs added to this one's
+        if (top.len == k && backoff + levels[c].positive_backoffs <
+                            predictions[0].probability)
+            break;
+        if (c > 0) {
+            select_children(t, levels, n, c, backoff, filter, &top);
+            backoff += levels[c].backoff;
+        } else {
+            select_unigrams(t, levels, n, backoff, filter, &top);
+        }
+    }
+    count_metric(t, METRICS_RANKED_CONTEXTS, 1);
+    count_metric(t, METRICS_BACKOFF_LEVELS, n - c - 1);
+    return finish_top_k(&top);
+}
+
+/**
+ * Sort the predictions of \p top from the best to the worst and set the ones
+ * left of its k to an unknown word with a -inf probability.
+ * @return the number of predictions found.
+ */
+static unsigned short finish_top_k(struct top_k *top)
+{
+    top_k_sort(top);
+    for (unsigned short i = top->len; i < top->k; i++) {
+        top->heap[i].word_id = -1;
+        top->heap[i].probability = -INFINITY;
+    }
+    return top->len;
+}
+
+/**
+ * Prefetch the records in [\p l, \p r) of the \p n-grams array.
+ */
+static inline void
+prefetch_records(const struct trie *t, int n, uint64_t l, uint64_t r)
+{
+    const struct array *a = t->arrays[n - 1];
+    __builtin_prefetch(a->elems + l * a->elem_size / 8);
+    __builtin_prefetch(a->elems + (r * a->elem_size - 1) / 8);
+}
+
+/**
+ * Search the hashes of \p len words in the vocabulary lookup in lockstep,
+ * prefetching the next probe of every search before making any of them. The
+ * id of the unknown words is set to -1.
+ * Every search takes the same \f$\lceil \log_2 |V| \rceil\f$ branchless
+ * steps, so that they advance together.
+ */
+static void vocab_search_batch(const struct trie *t, struct vocab_search *s,
+                               unsigned int len)
+{
+    const struct word *vocab = t->vocab_lookup;
+    uint64_t range_len = t->n_ngrams[0];
+    for (unsigned int i = 0; i < len; i++)
+        s[i].base = 0;
+    while (range_len > 1) {
+        const uint64_t half = range_len / 2;
+        range_len -= half;
+        for (unsigned int i = 0; i < len; i++) {
+            s[i].base += (vocab[s[i].base + half].hash <= s[i].hash) ? half : 0;
+            __builtin_prefetch(&vocab[s[i].base + range_len / 2]);
+        }
+    }
+    for (unsigned int i = 0; i < len; i++)
+        *s[i].id = (vocab[s[i].base].hash == s[i].hash) ? s[i].base : -1;
+}
+
+static void path_walk_start(const struct trie *t, struct path_walk *w)
+{
+    w->n = 1;
+    w->index = w->ids[0];
+    w->stage = WALK_BOUNDS;
+    prefetch_records(t, 1, w->index, w->index + 2);
+}
+
+/**
+ * Restart \p w with the next shorter suffix of its context, as done by
+ * trie_get_k_nwp() when a suffix is not in the trie.
+ */
+static void path_walk_backoff(const struct trie *t, struct path_walk *w)
+{
+    w->ids++;
+    w->len--;
+    path_walk_start(t, w);
+}
+
+/**
+ * Make the memory accesses prefetched by the last step of \p w and prefetch
+ * the ones of its next step. The children ranges are searched as in
+ * array_isearch_within(): the range endpoints are read, then an
+ * interpolation probe is made, followed by a binary probe if it was not
+ * enough to halve the range.
+ */
+static void path_walk_step(const struct trie *t, struct path_walk *w)
+{
+    if (w->stage == WALK_BOUNDS) {
+        const struct array *a = t->arrays[w->n - 1];
+        const struct record_layout *layout = &t->layouts[w->n - 1];
+        w->l = array_get_field(a, w->index, layout->first_child_index_offset,
+                               layout->first_child_index_size);
+        w->r = array_get_field(a, w->index + 1,
+                               layout->first_child_index_offset,
+                               layout->first_child_index_size);
+        if (w->n == w->len) {
+            w->stage = WALK_DONE;
+            return;
+        }
+        if (w->l >= w->r) {
+            path_walk_backoff(t, w);
+            return;
+        }
+        w->stage = WALK_ENDPOINTS;
+        prefetch_records(t, w->n + 1, w->l, w->l + 1);
+        prefetch_records(t, w->n + 1, w->r - 1, w->r);
+        return;
+    }
+
+    const struct array *a = t->arrays[w->n];
+    const struct record_layout *layout = &t->layouts[w->n];
+    const word_id_type key = w->ids[w->n];
+    if (w->stage == WALK_ENDPOINTS) {
+        const uint64_t low = array_get_field(a, w->l, layout->word_id_offset,
+                                             layout->word_id_size);
+        const uint64_t high = array_get_field(a, w->r - 1,
+                                              layout->word_id_offset,
+                                              layout->word_id_size);
+        if (key < low || key > high) {
+            path_walk_backoff(t, w);
+            return;
+        }
+        w->len_before_probe = w->r - w->l;
+        w->mid = (low == high) ? w->l : w->l + (uint64_t) (
+                (double) (key - low) / (double) (high - low) *
+                (w->len_before_probe - 1));
+        w->stage = WALK_INTERPOLATION_PROBE;
+        prefetch_records(t, w->n + 1, w->mid, w->mid + 1);
+        return;
+    }
+
+    const word_id_type id = array_get_field(a, w->mid, layout->word_id_offset,
+                                            layout->word_id_size);
+    if (id == key) {
+        w->index = w->mid;
+        w->n++;
+        w->stage = WALK_BOUNDS;
+        prefetch_records(t, w->n, w->index, w->index + 2);
+        return;
+    }
+    if (id < key)
+        w->l = w->mid + 1;
+    else
+        w->r = w->mid;
+    if (w->l >= w->r) {
+        path_walk_backoff(t, w);
+    } else if (w->stage == WALK_INTERPOLATION_PROBE &&
+               w->r - w->l > w->len_before_probe / 2) {
+        w->mid = w->l + (w->r - w->l) / 2;
+        w->stage = WALK_BINARY_PROBE;
+        prefetch_records(t, w->n + 1, w->mid, w->mid + 1);
+    } else {
+        w->stage = WALK_ENDPOINTS;
+        prefetch_records(t, w->n + 1, w->l, w->l + 1);
+        prefetch_records(t, w->n + 1, w->r - 1, w->r);
+    }
+}
+
+void trie_get_k_nwp_batch(const struct trie *t, const char **contexts[],
+                          const int *lens, unsigned int m, unsigned short k,
+                          struct prediction *predictions)
+{
+    // only the last order - 1 words of a context can be matched
+    const unsigned short max_len = t->order - 1;
+    word_id_type ids[BATCH_GROUP_SIZE * t->order];
+    struct vocab_search searches[BATCH_GROUP_SIZE * t->order];
+    struct path_walk walks[BATCH_GROUP_SIZE];
+    uint64_t nodes[t->order];
+    const word_id_type sentence_start = find_word_id(t, "<s>");
+    const uint64_t start_time = start_latency(t);
+
+    for (unsigned int g = 0; g < m; g += BATCH_GROUP_SIZE) {
+        const unsigned int group_len = (m - g < BATCH_GROUP_SIZE) ? m - g :
+                                       BATCH_GROUP_SIZE;
+        unsigned int n_searches = 0;
+        for (unsigned int i = 0; i < group_len; i++) {
+            const int len = lens[g + i];
+            const int start = (len > max_len) ? len - max_len : 0;
+            walks[i].ids = &ids[i * max_len];
+            walks[i].len = len - start;
+            for (int j = start; j < len; j++) {
+                struct vocab_search *s = &searches[n_searches++];
+                uint64_t out[2];
+                s->text = contexts[g + i][j];
+                murmurhash3(s->text, strlen(s->text), out);
+                s->hash = out[0];
+                s->id = &ids[i * max_len + j - start];
+            }
+        }
+        vocab_search_batch(t, searches, n_searches);
+        for (unsigned int i = 0; i < n_searches; i++)
+            count_word(t, searches[i].text, *searches[i].id);
+
+        unsigned int active = 0;
+        for (unsigned int i = 0; i < group_len; i++) {
+            struct path_walk *w = &walks[i];
+            for (int j = w->len - 1; j >= 0; j--)
+                if (is_unknown_wid(t, w->ids[j])) {
+                    w->ids += j + 1;
+                    w->len -= j + 1;
+                    break;
+                }
+            if (w->len == 0 && !is_unknown_wid(t, sentence_start)) {
+                ids[i * max_len] = sentence_start;
+                w->ids = &ids[i * max_len];
+                w->len = 1;
+            }
+            if (w->len == 0) {
+                // without "<s>", the unigrams are ranked
+                w->n = 0;
+                w->stage = WALK_DONE;
+                continue;
+            }
+            path_walk_start(t, w);
+            active++;
+        }
+        while (active > 0) {
+            for (unsigned int i = 0; i < group_len; i++) {
+                if (walks[i].stage == WALK_DONE)
+                    continue;
+                path_walk_step(t, &walks[i]);
+                if (walks[i].stage == WALK_DONE) {
+                    active--;
+                    prefetch_records(t, walks[i].n + 1, walks[i].l,
+                                     walks[i].l + 1);
+                }
+            }
+        }
+
+        for (unsigned int i = 0; i < group_len; i++) {
+            const unsigned short n = get_suffix_nodes(t, walks[i].ids,
+                                                      walks[i].n, nodes);
+            get_k_nwp_within(t, nodes, n, k, &predictions[(g + i) * k]);
+        }
+    }
+    record_latency(t, METRICS_K_NWP_BATCH, start_time);
+}
+
+void trie_get_k_nwp_batch_parallel(const struct trie *t,
+                                   const char **contexts[], const int *lens,
+                                   unsigned int m, unsigned short k,
+                                   struct prediction *predictions,
+                                   unsigned int n_threads)
+{
+    if (n_threads == 0) {
+        const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0) ? n_cpus : 1;
+    }
+    const unsigned int max_threads = (m + MIN_THREAD_BATCH_SIZE - 1) /
+                                     MIN_THREAD_BATCH_SIZE;
+    if (n_threads > max_threads)
+        n_threads = max_threads;
+    if (n_threads <= 1) {
+        trie_get_k_nwp_batch(t, contexts, lens, m, k, predictions);
+        return;
+    }
+
+    struct batch_slice slices[n_threads];
+    for (unsigned int i = 0; i < n_threads; i++) {
+        const unsigned int l = (uint64_t) m * i / n_threads;
+        const unsigned int r = (uint64_t) m * (i + 1) / n_threads;
+        slices[i] = (struct batch_slice) {
+                .t = t, .contexts = &contexts[l], .lens = &lens[l],
+                .m = r - l, .k = k, .predictions = &predictions[l * k]
+        };
+    }
+    // the calling thread takes the first slice, and the slices of the threads
+    // that could not be created
+    pthread_t threads[n_threads - 1];
+    unsigned int n_started = 0;
+    while (n_started < n_threads - 1 &&
+           pthread_create(&threads[n_started], NULL, get_k_nwp_batch_slice,
+                          &slices[n_started + 1]) == 0)
+        n_started++;
+    get_k_nwp_batch_slice(&slices[0]);
+    for (unsigned int i = n_started + 1; i < n_threads; i++)
+        get_k_nwp_batch_slice(&slices[i]);
+    for (unsigned int i = 0; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void *get_k_nwp_batch_slice(void *arg)
+{
+    const struct batch_slice *s = arg;
+    trie_get_k_nwp_batch(s->t, s->contexts, s->lens, s->m, s->k,
+                         s->predictions);
+    return NULL;
+}
+
+struct lm_state *trie_state_new(const struct trie *t)
+{
+    return init_state(t, malloc(get_state_size(t)));
+}
+
+/**
+ * Get the size of a state of \p t, including its nodes and ids.
+ */
+static size_t get_state_size(const struct trie *t)
+{
+    return sizeof(struct lm_state) + (t->order - 1) * (
+            sizeof(uint64_t) + sizeof(word_id_type));
+}
+
+/**
+ * Initialize an empty state of \p t in \p memory, of get_state_size() bytes.
+ */
+static struct lm_state *init_state(const struct trie *t, void *memory)
+{
+    const unsigned short max_len = t->order - 1;
+    struct lm_state *state = memory;
+    state->max_len = max_len;
+    state->len = 0;
+    state->nodes = (uint64_t *) (state + 1);
+    state->ids = (word_id_type *) (state->nodes + max_len);
+    return state;
+}
+
+void trie_state_delete(struct lm_state *state)
+{
+    free(state);
+}
+
+void trie_state_reset(struct lm_state *state)
+{
+    state->len = 0;
+}
+
+void trie_state_copy(struct lm_state *dest, const struct lm_state *src)
+{
+    dest->len = src->len;
+    memcpy(dest->nodes, src->nodes, src->len * sizeof(uint64_t));
+    memcpy(dest->ids, src->ids, src->len * sizeof(word_id_type));
+}
+
+unsigned short trie_state_length(const struct lm_state *state)
+{
+    return state->len;
+}
+
+void trie_state_advance(const struct trie *t, const struct lm_state *state,
+                        word_id_type word_id, struct lm_state *out_state)
+{
+    if (is_unknown_wid(t, word_id) || state->max_len == 0) {
+        out_state->len = 0;
+        return;
+    }
+    unsigned short len = (state->len < state->max_len) ? state->len + 1 :
+                         state->max_len;
+    // The (j + 1)-gram suffix of the new context is a child of the j-gram
+    // suffix of the old one. Going from the longest to the shortest suffix,
+    // each node of the old state is read before being overwritten, so that
+    // out_state can be state.
+    for (unsigned short j = len; j > 1; j--) {
+        const uint64_t parent = state->nodes[j - 2];
+        const uint64_t left = get_array_record(t, j - 1, parent)
+                .first_child_index;
+        const uint64_t right = get_array_record(t, j - 1, parent + 1)
+                .first_child_index;
+        if (find_child(t, j - 1, parent, left, right, word_id,
+                       &out_state->nodes[j - 1]) != 0)
+            len = j - 1;
+    }
+    out_state->nodes[0] = word_id;
+    memmove(out_state->ids, &state->ids[state->len - (len - 1)],
+            (len - 1) * sizeof(word_id_type));
+    out_state->ids[len - 1] = word_id;
+    out_state->len = len;
+}
+
+unsigned short
+trie_state_get_k_nwp(const struct trie *t, const struct lm_state *state,
+                     unsigned short k, struct prediction *predictions)
+{
+    const uint64_t start_time = start_latency(t);
+    const unsigned short found = get_k_nwp_within(t, state->nodes, state->len,
+                                                  k, predictions);
+    record_latency(t, METRICS_STATE_K_NWP, start_time);
+    return found;
+}
+
+float trie_state_score(const struct trie *t, const struct lm_state *state,
+                       word_id_type word_id, struct lm_state *out_state,
+                       struct token_score *score)
+{
+    const int is_oov = is_unknown_wid(t, word_id);
+    if (is_oov)
+        word_id = find_word_id(t, "<unk>");
+    float log10_probability = UNKNOWN_WORD_LOG10_PROBABILITY;
+    unsigned short m = 0;
+    if (!is_unknown_wid(t, word_id)) {
+        // the j-gram ending at word_id is a child of the (j - 1)-gram suffix
+        // of the context
+        uint64_t node = word_id;
+        m = 1;
+        if (state->max_len > 0)
+            out_state->nodes[0] = word_id;
+        for (unsigned short j = 2; j <= state->len + 1; j++) {
+            const uint64_t parent = state->nodes[j - 2];
+            const uint64_t left = get_array_record(t, j - 1, parent)
+                    .first_child_index;
+            const uint64_t right = get_array_record(t, j - 1, parent + 1)
+                    .first_child_index;
+            if (find_child(t, j - 1, parent, left, right, word_id, &node) != 0)
+                break;
+            m = j;
+            if (j <= state->max_len)
+                out_state->nodes[j - 1] = node;
+        }
+        log10_probability = get_array_record(t, m, node).probability;
+    }
+    // back off from the whole context to the (m - 1)-gram context
+    const unsigned short first_backoff = (m > 1) ? m : 1;
+    for (unsigned short c = first_backoff; c <= state->len; c++)
+        log10_probability += get_array_record(t, c, state->nodes[c - 1])
+                .backoff;
+    if (t->metrics != NULL) {
+        metrics_count(t->metrics, METRICS_TOKENS, 1);
+        metrics_count(t->metrics, METRICS_OOV_TOKENS, is_oov);
+        metrics_count(t->metrics, METRICS_MATCHED_ORDERS, m);
+        if (state->len >= first_backoff)
+            metrics_count(t->metrics, METRICS_TOKEN_BACKOFFS,
+                          state->len - first_backoff + 1);
+    }
+
+    if (is_oov || m == 0 || state->max_len == 0) {
+        out_state->len = 0;
+    } else {
+        const unsigned short len = (m < state->max_len) ? m : state->max_len;
+        memcpy(out_state->ids, &state->ids[state->len - (len - 1)],
+               (len - 1) * sizeof(word_id_type));
+        out_state->ids[len - 1] = word_id;
+        out_state->len = len;
+    }
+    if (score != NULL) {
+        score->log10_probability = log10_probability;
+        score->ngram_length = m;
+        score->is_oov = is_oov;
+    }
+    return log10_probability;
+}
+
+/**
+ * Score the \p n words of \p ids one after the other, starting from the
+ * context of \p states[0]. \p states[1] is used as the other state, and the
+ * final state is left in \p states[n % 2].
+ * @return the sum of the scores.
+ */
+static float score_word_ids(const struct trie *t, struct lm_state **states,
+                            const word_id_type *ids, unsigned int n,
+                            struct token_score *scores)
+{
+    float total = 0;
+    for (unsigned int i = 0; i < n; i++)
+        total += trie_state_score(t, states[i % 2], ids[i],
+                                  states[(i + 1) % 2],
+                                  (scores != NULL) ? &scores[i] : NULL);
+    return total;
+}
+
+float trie_score_tokens(const struct trie *t, const char **words,
+                        unsigned int n, struct token_score *scores)
+{
+    const uint64_t start_time = start_latency(t);
+    const struct scratch_mark mark = scratch_mark();
+    struct lm_state *states[] = {
+            init_state(t, scratch_alloc(get_state_size(t))),
+            init_state(t, scratch_alloc(get_state_size(t)))
+    };
+    word_id_type *ids = scratch_alloc(n * sizeof(word_id_type));
+    for (unsigned int i = 0; i < n; i++)
+        ids[i] = find_word_id(t, words[i]);
+    float total = score_word_ids(t, states, ids, n, scores);
+    scratch_release(mark);
+    record_latency(t, METRICS_SCORE, start_time);
+    return total;
+}
+
+float trie_score_word_ids(const struct trie *t, const word_id_type *ids,
+                          unsigned int n, struct token_score *scores)
+{
+    const uint64_t start_time = start_latency(t);
+    const struct scratch_mark mark = scratch_mark();
+    struct lm_state *states[] = {
+            init_state(t, scratch_alloc(get_state_size(t))),
+            init_state(t, scratch_alloc(get_state_size(t)))
+    };
+    float total = score_word_ids(t, states, ids, n, scores);
+    scratch_release(mark);
+    record_latency(t, METRICS_SCORE, start_time);
+    return total;
+}
+
+float trie_score_sentence(const struct trie *t, const char **words,
+                          unsigned int n, struct token_score *scores)
+{
+    const uint64_t start_time = start_latency(t);
+    const struct scratch_mark mark = scratch_mark();
+    struct lm_state *states[] = {
+            init_state(t, scratch_alloc(get_state_size(t))),
+            init_state(t, scratch_alloc(get_state_size(t)))
+    };
+    word_id_type *ids = scratch_alloc((n + 1) * sizeof(word_id_type));
+    for (unsigned int i = 0; i < n; i++)
+        ids[i] = find_word_id(t, words[i]);
+    ids[n] = find_word_id(t, "</s>");
+    trie_state_advance(t, states[0], find_word_id(t, "<s>"), states[0]);
+    float total = score_word_ids(t, states, ids, n + 1, scores);
+    scratch_release(mark);
+    record_latency(t, METRICS_SCORE, start_time);
+    return total;
+}
+
+/**
+ * Prefetch the records read by trie_state_score() before searching the
+ * children of each node of \p state, which are known beforehand, unlike the
+ * children found.
+ */
+static void prefetch_state_score(const struct trie *t,
+                                 const struct lm_state *state,
+                                 word_id_type word_id)
+{
+    if (!is_unknown_wid(t, word_id))
+        prefetch_records(t, 1, word_id, word_id + 1);
+    for (unsigned short c = 1; c <= state->len; c++)
+        prefetch_records(t, c, state->nodes[c - 1], state->nodes[c - 1] + 2);
+}
+
+/**
+ * Prefetch the endpoints of the children ranges of the nodes of \p state,
+ * which are the first records read by the searches of trie_state_score().
+ * The records prefetched by prefetch_state_score() are read.
+ */
+static void prefetch_state_children(const struct trie *t,
+                                    const struct lm_state *state)
+{
+    for (unsigned short c = 1; c <= state->len; c++) {
+        const struct array *a = t->arrays[c - 1];
+        const struct record_layout *layout = &t->layouts[c - 1];
+        const uint64_t l = array_get_field(a, state->nodes[c - 1],
+                                           layout->first_child_index_offset,
+                                           layout->first_child_index_size);
+        const uint64_t r = array_get_field(a, state->nodes[c - 1] + 1,
+                                           layout->first_child_index_offset,
+                                           layout->first_child_index_size);
+        if (l < r) {
+            prefetch_records(t, c + 1, l, l + 1);
+            prefetch_records(t, c + 1, r - 1, r);
+        }
+    }
+}
+
+void trie_score_sentences(const struct trie *t, const char **sentences[],
+                          const unsigned int *lens, unsigned int m,
+                          float *totals, struct token_score *scores)
+{
+    const uint64_t start_time = start_latency(t);
+    const struct scratch_mark mark = scratch_mark();
+    struct lm_state *states[2 * BATCH_GROUP_SIZE];
+    for (int i = 0; i < 2 * BATCH_GROUP_SIZE; i++)
+        states[i] = init_state(t, scratch_alloc(get_state_size(t)));
+    const word_id_type sentence_start = find_word_id(t, "<s>");
+    const word_id_type sentence_end = find_word_id(t, "</s>");
+    uint64_t scores_offset = 0;
+
+    for (unsigned int g = 0; g < m; g += BATCH_GROUP_SIZE) {
+        const unsigned int group_len = (m - g < BATCH_GROUP_SIZE) ? m - g :
+                                       BATCH_GROUP_SIZE;
+        // the word ids of the i-th sentence of the group, followed by "</s>",
+        // start at ids[offsets[i]]
+        uint64_t offsets[BATCH_GROUP_SIZE + 1];
+        unsigned int max_len = 0;
+        offsets[0] = 0;
+        for (unsigned int i = 0; i < group_len; i++) {
+            offsets[i + 1] = offsets[i] + lens[g + i] + 1;
+            if (lens[g + i] > max_len)
+                max_len = lens[g + i];
+        }
+        const struct scratch_mark group_mark = scratch_mark();
+        word_id_type *ids = scratch_alloc(offsets[group_len] *
+                                          sizeof(word_id_type));
+        struct vocab_search *searches = scratch_alloc(
+                offsets[group_len] * sizeof(struct vocab_search));
+        unsigned int n_searches = 0;
+        for (unsigned int i = 0; i < group_len; i++) {
+            for (unsigned int j = 0; j < lens[g + i]; j++) {
+                struct vocab_search *s = &searches[n_searches++];
+                uint64_t out[2];
+                s->text = sentences[g + i][j];
+                murmurhash3(s->text, strlen(s->text), out);
+                s->hash = out[0];
+                s->id = &ids[offsets[i] + j];
+            }
+            ids[offsets[i + 1] - 1] = sentence_end;
+            trie_state_reset(states[2 * i]);
+            trie_state_advance(t, states[2 * i], sentence_start,
+                               states[2 * i]);
+            totals[g + i] = 0;
+        }
+        vocab_search_batch(t, searches, n_searches);
+
+        // score the j-th token of every sentence of the group, prefetching
+        // what can be prefetched of all of them before scoring any
+        for (unsigned int j = 0; j <= max_len; j++) {
+            for (unsigned int i = 0; i < group_len; i++)
+                if (j <= lens[g + i])
+                    prefetch_state_score(t, states[2 * i + j % 2],
+                                         ids[offsets[i] + j]);
+            for (unsigned int i = 0; i < group_len; i++)
+                if (j <= lens[g + i])
+                    prefetch_state_children(t, states[2 * i + j % 2]);
+            for (unsigned int i = 0; i < group_len; i++) {
+                if (j > lens[g + i])
+                    continue;
+                struct token_score *score = (scores == NULL) ? NULL :
+                        &scores[scores_offset + offsets[i] + j];
+                totals[g + i] += trie_state_score(t, states[2 * i + j % 2],
+                                                  ids[offsets[i] + j],
+                                                  states[2 * i +
+                                                         (j + 1) % 2],
+                                                  score);
+            }
+        }
+        scores_offset += offsets[group_len];
+        scratch_release(group_mark);
+    }
+    scratch_release(mark);
+    record_latency(t, METRICS_SCORE_BATCH, start_time);
+}
+
+double trie_perplexity(const struct trie *t, const char **sentences[],
+                       const unsigned int *lens, unsigned int m)
+{
+    const struct scratch_mark mark = scratch_mark();
+    float *totals = scratch_alloc(m * sizeof(float));
+    trie_score_sentences(t, sentences, lens, m, totals, NULL);
+    double total = 0;
+    uint64_t n_tokens = 0;
+    for (unsigned int i = 0; i < m; i++) {
+        total += totals[i];
+        n_tokens += lens[i] + 1;
+    }
+    scratch_release(mark);
+    return pow(10.0, -total / (double) n_tokens);
+}
+
+struct trie_mixture *trie_mixture_new(const struct trie **tries,
+                                      const float *weights, unsigned short m)
+{
+    if (m == 0) {
+        log_warn("A mixture needs at least one trie");
+        return NULL;
+    }
+    double total_weight = 0;
+    for (unsigned short i = 0; i < m; i++) {
+        if (!(weights[i] > 0)) {
+            log_warn("The weight %f of the trie %d of the mixture is not "
+                     "positive", weights[i], i);
+            return NULL;
+        }
+        total_weight += weights[i];
+    }
+    struct trie_mixture *mix = malloc(sizeof(struct trie_mixture));
+    mix->m = 0;
+    mix->tries = malloc(m * sizeof(struct trie *));
+    mix->weights = malloc(m * sizeof(double));
+    mix->mixture_ids = malloc(m * sizeof(word_id_type *));
+    uint64_t max_words = 0;
+    for (unsigned short i = 0; i < m; i++) {
+        // a trie given more than once is searched once, with all its weights
+        unsigned short j = 0;
+        while (j < mix->m && mix->tries[j] != tries[i])
+            j++;
+        if (j < mix->m) {
+            mix->weights[j] += weights[i] / total_weight;
+            continue;
+        }
+        mix->tries[mix->m] = tries[i];
+        mix->weights[mix->m] = weights[i] / total_weight;
+        mix->mixture_ids[mix->m++] = malloc(tries[i]->n_ngrams[0] *
+                                            sizeof(word_id_type));
+        max_words += tries[i]->n_ngrams[0];
+    }
+    tries = mix->tries;
+    m = mix->m;
+
+    // the vocabularies are sorted by hash, so their union is their merge
+    mix->vocab_lookup = malloc(max_words * sizeof(struct word));
+    mix->trie_ids = malloc(max_words * m * sizeof(word_id_type));
+    uint64_t cursors[m];
+    memset(cursors, 0, sizeof(cursors));
+    mix->n_words = 0;
+    while (1) {
+        const struct word *first = NULL;
+        for (unsigned short i = 0; i < m; i++)
+            if (cursors[i] < tries[i]->n_ngrams[0] &&
+                (first == NULL || cmp_words(&tries[i]->vocab_lookup[cursors[i]],
+                                            first) < 0))
+                first = &tries[i]->vocab_lookup[cursors[i]];
+        if (first == NULL)
+            break;
+        const word_id_type id = mix->n_words++;
+        mix->vocab_lookup[id] = *first;
+        for (unsigned short i = 0; i < m; i++) {
+            if (cursors[i] < tries[i]->n_ngrams[0] &&
+                cmp_words(&tries[i]->vocab_lookup[cursors[i]], first) == 0) {
+                mix->trie_ids[id * m + i] = cursors[i];
+                mix->mixture_ids[i][cursors[i]++] = id;
+            } else {
+                mix->trie_ids[id * m + i] = -1;
+            }
+        }
+    }
+    mix->sentence_start = mixture_find_word_id(mix, "<s>");
+    mix->unknown = mixture_find_word_id(mix, "<unk>");
+    return mix;
+}
+
+void trie_mixture_delete(struct trie_mixture *mix)
+{
+    for (unsigned short i = 0; i < mix->m; i++)
+        free(mix->mixture_ids[i]);
+    free(mix->mixture_ids);
+    free(mix->trie_ids);
+    free(mix->vocab_lookup);
+    free(mix->weights);
+    free(mix->tries);
+    free(mix);
+}
+
+uint64_t trie_mixture_vocab_size(const struct trie_mixture *mix)
+{
+    return mix->n_words;
+}
+
+word_id_type trie_mixture_get_word_id(const struct trie_mixture *mix,
+                                      const char *word_text)
+{
+    return mixture_find_word_id(mix, word_text);
+}
+
+const char *trie_mixture_word_text(const struct trie_mixture *mix,
+                                   word_id_type id)
+{
+    return (id < mix->n_words) ? mix->vocab_lookup[id].text : NULL;
+}
+
+unsigned short
+trie_mixture_get_k_nwp(const struct trie_mixture *mix, const char **words,
+                       int n, unsigned short k, struct prediction *predictions)
+{
+    const struct scratch_mark mark = scratch_mark();
+    struct lm_state **states = scratch_alloc(mix->m *
+                                             sizeof(struct lm_state *));
+    int max_len = 0;
+    for (unsigned short i = 0; i < mix->m; i++) {
+        states[i] = init_state(mix->tries[i],
+                               scratch_alloc(get_state_size(mix->tries[i])));
+        if (states[i]->max_len > max_len)
+            max_len = states[i]->max_len;
+    }
+    // only the last order - 1 words of the context can change its predictions
+    const int first = (n > max_len) ? n - max_len : 0;
+    word_id_type *ids = scratch_alloc((n - first + 1) * sizeof(word_id_type));
+    for (int j = first; j < n; j++)
+        ids[j - first] = mixture_find_word_id(mix, words[j]);
+    walk_mixture_context(mix, states, 1, ids, n - first);
+
+    struct mixture_source *sources = scratch_alloc(
+            mix->m * sizeof(struct mixture_source));
+    for (unsigned short i = 0; i < mix->m; i++)
+        set_mixture_source(mix, i, states[i], &sources[i]);
+    const unsigned short found = rank_mixture(mix, sources, k, predictions);
+    scratch_release(mark);
+    return found;
+}
+
+float trie_mixture_score_sentence(const struct trie_mixture *mix,
+                                  const char **words, unsigned int n,
+                                  float *scores)
+{
+    const struct scratch_mark mark = scratch_mark();
+    // the states of the i-th trie are at 2 * i and 2 * i + 1
+    struct lm_state **states = scratch_alloc(2 * mix->m *
+                                             sizeof(struct lm_state *));
+    for (unsigned short i = 0; i < 2 * mix->m; i++) {
+        const struct trie *t = mix->tries[i / 2];
+        states[i] = init_state(t, scratch_alloc(get_state_size(t)));
+    }
+    word_id_type *ids = scratch_alloc((n + 1) * sizeof(word_id_type));
+    for (unsigned int j = 0; j < n; j++)
+        ids[j] = mixture_find_word_id(mix, words[j]);
+    ids[n] = mixture_find_word_id(mix, "</s>");
+    walk_mixture_context(mix, states, 2, &mix->sentence_start, 1);
+
+    float total = 0;
+    for (unsigned int j = 0; j <= n; j++) {
+        // the tries are scored after prefetching what can be of all of them
+        for (unsigned short i = 0; i < mix->m; i++)
+            prefetch_state_score(mix->tries[i], states[2 * i + j % 2],
+                                 mixture_trie_id(mix, ids[j], i));
+        for (unsigned short i = 0; i < mix->m; i++)
+            prefetch_state_children(mix->tries[i], states[2 * i + j % 2]);
+        double probability = 0;
+        for (unsigned short i = 0; i < mix->m; i++)
+            probability += mix->weights[i] * to_probability(trie_state_score(
+                    mix->tries[i], states[2 * i + j % 2],
+                    mixture_trie_id(mix, ids[j], i),
+                    states[2 * i + (j + 1) % 2], NULL));
+        const float log10_probability = log10(probability);
+        if (scores != NULL)
+            scores[j] = log10_probability;
+        total += log10_probability;
+    }
+    scratch_release(mark);
+    return total;
+}
+
+/**
+ * Same as find_word_id(), but in the vocabulary of \p mix.
+ */
+static word_id_type
+mixture_find_word_id(const struct trie_mixture *mix, const char *word_text)
+{
+    uint64_t out[2];
+    murmurhash3(word_text, strlen(word_text), out);
+    struct word key = { out[0], (char *) word_text };
+    const struct word *idx = bsearch(&key, mix->vocab_lookup, mix->n_words,
+                                     sizeof(struct word), cmp_words);
+    if (idx == NULL)
+        return -1;
+    return idx - mix->vocab_lookup;
+}
+
+/**
+ * @return the id in the \p i-th trie of \p mix of its word \p id, which is
+ * unknown to the trie if it is not a word of \p mix.
+ */
+static inline word_id_type
+mixture_trie_id(const struct trie_mixture *mix, word_id_type id,
+                unsigned short i)
+{
+    return (id < mix->n_words) ? mix->trie_ids[id * mix->m + i] : -1;
+}
+
+/**
+ * Append the \p len words of \p ids of \p mix to the contexts of the states
+ * of its tries, the one of the i-th trie at \p states[i * stride], in
+ * lockstep: what every trie reads for a word is prefetched before any of
+ * them searches it.
+ */
+static void walk_mixture_context(const struct trie_mixture *mix,
+                                 struct lm_state **states, unsigned int stride,
+                                 const word_id_type *ids, unsigned int len)
+{
+    for (unsigned int j = 0; j < len; j++) {
+        for (unsigned short i = 0; i < mix->m; i++)
+            prefetch_state_score(mix->tries[i], states[i * stride],
+                                 mixture_trie_id(mix, ids[j], i));
+        for (unsigned short i = 0; i < mix->m; i++)
+            prefetch_state_children(mix->tries[i], states[i * stride]);
+        for (unsigned short i = 0; i < mix->m; i++)
+            trie_state_advance(mix->tries[i], states[i * stride],
+                               mixture_trie_id(mix, ids[j], i),
+                               states[i * stride]);
+    }
+}
+
+/**
+ * Set the source \p s of the \p i-th trie of \p mix to the context of
+ * \p state. An empty context is taken as "<s>", as in get_k_nwp_within().
+ */
+static void set_mixture_source(const struct trie_mixture *mix,
+                               unsigned short i, const struct lm_state *state,
+                               struct mixture_source *s)
+{
+    const struct trie *t = mix->tries[i];
+    const uint64_t *nodes = state->nodes;
+    unsigned short n = state->len;
+    uint64_t sentence_start = mixture_trie_id(mix, mix->sentence_start, i);
+    if (n == 0 && !is_unknown_wid(t, sentence_start)) {
+        nodes = &sentence_start;
+        n = 1;
+    }
+    struct context_level *levels = scratch_alloc(
+            (n + 1) * sizeof(struct context_level));
+    set_context_levels(t, nodes, n, levels);
+    s->t = t;
+    s->levels = levels;
+    s->n = n;
+    s->backoffs = scratch_alloc((n + 1) * sizeof(float));
+    s->backoffs[n] = 0;
+    for (unsigned short c = n; c > 0; c--)
+        s->backoffs[c - 1] = s->backoffs[c] + levels[c].backoff;
+    // the words unknown to the trie are scored as in trie_state_score()
+    const word_id_type unknown = mixture_trie_id(mix, mix->unknown, i);
+    s->unknown = to_probability(is_unknown_wid(t, unknown) ?
+                                UNKNOWN_WORD_LOG10_PROBABILITY +
+                                s->backoffs[0] :
+                                source_probability(s, unknown));
+}
+
+/**
+ * @return the log10 probability of the word \p id of the trie of \p s given
+ * its context: the one of the longest context the word follows, weighted by
+ * the backoffs of the longer contexts.
+ */
+static float source_probability(const struct mixture_source *s,
+                                word_id_type id)
+{
+    uint64_t index;
+    for (unsigned short c = s->n; c > 0; c--) {
+        const struct context_level *level = &s->levels[c];
+        if (find_child(s->t, c, level->node, level->l, level->r, id,
+                       &index) == 0)
+            return get_array_record(s->t, c + 1, index).probability +
+                   s->backoffs[c];
+    }
+    return get_array_record(s->t, 1, id).probability + s->backoffs[0];
+}
+
+/**
+ * Get the top \p k next word predictions of \p mix given the contexts of its
+ * \p sources. The probability of a word is the weighted sum of its
+ * probabilities in the tries, so the words each trie ranks are scored in all
+ * of them, from the best one on, as in the threshold algorithm of Fagin et
+ * al.: the next word is taken from the trie whose words not scored yet can
+ * weigh the most, until no word left can beat the k-th best prediction. A
+ * word left has in each trie at most the probability of the next word the
+ * trie ranks, or the probability of the words the trie lacks, the same for
+ * all of them, so the words some trie lacks are only scored when another
+ * trie ranks them. A trie runs out of ranked words only when the k it
+ * ranked first are not enough, and then it ranks twice as many, but the
+ * other tries keep theirs.
+ * @return the number of predictions found.
+ */
+static unsigned short
+rank_mixture(const struct trie_mixture *mix, struct mixture_source *sources,
+             unsigned short k, struct prediction *predictions)
+{
+    struct top_k top = { predictions, 0, k };
+    struct word_id_set scored;
+    word_id_set_init(&scored, 1024);
+    for (unsigned short i = 0; i < mix->m; i++)
+        rank_source(&sources[i], k);
+    while (1) {
+        double bound = 0;
+        unsigned short next_i = mix->m;
+        for (unsigned short i = 0; i < mix->m; i++) {
+            const struct mixture_source *s = &sources[i];
+            const double lacked = (s->t->n_ngrams[0] < mix->n_words) ?
+                                  s->unknown : 0;
+            bound += mix->weights[i] * fmax(s->left, lacked);
+            if (is_next_source(mix, sources, i, next_i))
+                next_i = i;
+        }
+        if (next_i == mix->m || (top.len == k &&
+                                 predictions[0].probability +
+                                 MIXTURE_ROUNDING_SLACK >=
+                                 (float) log10(bound)))
+            break;
+        struct mixture_source *s = &sources[next_i];
+        if (s->next < s->found) {
+            const word_id_type id = s->ranked[s->next++].word_id;
+            score_mixture_word(mix, sources, mix->mixture_ids[next_i][id],
+                               next_i, s->left, &scored, &top);
+            set_source_left(s);
+        } else if (s->depth > UINT16_MAX / 2) {
+            // too deep for the rankings of the tries, so score every word
+            for (word_id_type id = 0; id < mix->n_words; id++)
+                if (id != mix->sentence_start)
+                    score_mixture_word(mix, sources, id, mix->m, 0, &scored,
+                                       &top);
+            break;
+        } else {
+            // the words ranked again are scored already, so they are skipped
+            rank_source(s, 2 * s->depth);
+        }
+    }
+    return finish_top_k(&top);
+}
+
+/**
+ * Whether the words of the \p i-th of \p sources are to be scored before the
+ * ones of the \p j-th, which is none if it is the number of tries of
+ * \p mix. The ranked words left are scored before a trie ranks more, which
+ * a trie that ranked fewer words than it was asked cannot, and the source
+ * whose words left can weigh the most goes first.
+ */
+static int is_next_source(const struct trie_mixture *mix,
+                          const struct mixture_source *sources,
+                          unsigned short i, unsigned short j)
+{
+    const struct mixture_source *s = &sources[i];
+    if (s->next == s->found && s->found < s->depth)
+        return 0;
+    if (j == mix->m)
+        return 1;
+    const struct mixture_source *other = &sources[j];
+    if ((s->next < s->found) != (other->next < other->found))
+        return s->next < s->found;
+    return mix->weights[i] * s->left > mix->weights[j] * other->left;
+}
+
+/**
+ * Rank the top \p depth predictions of the trie of \p s, to be scored from
+ * the best one on.
+ */
+static void rank_source(struct mixture_source *s, unsigned short depth)
+{
+    s->ranked = scratch_alloc(depth * sizeof(struct prediction));
+    s->depth = depth;
+    s->found = rank_levels(s->t, s->levels, s->n, NULL, depth, s->ranked);
+    s->next = 0;
+    set_source_left(s);
+}
+
+/**
+ * Set the highest probability the words of \p s not scored yet can have in
+ * its trie, but the ones it lacks: the one of the next word it ranks, or of
+ * the last one if it can rank more.
+ */
+static void set_source_left(struct mixture_source *s)
+{
+    if (s->next < s->found)
+        s->left = to_probability(s->ranked[s->next].probability);
+    else if (s->found == s->depth)
+        s->left = to_probability(s->ranked[s->depth - 1].probability);
+    else
+        s->left = 0;
+}
+
+/**
+ * Push the word \p id of \p mix to \p top with its probability in the
+ * mixture, unless it was scored already. If \p known_i is the index of a
+ * trie, \p known is the probability of the word in it, which is not
+ * searched.
+ */
+static void score_mixture_word(const struct trie_mixture *mix,
+                               const struct mixture_source *sources,
+                               word_id_type id, unsigned short known_i,
+                               double known, struct word_id_set *scored,
+                               struct top_k *top)
+{
+    if (!word_id_set_add(scored, id))
+        return;
+    const word_id_type *trie_ids = &mix->trie_ids[id * mix->m];
+    for (unsigned short i = 0; i < mix->m; i++)
+        if (i != known_i && !is_unknown_wid(mix->tries[i], trie_ids[i]))
+            prefetch_records(mix->tries[i], 1, trie_ids[i], trie_ids[i] + 1);
+    double probability = 0;
+    for (unsigned short i = 0; i < mix->m; i++) {
+        double p;
+        if (i == known_i)
+            p = known;
+        else if (is_unknown_wid(mix->tries[i], trie_ids[i]))
+            p = sources[i].unknown;
+        else
+            p = to_probability(source_probability(&sources[i], trie_ids[i]));
+        probability += mix->weights[i] * p;
+    }
+    const struct prediction p = { id, log10(probability) };
+    if (top_k_admits(top, &p))
+        top_k_push(top, p);
+}
+
+/**
+ * @return 10 to the power of \p log10_probability.
+ */
+static inline double to_probability(float log10_probability)
+{
+    return exp2(log10_probability * LOG2_10);
+}
+
+static void word_id_set_init(struct word_id_set *s, uint64_t capacity)
+{
+    s->ids = scratch_alloc(capacity * sizeof(word_id_type));
+    memset(s->ids, 0xff, capacity * sizeof(word_id_type));
+    s->mask = capacity - 1;
+    s->len = 0;
+}
+
+/**
+ * Add \p id to \p s, which doubles its capacity when it is half full.
+ * @return whether \p id was not in \p s.
+ */
+static int word_id_set_add(struct word_id_set *s, word_id_type id)
+{
+    if (2 * (s->len + 1) > s->mask + 1) {
+        const struct word_id_set old = *s;
+        word_id_set_init(s, 2 * (old.mask + 1));
+        for (uint64_t i = 0; i <= old.mask; i++)
+            if (old.ids[i] != (word_id_type) -1)
+                word_id_set_add(s, old.ids[i]);
+    }
+    uint64_t i = (id * 0x9e3779b97f4a7c15ULL) >> 32;
+    for (;; i++) {
+        word_id_type *slot = &s->ids[i & s->mask];
+        if (*slot == id)
+            return 0;
+        if (*slot == (word_id_type) -1) {
+            *slot = id;
+            s->len++;
+            return 1;
+        }
+    }
 }
@@ -4,6 +4,21 @@
  * @brief Trie for indexing and querying n-grams. This implementation is
  * based on KenLM, however here the n-grams are not saved in reverse order,
  * making it suitable for next word prediction queries.
+ *
+ * Every function is reentrant. Once built or loaded, a trie can be queried
+ * by any number of threads at once, since the queries only read it and the
+ * caches they fill are synchronized. The functions that change a trie, i.e.
+ * trie_index_large_ranges(), trie_cache_hot_contexts(),
+ * trie_cache_queries(), trie_collect_metrics() and trie_delete(), must not
+ * run while it is being queried. An lm_state must only be used by one
+ * thread at a time.
+ *
+ * The queries take the buffers whose size is only known at run time from
+ * the thread-local scratch memory of scratch.h, so once a thread has made a
+ * query of each size it needs, its queries no longer allocate from the heap.
+ * The exceptions are trie_query_ngram() and trie_state_new(), which return
+ * heap memory, and the insertions into the query cache of
+ * trie_cache_queries().
  */
 
 #ifndef NGRAM_LM_TRIE_H
@@ -13,18 +28,73 @@
 
 #include "arpa.h"
 #include "array.h"
+#include "eytzinger.h"
+#include "hot_cache.h"
+#include "metrics.h"
 #include "ngram.h"
+#include "query_cache.h"
 #include "word.h"
 
+/**
+ * Eytzinger layouts of the sibling ranges that have at least `min_fanout`
+ * children, indexed by the order of their parent. See
+ * trie_index_large_ranges().
+ */
+struct large_ranges {
+    uint64_t min_fanout;
+    uint64_t *len;                  /// number of indexed ranges per order
+    uint64_t **parents;             /// sorted parent indexes per order
+    struct eytzinger ***layouts;    /// layout of each parent's children
+};
+
+/**
+ * Bit offset and size of each field of the records of a given order. A
+ * field that is not stored (the word id of unigrams, which is their index,
+ * and the backoff and first child index of the highest order n-grams) has
+ * size 0.
+ */
+struct record_layout {
+    uint8_t probability_offset;
+    uint8_t probability_size;
+    uint8_t backoff_offset;
+    uint8_t backoff_size;
+    uint8_t word_id_offset;
+    uint8_t word_id_size;
+    uint8_t first_child_index_offset;
+    uint8_t first_child_index_size;
+};
+
 struct trie {
     unsigned short order;
     uint64_t *n_ngrams;
     struct word *vocab_lookup;
     struct array **arrays;      /// sorted ngram arrays
+    struct large_ranges *large_ranges;
+    struct record_layout *layouts;  /// record layout of each order
+    struct prediction *unigram_ranking; /// unigrams from the best to the worst
+    uint64_t n_ranked_unigrams;
+    word_id_type *lexicon;      /// word ids in the lexicographic order
+    uint32_t *lexicon_ranks;    /// position of each word id in the lexicon
+    struct hot_cache *hot_cache;    /// top-k predictions of the hot contexts
+    struct query_cache *query_cache;    /// results of the recent queries
+    struct metrics *metrics;    /// metrics of the queries, or NULL
+    void *mapping;              /// of the file of the arrays, see trie_map()
+    size_t mapping_size;
+};
+
+/**
+ * A gram of an n-gram found in the trie, along with the probability and
+ * backoff of the n-gram that ends at it.
+ */
+struct gram {
+    word_id_type word_id;
+    float probability;
+    float backoff;
 };
 
 struct array_record {
     float probability;
+    float backoff;
     word_id_type word_id;
     uint64_t first_child_index;
 };
@@ -50,6 +120,101 @@ struct trie *trie_new_from_arpa(unsigned short order, const struct arpa *arpa);
 struct trie *
 trie_new_from_arpa_path(unsigned short order, const char *arpa_path);
 
+/**
+ * Build an Eytzinger layout of the word ids of every sibling range with at
+ * least \p min_fanout children, which is then used to search those ranges
+ * instead of the binary search over the bit-packed arrays. Smaller ranges
+ * keep being searched in their sorted order. Calling it again replaces the
+ * previous layouts, and a \p min_fanout of 0 drops them.
+ * @note The layouts are not saved by trie_fwrite(). Call this function again
+ * after loading the trie.
+ * @param t
+ * @param min_fanout
+ */
+void trie_index_large_ranges(struct trie *t, uint64_t min_fanout);
+
+/**
+ * Cache the top \p k next word predictions of the most frequent contexts, in
+ * at most \p budget bytes. The contexts looked up are counted, and the ones
+ * looked up more often replace the less frequent ones (see hot_cache.h).
+ * Queries for at most \p k predictions, from any number of threads, use the
+ * cache. Calling it again replaces the previous cache, and a \p budget of 0
+ * drops it.
+ * @note The cache belongs to \p t and is not saved by trie_fwrite(), so a
+ * reloaded trie starts without one. Call this function again after loading
+ * the trie, before sharing it between threads.
+ * @param t
+ * @param budget
+ * @param k
+ * @return 0 on success or 1 if \p budget is too small.
+ */
+int trie_cache_hot_contexts(struct trie *t, size_t budget, unsigned short k);
+
+/**
+ * Cache the results of trie_get_k_nwp(), trie_get_k_nwp_predictions() and
+ * trie_query_ngram(), keyed by the word ids of their query and their \p k,
+ * in at most \p budget bytes. The cache is split into \p n_shards shards,
+ * each with its own lock and CLOCK eviction, so that many threads can query
+ * the trie at once without contending for a single lock (see
+ * query_cache.h). Calling it again replaces the previous cache, and a
+ * \p budget of 0 drops it.
+ * @note Like the hot cache, the query cache belongs to \p t and is not saved
+ * by trie_fwrite(). Call this function before sharing the trie between
+ * threads.
+ * @param t
+ * @param budget
+ * @param n_shards rounded up to a power of 2, or 0 for the default of 64.
+ * @return 0 on success or 1 if \p budget is too small.
+ */
+int trie_cache_queries(struct trie *t, size_t budget, unsigned int n_shards);
+
+/**
+ * Get the statistics of the first \p n shards of the query cache of \p t.
+ * @param t
+ * @param stats array of \p n statistics.
+ * @param n
+ * @return the number of shards of the query cache, or 0 if \p t has none.
+ */
+unsigned int
+trie_get_query_cache_stats(const struct trie *t,
+                           struct query_cache_stats *stats, unsigned int n);
+
+/**
+ * Get the lookup and hit counts, among others, of the hot cache of \p t.
+ * @param t
+ * @param stats pass out pointer for the statistics.
+ * @return 0 on success or 1 if \p t has no hot cache.
+ */
+int trie_get_hot_cache_stats(const struct trie *t,
+                             struct hot_cache_stats *stats);
+
+/**
+ * Start or stop collecting metrics of the queries of \p t: how many context
+ * words are unknown, how long the suffixes of the contexts found in the trie
+ * are, how many shorter contexts are ranked or backed off to, the sizes of
+ * the children ranges searched and scanned, and the latency of each query
+ * function (see metrics.h). Each thread records its metrics in one of
+ * \p n_shards shards, so that the threads do not contend for them. Calling
+ * it again resets the metrics.
+ * @note The metrics belong to \p t and are not saved by trie_fwrite(). Call
+ * this function before sharing the trie between threads.
+ * @param t
+ * @param enable
+ * @param n_shards rounded up to a power of 2, or 0 for the default of 16.
+ * @return 0 on success or 1 if the metrics could not be allocated.
+ */
+int trie_collect_metrics(struct trie *t, int enable, unsigned int n_shards);
+
+/**
+ * Get the metrics collected by \p t so far. Use metrics_format_prometheus()
+ * to export them.
+ * @param t
+ * @param snapshot pass out pointer for the metrics.
+ * @return 0 on success or 1 if \p t does not collect metrics.
+ */
+int trie_metrics_snapshot(const struct trie *t,
+                          struct metrics_snapshot *snapshot);
+
 /**
  * Free trie \p t.
  * @param t
@@ -66,13 +231,28 @@ void trie_delete(struct trie *t);
  * @param words array of \p n words/grams.
  * @param n length of the n-gram to be queried, as parameter. length of the
  * returned n-gram, as return-value.
- * @return n-gram found.
+ * @return n-gram found, or NULL if the last word is unknown.
  */
 struct ngram *
 trie_query_ngram(const struct trie *t, char const **words, int *n);
 
 /**
- * Write trie model to file pointed by \p f.
+ * Same as trie_query_ngram(), but writing the grams of the n-gram found to
+ * \p grams instead of allocating them.
+ * @param t
+ * @param words array of \p n words/grams.
+ * @param n length of the n-gram to be queried.
+ * @param grams array of at least \p n grams, where the ones of the n-gram
+ * found are written from the first to the last.
+ * @return the length of the n-gram found, which is 0 if the last word is
+ * unknown.
+ */
+int trie_query_ngram_grams(const struct trie *t, char const **words, int n,
+                           struct gram *grams);
+
+/**
+ * Write trie model to file pointed by \p f. The file starts with a magic
+ * number and the version of the format, which changes with struct trie.
  * @param t
  * @param f
  */
@@ -83,7 +263,8 @@ void trie_fwrite(const struct trie *t, FILE *f);
  * @warning *\p t should be freed by the caller. Use trie_delete().
  * @param t
  * @param f
- * @return
+ * @return 1 on success, other value if the file could not be read or was
+ * not written by trie_fwrite() of this version of the format.
  */
 size_t trie_fread(struct trie **t, FILE *f);
 
@@ -104,9 +285,82 @@ int trie_save(const struct trie *t, const char *path);
  */
 int trie_load(const char *path, struct trie **t);
 
+/**
+ * Same as trie_load(), but the n-gram arrays are memory mapped from the file
+ * instead of read, so that loading costs only the vocabulary, the n-grams are
+ * read from disk as they are queried, and the processes that map the same
+ * file share their pages.
+ * @warning *\p t should be freed by the caller. Use trie_delete(). The file
+ * must not be changed while it is mapped.
+ * @param path
+ * @param t
+ * @return 0 if no error occurred. Other value if an error occurred.
+ */
+int trie_map(const char *path, struct trie **t);
+
+/**
+ * Build the trie of \p t updated with the n-gram changes of the delta file
+ * \p delta_path, without building it again from an ARPA file. The n-grams
+ * of \p t, which may be mapped, are merged in order with the sorted changes,
+ * so the update costs a pass over the trie plus sorting the delta.
+ *
+ * The delta has ARPA sections of the n-grams to add or change, whose lines
+ * have a probability, the words and an optional backoff, and sections of
+ * the n-grams to remove, whose lines have only the words:
+ * @code
+ * \2-grams:
+ * -0.5 é que -0.1
+ * \removed-3-grams:
+ * é que os
+ * @endcode
+ * Lines before the first section, like the ones of \\data\\, are ignored,
+ * and the last change of an n-gram wins. A changed n-gram keeps its
+ * children, and a removed one loses them, as a removed word loses all of
+ * its n-grams. The words added by 1-grams take word ids among the existing
+ * ones, which shift to make room.
+ * @warning the trie returned should be freed by the caller. Use
+ * trie_delete().
+ * @param t
+ * @param delta_path
+ * @return the updated trie, or NULL if the delta could not be read, is not
+ * valid, or adds an n-gram with an unknown word or context.
+ */
+struct trie *trie_apply_delta(const struct trie *t, const char *delta_path);
+
 word_id_type
 trie_get_word_id_from_text(const struct trie *t, const char *word_text);
 
+/**
+ * Get the ids of the \p n words of \p word_text, as
+ * trie_get_word_id_from_text() does for each of them, so that the words can
+ * be encoded once and queried by id.
+ * @param t
+ * @param word_text array of \p n words.
+ * @param n
+ * @param dest array of \p n ids, where the unknown words get id -1.
+ */
+void
+trie_get_word_ids(const struct trie *t, const char **word_text, unsigned int n,
+                  word_id_type *dest);
+
+/**
+ * Get the children of the \p n-length context \p context, i.e. the words
+ * that follow it in the n-grams of the trie, with their log10 probabilities
+ * given the context, without backoffs. The children of the empty context are
+ * the unigrams. Call it with NULL \p ids to get their number first.
+ * @param t
+ * @param context array of \p n word ids.
+ * @param n
+ * @param ids array where to write the ids of the children, in the order of
+ * the trie, which is increasing, or NULL.
+ * @param probabilities array where to write the probabilities of the
+ * children, if \p ids is not NULL.
+ * @return the number of children, which is 0 if the context is not in the
+ * trie.
+ */
+uint64_t trie_get_children(const struct trie *t, const word_id_type *context,
+                           int n, word_id_type *ids, float *probabilities);
+
 /**
  * Obtain the text correspondent to word \p id. The rational of arguments
  * \p dest and \p n is the same as in \p <a href="https://en.cppreference
@@ -132,14 +386,365 @@ trie_word_textncpy(const struct trie *t, word_id_type id, char *dest, size_t n);
 struct word *trie_get_nwp(const struct trie *t, const char **words, int n);
 
 /**
- * Get top \p k next predictions predictions given the \p n-length context given by \p
- * words.
+ * Get top \p k next word predictions given the \p n-length context given by
+ * \p words. See trie_get_k_nwp_predictions().
  * @param t
  * @param words prediction context, of length \p n.
  * @param n the length of context \p words.
- * @return next predictions prediction.
+ * @param k
+ * @param predictions array of \p k words, from the best to the worst
+ * prediction. Predictions not found are set to NULL.
  */
 void trie_get_k_nwp(const struct trie *t, const char **words, int n,
                     unsigned short k, struct word **predictions);
 
+/**
+ * Get top \p k next word predictions, with their probabilities, given the
+ * \p n-length context given by \p words. The words are ranked by their
+ * backed-off probability given the context, as scored by trie_state_score(),
+ * across all the orders. The shorter contexts are only searched while they
+ * can still beat the k-th best prediction, and only \f$O(k)\f$ memory is
+ * used, regardless of the number of children.
+ * @param t
+ * @param words prediction context, of length \p n.
+ * @param n the length of context \p words.
+ * @param k
+ * @param predictions array of \p k predictions, from the best to the worst.
+ * Predictions not found, if the vocabulary has less than \p k words, are set
+ * to word id -1 with a probability of -inf.
+ * @return the number of predictions found.
+ */
+unsigned short
+trie_get_k_nwp_predictions(const struct trie *t, const char **words, int n,
+                           unsigned short k, struct prediction *predictions);
+
+/**
+ * Same as trie_get_k_nwp_predictions(), but with the context given by the ids
+ * of its words, e.g. from trie_get_word_ids(). Any id that is not of a word of
+ * the vocabulary is an unknown word.
+ */
+unsigned short
+trie_get_k_nwp_word_ids(const struct trie *t, const word_id_type *ids, int n,
+                        unsigned short k, struct prediction *predictions);
+
+/**
+ * Get top \p k next word predictions starting with \p prefix, e.g. the part
+ * of the word being typed, given the \p n-length context given by \p words.
+ * The words are ranked as in trie_get_k_nwp_predictions(). The words starting
+ * with \p prefix are taken from a lexicographically sorted index of the
+ * vocabulary. When they are few, each one is searched among the children of
+ * the context, and when they are many, the children are scanned for them.
+ * @param t
+ * @param words prediction context, of length \p n.
+ * @param n the length of context \p words.
+ * @param prefix start of the predicted words. An empty one matches any word.
+ * @param k
+ * @param predictions array of \p k predictions, from the best to the worst.
+ * Predictions not found, if less than \p k words start with \p prefix, are
+ * set to word id -1 with a probability of -inf.
+ * @return the number of predictions found.
+ */
+unsigned short
+trie_get_k_nwp_prefix(const struct trie *t, const char **words, int n,
+                      const char *prefix, unsigned short k,
+                      struct prediction *predictions);
+
+/**
+ * Get the top \p k next word predictions of each of the \p m contexts of
+ * \p contexts, the same as calling trie_get_k_nwp_predictions() for each of
+ * them. The
+ * contexts are looked up in groups, whose trie paths are walked in lockstep:
+ * the next probe of every lookup of the group is prefetched before any of
+ * them is made, so that their cache misses overlap instead of being paid one
+ * after another.
+ * @param t
+ * @param contexts array of \p m prediction contexts.
+ * @param lens the length of each context of \p contexts.
+ * @param m the number of contexts.
+ * @param k
+ * @param predictions array of \p m * \p k predictions, where the
+ * predictions for the i-th context are written starting at index i * \p k.
+ */
+void trie_get_k_nwp_batch(const struct trie *t, const char **contexts[],
+                          const int *lens, unsigned int m, unsigned short k,
+                          struct prediction *predictions);
+
+/**
+ * Same as trie_get_k_nwp_batch(), but with the contexts split among
+ * \p n_threads threads, the calling one included, each getting the
+ * predictions of a slice of them. Fewer threads are used for small batches,
+ * since each one is created for the call.
+ * @param n_threads the number of threads, or 0 for as many as the online CPUs.
+ */
+void trie_get_k_nwp_batch_parallel(const struct trie *t,
+                                   const char **contexts[], const int *lens,
+                                   unsigned int m, unsigned short k,
+                                   struct prediction *predictions,
+                                   unsigned int n_threads);
+
+/**
+ * State of a query context that is extended one word at a time, holding the
+ * trie nodes of the suffixes of the context, so that extending it costs one
+ * children search per order instead of a walk from the root per query. A
+ * state is tied to the trie that created it.
+ * @code
+ * struct lm_state *state = trie_state_new(t);
+ * trie_state_advance(t, state, trie_get_word_id_from_text(t, "This"), state);
+ * trie_state_advance(t, state, trie_get_word_id_from_text(t, "is"), state);
+ * trie_state_get_k_nwp(t, state, k, predictions);
+ * trie_state_delete(state);
+ * @endcode
+ */
+struct lm_state;
+
+/**
+ * Create a state with an empty context, for which the predictions are the
+ * ones of the sentence start "<s>".
+ * @warning The state must be freed by the caller. Use trie_state_delete().
+ * @param t
+ * @return
+ */
+struct lm_state *trie_state_new(const struct trie *t);
+
+/**
+ * Free \p state.
+ * @param state
+ */
+void trie_state_delete(struct lm_state *state);
+
+/**
+ * Empty the context of \p state.
+ * @param state
+ */
+void trie_state_reset(struct lm_state *state);
+
+/**
+ * Copy \p src into \p dest, both created by the same trie.
+ * @param dest
+ * @param src
+ */
+void trie_state_copy(struct lm_state *dest, const struct lm_state *src);
+
+/**
+ * Get the length of the longest suffix of the context of \p state that is in
+ * the trie, which is at most the order of the trie minus one.
+ * @param state
+ * @return
+ */
+unsigned short trie_state_length(const struct lm_state *state);
+
+/**
+ * Append word \p word_id to the context of \p state, writing the result to
+ * \p out_state. An unknown word empties the context, as in trie_get_k_nwp().
+ * @note \p out_state can be \p state.
+ * @warning The matched suffixes are found by extending the suffixes of
+ * \p state, which assumes that, as in any ARPA file, the suffixes of every
+ * n-gram are listed too.
+ * @param t
+ * @param state
+ * @param word_id
+ * @param out_state
+ */
+void trie_state_advance(const struct trie *t, const struct lm_state *state,
+                        word_id_type word_id, struct lm_state *out_state);
+
+/**
+ * Get top \p k next word predictions given the context of \p state. The
+ * predictions are the same as the ones of trie_get_k_nwp_predictions() for
+ * the context.
+ * @param t
+ * @param state
+ * @param k
+ * @param predictions array of \p k predictions.
+ * @return the number of predictions found.
+ */
+unsigned short
+trie_state_get_k_nwp(const struct trie *t, const struct lm_state *state,
+                     unsigned short k, struct prediction *predictions);
+
+/**
+ * Score of a word given its preceding words.
+ */
+struct token_score {
+    float log10_probability;    /// log10 p(w | h), backoffs included
+    unsigned short ngram_length;    /// length of the n-gram used
+    uint8_t is_oov;             /// whether w is not in the vocabulary
+};
+
+/**
+ * Score word \p word_id given the context of \p state, writing the context
+ * extended with \p word_id to \p out_state. The probability of the longest
+ * n-gram ending at \p word_id that is in the trie is used, plus the backoffs
+ * of the contexts longer than its context. Unknown words are scored as
+ * "<unk>", or with a log10 probability of -100 if there is no "<unk>", and
+ * empty the context.
+ * @warning \p out_state cannot be \p state.
+ * @param t
+ * @param state
+ * @param word_id
+ * @param out_state
+ * @param score pass out pointer for the details of the score. Can be NULL.
+ * @return log10 p(\p word_id | context of \p state).
+ */
+float trie_state_score(const struct trie *t, const struct lm_state *state,
+                       word_id_type word_id, struct lm_state *out_state,
+                       struct token_score *score);
+
+/**
+ * Score each of the \p n \p words given the words before it in \p words.
+ * @param t
+ * @param words
+ * @param n
+ * @param scores array of \p n scores, or NULL.
+ * @return the log10 probability of the sequence.
+ */
+float trie_score_tokens(const struct trie *t, const char **words,
+                        unsigned int n, struct token_score *scores);
+
+/**
+ * Same as trie_score_tokens(), but with the words given by their ids, e.g.
+ * from trie_get_word_ids(). Any id that is not of a word of the vocabulary is
+ * an unknown word.
+ */
+float trie_score_word_ids(const struct trie *t, const word_id_type *ids,
+                          unsigned int n, struct token_score *scores);
+
+/**
+ * Score the sentence of \p n \p words, preceded by "<s>" and followed by
+ * "</s>". The perplexity of the sentence is
+ * \f$10^{-s / (n + 1)}\f$, where \f$s\f$ is the returned score.
+ * @param t
+ * @param words
+ * @param n
+ * @param scores array of \p n + 1 scores, the last for "</s>", or NULL.
+ * @return the log10 probability of the sentence.
+ */
+float trie_score_sentence(const struct trie *t, const char **words,
+                          unsigned int n, struct token_score *scores);
+
+/**
+ * Score the \p m \p sentences, the same as calling trie_score_sentence() for
+ * each of them. The sentences are scored in groups, a token of each sentence
+ * of the group at a time, with the memory accesses that do not depend on
+ * each other being prefetched for all the sentences of the group first.
+ * @param t
+ * @param sentences array of \p m sentences.
+ * @param lens the length of each sentence of \p sentences.
+ * @param m the number of sentences.
+ * @param totals array of \p m log10 probabilities, one per sentence.
+ * @param scores array of \f$\sum_i\f$ (\p lens[i] + 1) scores, where the
+ * ones of each sentence follow the ones of the previous sentence, or NULL.
+ */
+void trie_score_sentences(const struct trie *t, const char **sentences[],
+                          const unsigned int *lens, unsigned int m,
+                          float *totals, struct token_score *scores);
+
+/**
+ * Compute the perplexity of the \p m \p sentences, counting "</s>" as a
+ * token of every sentence.
+ * @param t
+ * @param sentences array of \p m sentences.
+ * @param lens the length of each sentence of \p sentences.
+ * @param m the number of sentences.
+ * @return
+ */
+double trie_perplexity(const struct trie *t, const char **sentences[],
+                       const unsigned int *lens, unsigned int m);
+
+/**
+ * Linear interpolation of several tries, e.g. of a general model with domain
+ * models, queried in a single pass over all of them. Its vocabulary is the
+ * union of theirs, with ids of its own, so that the words of a query are
+ * looked up once, and the tries are walked in lockstep, with what each of
+ * them reads at a step prefetched before any of them reads it. A mixture is
+ * read only, so several threads can query it at once.
+ * @code
+ * const struct trie *tries[] = { general, news };
+ * const float weights[] = { 0.7f, 0.3f };
+ * struct trie_mixture *mix = trie_mixture_new(tries, weights, 2);
+ * struct prediction predictions[3];
+ * const char *words[] = { "é", "que" };
+ * unsigned short n = trie_mixture_get_k_nwp(mix, words, 2, 3, predictions);
+ * for (unsigned short i = 0; i < n; i++)
+ *     puts(trie_mixture_word_text(mix, predictions[i].word_id));
+ * trie_mixture_delete(mix);
+ * @endcode
+ */
+struct trie_mixture;
+
+/**
+ * Create the mixture of the \p m \p tries, with the probability of a word
+ * being \f$\sum_i w_i p_i\f$, where \f$p_i\f$ is its probability in the
+ * i-th trie and \f$w_i\f$ is \p weights[i] over the sum of \p weights. A
+ * word a trie lacks has the probability of "<unk>" in it, as when scoring.
+ * A trie given more than once is searched once, with the sum of its weights.
+ * @warning The mixture must be freed by the caller. Use
+ * trie_mixture_delete(). The tries must outlive it.
+ * @param tries
+ * @param weights array of \p m positive weights.
+ * @param m
+ * @return the mixture, or NULL if \p m is 0 or a weight is not positive.
+ */
+struct trie_mixture *trie_mixture_new(const struct trie **tries,
+                                      const float *weights, unsigned short m);
+
+/**
+ * Free \p mix, but not its tries.
+ * @param mix
+ */
+void trie_mixture_delete(struct trie_mixture *mix);
+
+/**
+ * @return the number of words of the vocabulary of \p mix.
+ */
+uint64_t trie_mixture_vocab_size(const struct trie_mixture *mix);
+
+/**
+ * @return the id of the word \p word_text in \p mix, or an id not less than
+ * its vocabulary size if it has no such word.
+ */
+word_id_type trie_mixture_get_word_id(const struct trie_mixture *mix,
+                                      const char *word_text);
+
+/**
+ * @return the text of the word \p id of \p mix, or NULL if it has no such
+ * word.
+ */
+const char *trie_mixture_word_text(const struct trie_mixture *mix,
+                                   word_id_type id);
+
+/**
+ * Get the top \p k next word predictions of \p mix given the context
+ * \p words, with the ids of the words of \p mix. Each trie takes the context
+ * as trie_get_k_nwp_predictions() does. The top predictions of each trie
+ * are scored in all of them, and more of them are only searched while a word
+ * left can beat the k-th best prediction, so the predictions are exact up to
+ * the float rounding of their probabilities.
+ * @param mix
+ * @param words
+ * @param n the length of \p words.
+ * @param k
+ * @param predictions array of \p k predictions, set as
+ * trie_get_k_nwp_predictions() does.
+ * @return the number of predictions found.
+ */
+unsigned short
+trie_mixture_get_k_nwp(const struct trie_mixture *mix, const char **words,
+                       int n, unsigned short k, struct prediction *predictions);
+
+/**
+ * Score the sentence of \p n \p words, preceded by "<s>" and followed by
+ * "</s>", as trie_score_sentence() does, with the probability of each token
+ * in \p mix.
+ * @param mix
+ * @param words
+ * @param n
+ * @param scores array of \p n + 1 log10 probabilities, the last of "</s>",
+ * or NULL.
+ * @return the log10 probability of the sentence.
+ */
+float trie_mixture_score_sentence(const struct trie_mixture *mix,
+                                  const char **words, unsigned int n,
+                                  float *scores);
+
 #endif //NGRAM_LM_TRIE_H
@@ -5,10 +5,52 @@ extern "C" {
 #include "c/trie.h"
 #include "c/ngram.h"
 #include "c/arpa.h"
+#include "c/arpa_gen.h"
+#include "c/util/log.h"
 }
 
 #include <gtest/gtest.h>
 #include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The sanitizers interpose the allocator themselves.
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define COUNT_ALLOCATIONS
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+}
+
+/**
+ * The heap allocations made by the calling thread.
+ */
+static __thread unsigned long n_allocations;
+
+void *malloc(size_t size) noexcept
+{
+    n_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept
+{
+    n_allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+    n_allocations++;
+    return __libc_realloc(ptr, size);
+}
+#endif
 
 const char *TEST_DATA = "./data/tmp.arpa";
 
@@ -24,6 +66,11 @@ static void validate_trie(const struct trie *t)
         EXPECT_TRUE(
                 t->vocab_lookup[i - 1].hash < t->vocab_lookup[i].hash);
     }
+    for (int i = 1; i < t->n_ngrams[0]; i++) {
+        EXPECT_LT(strcmp(t->vocab_lookup[t->lexicon[i - 1]].text,
+                         t->vocab_lookup[t->lexicon[i]].text), 0);
+        EXPECT_EQ(t->lexicon_ranks[t->lexicon[i]], i);
+    }
 
     EXPECT_EQ(t->arrays[0]->len, 210);
     EXPECT_EQ(t->arrays[1]->len, 324);
@@ -54,6 +101,7 @@ TEST(Trie, trie_query_ngram)
     struct ngram *ngram = trie_query_ngram(t, (char const **) grams, &n);
     EXPECT_EQ(-0.29952f, ngram->probability);
     EXPECT_STREQ(ngram->word->text, "português");
+    ngram_delete(ngram);
 
     grams[0] = "garanta";
     grams[1] = "essa";
@@ -63,6 +111,7 @@ TEST(Trie, trie_query_ngram)
     EXPECT_STREQ(ngram->word->text, "circulação");
     EXPECT_TRUE(ngram->context != nullptr);
     EXPECT_TRUE(ngram->context->context != nullptr);
+    ngram_delete(ngram);
 
     grams[0] = "havia";
     grams[1] = "é";
@@ -70,10 +119,45 @@ TEST(Trie, trie_query_ngram)
     ngram = trie_query_ngram(t, (char const **) grams, &n);
     EXPECT_STREQ(ngram->word->text, "é");
     EXPECT_TRUE(ngram->context == nullptr);
+    ngram_delete(ngram);
+
+    grams[0] = "é";
+    grams[1] = "anonexistingword";
+    n = 2;
+    EXPECT_TRUE(trie_query_ngram(t, (char const **) grams, &n) == nullptr);
+    EXPECT_EQ(n, 0);
 
     trie_delete(t);
 }
 
+TEST(Trie, trie_query_ngram_grams)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    char const *grams[] = { "anonexistingword", "garanta", "essa",
+                            "circulação" };
+    struct gram found[4];
+    for (int start = 0; start < 4; start++) {
+        const int n = 4 - start;
+        int expected_n = n;
+        struct ngram *chain = trie_query_ngram(t, &grams[start], &expected_n);
+        EXPECT_EQ(trie_query_ngram_grams(t, &grams[start], n, found),
+                  expected_n);
+        const struct ngram *ngram = chain;
+        // the grams are written from the first to the last
+        for (int i = expected_n - 1; i >= 0; i--) {
+            EXPECT_STREQ(t->vocab_lookup[found[i].word_id].text,
+                         ngram->word->text);
+            EXPECT_EQ(found[i].probability, ngram->probability);
+            EXPECT_EQ(found[i].backoff, ngram->backoff);
+            ngram = ngram->context;
+        }
+        EXPECT_TRUE(ngram == nullptr);
+        ngram_delete(chain);
+    }
+    EXPECT_EQ(trie_query_ngram_grams(t, grams, 1, found), 0);
+    trie_delete(t);
+}
+
 const char *OUT_PATH = "./data/tmp.bin";
 
 TEST(Trie, trie_fwrite_and_trie_fread)
@@ -115,6 +199,170 @@ TEST(Trie, trie_save_and_trie_load)
     std::remove(OUT_PATH);
 }
 
+TEST(Trie, trie_load_rejects_files_of_other_versions)
+{
+    log_set_quiet(true);
+    // a file of the format without a version, which starts with the order
+    const unsigned short order = 3;
+    FILE *f = fopen(OUT_PATH, "wb");
+    ASSERT_TRUE(f != nullptr);
+    fwrite(&order, sizeof(order), 1, f);
+    fwrite(std::vector<char>(1024).data(), 1, 1024, f);
+    fclose(f);
+    struct trie *t = nullptr;
+    EXPECT_NE(trie_load(OUT_PATH, &t), 0);
+    EXPECT_NE(trie_map(OUT_PATH, &t), 0);
+    EXPECT_TRUE(t == nullptr);
+    std::remove(OUT_PATH);
+    log_set_quiet(false);
+}
+
+TEST(Trie, trie_map)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    trie_save(t, OUT_PATH);
+    trie_delete(t);
+
+    ASSERT_EQ(trie_map(OUT_PATH, &t), 0);
+    EXPECT_TRUE(t->mapping != nullptr);
+    validate_trie(t);
+    const char *words[] = { "é", "que" };
+    struct word *word_preds[3];
+    trie_get_k_nwp(t, words, 2, 3, word_preds);
+    EXPECT_STREQ(word_preds[0]->text, "os");
+    EXPECT_STREQ(word_preds[1]->text, "levaram");
+    EXPECT_STREQ(word_preds[2]->text, "já");
+    trie_delete(t);
+    std::remove(OUT_PATH);
+
+    EXPECT_NE(trie_map("/nonexistent/file.trie", &t), 0);
+}
+
+const char *DELTA_PATH = "./data/tmp.delta";
+
+static void write_delta(const char *text)
+{
+    std::ofstream(DELTA_PATH) << text;
+}
+
+TEST(Trie, trie_apply_delta)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    trie_save(t, OUT_PATH);
+    trie_delete(t);
+    ASSERT_EQ(trie_map(OUT_PATH, &t), 0);
+
+    write_delta("\\data\\\n"
+                "ngram 1=1\n"
+                "\n"
+                "\\1-grams:\n"
+                "-3.5\tnovapalavra\t-0.2\n"
+                "\\removed-1-grams:\n"
+                "Público\n"
+                "\n"
+                "\\2-grams:\n"
+                "-0.1\té que\t-0.5\n"
+                "-1\tque novapalavra\t-0.1\n"
+                "\\removed-2-grams:\n"
+                "que os\n"
+                "\n"
+                "\\3-grams:\n"
+                "-2\té que novapalavra\n"
+                "-0.01\té que novapalavra\n"
+                "\\end\\\n");
+    struct trie *u = trie_apply_delta(t, DELTA_PATH);
+    ASSERT_TRUE(u != nullptr);
+    EXPECT_EQ(u->n_ngrams[0], 209);
+    EXPECT_EQ(u->n_ngrams[1], 321);
+    EXPECT_EQ(u->n_ngrams[2], 322);
+    for (int i = 1; i < u->n_ngrams[0]; i++) {
+        EXPECT_LT(u->vocab_lookup[i - 1].hash, u->vocab_lookup[i].hash);
+        EXPECT_LT(strcmp(u->vocab_lookup[u->lexicon[i - 1]].text,
+                         u->vocab_lookup[u->lexicon[i]].text), 0);
+        EXPECT_EQ(u->lexicon_ranks[u->lexicon[i]], i);
+    }
+    EXPECT_GE(trie_get_word_id_from_text(u, "Público"), u->n_ngrams[0]);
+
+    // the changed 2-gram keeps its children, the last change of one wins
+    const char *words[] = { "é", "que", "novapalavra" };
+    struct gram grams[3];
+    ASSERT_EQ(trie_query_ngram_grams(u, words, 3, grams), 3);
+    EXPECT_FLOAT_EQ(grams[1].probability, -0.1f);
+    EXPECT_FLOAT_EQ(grams[1].backoff, -0.5f);
+    EXPECT_FLOAT_EQ(grams[2].probability, -0.01f);
+    struct word *word_preds[6];
+    trie_get_k_nwp(u, words, 2, 6, word_preds);
+    EXPECT_STREQ(word_preds[0]->text, "novapalavra");
+    EXPECT_STREQ(word_preds[1]->text, "os");
+    EXPECT_STREQ(word_preds[2]->text, "levaram");
+    EXPECT_STREQ(word_preds[3]->text, "já");
+    EXPECT_STREQ(word_preds[4]->text, "avançaram");
+    EXPECT_STREQ(word_preds[5]->text, "dentro");
+
+    // a removed n-gram loses its children
+    const char *removed[] = { "que", "os", "homens" };
+    EXPECT_EQ(trie_query_ngram_grams(t, removed, 3, grams), 3);
+    EXPECT_EQ(trie_query_ngram_grams(u, removed, 2, grams), 1);
+    EXPECT_EQ(trie_query_ngram_grams(u, removed, 3, grams), 2);
+
+    // the untouched n-grams are the same
+    const char *kept[] = { "garanta", "essa", "circulação" };
+    struct gram old_grams[3];
+    ASSERT_EQ(trie_query_ngram_grams(t, kept, 3, old_grams), 3);
+    ASSERT_EQ(trie_query_ngram_grams(u, kept, 3, grams), 3);
+    EXPECT_EQ(grams[2].probability, old_grams[2].probability);
+
+    std::remove(OUT_PATH);
+    trie_save(u, OUT_PATH);
+    trie_delete(u);
+    ASSERT_EQ(trie_load(OUT_PATH, &u), 0);
+    EXPECT_EQ(u->n_ngrams[2], 322);
+    trie_get_k_nwp(u, words, 2, 1, word_preds);
+    EXPECT_STREQ(word_preds[0]->text, "novapalavra");
+    trie_delete(u);
+
+    // added n-grams need known words and contexts
+    write_delta("\\2-grams:\n-1\tque palavradesconhecida\n");
+    EXPECT_TRUE(trie_apply_delta(t, DELTA_PATH) == nullptr);
+    write_delta("\\3-grams:\n-1\tque os homens\n"
+                "\\removed-2-grams:\nque os\n");
+    EXPECT_TRUE(trie_apply_delta(t, DELTA_PATH) == nullptr);
+    write_delta("\\2-grams:\nnotaprobability que os\n");
+    EXPECT_TRUE(trie_apply_delta(t, DELTA_PATH) == nullptr);
+    write_delta("\\4-grams:\n");
+    EXPECT_TRUE(trie_apply_delta(t, DELTA_PATH) == nullptr);
+    EXPECT_TRUE(trie_apply_delta(t, "/nonexistent/file.delta") == nullptr);
+    trie_delete(t);
+    std::remove(DELTA_PATH);
+    std::remove(OUT_PATH);
+}
+
+TEST(Trie, trie_index_large_ranges)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    trie_index_large_ranges(t, 2);
+    ASSERT_TRUE(t->large_ranges != nullptr);
+    EXPECT_GT(t->large_ranges->len[0], 0);
+
+    const char *words[] = { "é", "que" };
+    struct word *word_preds[3];
+    trie_get_k_nwp(t, words, 2, 3, word_preds);
+    EXPECT_STREQ(word_preds[0]->text, "os");
+    EXPECT_STREQ(word_preds[1]->text, "levaram");
+    EXPECT_STREQ(word_preds[2]->text, "já");
+
+    char const *grams[] = { "garanta", "essa", "circulação" };
+    int n = 3;
+    struct ngram *ngram = trie_query_ngram(t, grams, &n);
+    EXPECT_EQ(n, 3);
+    EXPECT_STREQ(ngram->word->text, "circulação");
+    ngram_delete(ngram);
+
+    trie_index_large_ranges(t, 0);
+    EXPECT_TRUE(t->large_ranges == nullptr);
+    trie_delete(t);
+}
+
 TEST(Trie, trie_get_word_id_from_text)
 {
     struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
@@ -126,6 +374,66 @@ TEST(Trie, trie_get_word_id_from_text)
     trie_delete(t);
 }
 
+TEST(Trie, trie_get_word_ids)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *words[] = { "»", "amarrar", "anonexistingword", "afinal" };
+    word_id_type ids[4];
+
+    trie_get_word_ids(t, words, 4, ids);
+    EXPECT_EQ(ids[0], 0);
+    EXPECT_EQ(ids[1], 1);
+    EXPECT_EQ(ids[2], (word_id_type) -1);
+    EXPECT_EQ(ids[3], 200);
+
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_children)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const uint64_t n_unigrams = t->n_ngrams[0];
+    std::vector<word_id_type> ids(n_unigrams);
+    std::vector<float> probabilities(n_unigrams);
+
+    // the children of the empty context are the unigrams
+    EXPECT_EQ(trie_get_children(t, NULL, 0, NULL, NULL), n_unigrams);
+    EXPECT_EQ(trie_get_children(t, NULL, 0, ids.data(), probabilities.data()),
+              n_unigrams);
+    for (word_id_type id = 0; id < n_unigrams; id++)
+        EXPECT_EQ(ids[id], id);
+
+    // and the ones of each unigram are its bigrams
+    uint64_t n_bigrams = 0;
+    char text[48];
+    for (word_id_type id = 0; id < n_unigrams; id++) {
+        const uint64_t n = trie_get_children(t, &id, 1, NULL, NULL);
+        EXPECT_EQ(trie_get_children(t, &id, 1, ids.data(),
+                                    probabilities.data()), n);
+        for (uint64_t i = 0; i < n; i++) {
+            const char *words[] = { t->vocab_lookup[id].text,
+                                    trie_word_textncpy(t, ids[i], text, 48) };
+            struct gram grams[2];
+            ASSERT_EQ(trie_query_ngram_grams(t, words, 2, grams), 2);
+            EXPECT_EQ(grams[1].probability, probabilities[i]);
+            if (i > 0)
+                EXPECT_LT(ids[i - 1], ids[i]);
+        }
+        n_bigrams += n;
+    }
+    EXPECT_EQ(n_bigrams, t->n_ngrams[1]);
+
+    const word_id_type unknown[] = { (word_id_type) -1 };
+    EXPECT_EQ(trie_get_children(t, unknown, 1, NULL, NULL), 0);
+    const word_id_type trigram[] = {
+            trie_get_word_id_from_text(t, "é"),
+            trie_get_word_id_from_text(t, "que"),
+            trie_get_word_id_from_text(t, "os")
+    };
+    EXPECT_EQ(trie_get_children(t, trigram, 3, NULL, NULL), 0);
+    trie_delete(t);
+}
+
 TEST(Trie, trie_word_textncpy)
 {
     struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
@@ -195,8 +503,8 @@ TEST(Trie, trie_get_k_nwp)
     ASSERT_STREQ(word_preds[5]->text, "dentro");
     ASSERT_STREQ(word_preds[6]->text, "lhes");
     ASSERT_STREQ(word_preds[7]->text, "reforça");
-    ASSERT_STREQ(word_preds[8]->text, "Na");
-    ASSERT_STREQ(word_preds[9]->text, "Em");
+    ASSERT_STREQ(word_preds[8]->text, ",");
+    ASSERT_STREQ(word_preds[9]->text, "de");
 
     words[0] = "havia";
     words[1] = "é";
@@ -217,8 +525,1052 @@ TEST(Trie, trie_get_k_nwp)
     ASSERT_STREQ(word_preds[5]->text, "dentro");
     ASSERT_STREQ(word_preds[6]->text, "lhes");
     ASSERT_STREQ(word_preds[7]->text, "reforça");
-    ASSERT_STREQ(word_preds[8]->text, "Na");
-    ASSERT_STREQ(word_preds[9]->text, "Em");
+    ASSERT_STREQ(word_preds[8]->text, ",");
+    ASSERT_STREQ(word_preds[9]->text, "de");
+
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_predictions)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *contexts[][2] = { { "é", "que" }, { "havia", "é" },
+                                  { "anonexistingword", "Para" } };
+    const word_id_type sentence_start = trie_get_word_id_from_text(t, "<s>");
+    const int k = 210;
+    struct prediction preds[k];
+    struct lm_state *state = trie_state_new(t);
+    struct lm_state *next = trie_state_new(t);
+    for (int len = 0; len <= 2; len++) {
+        for (auto &context : contexts) {
+            // rank every word but "<s>" by its score given the context, which
+            // is "<s>" when empty
+            trie_state_reset(state);
+            if (len == 0)
+                trie_state_advance(t, state, sentence_start, state);
+            for (int i = 0; i < len; i++)
+                trie_state_advance(t, state, trie_get_word_id_from_text(
+                        t, context[2 - len + i]), state);
+            std::vector<std::pair<float, int>> expected;
+            for (word_id_type id = 0; id < t->n_ngrams[0]; id++) {
+                if (id == sentence_start)
+                    continue;
+                float score = trie_state_score(t, state, id, next, NULL);
+                expected.emplace_back(-score, id);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            for (unsigned short kk : { 1, 10, 30 }) {
+                EXPECT_EQ(trie_get_k_nwp_predictions(t, &context[2 - len],
+                                                     len, kk, preds), kk);
+                for (int i = 0; i < kk; i++) {
+                    EXPECT_EQ(preds[i].word_id, expected[i].second);
+                    EXPECT_FLOAT_EQ(preds[i].probability, -expected[i].first);
+                }
+            }
+            // every word but "<s>" is predicted, and the rest is padding
+            EXPECT_EQ(trie_get_k_nwp_predictions(t, &context[2 - len], len, k,
+                                                 preds), k - 2);
+            for (int i = 0; i < k - 2; i++)
+                EXPECT_EQ(preds[i].word_id, expected[i].second);
+            EXPECT_EQ(preds[k - 1].word_id, (word_id_type) -1);
+            EXPECT_EQ(preds[k - 1].probability, -INFINITY);
+        }
+    }
+    trie_state_delete(next);
+    trie_state_delete(state);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_word_ids)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *words[] = { "Para", "é", "anonexistingword", "havia", "é",
+                            "que" };
+    const int n = 6, k = 10;
+    word_id_type ids[n];
+    trie_get_word_ids(t, words, n, ids);
+    struct prediction expected[k], preds[k];
+    for (int len = 0; len <= n; len++) {
+        EXPECT_EQ(trie_get_k_nwp_word_ids(t, ids, len, k, preds),
+                  trie_get_k_nwp_predictions(t, words, len, k, expected));
+        for (int i = 0; i < k; i++) {
+            EXPECT_EQ(preds[i].word_id, expected[i].word_id);
+            EXPECT_EQ(preds[i].probability, expected[i].probability);
+        }
+    }
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_prefix)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *contexts[][2] = { { "é", "que" }, { "havia", "é" },
+                                  { "anonexistingword", "Para" } };
+    // few words start with the longer prefixes, which are searched among the
+    // children, and many with the shorter ones, whose children are scanned
+    const char *prefixes[] = { "", "a", "d", "de", "p", "qu", "é", "zzz" };
+    const word_id_type sentence_start = trie_get_word_id_from_text(t, "<s>");
+    struct prediction preds[30];
+    struct lm_state *state = trie_state_new(t);
+    struct lm_state *next = trie_state_new(t);
+    for (int len = 0; len <= 2; len++) {
+        for (auto &context : contexts) {
+            trie_state_reset(state);
+            if (len == 0)
+                trie_state_advance(t, state, sentence_start, state);
+            for (int i = 0; i < len; i++)
+                trie_state_advance(t, state, trie_get_word_id_from_text(
+                        t, context[2 - len + i]), state);
+            for (const char *prefix : prefixes) {
+                // rank every word starting with the prefix but "<s>"
+                std::vector<std::pair<float, int>> expected;
+                for (word_id_type id = 0; id < t->n_ngrams[0]; id++) {
+                    const char *text = t->vocab_lookup[id].text;
+                    if (id == sentence_start ||
+                        strncmp(text, prefix, strlen(prefix)) != 0)
+                        continue;
+                    float score = trie_state_score(t, state, id, next, NULL);
+                    expected.emplace_back(-score, id);
+                }
+                std::sort(expected.begin(), expected.end());
+
+                for (unsigned short k : { 1, 10, 30 }) {
+                    const unsigned short n_expected = std::min(
+                            (size_t) k, expected.size());
+                    EXPECT_EQ(trie_get_k_nwp_prefix(t, &context[2 - len], len,
+                                                    prefix, k, preds),
+                              n_expected);
+                    for (int i = 0; i < n_expected; i++) {
+                        EXPECT_EQ(preds[i].word_id, expected[i].second);
+                        EXPECT_FLOAT_EQ(preds[i].probability,
+                                        -expected[i].first);
+                    }
+                    for (int i = n_expected; i < k; i++)
+                        EXPECT_EQ(preds[i].word_id, (word_id_type) -1);
+                }
+            }
+        }
+    }
+    trie_state_delete(next);
+    trie_state_delete(state);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_cache_hot_contexts)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *contexts[][2] = { { "é", "que" }, { "havia", "é" },
+                                  { "anonexistingword", "Para" },
+                                  { "que", "os" } };
+    const int k = 5, m = 4;
+    struct prediction expected[m][3][k], preds[k + 1];
+    for (int i = 0; i < m; i++)
+        for (int len = 0; len <= 2; len++)
+            trie_get_k_nwp_predictions(t, &contexts[i][2 - len], len, k,
+                                       expected[i][len]);
+    struct hot_cache_stats stats;
+    EXPECT_EQ(trie_get_hot_cache_stats(t, &stats), 1);
+    EXPECT_EQ(trie_cache_hot_contexts(t, 1, k), 1);
+    ASSERT_EQ(trie_cache_hot_contexts(t, 1 << 16, k), 0);
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < m; i++) {
+            for (int len = 0; len <= 2; len++) {
+                for (int kk = 1; kk <= k + 1; kk++) {
+                    unsigned short n = trie_get_k_nwp_predictions(
+                            t, &contexts[i][2 - len], len, kk, preds);
+                    EXPECT_EQ(n, kk);
+                    for (int j = 0; j < kk && j < k; j++) {
+                        EXPECT_EQ(preds[j].word_id,
+                                  expected[i][len][j].word_id);
+                        EXPECT_EQ(preds[j].probability,
+                                  expected[i][len][j].probability);
+                    }
+                    if (kk == k + 1)
+                        break;
+                }
+            }
+        }
+    }
+    ASSERT_EQ(trie_get_hot_cache_stats(t, &stats), 0);
+    // queries for more than k predictions are not looked up
+    EXPECT_EQ(stats.lookups, 3 * m * 3 * k);
+    EXPECT_GT(stats.hits, stats.lookups / 2);
+
+    EXPECT_EQ(trie_cache_hot_contexts(t, 0, k), 0);
+    EXPECT_EQ(trie_get_hot_cache_stats(t, &stats), 1);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_cache_queries)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *contexts[][3] = { { "bla", "é", "que" },
+                                  { "havia", "é", "que" },
+                                  { "anonexistingword", "é", "que" },
+                                  { "é", "os", "que" } };
+    const int k = 5, m = 4;
+    struct prediction expected[m][k], preds[k];
+    float expected_probabilities[m];
+    int expected_n[m];
+    for (int i = 0; i < m; i++) {
+        trie_get_k_nwp_predictions(t, contexts[i], 3, k, expected[i]);
+        expected_n[i] = 2;
+        struct ngram *ngram = trie_query_ngram(t, &contexts[i][1],
+                                               &expected_n[i]);
+        expected_probabilities[i] = ngram->probability;
+        ngram_delete(ngram);
+    }
+    EXPECT_EQ(trie_get_query_cache_stats(t, NULL, 0), 0);
+    EXPECT_EQ(trie_cache_queries(t, 64, 4), 1);
+    ASSERT_EQ(trie_cache_queries(t, 1 << 16, 4), 0);
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < m; i++) {
+            EXPECT_EQ(trie_get_k_nwp_predictions(t, contexts[i], 3, k, preds),
+                      k);
+            for (int j = 0; j < k; j++) {
+                EXPECT_EQ(preds[j].word_id, expected[i][j].word_id);
+                EXPECT_EQ(preds[j].probability, expected[i][j].probability);
+            }
+            int n = 2;
+            struct ngram *ngram = trie_query_ngram(t, &contexts[i][1], &n);
+            EXPECT_EQ(n, expected_n[i]);
+            EXPECT_EQ(ngram->probability, expected_probabilities[i]);
+            EXPECT_STREQ(ngram->word->text, contexts[i][2]);
+            ngram_delete(ngram);
+        }
+    }
+    struct query_cache_stats stats[4];
+    ASSERT_EQ(trie_get_query_cache_stats(t, stats, 4), 4);
+    uint64_t lookups = 0, hits = 0;
+    for (auto &s : stats) {
+        lookups += s.lookups;
+        hits += s.hits;
+    }
+    EXPECT_EQ(lookups, 3 * 2 * m);
+    // only "é que" and "os que" are cached, as the words before the last
+    // order - 1 ones are not part of the keys
+    EXPECT_EQ(hits, lookups - 2 * 2);
+
+    EXPECT_EQ(trie_cache_queries(t, 0, 0), 0);
+    EXPECT_EQ(trie_get_query_cache_stats(t, stats, 4), 0);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_collect_metrics)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    struct metrics_snapshot s;
+    EXPECT_EQ(trie_metrics_snapshot(t, &s), 1);
+    ASSERT_EQ(trie_collect_metrics(t, 1, 0), 0);
+
+    // only the last 2 words are looked up
+    const char *context[] = { "é", "anonexistingword", "que" };
+    struct prediction preds[5];
+    trie_get_k_nwp_predictions(t, context, 3, 5, preds);
+    const char *words[] = { "Para", "é", "que", "os", "anonexistingword",
+                            "havia", "é", "que", "os" };
+    trie_score_sentence(t, words, 9, NULL);
+    ASSERT_EQ(trie_metrics_snapshot(t, &s), 0);
+    EXPECT_EQ(s.counters[METRICS_WORDS], 2);
+    EXPECT_EQ(s.counters[METRICS_OOV_WORDS], 1);
+    EXPECT_EQ(s.counters[METRICS_CONTEXTS], 1);
+    EXPECT_EQ(s.counters[METRICS_MATCHED_CONTEXT_WORDS], 1);
+    EXPECT_EQ(s.counters[METRICS_RANKED_CONTEXTS], 1);
+    // the tokens and their n-gram lengths of the trie_score_sentence test
+    EXPECT_EQ(s.counters[METRICS_TOKENS], 10);
+    EXPECT_EQ(s.counters[METRICS_OOV_TOKENS], 1);
+    EXPECT_EQ(s.counters[METRICS_MATCHED_ORDERS], 17);
+    EXPECT_GT(s.counters[METRICS_TOKEN_BACKOFFS], 0);
+    EXPECT_EQ(s.histograms[METRICS_K_NWP].count, 1);
+    EXPECT_GT(s.histograms[METRICS_K_NWP].sum, 0);
+    EXPECT_EQ(s.histograms[METRICS_SCORE].count, 1);
+    EXPECT_EQ(s.histograms[METRICS_SCORE_BATCH].count, 0);
+    EXPECT_GT(s.histograms[METRICS_SEARCHED_RANGES].count, 0);
+    EXPECT_GT(s.histograms[METRICS_SCANNED_RANGES].count, 0);
+
+    char text[1 << 14];
+    ASSERT_LT(metrics_format_prometheus(&s, text, sizeof(text)), sizeof(text));
+    EXPECT_TRUE(strstr(text, "\nngram_lm_oov_words_total 1\n") != nullptr);
 
+    // collecting again starts over
+    ASSERT_EQ(trie_collect_metrics(t, 1, 2), 0);
+    ASSERT_EQ(trie_metrics_snapshot(t, &s), 0);
+    EXPECT_EQ(s.counters[METRICS_WORDS], 0);
+    ASSERT_EQ(trie_collect_metrics(t, 0, 0), 0);
+    EXPECT_EQ(trie_metrics_snapshot(t, &s), 1);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_state_advance)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *words[] = { "Para", "é", "que", "os", "anonexistingword",
+                            "havia", "é", "que", "os" };
+    const unsigned short lengths[] = { 1, 1, 2, 2, 0, 1, 1, 2, 2 };
+    const int n = 9, k = 5;
+    struct lm_state *state = trie_state_new(t);
+    struct lm_state *copy = trie_state_new(t);
+    struct prediction state_preds[k], word_preds[k];
+    EXPECT_EQ(trie_state_length(state), 0);
+    trie_state_get_k_nwp(t, state, k, state_preds);
+    trie_get_k_nwp_predictions(t, words, 0, k, word_preds);
+    for (int j = 0; j < k; j++)
+        EXPECT_EQ(state_preds[j].word_id, word_preds[j].word_id);
+
+    for (int i = 0; i < n; i++) {
+        word_id_type id = trie_get_word_id_from_text(t, words[i]);
+        trie_state_advance(t, state, id, copy);
+        trie_state_advance(t, state, id, state);
+        EXPECT_EQ(trie_state_length(state), lengths[i]);
+        EXPECT_EQ(trie_state_length(copy), lengths[i]);
+        trie_state_get_k_nwp(t, state, k, state_preds);
+        trie_get_k_nwp_predictions(t, words, i + 1, k, word_preds);
+        for (int j = 0; j < k; j++)
+            EXPECT_EQ(state_preds[j].word_id, word_preds[j].word_id);
+    }
+
+    trie_state_copy(copy, state);
+    EXPECT_EQ(trie_state_length(copy), 2);
+    trie_state_reset(state);
+    EXPECT_EQ(trie_state_length(state), 0);
+    trie_state_delete(copy);
+    trie_state_delete(state);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_score_sentence)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *words[] = { "Para", "é", "que", "os", "anonexistingword",
+                            "havia", "é", "que", "os" };
+    const unsigned int n = 9;
+    // computed from the ARPA file, e.g. p(é | <s> Para) = p(é) + bo(Para)
+    // + bo(<s> Para)
+    const float expected[] = { -0.992502, -2.900409, -0.583311, -0.272728,
+                               -3.315382, -2.458050, -2.599379, -0.583311,
+                               -0.272728, -3.060110 };
+    const unsigned short ngram_lengths[] = { 2, 1, 2, 3, 1, 1, 1, 2, 3, 1 };
+    struct token_score scores[n + 1];
+    float total = trie_score_sentence(t, words, n, scores);
+    EXPECT_NEAR(total, -17.037910, 1e-4);
+    for (unsigned int i = 0; i <= n; i++) {
+        EXPECT_NEAR(scores[i].log10_probability, expected[i], 1e-5);
+        EXPECT_EQ(scores[i].ngram_length, ngram_lengths[i]);
+        EXPECT_EQ(scores[i].is_oov, i == 4);
+    }
+
+    total = trie_score_tokens(t, &words[1], 3, scores);
+    EXPECT_NEAR(scores[0].log10_probability, -2.2983491, 1e-5);
+    EXPECT_NEAR(total, -2.2983491 - 0.583311 - 0.272728, 1e-4);
+
+    word_id_type ids[n];
+    trie_get_word_ids(t, words, n, ids);
+    struct token_score id_scores[n];
+    EXPECT_EQ(trie_score_word_ids(t, ids, n, id_scores),
+              trie_score_tokens(t, words, n, scores));
+    for (unsigned int i = 0; i < n; i++) {
+        EXPECT_EQ(id_scores[i].log10_probability, scores[i].log10_probability);
+        EXPECT_EQ(id_scores[i].ngram_length, scores[i].ngram_length);
+        EXPECT_EQ(id_scores[i].is_oov, scores[i].is_oov);
+    }
+    trie_delete(t);
+}
+
+TEST(Trie, trie_score_sentences)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *vocab[] = { "é", "que", "Para", "havia", "anonexistingword",
+                            "<s>", "os", "já" };
+    const unsigned int m = 50;
+    const char *words[m][6];
+    const char **sentences[m];
+    unsigned int lens[m], n_tokens = 0;
+    for (unsigned int i = 0; i < m; i++) {
+        for (int j = 0; j < 6; j++)
+            words[i][j] = vocab[(i + 3 * j) % 8];
+        sentences[i] = words[i];
+        lens[i] = i % 7;
+        n_tokens += lens[i] + 1;
+    }
+    float totals[m];
+    struct token_score batch_scores[n_tokens], scores[7];
+    trie_score_sentences(t, sentences, lens, m, totals, batch_scores);
+
+    double log10_total = 0;
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < m; i++) {
+        float total = trie_score_sentence(t, sentences[i], lens[i], scores);
+        EXPECT_FLOAT_EQ(totals[i], total);
+        for (unsigned int j = 0; j <= lens[i]; j++) {
+            EXPECT_FLOAT_EQ(batch_scores[offset + j].log10_probability,
+                            scores[j].log10_probability);
+            EXPECT_EQ(batch_scores[offset + j].ngram_length,
+                      scores[j].ngram_length);
+        }
+        offset += lens[i] + 1;
+        log10_total += total;
+    }
+    EXPECT_NEAR(trie_perplexity(t, sentences, lens, m),
+                std::pow(10, -log10_total / n_tokens), 1e-3);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_batch)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *vocab[] = { "é", "que", "Para", "havia", "anonexistingword",
+                            "<s>", "os", "já" };
+    const int m = 100, k = 5;
+    const char *words[m][4];
+    const char **contexts[m];
+    int lens[m];
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < 4; j++)
+            words[i][j] = vocab[(i + j) % 8];
+        contexts[i] = words[i];
+        lens[i] = i % 5;
+    }
+    struct prediction batch_preds[m * k];
+    trie_get_k_nwp_batch(t, contexts, lens, m, k, batch_preds);
+
+    struct prediction word_preds[k];
+    for (int i = 0; i < m; i++) {
+        trie_get_k_nwp_predictions(t, contexts[i], lens[i], k, word_preds);
+        for (int j = 0; j < k; j++) {
+            EXPECT_EQ(batch_preds[i * k + j].word_id, word_preds[j].word_id);
+            EXPECT_EQ(batch_preds[i * k + j].probability,
+                      word_preds[j].probability);
+        }
+    }
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_batch_parallel)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const char *vocab[] = { "é", "que", "Para", "havia", "anonexistingword",
+                            "<s>", "os", "já" };
+    const int m = 1000, k = 3;
+    std::vector<std::array<const char *, 3>> words(m);
+    std::vector<const char **> contexts(m);
+    std::vector<int> lens(m);
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < 3; j++)
+            words[i][j] = vocab[(i * 7 + j * 3) % 8];
+        contexts[i] = words[i].data();
+        lens[i] = i % 4;
+    }
+    std::vector<struct prediction> expected(m * k);
+    trie_get_k_nwp_batch(t, contexts.data(), lens.data(), m, k,
+                         expected.data());
+
+    for (unsigned int n_threads : { 0, 1, 3, 64 }) {
+        std::vector<struct prediction> preds(m * k);
+        trie_get_k_nwp_batch_parallel(t, contexts.data(), lens.data(), m, k,
+                                      preds.data(), n_threads);
+        for (int i = 0; i < m * k; i++) {
+            EXPECT_EQ(preds[i].word_id, expected[i].word_id);
+            EXPECT_EQ(preds[i].probability, expected[i].probability);
+        }
+    }
+    trie_delete(t);
+}
+
+static const std::vector<std::vector<const char *>> MIXTURE_CONTEXTS = {
+        {}, { "é", "que" }, { "havia", "é", "que", "os" },
+        { "é", "anonexistingword" }, { "anonexistingword", "é" },
+        { "que" }, { "novapalavra" }, { "que", "novapalavra" }
+};
+
+TEST(Trie, trie_mixture_of_one_trie)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const struct trie *tries[] = { t };
+    const float weights[] = { 2 };
+    struct trie_mixture *mix = trie_mixture_new(tries, weights, 1);
+    ASSERT_TRUE(mix != nullptr);
+    EXPECT_EQ(trie_mixture_vocab_size(mix), t->n_ngrams[0]);
+
+    const unsigned short k = 10;
+    for (const auto &context : MIXTURE_CONTEXTS) {
+        struct prediction expected[k], predictions[k];
+        const unsigned short n = trie_get_k_nwp_predictions(
+                t, (const char **) context.data(), context.size(), k,
+                expected);
+        ASSERT_EQ(trie_mixture_get_k_nwp(mix, (const char **) context.data(),
+                                         context.size(), k, predictions), n);
+        for (unsigned short i = 0; i < n; i++) {
+            EXPECT_NEAR(predictions[i].probability, expected[i].probability,
+                        1e-5);
+            if (i + 1 < n && expected[i].probability !=
+                             expected[i + 1].probability)
+                EXPECT_STREQ(trie_mixture_word_text(mix,
+                                                    predictions[i].word_id),
+                             t->vocab_lookup[expected[i].word_id].text);
+        }
+    }
+
+    const char *words[] = { "Para", "é", "que", "os", "anonexistingword",
+                            "havia", "é", "que", "os" };
+    struct token_score expected[10];
+    float scores[10];
+    EXPECT_NEAR(trie_mixture_score_sentence(mix, words, 9, scores),
+                trie_score_sentence(t, words, 9, expected), 1e-4);
+    for (int i = 0; i < 10; i++)
+        EXPECT_NEAR(scores[i], expected[i].log10_probability, 1e-5);
+    trie_mixture_delete(mix);
+    trie_delete(t);
+}
+
+TEST(Trie, trie_mixture_of_a_trie_given_more_than_once)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    const struct trie *tries[] = { t, t, t };
+    const float weights[] = { 0.5, 0.3, 0.2 };
+    struct trie_mixture *mix = trie_mixture_new(tries, weights, 3);
+    ASSERT_TRUE(mix != nullptr);
+    EXPECT_EQ(trie_mixture_vocab_size(mix), t->n_ngrams[0]);
+
+    const unsigned short k = 10;
+    for (const auto &context : MIXTURE_CONTEXTS) {
+        struct prediction expected[k], predictions[k];
+        const unsigned short n = trie_get_k_nwp_predictions(
+                t, (const char **) context.data(), context.size(), k,
+                expected);
+        ASSERT_EQ(trie_mixture_get_k_nwp(mix, (const char **) context.data(),
+                                         context.size(), k, predictions), n);
+        for (unsigned short i = 0; i < n; i++)
+            EXPECT_NEAR(predictions[i].probability, expected[i].probability,
+                        1e-5);
+    }
+    trie_mixture_delete(mix);
+    trie_delete(t);
+}
+
+/**
+ * @return the log10 probability of each word of \p mix in the mixture of
+ * \p tries given \p context, scoring each word in each trie on its own. If
+ * \p predicting, an empty context of a trie (e.g. after an unknown word) is
+ * "<s>", as when predicting.
+ */
+static std::vector<float>
+mixture_probabilities(const struct trie_mixture *mix,
+                      const std::vector<const struct trie *> &tries,
+                      const std::vector<float> &weights,
+                      const std::vector<const char *> &context,
+                      bool predicting)
+{
+    std::vector<double> probabilities(trie_mixture_vocab_size(mix));
+    for (size_t i = 0; i < tries.size(); i++) {
+        const struct trie *t = tries[i];
+        struct lm_state *state = trie_state_new(t);
+        for (const char *word : context)
+            trie_state_advance(t, state, trie_get_word_id_from_text(t, word),
+                               state);
+        if (predicting && trie_state_length(state) == 0)
+            trie_state_advance(t, state, trie_get_word_id_from_text(t, "<s>"),
+                               state);
+        struct lm_state *next = trie_state_new(t);
+        for (word_id_type w = 0; w < probabilities.size(); w++) {
+            const word_id_type id = trie_get_word_id_from_text(
+                    t, trie_mixture_word_text(mix, w));
+            probabilities[w] += weights[i] * std::pow(
+                    10, trie_state_score(t, state, id, next, nullptr));
+        }
+        trie_state_delete(next);
+        trie_state_delete(state);
+    }
+    std::vector<float> log10_probabilities;
+    for (double p : probabilities)
+        log10_probabilities.push_back(std::log10(p));
+    return log10_probabilities;
+}
+
+TEST(Trie, trie_mixture_get_k_nwp)
+{
+    log_set_quiet(true);
+    struct trie *general = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    // a domain model with a word of its own, and other probabilities
+    write_delta("\\1-grams:\n"
+                "-1.5\tnovapalavra\t-0.2\n"
+                "-1\tos\t-0.1\n"
+                "\\2-grams:\n"
+                "-0.2\té que\t-0.5\n"
+                "-0.3\tque novapalavra\t-0.1\n"
+                "-0.1\tnovapalavra é\n"
+                "\\3-grams:\n"
+                "-0.05\té que novapalavra\n");
+    struct trie *domain = trie_apply_delta(general, DELTA_PATH);
+    std::remove(DELTA_PATH);
+    ASSERT_TRUE(domain != nullptr);
+    const std::vector<const struct trie *> tries = { general, domain, general };
+    const std::vector<float> weights = { 0.5f, 0.3f, 0.2f };
+    struct trie_mixture *mix = trie_mixture_new(
+            (const struct trie **) tries.data(), weights.data(), 3);
+    ASSERT_TRUE(mix != nullptr);
+    EXPECT_EQ(trie_mixture_vocab_size(mix), general->n_ngrams[0] + 1);
+    EXPECT_STREQ(trie_mixture_word_text(
+            mix, trie_mixture_get_word_id(mix, "novapalavra")), "novapalavra");
+    EXPECT_GE(trie_mixture_get_word_id(mix, "anonexistingword"),
+              trie_mixture_vocab_size(mix));
+    EXPECT_TRUE(trie_mixture_word_text(mix, trie_mixture_vocab_size(mix)) ==
+                nullptr);
+
+    const word_id_type sentence_start = trie_mixture_get_word_id(mix, "<s>");
+    const unsigned short k = 20;
+    for (const auto &context : MIXTURE_CONTEXTS) {
+        std::vector<float> expected = mixture_probabilities(
+                mix, tries, weights, context, true);
+        struct prediction predictions[k];
+        ASSERT_EQ(trie_mixture_get_k_nwp(mix, (const char **) context.data(),
+                                         context.size(), k, predictions), k);
+        for (unsigned short i = 0; i < k; i++)
+            EXPECT_NEAR(predictions[i].probability,
+                        expected[predictions[i].word_id], 1e-5);
+        // no word but "<s>" is more probable than the k-th prediction
+        expected[sentence_start] = -INFINITY;
+        std::sort(expected.begin(), expected.end(), std::greater<float>());
+        for (unsigned short i = 0; i < k; i++)
+            EXPECT_NEAR(predictions[i].probability, expected[i], 1e-5);
+    }
+
+    const char *words[] = { "é", "que", "novapalavra", "é" };
+    float scores[5];
+    float total = trie_mixture_score_sentence(mix, words, 4, scores);
+    std::vector<const char *> context = { "<s>" };
+    float expected_total = 0;
+    for (int i = 0; i <= 4; i++) {
+        const char *word = (i < 4) ? words[i] : "</s>";
+        const float expected = mixture_probabilities(mix, tries, weights,
+                                                     context, false)
+                [trie_mixture_get_word_id(mix, word)];
+        EXPECT_NEAR(scores[i], expected, 1e-5);
+        expected_total += expected;
+        context.push_back(word);
+    }
+    EXPECT_NEAR(total, expected_total, 1e-4);
+
+    trie_mixture_delete(mix);
+    const float no_weights[] = { 1, 0 };
+    EXPECT_TRUE(trie_mixture_new((const struct trie **) tries.data(),
+                                 no_weights, 2) == nullptr);
+    EXPECT_TRUE(trie_mixture_new(nullptr, nullptr, 0) == nullptr);
+    trie_delete(domain);
+    trie_delete(general);
+    log_set_quiet(false);
+}
+
+/**
+ * @return the trie of a generated model of \p n_words words.
+ */
+static struct trie *new_generated_trie(uint64_t n_words, uint64_t seed)
+{
+    const uint64_t n_ngrams[] = { n_words, 10 * n_words, 20 * n_words };
+    struct arpa_gen *g = arpa_gen_new(3, n_ngrams, 1.0, seed);
+    char path[] = "/tmp/ngram_lm_mixture_XXXXXX";
+    FILE *f = fdopen(mkstemp(path), "w");
+    arpa_gen_fwrite(g, f);
+    fclose(f);
+    arpa_gen_delete(g);
+    struct trie *t = trie_new_from_arpa_path(3, path);
+    std::remove(path);
+    return t;
+}
+
+/**
+ * Same as mixture_probabilities() when predicting, but from the predictions
+ * of all the words of each trie, which back off from the longest context a
+ * word follows even when the n-grams of the model lack some of its suffixes,
+ * as the generated ones do. The words a trie lacks have its probability of
+ * "<unk>".
+ */
+static std::vector<float>
+ranked_mixture_probabilities(const struct trie_mixture *mix,
+                             const std::vector<const struct trie *> &tries,
+                             const std::vector<float> &weights,
+                             const std::vector<const char *> &context)
+{
+    std::vector<double> probabilities(trie_mixture_vocab_size(mix));
+    std::vector<struct prediction> ranked(UINT16_MAX);
+    for (size_t i = 0; i < tries.size(); i++) {
+        const struct trie *t = tries[i];
+        const unsigned short found = trie_get_k_nwp_predictions(
+                t, (const char **) context.data(), context.size(), UINT16_MAX,
+                ranked.data());
+        std::vector<float> trie_probabilities(t->n_ngrams[0], -INFINITY);
+        for (unsigned short j = 0; j < found; j++)
+            trie_probabilities[ranked[j].word_id] = ranked[j].probability;
+        const float unknown = trie_probabilities[
+                trie_get_word_id_from_text(t, "<unk>")];
+        for (word_id_type w = 0; w < probabilities.size(); w++) {
+            const word_id_type id = trie_get_word_id_from_text(
+                    t, trie_mixture_word_text(mix, w));
+            probabilities[w] += weights[i] * std::pow(
+                    10, (id < t->n_ngrams[0]) ? trie_probabilities[id] :
+                        unknown);
+        }
+    }
+    std::vector<float> log10_probabilities;
+    for (double p : probabilities)
+        log10_probabilities.push_back(std::log10(p));
+    return log10_probabilities;
+}
+
+TEST(Trie, trie_mixture_of_different_vocabularies)
+{
+    log_set_quiet(true);
+    // the generated words are "w1", "w2"..., so the larger model has 3000
+    // words the smaller one lacks
+    struct trie *general = new_generated_trie(5000, 42);
+    struct trie *generated = new_generated_trie(2000, 7);
+    // and the words the smaller one lacks are likely, so that they compete
+    // with the ones it ranks
+    write_delta("\\1-grams:\n"
+                "-1.5\t<unk>\n");
+    struct trie *domain = trie_apply_delta(generated, DELTA_PATH);
+    std::remove(DELTA_PATH);
+    ASSERT_TRUE(domain != nullptr);
+    const std::vector<const struct trie *> tries = { general, domain };
+    const std::vector<float> weights = { 0.4f, 0.6f };
+    struct trie_mixture *mix = trie_mixture_new(
+            (const struct trie **) tries.data(), weights.data(), 2);
+    ASSERT_TRUE(mix != nullptr);
+    EXPECT_EQ(trie_mixture_vocab_size(mix), general->n_ngrams[0]);
+
+    const word_id_type sentence_start = trie_mixture_get_word_id(mix, "<s>");
+    std::vector<std::string> words;
+    for (const char *word : { "w1", "w2", "w10", "w500", "w1999", "w2500",
+                              "w4000", "anonexistingword" })
+        words.emplace_back(word);
+    for (const std::string &first : words) {
+        for (const std::string &second : { "w1", "w3", "w1500", "w3000" }) {
+            const std::vector<const char *> context = { first.c_str(),
+                                                        second.c_str() };
+            std::vector<float> expected = ranked_mixture_probabilities(
+                    mix, tries, weights, context);
+            for (unsigned short k : { 1, 10, 100 }) {
+                std::vector<struct prediction> predictions(k);
+                ASSERT_EQ(trie_mixture_get_k_nwp(
+                        mix, (const char **) context.data(), 2, k,
+                        predictions.data()), k);
+                for (unsigned short i = 0; i < k; i++)
+                    EXPECT_NEAR(predictions[i].probability,
+                                expected[predictions[i].word_id], 1e-5);
+                std::vector<float> sorted = expected;
+                sorted[sentence_start] = -INFINITY;
+                std::partial_sort(sorted.begin(), sorted.begin() + k,
+                                  sorted.end(), std::greater<float>());
+                for (unsigned short i = 0; i < k; i++)
+                    EXPECT_NEAR(predictions[i].probability, sorted[i], 1e-5);
+            }
+        }
+    }
+    trie_mixture_delete(mix);
+    trie_delete(domain);
+    trie_delete(generated);
+    trie_delete(general);
+    log_set_quiet(false);
+}
+
+TEST(Trie, queries_do_not_allocate)
+{
+#ifndef COUNT_ALLOCATIONS
+    GTEST_SKIP() << "the allocations are not counted with sanitizers";
+#else
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    trie_index_large_ranges(t, 2);
+    ASSERT_EQ(trie_cache_hot_contexts(t, 1 << 16, 10), 0);
+    const char *context[] = { "havia", "é", "que" };
+    const char *sentence[] = { "Para", "é", "que", "os", "levaram" };
+    const char **sentences[] = { sentence, context };
+    const unsigned int lens[] = { 5, 3 };
+    const int batch_lens[] = { 5, 3 };
+    const int k = 10;
+    struct word *words[k];
+    struct prediction preds[2 * k];
+    struct token_score scores[5 + 1];
+    struct gram grams[3];
+    float totals[2];
+    struct lm_state *state = trie_state_new(t);
+    auto query = [&]() {
+        trie_get_k_nwp(t, context, 3, k, words);
+        trie_get_k_nwp_predictions(t, context, 3, k, preds);
+        trie_get_k_nwp_prefix(t, context, 3, "a", k, preds);
+        trie_get_k_nwp_batch(t, sentences, batch_lens, 2, k, preds);
+        trie_state_reset(state);
+        for (const char *word : context)
+            trie_state_advance(t, state, trie_get_word_id_from_text(t, word),
+                               state);
+        trie_state_get_k_nwp(t, state, k, preds);
+        trie_score_sentence(t, sentence, 5, scores);
+        trie_score_tokens(t, sentence, 5, scores);
+        trie_score_sentences(t, sentences, lens, 2, totals, NULL);
+        trie_perplexity(t, sentences, lens, 2);
+        trie_query_ngram_grams(t, context, 3, grams);
+    };
+    // the first queries grow the scratch memory of the thread
+    query();
+    n_allocations = 0;
+    for (int i = 0; i < 10; i++)
+        query();
+    EXPECT_EQ(n_allocations, 0);
+
+    struct hot_cache_stats stats;
+    ASSERT_EQ(trie_get_hot_cache_stats(t, &stats), 0);
+    EXPECT_GT(stats.hits, 0);
+    trie_state_delete(state);
+    trie_delete(t);
+#endif
+}
+
+TEST(Trie, concurrent_queries)
+{
+    struct trie *t = trie_new_from_arpa(3, arpa_open(TEST_DATA));
+    trie_index_large_ranges(t, 2);
+    const char *contexts[][2] = { { "é", "que" }, { "havia", "é" },
+                                  { "anonexistingword", "Para" },
+                                  { "os", "que" } };
+    const char *prefixes[] = { "", "a", "de", "p" };
+    const char *sentence[] = { "é", "que", "os", "levaram", "havia" };
+    const int n_contexts = 4, n_prefixes = 4, k = 10;
+    // the results of a single thread, before the caches are set
+    struct prediction expected[n_contexts][n_prefixes][k];
+    for (int i = 0; i < n_contexts; i++)
+        for (int j = 0; j < n_prefixes; j++)
+            trie_get_k_nwp_prefix(t, contexts[i], 2, prefixes[j], k,
+                                  expected[i][j]);
+    const float expected_score = trie_score_sentence(t, sentence, 5, NULL);
+    // the caches are small, so that their entries keep being replaced
+    ASSERT_EQ(trie_cache_hot_contexts(t, 4096, k), 0);
+    ASSERT_EQ(trie_cache_queries(t, 4096, 4), 0);
+    ASSERT_EQ(trie_collect_metrics(t, 1, 4), 0);
+
+    const int n_threads = 64, n_iterations = 20;
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < n_threads; thread++) {
+        threads.emplace_back([&, thread]() {
+            struct prediction preds[k], batch_preds[n_contexts * k];
+            const char **batch[n_contexts];
+            int lens[n_contexts];
+            for (int i = 0; i < n_contexts; i++) {
+                batch[i] = contexts[i];
+                lens[i] = 2;
+            }
+            struct lm_state *state = trie_state_new(t);
+            for (int it = 0; it < n_iterations; it++) {
+                const int i = (thread + it) % n_contexts;
+                for (int j = 0; j < n_prefixes; j++) {
+                    trie_get_k_nwp_prefix(t, contexts[i], 2, prefixes[j], k,
+                                          preds);
+                    for (int p = 0; p < k; p++)
+                        EXPECT_EQ(preds[p].word_id, expected[i][j][p].word_id);
+                }
+                trie_get_k_nwp_predictions(t, contexts[i], 2, k, preds);
+                for (int p = 0; p < k; p++)
+                    EXPECT_EQ(preds[p].word_id, expected[i][0][p].word_id);
+
+                trie_state_reset(state);
+                for (const char *word : contexts[i])
+                    trie_state_advance(t, state, trie_get_word_id_from_text(
+                            t, word), state);
+                trie_state_get_k_nwp(t, state, k, preds);
+                for (int p = 0; p < k; p++)
+                    EXPECT_EQ(preds[p].word_id, expected[i][0][p].word_id);
+
+                trie_get_k_nwp_batch(t, batch, lens, n_contexts, k,
+                                     batch_preds);
+                for (int c = 0; c < n_contexts; c++)
+                    for (int p = 0; p < k; p++)
+                        EXPECT_EQ(batch_preds[c * k + p].word_id,
+                                  expected[c][0][p].word_id);
+
+                EXPECT_FLOAT_EQ(trie_score_sentence(t, sentence, 5, NULL),
+                                expected_score);
+                const char *grams[] = { "garanta", "essa", "circulação" };
+                int n = 3;
+                struct ngram *ngram = trie_query_ngram(t, grams, &n);
+                EXPECT_EQ(n, 3);
+                EXPECT_STREQ(ngram->word->text, "circulação");
+                ngram_delete(ngram);
+            }
+            trie_state_delete(state);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    struct hot_cache_stats stats;
+    ASSERT_EQ(trie_get_hot_cache_stats(t, &stats), 0);
+    EXPECT_GT(stats.hits, 0);
+    struct metrics_snapshot metrics;
+    ASSERT_EQ(trie_metrics_snapshot(t, &metrics), 0);
+    EXPECT_EQ(metrics.counters[METRICS_TOKENS], n_threads * n_iterations * 6);
+    EXPECT_EQ(metrics.histograms[METRICS_K_NWP_BATCH].count,
+              n_threads * n_iterations);
+    trie_delete(t);
+}
+
+TEST(Trie, concurrent_builds)
+{
+    const int n_threads = 4;
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < n_threads; thread++) {
+        threads.emplace_back([]() {
+            struct arpa *arpa = arpa_open(TEST_DATA);
+            struct trie *t = trie_new_from_arpa(3, arpa);
+            arpa_close(arpa);
+            validate_trie(t);
+            const char *words[] = { "é", "que" };
+            struct word *word_preds[3];
+            trie_get_k_nwp(t, words, 2, 3, word_preds);
+            EXPECT_STREQ(word_preds[0]->text, "os");
+            EXPECT_STREQ(word_preds[1]->text, "levaram");
+            EXPECT_STREQ(word_preds[2]->text, "já");
+            trie_delete(t);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+}
+
+const char *SMALL_ARPA_PATH = "./data/tmp_small.arpa";
+
+/**
+ * @return the trie of order \p sections.size() of the n-grams of
+ * \p sections, the lines of the ARPA sections of each order.
+ */
+static struct trie *
+new_small_trie(const std::vector<std::vector<std::string>> &sections)
+{
+    std::ofstream f(SMALL_ARPA_PATH);
+    f << "\\data\\\n";
+    for (size_t n = 1; n <= sections.size(); n++)
+        f << "ngram " << n << "=" << sections[n - 1].size() << "\n";
+    for (size_t n = 1; n <= sections.size(); n++) {
+        f << "\n\\" << n << "-grams:\n";
+        for (const std::string &line : sections[n - 1])
+            f << line << "\n";
+    }
+    f << "\n\\end\\\n";
+    f.close();
+    struct trie *t = trie_new_from_arpa(sections.size(),
+                                        arpa_open(SMALL_ARPA_PATH));
+    std::remove(SMALL_ARPA_PATH);
+    return t;
+}
+
+TEST(Trie, trie_of_a_model_of_few_ngrams)
+{
+    // fewer n-grams than the steps of the progress bar
+    struct trie *t = new_small_trie({ { "-1\t<s>\t-0.1", "-1\t</s>",
+                                        "-1\ta\t-0.1" },
+                                      { "-0.5\t<s> a" } });
+    const char *words[] = { "<s>", "a" };
+    struct gram grams[2];
+    EXPECT_EQ(trie_query_ngram_grams(t, words, 2, grams), 2);
+    EXPECT_FLOAT_EQ(grams[1].probability, -0.5f);
+    trie_delete(t);
+}
+
+TEST(Trie, ngrams_without_children_have_none)
+{
+    // only "w4 w5" has children, so the contexts before and after it, in
+    // the order of the word ids, have none
+    std::vector<std::vector<std::string>> sections(3);
+    for (int i = 1; i <= 8; i++)
+        sections[0].push_back("-1\tw" + std::to_string(i) + "\t-0.1");
+    for (int i = 1; i <= 8; i++)
+        sections[1].push_back("-0.5\tw" + std::to_string(i) + " w" +
+                              std::to_string(i % 8 + 1) + "\t-0.1");
+    for (int i = 1; i <= 8; i++)
+        sections[2].push_back("-0.2\tw4 w5 w" + std::to_string(i));
+    struct trie *t = new_small_trie(sections);
+    struct gram grams[3];
+    for (int i = 1; i <= 8; i++) {
+        const std::string first = "w" + std::to_string(i);
+        const std::string second = "w" + std::to_string(i % 8 + 1);
+        for (int j = 1; j <= 8; j++) {
+            const std::string third = "w" + std::to_string(j);
+            const char *words[] = { first.c_str(), second.c_str(),
+                                    third.c_str() };
+            EXPECT_EQ(trie_query_ngram_grams(t, words, 3, grams) == 3, i == 4)
+                    << first << " " << second << " " << third;
+        }
+    }
+    trie_delete(t);
+}
+
+TEST(Trie, context_ids_larger_than_the_higher_order_counts)
+{
+    // many more unigrams, the contexts of the bigrams, than trigrams
+    std::vector<std::vector<std::string>> sections(3);
+    for (int i = 1; i <= 40; i++)
+        sections[0].push_back("-1\tw" + std::to_string(i) + "\t-0.1");
+    for (int i = 1; i <= 40; i++)
+        sections[1].push_back("-0." + std::to_string(i) + "\tw" +
+                              std::to_string(i) + " w1\t-0.1");
+    sections[2] = { "-0.2\tw2 w1 w1" };
+    struct trie *t = new_small_trie(sections);
+    struct gram grams[2];
+    for (int i = 1; i <= 40; i++) {
+        const std::string first = "w" + std::to_string(i);
+        const char *words[] = { first.c_str(), "w1" };
+        ASSERT_EQ(trie_query_ngram_grams(t, words, 2, grams), 2) << first;
+        EXPECT_FLOAT_EQ(grams[1].probability,
+                        std::stof("-0." + std::to_string(i)));
+    }
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_batch_without_sentence_start)
+{
+    // without "<s>", empty contexts and contexts of unknown words rank the
+    // unigrams
+    struct trie *t = new_small_trie({ { "-0.5\ta\t-0.1", "-1\tb\t-0.1",
+                                        "-1.5\tc\t-0.1" },
+                                      { "-0.2\ta c" } });
+    const char *words[] = { "a", "unknownword" };
+    const char **contexts[] = { words, words, &words[1] };
+    const int lens[] = { 0, 1, 1 }, m = 3, k = 2;
+    struct prediction batch_preds[m * k];
+    trie_get_k_nwp_batch(t, contexts, lens, m, k, batch_preds);
+
+    const char *expected[m][k] = { { "a", "b" }, { "c", "a" }, { "a", "b" } };
+    for (int i = 0; i < m; i++)
+        for (int j = 0; j < k; j++)
+            EXPECT_EQ(batch_preds[i * k + j].word_id,
+                      trie_get_word_id_from_text(t, expected[i][j]));
+    trie_delete(t);
+}
+
+TEST(Trie, trie_get_k_nwp_predictions_of_more_than_32768_words)
+{
+    // the children of the heap nodes past the 32768th do not fit 16 bits
+    const int n_words = 40000;
+    std::vector<std::vector<std::string>> sections(2);
+    for (int i = 0; i < n_words; i++)
+        sections[0].push_back("-1\tw" + std::to_string(i) + "\t-0.1");
+    // the probabilities of the children of "w0" are shuffled
+    for (int i = 1; i < n_words; i++)
+        sections[1].push_back(std::to_string(-(i * 7919 % n_words) / 1e5) +
+                              "\tw0 w" + std::to_string(i));
+    struct trie *t = new_small_trie(sections);
+    std::vector<struct prediction> preds(UINT16_MAX);
+    const char *context[] = { "w0" };
+    const unsigned short found = trie_get_k_nwp_predictions(t, context, 1,
+                                                            UINT16_MAX,
+                                                            preds.data());
+    ASSERT_EQ(found, n_words);
+    // the children, from the best to the worst, then "w0" backed off to
+    for (int i = 0; i < n_words; i++) {
+        // 17679 * 7919 % 40000 == 1
+        const int j = (i + 1) * 17679 % n_words;
+        EXPECT_EQ(preds[i].word_id,
+                  trie_get_word_id_from_text(
+                          t, ("w" + std::to_string(j)).c_str())) << i;
+    }
     trie_delete(t);
 }
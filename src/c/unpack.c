@@ -0,0 +1,175 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include "unpack.h"
+
+#include "bit.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define UNPACK_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*unpack_kernel)(const uint8_t *elems, uint8_t elem_size,
+                              uint64_t l, uint64_t r, unsigned int offset,
+                              unsigned int nbits, void *dest,
+                              unsigned int dest_size);
+
+static void unpack_scalar(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                          uint64_t r, unsigned int offset, unsigned int nbits,
+                          void *dest, unsigned int dest_size);
+
+static enum unpack_isa isa = UNPACK_SCALAR;
+static unpack_kernel kernel = unpack_scalar;
+
+void unpack_field(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                  uint64_t r, unsigned int offset, unsigned int nbits,
+                  void *dest, unsigned int dest_size)
+{
+    // the vector kernels shift a 64-bit word by up to 7 bits
+    if (nbits > 57)
+        unpack_scalar(elems, elem_size, l, r, offset, nbits, dest, dest_size);
+    else
+        kernel(elems, elem_size, l, r, offset, nbits, dest, dest_size);
+}
+
+static void unpack_scalar(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                          uint64_t r, unsigned int offset, unsigned int nbits,
+                          void *dest, unsigned int dest_size)
+{
+    uint64_t bit = l * elem_size + offset;
+    if (dest_size == sizeof(uint32_t)) {
+        uint32_t *d = dest;
+        for (uint64_t i = l; i < r; i++, bit += elem_size)
+            *d++ = bits_get(elems, bit, nbits);
+    } else {
+        uint64_t *d = dest;
+        for (uint64_t i = l; i < r; i++, bit += elem_size)
+            *d++ = bits_get(elems, bit, nbits);
+    }
+}
+
+#ifdef UNPACK_X86
+
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                        uint64_t r, unsigned int offset, unsigned int nbits,
+                        void *dest, unsigned int dest_size)
+{
+    const int64_t first = l * elem_size + offset;
+    const __m256i mask = _mm256_set1_epi64x((INT64_C(1) << nbits) - 1);
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i step = _mm256_set1_epi64x(4 * (int64_t) elem_size);
+    const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    __m256i bits = _mm256_setr_epi64x(first, first + elem_size,
+                                      first + 2 * elem_size,
+                                      first + 3 * elem_size);
+    uint64_t i = l;
+    for (; i + 4 <= r; i += 4) {
+        const __m256i bytes = _mm256_srli_epi64(bits, 3);
+        const __m256i shifts = _mm256_and_si256(bits, seven);
+        __m256i x = _mm256_i64gather_epi64((const long long *) elems, bytes, 1);
+        x = _mm256_and_si256(_mm256_srlv_epi64(x, shifts), mask);
+        if (dest_size == sizeof(uint32_t)) {
+            x = _mm256_permutevar8x32_epi32(x, low_halves);
+            _mm_storeu_si128((__m128i *) ((uint32_t *) dest + (i - l)),
+                             _mm256_castsi256_si128(x));
+        } else {
+            _mm256_storeu_si256((__m256i *) ((uint64_t *) dest + (i - l)), x);
+        }
+        bits = _mm256_add_epi64(bits, step);
+    }
+    // the compiler does not clear the upper halves of the vector registers
+    // before a tail call, and the SSE code after it (e.g. of libm) would run
+    // several times slower until they are
+    _mm256_zeroupper();
+    unpack_scalar(elems, elem_size, i, r, offset, nbits,
+                  (uint8_t *) dest + (i - l) * dest_size, dest_size);
+}
+
+__attribute__((target("avx512f")))
+static void unpack_avx512(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                          uint64_t r, unsigned int offset, unsigned int nbits,
+                          void *dest, unsigned int dest_size)
+{
+    const int64_t first = l * elem_size + offset;
+    const __m512i mask = _mm512_set1_epi64((INT64_C(1) << nbits) - 1);
+    const __m512i seven = _mm512_set1_epi64(7);
+    const __m512i step = _mm512_set1_epi64(8 * (int64_t) elem_size);
+    __m512i bits = _mm512_setr_epi64(first, first + elem_size,
+                                     first + 2 * elem_size,
+                                     first + 3 * elem_size,
+                                     first + 4 * elem_size,
+                                     first + 5 * elem_size,
+                                     first + 6 * elem_size,
+                                     first + 7 * elem_size);
+    uint64_t i = l;
+    for (; i + 8 <= r; i += 8) {
+        const __m512i bytes = _mm512_srli_epi64(bits, 3);
+        const __m512i shifts = _mm512_and_si512(bits, seven);
+        __m512i x = _mm512_i64gather_epi64(bytes, elems, 1);
+        x = _mm512_and_si512(_mm512_srlv_epi64(x, shifts), mask);
+        if (dest_size == sizeof(uint32_t))
+            _mm256_storeu_si256((__m256i *) ((uint32_t *) dest + (i - l)),
+                                _mm512_cvtepi64_epi32(x));
+        else
+            _mm512_storeu_si512((uint64_t *) dest + (i - l), x);
+        bits = _mm512_add_epi64(bits, step);
+    }
+    _mm256_zeroupper();
+    unpack_scalar(elems, elem_size, i, r, offset, nbits,
+                  (uint8_t *) dest + (i - l) * dest_size, dest_size);
+}
+
+static int isa_supported(enum unpack_isa i)
+{
+    switch (i) {
+        case UNPACK_AVX512:
+            return __builtin_cpu_supports("avx512f");
+        case UNPACK_AVX2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            return 1;
+    }
+}
+
+__attribute__((constructor))
+static void detect_isa(void)
+{
+    __builtin_cpu_init();
+    if (unpack_set_isa(UNPACK_AVX512) != 0 && unpack_set_isa(UNPACK_AVX2) != 0)
+        unpack_set_isa(UNPACK_SCALAR);
+}
+
+#else
+
+static int isa_supported(enum unpack_isa i)
+{
+    return i == UNPACK_SCALAR;
+}
+
+#endif
+
+enum unpack_isa unpack_get_isa(void)
+{
+    return isa;
+}
+
+int unpack_set_isa(enum unpack_isa i)
+{
+    if (!isa_supported(i))
+        return -1;
+    switch (i) {
+#ifdef UNPACK_X86
+        case UNPACK_AVX512:
+            kernel = unpack_avx512;
+            break;
+        case UNPACK_AVX2:
+            kernel = unpack_avx2;
+            break;
+#endif
+        default:
+            kernel = unpack_scalar;
+    }
+    isa = i;
+    return 0;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+/**
+ * @file
+ * @brief Kernels for unpacking one field of a range of bit-packed elements
+ * (see array.h) into a dense column of 32- or 64-bit integers. Besides the
+ * portable scalar kernel, there are AVX2 and AVX-512 kernels that gather the
+ * 64-bit words holding 4 or 8 elements at a time and shift each one by its
+ * own bit offset. The kernel is chosen at load time from CPUID, so a single
+ * library binary can run on any x86-64 (or other) CPU.
+ */
+
+#ifndef NGRAM_LM_UNPACK_H
+#define NGRAM_LM_UNPACK_H
+
+#include <stdint.h>
+
+enum unpack_isa {
+    UNPACK_SCALAR,
+    UNPACK_AVX2,
+    UNPACK_AVX512
+};
+
+/**
+ * Unpack the \p nbits (at most 64) bits field that starts \p offset bits
+ * after the beginning of each of the elements [\p l, \p r) of \p elems,
+ * where each element has \p elem_size bits, into \p dest.
+ * @warning \p elems must be padded with 8 bytes, as done by array_new().
+ * @param elems
+ * @param elem_size
+ * @param l
+ * @param r
+ * @param offset
+ * @param nbits
+ * @param dest array of \p r - \p l integers
+ * @param dest_size size in bytes of each integer of \p dest: 4 or 8
+ */
+void unpack_field(const uint8_t *elems, uint8_t elem_size, uint64_t l,
+                  uint64_t r, unsigned int offset, unsigned int nbits,
+                  void *dest, unsigned int dest_size);
+
+/**
+ * Get the instruction set of the kernel used by unpack_field().
+ * @return
+ */
+enum unpack_isa unpack_get_isa(void);
+
+/**
+ * Use the kernel for \p isa in unpack_field(), if the CPU supports it. Mostly
+ * useful for testing and benchmarking the kernels against each other.
+ * @warning It must not be called while another thread is unpacking.
+ * @param isa
+ * @return 0 if the kernel was set or -1 if the CPU does not support \p isa.
+ */
+int unpack_set_isa(enum unpack_isa isa);
+
+#endif //NGRAM_LM_UNPACK_H
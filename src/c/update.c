@@ -0,0 +1,105 @@
+// Copyright (c) 2021, João Fé, All rights reserved.
+
+#include <argp.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <c/util/log.h>
+#include "trie.h"
+
+const char *argp_program_version =
+        "ngram-lm 0.1";
+const char *argp_program_bug_address =
+        "<joaofe2000@gmail.com>";
+
+static char doc[] = "This program updates a trie with the n-grams added, "
+                    "changed and removed by a DELTA_FILE, without building "
+                    "it again from the ARPA file, and saves it to OUT_FILE. "
+                    "The DELTA_FILE has \\N-grams: sections of ARPA lines "
+                    "of the n-grams to add or change, and \\removed-N-grams: "
+                    "sections of the words of the n-grams to remove.";
+
+static char args_doc[] = "TRIE_FILE DELTA_FILE OUT_FILE";
+
+static struct argp_option options[] = {
+        { 0 }
+};
+
+struct arguments {
+    char *trie;
+    char *delta;
+    char *out;
+};
+
+static error_t
+parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case ARGP_KEY_ARG:
+            if (state->arg_num >= 3)
+                argp_usage(state);
+            switch (state->arg_num) {
+                case 0:
+                    arguments->trie = arg;
+                    break;
+                case 1:
+                    arguments->delta = arg;
+                    break;
+                case 2:
+                    arguments->out = arg;
+                    break;
+            }
+            break;
+        case ARGP_KEY_END:
+            if (state->arg_num < 3)
+                argp_usage(state);
+            break;
+
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    struct arguments arguments = { 0 };
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct trie *t;
+    // the old n-grams are read once, in order, so they need not be loaded
+    if (trie_map(arguments.trie, &t) != 0) {
+        log_error("Trie file '%s' could not be mapped", arguments.trie);
+        exit(EXIT_FAILURE);
+    }
+    struct trie *updated = trie_apply_delta(t, arguments.delta);
+    if (updated == NULL) {
+        log_error("Delta file '%s' could not be applied", arguments.delta);
+        trie_delete(t);
+        exit(EXIT_FAILURE);
+    }
+    for (int n = 1; n <= t->order; n++)
+        log_info("%d-grams: %" PRIu64 " -> %" PRIu64, n, t->n_ngrams[n - 1],
+                 updated->n_ngrams[n - 1]);
+    trie_delete(t);
+    if (trie_save(updated, arguments.out) != 0) {
+        trie_delete(updated);
+        exit(EXIT_FAILURE);
+    }
+    trie_delete(updated);
+    log_info("Trie updated in %.3f s", seconds_since(&start));
+    exit(0);
+}
@@ -52,6 +52,8 @@ static void stdout_callback(log_Event *ev)
 {
     char buf[16];
     buf[strftime(buf, sizeof(buf), "%H:%M:%S", ev->time)] = '\0';
+    // the lines of concurrent events are not interleaved
+    flockfile(ev->udata);
 #ifdef LOG_USE_COLOR
     fprintf(
             ev->udata, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
@@ -65,18 +67,21 @@ static void stdout_callback(log_Event *ev)
     vfprintf(ev->udata, ev->fmt, ev->ap);
     fprintf(ev->udata, "\n");
     fflush(ev->udata);
+    funlockfile(ev->udata);
 }
 
 static void file_callback(log_Event *ev)
 {
     char buf[64];
     buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", ev->time)] = '\0';
+    flockfile(ev->udata);
     fprintf(
             ev->udata, "%s %-5s %s:%d: ",
             buf, level_strings[ev->level], ev->file, ev->line);
     vfprintf(ev->udata, ev->fmt, ev->ap);
     fprintf(ev->udata, "\n");
     fflush(ev->udata);
+    funlockfile(ev->udata);
 }
 
 static void lock(void)
@@ -126,15 +131,28 @@ int log_add_fp(FILE *fp, int level)
     return log_add_callback(file_callback, fp, level);
 }
 
-static void init_event(log_Event *ev, void *udata)
+static void init_event(log_Event *ev, void *udata, struct tm *time_buf)
 {
     if (!ev->time) {
         time_t t = time(NULL);
-        ev->time = localtime(&t);
+        ev->time = localtime_r(&t, time_buf);
     }
     ev->udata = udata;
 }
 
+/**
+ * Whether an event of \p level is logged anywhere.
+ */
+static bool is_logged(int level)
+{
+    if (!L.quiet && level >= L.level)
+        return true;
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+        if (level >= L.callbacks[i].level)
+            return true;
+    return false;
+}
+
 void log_log(int level, const char *file, int line, const char *fmt, ...)
 {
     log_Event ev = {
@@ -143,11 +161,15 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
             .line  = line,
             .level = level,
     };
+    struct tm time_buf;
+
+    if (!is_logged(level))
+        return;
 
     lock();
 
     if (!L.quiet && level >= L.level) {
-        init_event(&ev, stderr);
+        init_event(&ev, stderr, &time_buf);
         va_start(ev.ap, fmt);
         stdout_callback(&ev);
         va_end(ev.ap);
@@ -156,7 +178,7 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
     for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
         Callback *cb = &L.callbacks[i];
         if (level >= cb->level) {
-            init_event(&ev, cb->udata);
+            init_event(&ev, cb->udata, &time_buf);
             va_start(ev.ap, fmt);
             cb->fn(&ev);
             va_end(ev.ap);
@@ -42,6 +42,10 @@ enum {
 
 const char *log_level_string(int level);
 
+/*
+ * Logging is thread-safe, with each line written at once, but the functions
+ * below must be called before other threads start logging.
+ */
 void log_set_lock(log_LockFn fn, void *udata);
 
 void log_set_level(int level);
@@ -7,7 +7,8 @@
 
 extern inline void progress_bar(const char *desc, uint64_t i, uint64_t total)
 {
-    if (i % (total / 101) == 0 || i == (total - 1)) {
+    const uint64_t step = total / 101;
+    if (step == 0 || i % step == 0 || i == (total - 1)) {
         const uint64_t prog = (i + 1) * 100 / total;
         log_info("%s: %d%%", desc, (int) prog);
         if (prog < 100) {
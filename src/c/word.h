@@ -16,6 +16,14 @@ struct word {
     char *text;
 };
 
+/**
+ * A next word prediction.
+ */
+struct prediction {
+    word_id_type word_id;
+    float probability;          /// log10 p(word | context)
+};
+
 inline const char *word_get_text(const struct word *word)
 {
     return word->text;
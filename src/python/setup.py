@@ -26,5 +26,6 @@ setup(name="ngram-lm",
       author="João Fé",
       author_email="joaofe2000@gmail.com",
       ext_modules=ext_modules,
+      install_requires=["numpy"],
       long_description=long_description,
       long_description_content_type='text/markdown')
@@ -1,12 +1,30 @@
-from word cimport word_id_type, word
+from word cimport word_id_type, word, prediction
 
+from libc.stdint cimport uint8_t, uint64_t
 from libc.stdio cimport FILE
 
 
 cdef extern from "trie.h":
     cdef struct trie:
+        word *vocab_lookup
+
+    cdef struct trie_mixture:
         pass
 
+    cdef struct token_score:
+        float log10_probability
+        unsigned short ngram_length
+        uint8_t is_oov
+
+    cdef struct query_cache_stats:
+        uint64_t lookups
+        uint64_t hits
+        uint64_t insertions
+        uint64_t evictions
+        uint64_t entries
+        size_t size
+        size_t budget
+
     trie *trie_new_from_arpa_path(unsigned short order, const char *arpa_path)
     void trie_delete(trie *t)
     word_id_type trie_get_word_id_from_text(const trie *t, const char *word_text)
@@ -14,5 +32,23 @@ cdef extern from "trie.h":
     int trie_save(const trie *t, const char *path)
     int trie_load(const char *path, trie **t)
     word_id_type trie_get_word_id(const trie *t, const char *word_text)
+    void trie_get_word_ids(const trie *t, const char **word_text, unsigned int n, word_id_type *dest)
+    uint64_t trie_get_children(const trie *t, const word_id_type *context, int n, word_id_type *ids,
+                               float *probabilities)
     word *trie_get_nwp(const trie *t, const char **words, int n)
     void trie_get_k_nwp(const trie *t, const char **words, int n, unsigned short k, word **predictions)
+    unsigned short trie_get_k_nwp_word_ids(const trie *t, const word_id_type *ids, int n, unsigned short k,
+                                           prediction *predictions)
+    float trie_score_word_ids(const trie *t, const word_id_type *ids, unsigned int n, token_score *scores)
+    void trie_get_k_nwp_batch_parallel(const trie *t, const char ***contexts, const int *lens, unsigned int m,
+                                       unsigned short k, prediction *predictions, unsigned int n_threads) nogil
+    int trie_cache_queries(trie *t, size_t budget, unsigned int n_shards)
+    unsigned int trie_get_query_cache_stats(const trie *t, query_cache_stats *stats, unsigned int n)
+    trie_mixture *trie_mixture_new(const trie **tries, const float *weights, unsigned short m)
+    void trie_mixture_delete(trie_mixture *mix)
+    uint64_t trie_mixture_vocab_size(const trie_mixture *mix)
+    word_id_type trie_mixture_get_word_id(const trie_mixture *mix, const char *word_text)
+    const char *trie_mixture_word_text(const trie_mixture *mix, word_id_type id)
+    unsigned short trie_mixture_get_k_nwp(const trie_mixture *mix, const char **words, int n, unsigned short k,
+                                          prediction *predictions)
+    float trie_mixture_score_sentence(const trie_mixture *mix, const char **words, unsigned int n, float *scores)
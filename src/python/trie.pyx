@@ -1,12 +1,15 @@
 cimport trie as ctrie
 cimport word as cword
 
+from libc.stdint cimport int32_t, uint64_t
 from libc.stdlib cimport malloc, free
 from libc.string cimport strcpy
 from libc.stdio cimport FILE, fopen, fclose
 
 import multiprocessing
 
+import numpy as np
+
 from ngram_lm.word import Word
 
 
@@ -38,6 +41,109 @@ cdef class Trie:
     def get_word_id(self, word: str):
         return ctrie.trie_get_word_id_from_text(self._c_trie, word.encode())
 
+    def encode(self, words: [str]) -> np.ndarray:
+        """
+        Get the ids of words as an int32 array, where the unknown words get
+        id -1, to query them by id afterwards without hashing them again.
+        """
+        cdef unsigned int i, n = len(words)
+        ids = np.empty(n, dtype=np.int32)
+        if n == 0:
+            return ids
+        cdef int32_t[::1] c_ids = ids
+        byte_str = [w.encode() for w in words]
+        cdef const char **c_words = <const char **> malloc(n * sizeof(char *))
+        if c_words is NULL:
+            raise MemoryError()
+        for i in range(n):
+            c_words[i] = byte_str[i]
+        ctrie.trie_get_word_ids(self._c_trie, c_words, n, <cword.word_id_type *> &c_ids[0])
+        free(c_words)
+        return ids
+
+    def decode(self, ids) -> [str]:
+        """
+        Get the texts of the words of ids, None for the unknown ones.
+        """
+        cdef const int32_t[::1] c_ids = _as_ids(ids)
+        cdef Py_ssize_t i
+        cdef cword.word_id_type n_words = self.vocabulary_size()
+        return [self._c_trie.vocab_lookup[c_ids[i]].text.decode()
+                if <cword.word_id_type> c_ids[i] < n_words else None
+                for i in range(c_ids.shape[0])]
+
+    def vocabulary_size(self) -> int:
+        return ctrie.trie_get_children(self._c_trie, NULL, 0, NULL, NULL)
+
+    def children(self, context_ids=()) -> tuple[np.ndarray, np.ndarray]:
+        """
+        Get the words that follow the context of ids context_ids in the
+        n-grams of the trie, as an int32 array of their ids, in increasing
+        order, and a float32 array of their log10 probabilities given the
+        context, without backoffs. The children of the empty context are the
+        unigrams. Both are empty if the context is not in the trie.
+        """
+        cdef const int32_t[::1] c_context = _as_ids(context_ids)
+        cdef int n = c_context.shape[0]
+        cdef const cword.word_id_type *context = _ids_pointer(c_context)
+        cdef uint64_t n_children = ctrie.trie_get_children(self._c_trie, context, n, NULL, NULL)
+        ids = np.empty(n_children, dtype=np.int32)
+        probabilities = np.empty(n_children, dtype=np.float32)
+        if n_children == 0:
+            return ids, probabilities
+        cdef int32_t[::1] c_ids = ids
+        cdef float[::1] c_probabilities = probabilities
+        ctrie.trie_get_children(self._c_trie, context, n, <cword.word_id_type *> &c_ids[0], &c_probabilities[0])
+        return ids, probabilities
+
+    def nwp_ids(self, context_ids, k: int = 1) -> tuple[np.ndarray, np.ndarray]:
+        """
+        Get the top k next word predictions given the context of ids
+        context_ids, from the best to the worst, as an int32 array of their
+        ids and a float32 array of their log10 probabilities. Any id that is
+        not of a word of the vocabulary, such as -1, is an unknown word.
+        """
+        cdef const int32_t[::1] c_context = _as_ids(context_ids)
+        cdef unsigned short i, found, c_k = k
+        ids = np.empty(c_k, dtype=np.int32)
+        probabilities = np.empty(c_k, dtype=np.float32)
+        if c_k == 0:
+            return ids, probabilities
+        cdef int32_t[::1] c_ids = ids
+        cdef float[::1] c_probabilities = probabilities
+        cdef cword.prediction *cpreds = <cword.prediction *> malloc(c_k * sizeof(cword.prediction))
+        if cpreds is NULL:
+            raise MemoryError()
+        found = ctrie.trie_get_k_nwp_word_ids(self._c_trie, _ids_pointer(c_context), c_context.shape[0], c_k,
+                                              cpreds)
+        for i in range(found):
+            c_ids[i] = cpreds[i].word_id
+            c_probabilities[i] = cpreds[i].probability
+        free(cpreds)
+        return ids[:found], probabilities[:found]
+
+    def score_ids(self, ids) -> tuple[float, np.ndarray]:
+        """
+        Score each word of ids given the words before it, as the log10
+        probability of the sequence and a float32 array of the log10
+        probability of each word. Any id that is not of a word of the
+        vocabulary, such as -1, is scored as "<unk>".
+        """
+        cdef const int32_t[::1] c_words = _as_ids(ids)
+        cdef unsigned int i, n = c_words.shape[0]
+        scores = np.empty(n, dtype=np.float32)
+        if n == 0:
+            return 0.0, scores
+        cdef float[::1] c_scores = scores
+        cdef ctrie.token_score *token_scores = <ctrie.token_score *> malloc(n * sizeof(ctrie.token_score))
+        if token_scores is NULL:
+            raise MemoryError()
+        total = ctrie.trie_score_word_ids(self._c_trie, _ids_pointer(c_words), n, token_scores)
+        for i in range(n):
+            c_scores[i] = token_scores[i].log10_probability
+        free(token_scores)
+        return total, scores
+
     def next_word_predictions(self, words: [str], k: int = 1):
         n = len(words)
         cdef char **context = <char **> malloc(n * sizeof(char *))
@@ -58,6 +164,180 @@ cdef class Trie:
     def nwp(self, words: [str], k: int = 1):
         return self.next_word_predictions(words, k)
 
+    def predict_batch(self, contexts: [[str]], k: int = 1, threads: int = 1) -> [[str]]:
+        """
+        Get the top k next word predictions of each context, as the texts of
+        the predicted words, from the best to the worst. The contexts are
+        encoded at once and looked up without the GIL, split among threads
+        native threads, or among as many as the CPUs if threads is 0.
+        """
+        cdef unsigned int i, j, m = len(contexts), n_words = 0
+        cdef unsigned short c_k = k
+        cdef unsigned int n_threads = threads
+        if m == 0:
+            return []
+        byte_str = [w.encode() for context in contexts for w in context]
+        cdef const char **words = <const char **> malloc(len(byte_str) * sizeof(char *))
+        cdef const char ***c_contexts = <const char ***> malloc(m * sizeof(char **))
+        cdef int *lens = <int *> malloc(m * sizeof(int))
+        cdef cword.prediction *cpreds = <cword.prediction *> malloc(m * c_k * sizeof(cword.prediction))
+        if (words is NULL and len(byte_str) > 0) or c_contexts is NULL or lens is NULL or cpreds is NULL:
+            free(words)
+            free(c_contexts)
+            free(lens)
+            free(cpreds)
+            raise MemoryError()
+        for i in range(len(byte_str)):
+            words[i] = byte_str[i]
+        for i in range(m):
+            lens[i] = len(contexts[i])
+            c_contexts[i] = &words[n_words]
+            n_words += lens[i]
+
+        with nogil:
+            ctrie.trie_get_k_nwp_batch_parallel(self._c_trie, c_contexts, lens, m, c_k, cpreds, n_threads)
+
+        # the texts of the most frequent predictions are only decoded once
+        texts = dict()
+        preds = list()
+        cdef cword.word_id_type word_id
+        for i in range(m):
+            context_preds = list()
+            for j in range(c_k):
+                word_id = cpreds[i * c_k + j].word_id
+                if word_id == <cword.word_id_type> -1:
+                    break
+                text = texts.get(word_id)
+                if text is None:
+                    text = self._c_trie.vocab_lookup[word_id].text.decode()
+                    texts[word_id] = text
+                context_preds.append(text)
+            preds.append(context_preds)
+        free(words)
+        free(c_contexts)
+        free(lens)
+        free(cpreds)
+        return preds
+
+    def cache_queries(self, budget: int, shards: int = 0):
+        if ctrie.trie_cache_queries(self._c_trie, budget, shards) != 0:
+            raise ValueError("Budget of %d bytes too small for the query cache" % budget)
+
+    def query_cache_stats(self) -> [dict]:
+        cdef unsigned int i, n = ctrie.trie_get_query_cache_stats(self._c_trie, NULL, 0)
+        cdef ctrie.query_cache_stats *stats = <ctrie.query_cache_stats *> malloc(
+            n * sizeof(ctrie.query_cache_stats))
+        ctrie.trie_get_query_cache_stats(self._c_trie, stats, n)
+        shards = list()
+        for i in range(n):
+            shards.append({"lookups": stats[i].lookups, "hits": stats[i].hits,
+                           "insertions": stats[i].insertions,
+                           "evictions": stats[i].evictions,
+                           "entries": stats[i].entries, "size": stats[i].size,
+                           "budget": stats[i].budget})
+        free(stats)
+        return shards
+
+
+cdef class Mixture:
+    """
+    Linear interpolation of several tries, e.g. of a general model with domain
+    models, queried in a single pass over all of them.
+    """
+    cdef ctrie.trie_mixture *_c_mixture
+    cdef list _tries
+
+    def __cinit__(self, tries: [Trie], weights: [float]):
+        cdef unsigned short i, m = len(tries)
+        if m == 0 or len(weights) != m:
+            raise ValueError("A mixture needs a weight per trie, and a trie at least")
+        cdef const ctrie.trie **c_tries = <const ctrie.trie **> malloc(m * sizeof(ctrie.trie *))
+        cdef float *c_weights = <float *> malloc(m * sizeof(float))
+        if c_tries is NULL or c_weights is NULL:
+            free(c_tries)
+            free(c_weights)
+            raise MemoryError()
+        for i in range(m):
+            c_tries[i] = (<Trie> tries[i])._c_trie
+            c_weights[i] = weights[i]
+        self._c_mixture = ctrie.trie_mixture_new(c_tries, c_weights, m)
+        free(c_tries)
+        free(c_weights)
+        if self._c_mixture is NULL:
+            raise ValueError("The weights of a mixture must be positive")
+        # the tries must outlive the mixture
+        self._tries = list(tries)
+
+    def __dealloc__(self):
+        if self._c_mixture is not NULL:
+            ctrie.trie_mixture_delete(self._c_mixture)
+
+    def vocabulary_size(self) -> int:
+        return ctrie.trie_mixture_vocab_size(self._c_mixture)
+
+    def get_word_id(self, word: str) -> int:
+        """
+        Get the id of word in the mixture, or -1 if no trie has it.
+        """
+        cdef cword.word_id_type word_id = ctrie.trie_mixture_get_word_id(self._c_mixture, word.encode())
+        return word_id if word_id < self.vocabulary_size() else -1
+
+    def nwp(self, words: [str], k: int = 1) -> tuple[[str], np.ndarray]:
+        """
+        Get the top k next word predictions of the context words, as the texts
+        of the predicted words and their log10 probabilities in the mixture,
+        from the best to the worst.
+        """
+        cdef unsigned short i, found, c_k = k
+        cdef int n = len(words)
+        byte_str = [w.encode() for w in words]
+        cdef const char **context = <const char **> malloc(n * sizeof(char *))
+        cdef cword.prediction *cpreds = <cword.prediction *> malloc(c_k * sizeof(cword.prediction))
+        if (context is NULL and n > 0) or (cpreds is NULL and c_k > 0):
+            free(context)
+            free(cpreds)
+            raise MemoryError()
+        for i in range(n):
+            context[i] = byte_str[i]
+        found = ctrie.trie_mixture_get_k_nwp(self._c_mixture, context, n, c_k, cpreds)
+        texts = [ctrie.trie_mixture_word_text(self._c_mixture, cpreds[i].word_id).decode()
+                 for i in range(found)]
+        probabilities = np.array([cpreds[i].probability for i in range(found)], dtype=np.float32)
+        free(context)
+        free(cpreds)
+        return texts, probabilities
+
+    def score(self, words: [str]) -> tuple[float, np.ndarray]:
+        """
+        Score the sentence words, preceded by "<s>" and followed by "</s>".
+        Return its log10 probability in the mixture, and the one of each token,
+        the last of "</s>".
+        """
+        cdef unsigned int i, n = len(words)
+        byte_str = [w.encode() for w in words]
+        cdef const char **c_words = <const char **> malloc(n * sizeof(char *))
+        if c_words is NULL and n > 0:
+            raise MemoryError()
+        for i in range(n):
+            c_words[i] = byte_str[i]
+        scores = np.empty(n + 1, dtype=np.float32)
+        cdef float[::1] c_scores = scores
+        total = ctrie.trie_mixture_score_sentence(self._c_mixture, c_words, n, &c_scores[0])
+        free(c_words)
+        return total, scores
+
+
+cdef const int32_t[::1] _as_ids(ids):
+    """
+    View ids, e.g. the array of Trie.encode() or a list, as a contiguous int32
+    buffer, which only copies them if they are not one already.
+    """
+    return np.ascontiguousarray(ids, dtype=np.int32)
+
+
+cdef inline const cword.word_id_type *_ids_pointer(const int32_t[::1] ids):
+    return <const cword.word_id_type *> &ids[0] if ids.shape[0] > 0 else NULL
+
 
 def build(order: int, arpa_path: str, out_path: str):
     def job():
@@ -1,4 +1,6 @@
-from ngram_lm.trie import Trie
+import numpy as np
+
+from ngram_lm.trie import Mixture, Trie
 
 
 def test_trie():
@@ -11,3 +13,93 @@ def test_trie():
     assert "os" == str(predictions[0])
     assert "levaram" == str(predictions[1])
     assert "já" == str(predictions[2])
+
+
+def test_predict_batch():
+    t = Trie.from_arpa(3, "data/tmp.arpa")
+    contexts = [["PAra", "é"], ["que"], ["é", "que"], [], ["anonexistingword"]] * 50
+    for threads in [1, 0, 4]:
+        predictions = t.predict_batch(contexts, 3, threads)
+        assert len(predictions) == len(contexts)
+        for context, context_predictions in zip(contexts, predictions):
+            assert context_predictions == [str(p) for p in t.nwp(context, 3)]
+    assert t.predict_batch([["é", "que"]], 3)[0] == ["os", "levaram", "já"]
+    assert t.predict_batch([]) == []
+
+
+def test_ids():
+    t = Trie.from_arpa(3, "data/tmp.arpa")
+    ids = t.encode(["é", "que", "anonexistingword", "amarrar"])
+    assert ids.dtype == np.int32
+    assert list(ids) == [t.get_word_id("é"), t.get_word_id("que"), -1, 1]
+    assert t.decode(ids) == ["é", "que", None, "amarrar"]
+    assert len(t.encode([])) == 0
+
+    for context in [[], ["é"], ["é", "que"], ["havia", "é", "que"], ["anonexistingword"]]:
+        ids, probabilities = t.nwp_ids(t.encode(context), 3)
+        assert t.decode(ids) == [str(p) for p in t.nwp(context, 3)]
+        assert probabilities.dtype == np.float32
+        assert list(probabilities) == sorted(probabilities, reverse=True)
+
+    words = ["é", "que", "os", "anonexistingword", "havia"]
+    total, scores = t.score_ids(t.encode(words))
+    assert len(scores) == len(words)
+    assert abs(total - scores.sum()) < 1e-4
+    assert t.score_ids([])[0] == 0
+
+
+def test_children():
+    t = Trie.from_arpa(3, "data/tmp.arpa")
+    ids, probabilities = t.children()
+    assert list(ids) == list(range(t.vocabulary_size()))
+    n_bigrams = 0
+    for word_id in ids:
+        children, _ = t.children([word_id])
+        assert np.all(np.diff(children) > 0)
+        n_bigrams += len(children)
+    assert n_bigrams > 0
+    ids, probabilities = t.children(t.encode(["é", "que"]))
+    assert "os" in t.decode(ids)
+    assert len(ids) == len(probabilities)
+    assert len(t.children([-1])[0]) == 0
+
+
+def test_query_cache():
+    t = Trie.from_arpa(3, "data/tmp.arpa")
+    assert t.query_cache_stats() == []
+    t.cache_queries(1 << 16, 4)
+    for _ in range(3):
+        predictions = t.nwp(["é", "que"], 3)
+        assert ["os", "levaram", "já"] == [str(p) for p in predictions]
+    stats = t.query_cache_stats()
+    assert len(stats) == 4
+    assert sum(s["lookups"] for s in stats) == 3
+    assert sum(s["hits"] for s in stats) == 2
+    t.cache_queries(0)
+    assert t.query_cache_stats() == []
+
+
+def test_mixture():
+    t = Trie.from_arpa(3, "data/tmp.arpa")
+    mix = Mixture([t], [1])
+    assert mix.vocabulary_size() == t.vocabulary_size()
+    assert mix.get_word_id("anonexistingword") == -1
+    for context in [[], ["é", "que"], ["anonexistingword"]]:
+        texts, probabilities = mix.nwp(context, 3)
+        assert texts == [str(p) for p in t.nwp(context, 3)]
+        _, expected = t.nwp_ids(t.encode(context), 3)
+        assert np.allclose(probabilities, expected, atol=1e-5)
+    words = ["é", "que", "os", "anonexistingword", "havia"]
+    total, scores = mix.score(words)
+    _, expected = t.score_ids(t.encode(["<s>"] + words + ["</s>"]))
+    assert np.allclose(scores, expected[1:], atol=1e-5)
+    assert abs(total - scores.sum()) < 1e-4
+
+    # the same trie twice is the same mixture
+    texts, probabilities = Mixture([t, t], [0.3, 0.7]).nwp(["é", "que"], 3)
+    assert texts == ["os", "levaram", "já"]
+    try:
+        Mixture([t, t], [1, 0])
+        assert False
+    except ValueError:
+        pass
@@ -4,6 +4,10 @@ from libc.stdint cimport uint32_t
 cdef extern from "word.h":
     ctypedef uint32_t word_id_type
     cdef struct word:
-        pass
+        char *text
+
+    cdef struct prediction:
+        word_id_type word_id
+        float probability
 
     const char *word_get_text(const word *word)
\ No newline at end of file